@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <string.h> /* for strlen(), strdup() */
+#include <stdlib.h> /* for free() */
+#include <unistd.h> /* for getopt() */
+#include <ctype.h>  /* for isalnum() */
+#include <errno.h>
+
+#include "aarray.h"
+#include "data-loader.h"
+
+/**
+ * Generate a compiled lookup table from a data file.
+ *
+ * The key/value pairs in the file are loaded into an associative
+ * array, which is frozen into a minimal perfect hash and written out
+ * as a C source file and header (see aaEmitStaticTable()).  Linked
+ * with libAA.a, the generated <NAME>_lookup() finds a key with one
+ * hash and one comparison, from tables that are all constant data.
+ */
+
+#define	LINE_MAX			128
+#define	OPTIONLEN			12
+#define	DEFAULT_ARRAY_SIZE	100
+#define	DEFAULT_GROW_AT_LOAD	0.5
+
+/** the bytes of a value: its string, including the NUL */
+static size_t
+stringValueBytes(void *value, const void **bytes, void *userdata)
+{
+	*bytes = value;
+	return strlen((const char *) value) + 1;
+}
+
+/** free the values, which were all copied onto the heap */
+static int
+deleteValue(AAKeyType key, size_t keylen, void *value, void *userdata)
+{
+	free(value);
+	return 0;
+}
+
+/** print out the help */
+void usage(char *progname)
+{
+	fprintf(stderr, "%s [<OPTIONS>] <datafile>\n", progname);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Writes the key/value pairs in <datafile> out as a compiled lookup\n");
+	fprintf(stderr, "table: <BASE>.c defines the table, and <BASE>.h declares it and\n");
+	fprintf(stderr, "its lookup function, <NAME>_lookup().  Link with libAA.a.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options: \n");
+	fprintf(stderr, "%-*s: Print this help.\n", OPTIONLEN, "-h");
+	fprintf(stderr, "%-*s: If a key is made of digits, store it as an int.\n", OPTIONLEN, "-i");
+	fprintf(stderr, "%-*s: Name of the table, default the base name.\n", OPTIONLEN, "-n <NAME>");
+	fprintf(stderr, "%-*s: Base name of the files to write, required.\n", OPTIONLEN, "-o <BASE>");
+	fprintf(stderr, "%-*s: Print out the table summary.\n", OPTIONLEN, "-s");
+	fprintf(stderr, "\n");
+	exit (1);
+}
+
+/**
+ * Program mainline -- generates the table for the file named on
+ * the command line
+ */
+int
+main(int argc, char **argv)
+{
+	char *programname = argv[0];
+	char *name = NULL, *base = NULL, *filename, *madeName = NULL;
+	int useIntKey = 0, printSummary = 0, status = 0, c;
+	AssociativeArray *assocArray;
+	AAOptions options;
+	FILE *source, *header;
+	const char *headerName;
+
+	while ((c = getopt(argc, argv, "hisn:o:")) != -1) {
+		if (c == 'i') {
+			useIntKey = 1;
+		} else if (c == 's') {
+			printSummary = 1;
+		} else if (c == 'n') {
+			name = optarg;
+		} else if (c == 'o') {
+			base = optarg;
+		} else {
+			usage(programname);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || base == NULL) {
+		fprintf(stderr, "Error: one data file and an output base name must be given\n");
+		usage(programname);
+	}
+
+	/** the name has to be a C identifier, so build one from the base */
+	if (name == NULL) {
+		name = madeName = strdup(strrchr(base, '/') != NULL ? strrchr(base, '/') + 1 : base);
+		for (c = 0; name[c] != '\0'; c++) {
+			if ( ! isalnum((unsigned char) name[c]))
+				name[c] = '_';
+		}
+	}
+
+	/** a growing table, as the size of the file is not known */
+	aaInitOptions(&options);
+	options.growAtLoad = DEFAULT_GROW_AT_LOAD;
+	assocArray = aaCreateConfiguredArray(DEFAULT_ARRAY_SIZE, "lin", "pri", "sum", &options);
+	if (assocArray == NULL) {
+		fprintf(stderr, "Error: cannot allocate associative array - exitting\n");
+		return -1;
+	}
+
+	if (loadAssociativeArray(assocArray, argv[0], useIntKey, 0) < 0
+			|| aaFreeze(assocArray) < 0) {
+		fprintf(stderr, "Error: cannot build a table from '%s'\n", argv[0]);
+		aaIterateAction(assocArray, deleteValue, NULL);
+		aaDeleteAssociativeArray(assocArray);
+		return -1;
+	}
+
+	filename = (char *) malloc(strlen(base) + 3);
+	sprintf(filename, "%s.h", base);
+	header = fopen(filename, "w");
+	headerName = strrchr(filename, '/') != NULL ? strrchr(filename, '/') + 1 : filename;
+	headerName = strdup(headerName);
+	sprintf(filename, "%s.c", base);
+	source = fopen(filename, "w");
+	if (header == NULL || source == NULL) {
+		fprintf(stderr, "Error: cannot open output file '%s' : %s\n",
+				filename, strerror(errno));
+		status = -1;
+	} else if (aaEmitStaticTable(source, header, assocArray, name, headerName,
+			stringValueBytes, NULL) < 0) {
+		fprintf(stderr, "Error: cannot write out the table\n");
+		status = -1;
+	}
+	if (header != NULL)		fclose(header);
+	if (source != NULL)		fclose(source);
+
+	if (printSummary) {
+		aaPrintSummary(stdout, assocArray);
+	}
+
+	aaIterateAction(assocArray, deleteValue, NULL);
+	aaDeleteAssociativeArray(assocArray);
+	free((char *) headerName);
+	free(filename);
+	free(madeName);
+
+	return status;
+}
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * Occupancy analysis of the slot array.
+ *
+ * Rather than dumping every slot (see aaPrintContents()) this walks
+ * the table once and summarizes the things that make probing
+ * expensive: runs of occupied slots (primary clusters), where the
+ * tombstones are, and how far each key ended up from its home slot.
+ *
+ * To help choose a hash and probe, the keys can also be rebuilt into
+ * a scratch table for every combination of them, and the clusters and
+ * displacement of each reported side by side.
+ */
+
+static char *sHashNames[] = { "sum", "len", "pri", "mix", NULL };
+static char *sProbeNames[] = { "lin", "qua", "dou", NULL };
+
+/** one run of contiguous occupied slots */
+typedef struct Cluster {
+	int start;
+	int length;
+} Cluster;
+
+
+/**
+ * Keep the nLargest longest clusters seen so far, sorted longest first
+ */
+static void
+rememberCluster(Cluster *largest, int nLargest, int start, int length)
+{
+	int i;
+
+	if (nLargest <= 0 || length <= largest[nLargest - 1].length)
+		return;
+
+	/** shuffle shorter clusters down to make room */
+	for (i = nLargest - 1; i > 0 && largest[i - 1].length < length; i--) {
+		largest[i] = largest[i - 1];
+	}
+	largest[i].start = start;
+	largest[i].length = length;
+}
+
+/**
+ * Record the length of every cluster in the table, and keep the
+ * nLargest longest of them if largest is not NULL
+ */
+static void
+measureClusters(AssociativeArray *aarray, AAOpStats *runStats,
+		Cluster *largest, int nLargest)
+{
+	int firstEmpty, i, j, runStart, runLength;
+
+	/**
+	 * start the scan just after an empty slot, so that we never
+	 * begin in the middle of a run that wraps around the end
+	 */
+	for (firstEmpty = 0; firstEmpty < aarray->size; firstEmpty++) {
+		if (aaSlotValidity(aarray, firstEmpty) == HASH_EMPTY)
+			break;
+	}
+
+	if (firstEmpty == aarray->size) {
+		/** no empty slots at all -- the whole table is one cluster */
+		aaRecordProbes(runStats, aarray->size);
+		if (largest != NULL)
+			rememberCluster(largest, nLargest, 0, aarray->size);
+	} else {
+		runLength = 0;
+		runStart = 0;
+		for (i = 1; i <= aarray->size; i++) {
+			j = (firstEmpty + i) % aarray->size;
+			if (aaSlotValidity(aarray, j) != HASH_EMPTY) {
+				if (runLength == 0)
+					runStart = j;
+				runLength++;
+			} else if (runLength > 0) {
+				aaRecordProbes(runStats, runLength);
+				if (largest != NULL)
+					rememberCluster(largest, nLargest, runStart, runLength);
+				runLength = 0;
+			}
+		}
+	}
+}
+
+/**
+ * Record the number of probes each key takes to reach, by re-running
+ * the probe for it
+ *
+ *  @return the total distance of the keys from their home slots
+ */
+static unsigned long
+measureDisplacement(AssociativeArray *aarray, AAOpStats *displacementStats)
+{
+	unsigned long linearDistance = 0;
+	KeyDataPair entry;
+	HashIndex home, found;
+	int cost, i;
+
+	for (i = 0; i < aarray->size; i++) {
+		if (aaSlotValidity(aarray, i) != HASH_USED)
+			continue;
+
+		aaSlotRead(aarray, i, &entry);
+		home = (*(aarray->hashAlgorithmPrimary))(
+				entry.key, entry.keylen, aarray->size);
+		cost = 0;
+		found = (*(aarray->hashProbe))(aarray,
+				entry.key, entry.keylen,
+				home, 0, &cost);
+		if (found != (HashIndex) i) {
+			fprintf(stderr, "Error: key in slot %d is not reachable by probing\n", i);
+		}
+		aaRecordProbes(displacementStats, cost);
+		linearDistance += (i + aarray->size - home) % aarray->size;
+	}
+
+	return linearDistance;
+}
+
+/**
+ * Print an analysis of the clustering in the table
+ *
+ * A slot counts as occupied if it is in use or holds a tombstone, as
+ * both of these force a lookup to keep probing.  Runs that wrap
+ * around the end of the table are counted as a single cluster.
+ *
+ *  @param  nRegions  number of equal-sized regions to report the
+ *				tombstone density of
+ *  @param  nLargest  number of the largest clusters to list
+ */
+void
+aaPrintClusterAnalysis(FILE *fp, AssociativeArray *aarray,
+		int nRegions, int nLargest)
+{
+	AAOpStats runStats, displacementStats;
+	Cluster *largest = NULL;
+	unsigned long linearDistance;
+	int i, j, regionStart, regionEnd, nUsed, nDeleted;
+
+	memset(&runStats, 0, sizeof(AAOpStats));
+	memset(&displacementStats, 0, sizeof(AAOpStats));
+
+	/** a frozen table has no probing, and so no clusters */
+	if (aarray->frozen != NULL) {
+		fprintf(fp, "Cluster analysis: table is frozen, with every key in its own slot\n");
+		return;
+	}
+
+	/** nor does a disk table, whose buckets are pages */
+	if (aarray->layout == AA_LAYOUT_DISK) {
+		fprintf(fp, "Cluster analysis: disk table, with buckets split as they fill\n");
+		return;
+	}
+	if (aarray->layout == AA_LAYOUT_SHARED) {
+		fprintf(fp, "Cluster analysis: shared table, with every key in its own slot\n");
+		return;
+	}
+
+	if (nLargest > 0) {
+		largest = (Cluster *) calloc(nLargest, sizeof(Cluster));
+	}
+	if (nRegions < 1)			nRegions = 1;
+	if (nRegions > aarray->size)	nRegions = aarray->size;
+
+	fprintf(fp, "Cluster analysis for '%s' hash, '%s' secondary hash and '%s' probing\n",
+			aarray->hashNamePrimary, aarray->hashNameSecondary, aarray->probeName);
+	fprintf(fp, "  %d entries, %d tombstones in %d slots\n",
+			aarray->nEntries, aarray->nTombstones, aarray->size);
+
+	/** the slots of a generation being rehashed away are only counted by the comparison */
+	if (aarray->retiring != NULL) {
+		fprintf(fp, "  (not counting %d entries still in the old %d slot table being rehashed)\n",
+				aarray->retiring->nEntries, aarray->retiring->size);
+	}
+
+	measureClusters(aarray, &runStats, largest, nLargest);
+
+	fprintf(fp, "Cluster lengths:\n");
+	aaPrintOpStats(fp, "Clusters", &runStats);
+
+	if (largest != NULL && runStats.count > 0) {
+		fprintf(fp, "Largest clusters:\n");
+		for (i = 0; i < nLargest && largest[i].length > 0; i++) {
+			fprintf(fp, "  %8d slots starting at %d\n",
+					largest[i].length, largest[i].start);
+		}
+	}
+
+	/** tombstone density, region by region */
+	fprintf(fp, "Occupancy by region:\n");
+	for (i = 0; i < nRegions; i++) {
+		regionStart = (int) (((long) aarray->size * i) / nRegions);
+		regionEnd = (int) (((long) aarray->size * (i + 1)) / nRegions);
+		nUsed = nDeleted = 0;
+		for (j = regionStart; j < regionEnd; j++) {
+			if (aaSlotValidity(aarray, j) == HASH_USED)
+				nUsed++;
+			else if (aaSlotValidity(aarray, j) == HASH_DELETED)
+				nDeleted++;
+		}
+		fprintf(fp, "  [%8d, %8d) : %5.1f%% used, %5.1f%% tombstones\n",
+				regionStart, regionEnd,
+				100.0 * nUsed / (regionEnd - regionStart),
+				100.0 * nDeleted / (regionEnd - regionStart));
+	}
+
+	/**
+	 * displacement is measured by re-running the probe for each key,
+	 * which gives the number of probes a lookup of that key costs
+	 */
+	linearDistance = measureDisplacement(aarray, &displacementStats);
+
+	fprintf(fp, "Displacement from home slot (probes to reach key):\n");
+	aaPrintOpStats(fp, "Keys", &displacementStats);
+	if (displacementStats.count > 0) {
+		fprintf(fp, "  Mean distance from home slot : %.2f slots\n",
+				(double) linearDistance / displacementStats.count);
+	}
+
+	if (largest != NULL)	free(largest);
+}
+
+/** a scratch table being filled with the keys of the table analysed */
+typedef struct ScratchFill {
+	AssociativeArray *table;
+	unsigned long nUnplaced;
+} ScratchFill;
+
+static int
+countKey(AAKeyType key, size_t keylen, void *value, void *userdata)
+{
+	(*(unsigned long *) userdata)++;
+	return 0;
+}
+
+static int
+fillScratch(AAKeyType key, size_t keylen, void *value, void *userdata)
+{
+	ScratchFill *fill = (ScratchFill *) userdata;
+
+	if (aaInsert(fill->table, key, keylen, NULL) < 0)
+		fill->nUnplaced++;
+	return 0;
+}
+
+/**
+ * Print the clustering and displacement the keys of the table would
+ * have under every combination of hash and probe, by inserting them
+ * all into a scratch table of the same size for each.  Every key is
+ * included, those still in a generation being rehashed away as well.
+ * The scratch tables have no deletes, and so no tombstones; only the
+ * table itself, in aaPrintClusterAnalysis(), shows where those are.
+ */
+void
+aaPrintConfigurationComparison(FILE *fp, AssociativeArray *aarray)
+{
+	AAOpStats runStats, displacementStats;
+	ScratchFill fill;
+	AAOptions options;
+	unsigned long nKeys = 0;
+	int size, h, p, current;
+
+	aaIterateAction(aarray, countKey, &nKeys);
+	if (nKeys == 0)
+		return;
+
+	/** tables that do not probe are compared at twice the keys they hold */
+	size = aarray->size;
+	if (aarray->frozen != NULL || aarray->layout == AA_LAYOUT_DISK
+			|| aarray->layout == AA_LAYOUT_SHARED || (unsigned long) size <= nKeys) {
+		size = getLargerPrime((int) (2 * nKeys));
+	}
+
+	aaInitOptions(&options);
+
+	fprintf(fp, "Hash and probe comparison over %lu keys in %d slots ('%s' secondary hash):\n",
+			nKeys, size, aarray->hashNameSecondary);
+	fprintf(fp, "    %-4s %-5s : %8s %9s %8s %9s %8s %8s %9s\n",
+			"hash", "probe", "clusters", "mean len", "max len",
+			"mean prb", "p99 prb", "max prb", "unplaced");
+
+	for (h = 0; sHashNames[h] != NULL; h++) {
+		for (p = 0; sProbeNames[p] != NULL; p++) {
+			fill.table = aaCreateConfiguredArray(size, sProbeNames[p],
+					sHashNames[h], aarray->hashNameSecondary, &options);
+			if (fill.table == NULL) {
+				fprintf(stderr, "Error: cannot allocate a table to compare with\n");
+				return;
+			}
+			fill.nUnplaced = 0;
+			aaIterateAction(aarray, fillScratch, &fill);
+
+			memset(&runStats, 0, sizeof(AAOpStats));
+			memset(&displacementStats, 0, sizeof(AAOpStats));
+			measureClusters(fill.table, &runStats, NULL, 0);
+			measureDisplacement(fill.table, &displacementStats);
+
+			current = (strncmp(aarray->hashNamePrimary, sHashNames[h], 3) == 0
+					&& strncmp(aarray->probeName, sProbeNames[p], 3) == 0);
+			fprintf(fp, "  %c %-4s %-5s : %8lu %9.2f %8lu %9.2f %8lu %8lu %9lu\n",
+					current ? '*' : ' ', sHashNames[h], sProbeNames[p],
+					runStats.count, aaStatsMeanProbes(&runStats), runStats.maxProbes,
+					aaStatsMeanProbes(&displacementStats),
+					aaStatsPercentile(&displacementStats, 99.0),
+					displacementStats.maxProbes, fill.nUnplaced);
+
+			aaDeleteAssociativeArray(fill.table);
+		}
+	}
+	fprintf(fp, "  (* marks the configuration of this table)\n");
+}
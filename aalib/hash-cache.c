@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * Bounded caches with CLOCK eviction.
+ *
+ * A cache has a limit on its live entries (and optionally on the
+ * bytes they take), and an insert that would pass it evicts entries
+ * rather than failing.  Victims are chosen by the CLOCK, or "second
+ * chance", approximation of least recently used: every slot has a
+ * reference bit, set when a lookup finds the key in it, and a hand
+ * sweeps round the slots.  A set bit is cleared and the hand moves
+ * on; the first live entry whose bit is already clear is evicted.
+ * Entries start with their bit clear, so a scan of keys that are
+ * never looked up again is evicted before anything that has been.
+ *
+ * Each eviction leaves a tombstone.  A cache never grows, so it uses
+ * the growth machinery only to clear those out: once the live entries
+ * and tombstones pass AA_CACHE_PURGE_LOAD of the slots the table is
+ * rehashed at the same size, all at once, with the reference bits
+ * carried across to the entries' new slots.  The live entries are
+ * held to half of the slots, so this happens at most once in every
+ * few tenths of the table's size of evictions.
+ */
+
+struct AACache {
+	unsigned char *referenced;
+	unsigned char *previous;	/** the bits of the old slots, during a rehash */
+	int nSlots;
+	int hand;
+	int capacity;
+	size_t byteBudget;
+	size_t bytesUsed;
+	unsigned long nEvictions;
+};
+
+/** what an entry counts against the byte budget: its key and its record */
+static size_t
+entryBytes(AssociativeArray *aarray, size_t keylen)
+{
+	return keylen + aarray->entryStride;
+}
+
+
+/**
+ * Set up the cache state for a newly created table, whose size has
+ * already been made at least twice the entry limit
+ *
+ *  @return 1 on success, or -1 if no memory is available
+ */
+int
+aaCacheCreate(AssociativeArray *aarray)
+{
+	AACache *cache;
+
+	cache = (AACache *) malloc(sizeof(AACache));
+	if (cache == NULL)
+		return -1;
+
+	cache->nSlots = aarray->size;
+	cache->referenced = (unsigned char *) calloc(cache->nSlots, 1);
+	cache->previous = (unsigned char *) calloc(cache->nSlots, 1);
+	if (cache->referenced == NULL || cache->previous == NULL) {
+		free(cache->referenced);
+		free(cache->previous);
+		free(cache);
+		return -1;
+	}
+
+	cache->hand = 0;
+	cache->capacity = (aarray->options.cacheEntries > 0)
+			? aarray->options.cacheEntries : aarray->size / 2;
+	if (cache->capacity < 1)
+		cache->capacity = 1;
+	cache->byteBudget = aarray->options.cacheBytes;
+	cache->bytesUsed = 0;
+	cache->nEvictions = 0;
+
+	aarray->cache = cache;
+	return 1;
+}
+
+void
+aaCacheDestroy(AACache *cache)
+{
+	if (cache == NULL)
+		return;
+	free(cache->referenced);
+	free(cache->previous);
+	free(cache);
+}
+
+/** a lookup found the key in this slot: give it a second chance */
+void
+aaCacheReferenced(AssociativeArray *aarray, HashIndex slot)
+{
+	aarray->cache->referenced[slot] = 1;
+}
+
+/** a new entry has been stored in this slot */
+void
+aaCacheStored(AssociativeArray *aarray, HashIndex slot, size_t keylen)
+{
+	aarray->cache->referenced[slot] = 0;
+	aarray->cache->bytesUsed += entryBytes(aarray, keylen);
+}
+
+/** the entry in this slot is about to be removed (its key is still there) */
+void
+aaCacheRemoved(AssociativeArray *aarray, HashIndex slot)
+{
+	KeyDataPair entry;
+
+	if (aaSlotRead(aarray, slot, &entry))
+		aarray->cache->bytesUsed -= entryBytes(aarray, entry.keylen);
+	aarray->cache->referenced[slot] = 0;
+}
+
+/**
+ * Evict one entry, chosen by the clock hand
+ *
+ *  @return 1 if an entry was evicted, or 0 if the table is empty
+ */
+int
+aaCacheEvict(AssociativeArray *aarray)
+{
+	AACache *cache = aarray->cache;
+	KeyDataPair entry;
+	HashIndex slot;
+
+	if (aarray->nEntries == 0)
+		return 0;
+
+	/** at most two turns: the first clears every bit it passes */
+	for (;;) {
+		slot = (HashIndex) cache->hand;
+		cache->hand = (cache->hand + 1) % aarray->size;
+		if (aaSlotValidity(aarray, slot) != HASH_USED)
+			continue;
+		if (cache->referenced[slot]) {
+			cache->referenced[slot] = 0;
+			continue;
+		}
+		break;
+	}
+
+	/** the owner gets the value back while the key is still good */
+	aaSlotRead(aarray, slot, &entry);
+	if (aarray->options.evicted != NULL) {
+		(*aarray->options.evicted)(entry.key, entry.keylen, entry.value,
+				aarray->options.evictUserdata);
+	}
+
+	/** a cache churns, so its tombstones do not keep their keys */
+	aaRemoveEntry(aarray, slot);
+	aaSlotReleaseKey(aarray, slot);
+	if (aarray->filter != NULL)
+		aaFilterRemoved(aarray);
+
+	cache->nEvictions++;
+	return 1;
+}
+
+/**
+ * Evict until one more entry with a key of the given length fits
+ * within the limits
+ *
+ *  @return 1 once it fits, or -1 if it never can (it is larger than
+ *			the whole byte budget)
+ */
+int
+aaCacheMakeRoom(AssociativeArray *aarray, size_t keylen)
+{
+	AACache *cache = aarray->cache;
+	size_t needed = entryBytes(aarray, keylen);
+
+	if (cache->byteBudget > 0 && needed > cache->byteBudget)
+		return -1;
+
+	while (aarray->nEntries >= cache->capacity
+			|| (cache->byteBudget > 0 && cache->bytesUsed + needed > cache->byteBudget)) {
+		if (aaCacheEvict(aarray) == 0)
+			return -1;
+	}
+	return 1;
+}
+
+/**
+ * A rehash is about to move every entry: keep the old slots' bits
+ * aside to be carried across by aaCacheMoved()
+ */
+void
+aaCacheRehashBegin(AssociativeArray *aarray)
+{
+	AACache *cache = aarray->cache;
+	unsigned char *saved = cache->previous;
+
+	cache->previous = cache->referenced;
+	cache->referenced = saved;
+	memset(cache->referenced, 0, cache->nSlots);
+	cache->hand = 0;
+}
+
+/** the entry in oldSlot of the retiring generation is now in newSlot */
+void
+aaCacheMoved(AssociativeArray *aarray, HashIndex oldSlot, HashIndex newSlot)
+{
+	aarray->cache->referenced[newSlot] = aarray->cache->previous[oldSlot];
+}
+
+void
+aaPrintCacheSummary(FILE *fp, AssociativeArray *aarray)
+{
+	AACache *cache = aarray->cache;
+
+	if (cache == NULL)
+		return;
+
+	fprintf(fp, "Cache: %d entries of %d allowed, %lu evicted\n",
+			aarray->nEntries, cache->capacity, cache->nEvictions);
+	if (cache->byteBudget > 0) {
+		fprintf(fp, "Cache: %lu bytes of keys and records of %lu allowed\n",
+				(unsigned long) cache->bytesUsed, (unsigned long) cache->byteBudget);
+	}
+}
@@ -0,0 +1,885 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hashtools.h"
+
+/**
+ * The router for a table partitioned over worker processes.
+ *
+ * The workers are a3 servers (see server.c in the driver), and the
+ * router speaks their protocol: a line per request, tab separated,
+ * with the replies coming back in the order of the requests.  A batch
+ * queues each key's request on the connection to the worker that owns
+ * its partition, then sends on every connection and reads the replies
+ * from every connection at once, through poll(2), so that no worker
+ * waits on another and no reply is read before all of its requests
+ * are sent.  The requests queued on one connection form a list in the
+ * order they were sent, and each reply is matched to the head of it.
+ *
+ * Partitions are assigned by starting every one on worker 0, then
+ * adding the workers one at a time, each taking its share from the
+ * workers that have the most at the time (and of those the highest
+ * numbered partitions).  Adding a worker to a running cluster takes
+ * exactly the same step, so only the partitions the new worker takes
+ * ever move, and a router opened afresh on the larger cluster routes
+ * every key as the one that grew it does.
+ *
+ * A move asks each worker that gives up partitions for their entries
+ * (SCAN, with the partitions as a hex bitmap), inserts them into the
+ * new worker, and only once every entry has been copied asks the old
+ * workers to drop them (DROP).
+ */
+
+#define	CLUSTER_REQUEST_MAX		4096	/** the longest line a worker accepts */
+#define	CLUSTER_BUFFER_SIZE		(16 * 1024)
+#define	CLUSTER_MOVE_BATCH		1024
+#define	PARTITION_DIGITS		(AA_CLUSTER_PARTITIONS / 4)
+#define	FIELD_CHAR				'\t'
+
+#define	REPLY_FAILED			(-1)
+#define	REPLY_NONE				0
+#define	REPLY_OK				1
+
+/** the connection to one worker */
+typedef struct ClusterWorker {
+	int fd;
+	char *output;
+	size_t outputLen;
+	size_t outputSent;
+	size_t outputAllocated;
+	char *input;
+	size_t inputStart;
+	size_t inputLen;
+	size_t inputAllocated;
+	int head;		/** the requests awaiting replies, oldest first */
+	int tail;
+} ClusterWorker;
+
+struct AACluster {
+	char *socketBase;
+	ClusterWorker *workers;
+	int nWorkers;
+	int owner[AA_CLUSTER_PARTITIONS];
+	struct pollfd *polls;
+	int *pollWorkers;
+	int failed;
+
+	/** the requests of the batch under way */
+	int *following;
+	int *results;
+	size_t *offsets;
+	int nRequestsAllocated;
+	char *values;
+	size_t valuesLen;
+	size_t valuesAllocated;
+
+	/** the entries being copied to a new worker */
+	char *moveBytes;
+	size_t moveLen;
+	size_t moveAllocated;
+	size_t moveKeyAt[CLUSTER_MOVE_BATCH];
+	size_t moveValueAt[CLUSTER_MOVE_BATCH];
+	AAKeyType moveKeys[CLUSTER_MOVE_BATCH];
+	size_t moveKeylens[CLUSTER_MOVE_BATCH];
+	const char *moveValues[CLUSTER_MOVE_BATCH];
+	int nMoving;
+};
+
+
+/** make a buffer at least the given size, doubling as it grows */
+static int
+reserve(char **buffer, size_t *allocated, size_t needed)
+{
+	size_t size = (*allocated > 0) ? *allocated : CLUSTER_BUFFER_SIZE;
+	char *grown;
+
+	if (needed <= *allocated)
+		return 1;
+	while (size < needed)
+		size *= 2;
+	grown = (char *) realloc(*buffer, size);
+	if (grown == NULL)
+		return -1;
+	*buffer = grown;
+	*allocated = size;
+	return 1;
+}
+
+/** the partition of a key: the top bits of its hash */
+int
+aaClusterPartition(AAKeyType key, size_t keylen)
+{
+	return (int) (aaMixHash64(key, keylen) >> (64 - AA_CLUSTER_PARTITION_BITS));
+}
+
+int
+aaClusterWorkerOf(AACluster *cluster, int partition)
+{
+	return cluster->owner[partition];
+}
+
+/** give the newest worker its share, from the workers with the most */
+static void
+stealPartitions(int *owner, int newWorker)
+{
+	int counts[AA_CLUSTER_PARTITIONS];
+	int share = AA_CLUSTER_PARTITIONS / (newWorker + 1);
+	int busiest, w, p;
+
+	memset(counts, 0, sizeof(counts));
+	for (p = 0; p < AA_CLUSTER_PARTITIONS; p++)
+		counts[owner[p]]++;
+
+	while (share-- > 0) {
+		busiest = 0;
+		for (w = 1; w < newWorker; w++) {
+			if (counts[w] > counts[busiest])
+				busiest = w;
+		}
+		for (p = AA_CLUSTER_PARTITIONS - 1; owner[p] != busiest; p--)
+			;
+		owner[p] = newWorker;
+		counts[busiest]--;
+	}
+}
+
+/** can these bytes go in a request line? */
+static int
+isSendable(const char *bytes, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		if (bytes[i] == FIELD_CHAR || bytes[i] == '\n'
+				|| bytes[i] == '\r' || bytes[i] == '\0')
+			return 0;
+	}
+	return 1;
+}
+
+/** add a request line to the worker's output */
+static int
+queueLine(ClusterWorker *worker, const char *command,
+		const char *field, size_t fieldLen, const char *value)
+{
+	size_t commandLen = strlen(command);
+	size_t valueLen = (value != NULL) ? strlen(value) : 0;
+	size_t lineLen = commandLen + 1 + fieldLen + 1 + ((value != NULL) ? valueLen + 1 : 0);
+	char *line;
+
+	if (reserve(&worker->output, &worker->outputAllocated, worker->outputLen + lineLen) < 0)
+		return -1;
+
+	line = worker->output + worker->outputLen;
+	memcpy(line, command, commandLen);
+	line += commandLen;
+	*line++ = FIELD_CHAR;
+	memcpy(line, field, fieldLen);
+	line += fieldLen;
+	if (value != NULL) {
+		*line++ = FIELD_CHAR;
+		memcpy(line, value, valueLen);
+		line += valueLen;
+	}
+	*line = '\n';
+
+	worker->outputLen += lineLen;
+	return 1;
+}
+
+/** connect to the worker with the given number, as worker[index] */
+static int
+connectWorker(AACluster *cluster, int index)
+{
+	ClusterWorker *worker = &cluster->workers[index];
+	struct sockaddr_un address;
+
+	memset(worker, 0, sizeof(ClusterWorker));
+	worker->fd = -1;
+	worker->head = worker->tail = -1;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (snprintf(address.sun_path, sizeof(address.sun_path), "%s.%d",
+			cluster->socketBase, index) >= (int) sizeof(address.sun_path)) {
+		fprintf(stderr, "Cluster socket name '%s.%d' is too long\n",
+				cluster->socketBase, index);
+		return -1;
+	}
+
+	worker->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (worker->fd < 0
+			|| connect(worker->fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+		fprintf(stderr, "Cannot connect to cluster worker '%s' : %s\n",
+				address.sun_path, strerror(errno));
+		if (worker->fd >= 0)
+			close(worker->fd);
+		worker->fd = -1;
+		return -1;
+	}
+	fcntl(worker->fd, F_SETFL, fcntl(worker->fd, F_GETFL) | O_NONBLOCK);
+
+	if (reserve(&worker->output, &worker->outputAllocated, CLUSTER_BUFFER_SIZE) < 0
+			|| reserve(&worker->input, &worker->inputAllocated, CLUSTER_BUFFER_SIZE) < 0) {
+		close(worker->fd);
+		worker->fd = -1;
+		return -1;
+	}
+	return 1;
+}
+
+static void
+disconnectWorker(ClusterWorker *worker)
+{
+	if (worker->fd >= 0)
+		close(worker->fd);
+	free(worker->output);
+	free(worker->input);
+	memset(worker, 0, sizeof(ClusterWorker));
+	worker->fd = -1;
+}
+
+/**
+ * Connect to the nWorkers workers serving at socketBase.0 onwards
+ *
+ *  @return the router, or NULL if a worker cannot be reached
+ */
+AACluster *
+aaClusterOpen(const char *socketBase, int nWorkers)
+{
+	AACluster *cluster;
+	int i;
+
+	if (nWorkers < 1 || nWorkers > AA_CLUSTER_PARTITIONS) {
+		fprintf(stderr, "A cluster needs from 1 to %d workers\n", AA_CLUSTER_PARTITIONS);
+		return NULL;
+	}
+
+	cluster = (AACluster *) calloc(1, sizeof(AACluster));
+	if (cluster == NULL)
+		return NULL;
+	cluster->socketBase = strdup(socketBase);
+	cluster->workers = (ClusterWorker *) calloc(AA_CLUSTER_PARTITIONS, sizeof(ClusterWorker));
+	cluster->polls = (struct pollfd *) calloc(AA_CLUSTER_PARTITIONS, sizeof(struct pollfd));
+	cluster->pollWorkers = (int *) calloc(AA_CLUSTER_PARTITIONS, sizeof(int));
+	if (cluster->socketBase == NULL || cluster->workers == NULL
+			|| cluster->polls == NULL || cluster->pollWorkers == NULL) {
+		aaClusterClose(cluster);
+		return NULL;
+	}
+
+	for (i = 0; i < nWorkers; i++) {
+		if (connectWorker(cluster, i) < 0) {
+			aaClusterClose(cluster);
+			return NULL;
+		}
+		cluster->nWorkers++;
+		if (i > 0)
+			stealPartitions(cluster->owner, i);
+	}
+	return cluster;
+}
+
+void
+aaClusterClose(AACluster *cluster)
+{
+	int i;
+
+	if (cluster == NULL)
+		return;
+
+	if (cluster->workers != NULL) {
+		for (i = 0; i < cluster->nWorkers; i++)
+			disconnectWorker(&cluster->workers[i]);
+	}
+	free(cluster->workers);
+	free(cluster->polls);
+	free(cluster->pollWorkers);
+	free(cluster->following);
+	free(cluster->results);
+	free(cluster->offsets);
+	free(cluster->values);
+	free(cluster->moveBytes);
+	free(cluster->socketBase);
+	free(cluster);
+}
+
+/** wait until the worker's socket is ready for the given events */
+static int
+waitFor(ClusterWorker *worker, short events)
+{
+	struct pollfd poller;
+
+	poller.fd = worker->fd;
+	poller.events = events;
+	while (poll(&poller, 1, -1) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+	return 1;
+}
+
+/**
+ * Send as much of the worker's output as its socket will take
+ *
+ *  @return 1 once it is all sent, 0 if some must wait, -1 on failure
+ */
+static int
+sendPending(ClusterWorker *worker)
+{
+	ssize_t nSent;
+
+	while (worker->outputSent < worker->outputLen) {
+		nSent = send(worker->fd, worker->output + worker->outputSent,
+				worker->outputLen - worker->outputSent, MSG_NOSIGNAL);
+		if (nSent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		worker->outputSent += nSent;
+	}
+	worker->outputLen = worker->outputSent = 0;
+	return 1;
+}
+
+static int
+sendAll(ClusterWorker *worker)
+{
+	int status;
+
+	while ((status = sendPending(worker)) == 0) {
+		if (waitFor(worker, POLLOUT) < 0)
+			return -1;
+	}
+	return status;
+}
+
+/**
+ * Read whatever the worker has sent
+ *
+ *  @return 1 if something was read, 0 if nothing is waiting, or -1 if
+ *			the worker has gone
+ */
+static int
+receive(ClusterWorker *worker)
+{
+	ssize_t nRead;
+
+	if (reserve(&worker->input, &worker->inputAllocated,
+			worker->inputLen + CLUSTER_BUFFER_SIZE) < 0)
+		return -1;
+
+	for (;;) {
+		nRead = read(worker->fd, worker->input + worker->inputLen,
+				worker->inputAllocated - worker->inputLen);
+		if (nRead > 0) {
+			worker->inputLen += nRead;
+			return 1;
+		}
+		if (nRead == 0)
+			return -1;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+}
+
+/**
+ * The next whole line read from a worker, or NULL if there is none
+ * yet, in which case any partial line is moved to the front of the
+ * buffer for the next read to add to
+ */
+static char *
+takeLine(ClusterWorker *worker)
+{
+	char *line = worker->input + worker->inputStart, *newline;
+
+	newline = (char *) memchr(line, '\n', worker->inputLen - worker->inputStart);
+	if (newline == NULL) {
+		memmove(worker->input, line, worker->inputLen - worker->inputStart);
+		worker->inputLen -= worker->inputStart;
+		worker->inputStart = 0;
+		return NULL;
+	}
+	*newline = '\0';
+	worker->inputStart = newline + 1 - worker->input;
+	return line;
+}
+
+/** wait for the next line from a worker, outside of a batch */
+static char *
+nextLine(ClusterWorker *worker)
+{
+	char *line;
+	int status;
+
+	while ((line = takeLine(worker)) == NULL) {
+		status = receive(worker);
+		if (status < 0 || (status == 0 && waitFor(worker, POLLIN) < 0))
+			return NULL;
+	}
+	return line;
+}
+
+/** start a batch of nRequests requests */
+static int
+prepareBatch(AACluster *cluster, int nRequests)
+{
+	int *following, *results;
+	size_t *offsets;
+	int i;
+
+	if (cluster->failed)
+		return -1;
+
+	if (nRequests > cluster->nRequestsAllocated) {
+		following = (int *) realloc(cluster->following, nRequests * sizeof(int));
+		if (following != NULL)
+			cluster->following = following;
+		results = (int *) realloc(cluster->results, nRequests * sizeof(int));
+		if (results != NULL)
+			cluster->results = results;
+		offsets = (size_t *) realloc(cluster->offsets, nRequests * sizeof(size_t));
+		if (offsets != NULL)
+			cluster->offsets = offsets;
+		if (following == NULL || results == NULL || offsets == NULL)
+			return -1;
+		cluster->nRequestsAllocated = nRequests;
+	}
+
+	for (i = 0; i < cluster->nWorkers; i++)
+		cluster->workers[i].head = cluster->workers[i].tail = -1;
+	cluster->valuesLen = 0;
+	return 1;
+}
+
+/** queue a request on the connection to the worker that owns the key */
+static int
+queueRequest(AACluster *cluster, int request, const char *command,
+		AAKeyType key, size_t keylen, const char *value)
+{
+	ClusterWorker *worker;
+
+	cluster->results[request] = REPLY_FAILED;
+	if ( ! isSendable((const char *) key, keylen)
+			|| (value != NULL && ! isSendable(value, strlen(value)))
+			|| keylen + ((value != NULL) ? strlen(value) : 0) + 8 > CLUSTER_REQUEST_MAX)
+		return 0;
+
+	worker = &cluster->workers[cluster->owner[aaClusterPartition(key, keylen)]];
+	if (queueLine(worker, command, (const char *) key, keylen, value) < 0)
+		return -1;
+
+	cluster->following[request] = -1;
+	if (worker->tail >= 0) {
+		cluster->following[worker->tail] = request;
+	} else {
+		worker->head = request;
+	}
+	worker->tail = request;
+	return 1;
+}
+
+/** match a reply to the oldest request waiting on the worker */
+static int
+takeReply(AACluster *cluster, ClusterWorker *worker, char *line)
+{
+	int request = worker->head;
+	size_t valueLen;
+
+	/** a reply that nothing asked for means the stream is out of step */
+	if (request < 0)
+		return -1;
+	worker->head = cluster->following[request];
+	if (worker->head < 0)
+		worker->tail = -1;
+
+	if (strncmp(line, "VALUE\t", 6) == 0) {
+		valueLen = strlen(line + 6) + 1;
+		if (reserve(&cluster->values, &cluster->valuesAllocated,
+				cluster->valuesLen + valueLen) < 0)
+			return -1;
+		memcpy(cluster->values + cluster->valuesLen, line + 6, valueLen);
+		cluster->offsets[request] = cluster->valuesLen;
+		cluster->valuesLen += valueLen;
+		cluster->results[request] = REPLY_OK;
+	} else if (strcmp(line, "OK") == 0) {
+		cluster->results[request] = REPLY_OK;
+	} else if (strcmp(line, "NONE") == 0) {
+		cluster->results[request] = REPLY_NONE;
+	} else {
+		cluster->results[request] = REPLY_FAILED;
+	}
+	return 1;
+}
+
+/** the stream to a worker has broken, so nothing more can be trusted */
+static int
+failCluster(AACluster *cluster, int w)
+{
+	fprintf(stderr, "Lost cluster worker '%s.%d'\n", cluster->socketBase, w);
+	cluster->failed = 1;
+	return -1;
+}
+
+/** send every worker its queued requests, and gather all of the replies */
+static int
+exchange(AACluster *cluster)
+{
+	ClusterWorker *worker;
+	char *line;
+	int nPolls, i, w, status;
+	short events;
+
+	for (;;) {
+		nPolls = 0;
+		for (w = 0; w < cluster->nWorkers; w++) {
+			worker = &cluster->workers[w];
+			events = 0;
+			if (worker->outputSent < worker->outputLen)
+				events |= POLLOUT;
+			if (worker->head >= 0)
+				events |= POLLIN;
+			if (events != 0) {
+				cluster->polls[nPolls].fd = worker->fd;
+				cluster->polls[nPolls].events = events;
+				cluster->polls[nPolls].revents = 0;
+				cluster->pollWorkers[nPolls++] = w;
+			}
+		}
+		if (nPolls == 0)
+			return 1;
+
+		if (poll(cluster->polls, nPolls, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for (i = 0; i < nPolls; i++) {
+			w = cluster->pollWorkers[i];
+			worker = &cluster->workers[w];
+			if ((cluster->polls[i].revents & POLLOUT) && sendPending(worker) < 0)
+				return failCluster(cluster, w);
+			if (cluster->polls[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				status = receive(worker);
+				if (status < 0)
+					return failCluster(cluster, w);
+				while (worker->head >= 0 && (line = takeLine(worker)) != NULL) {
+					if (takeReply(cluster, worker, line) < 0)
+						return failCluster(cluster, w);
+				}
+			}
+		}
+	}
+}
+
+/** route a request for each key, and wait for all of the replies */
+static int
+runBatch(AACluster *cluster, const char *command, int nKeys,
+		AAKeyType *keys, size_t *keylens, const char **values, const char *emptyValue)
+{
+	const char *value;
+	int i;
+
+	if (prepareBatch(cluster, nKeys) < 0)
+		return -1;
+
+	for (i = 0; i < nKeys; i++) {
+		value = emptyValue;
+		if (values != NULL && values[i] != NULL)
+			value = values[i];
+		if (queueRequest(cluster, i, command, keys[i], keylens[i], value) < 0) {
+			/** some of the batch may be queued, and cannot be taken back */
+			fprintf(stderr, "Cannot allocate cluster request buffers\n");
+			cluster->failed = 1;
+			return -1;
+		}
+	}
+	return exchange(cluster);
+}
+
+/**
+ * Insert a batch of keys, each with its string value
+ *
+ *  @return the number stored, or -1 if a worker cannot be reached
+ */
+int
+aaClusterInsertBatch(AACluster *cluster, int nKeys,
+		AAKeyType *keys, size_t *keylens, const char **values)
+{
+	int i, nStored = 0;
+
+	if (runBatch(cluster, "PUT", nKeys, keys, keylens, values, "") < 0)
+		return -1;
+	for (i = 0; i < nKeys; i++) {
+		if (cluster->results[i] == REPLY_OK)
+			nStored++;
+	}
+	return nStored;
+}
+
+/** fill in the values gathered by a batch, NULL for the keys without */
+static int
+collectValues(AACluster *cluster, int nKeys, const char **values)
+{
+	int i, nFound = 0;
+
+	for (i = 0; i < nKeys; i++) {
+		values[i] = NULL;
+		if (cluster->results[i] == REPLY_OK) {
+			values[i] = cluster->values + cluster->offsets[i];
+			nFound++;
+		}
+	}
+	return nFound;
+}
+
+/**
+ * Look up a batch of keys, filling in values[i] for each
+ *
+ *  @return the number found, or -1 if a worker cannot be reached
+ */
+int
+aaClusterLookupBatch(AACluster *cluster, int nKeys,
+		AAKeyType *keys, size_t *keylens, const char **values)
+{
+	if (runBatch(cluster, "GET", nKeys, keys, keylens, NULL, NULL) < 0)
+		return -1;
+	return collectValues(cluster, nKeys, values);
+}
+
+/**
+ * Delete a batch of keys, filling in the value each one had
+ *
+ *  @return the number deleted, or -1 if a worker cannot be reached
+ */
+int
+aaClusterDeleteBatch(AACluster *cluster, int nKeys,
+		AAKeyType *keys, size_t *keylens, const char **values)
+{
+	if (runBatch(cluster, "POP", nKeys, keys, keylens, NULL, NULL) < 0)
+		return -1;
+	return collectValues(cluster, nKeys, values);
+}
+
+int
+aaClusterInsert(AACluster *cluster, AAKeyType key, size_t keylen, const char *value)
+{
+	if (aaClusterInsertBatch(cluster, 1, &key, &keylen, &value) != 1)
+		return -1;
+	return 1;
+}
+
+const char *
+aaClusterLookup(AACluster *cluster, AAKeyType key, size_t keylen)
+{
+	const char *value;
+
+	if (aaClusterLookupBatch(cluster, 1, &key, &keylen, &value) != 1)
+		return NULL;
+	return value;
+}
+
+const char *
+aaClusterDelete(AACluster *cluster, AAKeyType key, size_t keylen)
+{
+	const char *value;
+
+	if (aaClusterDeleteBatch(cluster, 1, &key, &keylen, &value) != 1)
+		return NULL;
+	return value;
+}
+
+/**
+ * Write the hex bitmap of the partitions that worker w gives up
+ *
+ *  @return the number of them
+ */
+static int
+formatPartitions(char *bitmap, const int *oldOwner, const int *newOwner, int w)
+{
+	int digits[PARTITION_DIGITS];
+	int p, nMoved = 0;
+
+	memset(digits, 0, sizeof(digits));
+	for (p = 0; p < AA_CLUSTER_PARTITIONS; p++) {
+		if (oldOwner[p] == w && newOwner[p] != w) {
+			digits[p / 4] |= 1 << (p % 4);
+			nMoved++;
+		}
+	}
+	for (p = 0; p < PARTITION_DIGITS; p++)
+		bitmap[p] = "0123456789abcdef"[digits[p]];
+	bitmap[PARTITION_DIGITS] = '\0';
+	return nMoved;
+}
+
+/** insert the entries gathered so far into their new worker */
+static int
+flushMove(AACluster *cluster)
+{
+	int i, n = cluster->nMoving;
+
+	if (n == 0)
+		return 1;
+
+	/** the bytes are all in place now, so their addresses will hold */
+	for (i = 0; i < n; i++) {
+		cluster->moveKeys[i] = (AAKeyType) cluster->moveBytes + cluster->moveKeyAt[i];
+		cluster->moveKeylens[i] = strlen((char *) cluster->moveKeys[i]);
+		cluster->moveValues[i] = cluster->moveBytes + cluster->moveValueAt[i];
+	}
+	cluster->nMoving = 0;
+	cluster->moveLen = 0;
+
+	if (aaClusterInsertBatch(cluster, n, cluster->moveKeys,
+			cluster->moveKeylens, cluster->moveValues) != n)
+		return -1;
+	return 1;
+}
+
+/** keep a copy of an entry to be moved */
+static int
+holdEntry(AACluster *cluster, const char *key, const char *value)
+{
+	size_t keyLen = strlen(key) + 1, valueLen = strlen(value) + 1;
+
+	if (reserve(&cluster->moveBytes, &cluster->moveAllocated,
+			cluster->moveLen + keyLen + valueLen) < 0)
+		return -1;
+	cluster->moveKeyAt[cluster->nMoving] = cluster->moveLen;
+	memcpy(cluster->moveBytes + cluster->moveLen, key, keyLen);
+	cluster->moveLen += keyLen;
+	cluster->moveValueAt[cluster->nMoving] = cluster->moveLen;
+	memcpy(cluster->moveBytes + cluster->moveLen, value, valueLen);
+	cluster->moveLen += valueLen;
+	cluster->nMoving++;
+	return 1;
+}
+
+/**
+ * Copy the entries of the given partitions of worker w to the newest
+ * worker, which the routing already sends them to
+ *
+ *  @return the number copied, or -1 on failure
+ */
+static long
+copyPartitions(AACluster *cluster, int w, const char *bitmap)
+{
+	ClusterWorker *worker = &cluster->workers[w];
+	int newest = cluster->nWorkers - 1;
+	char *line, *key, *value;
+	long nCopied = 0;
+
+	if (queueLine(worker, "SCAN", bitmap, PARTITION_DIGITS, NULL) < 0
+			|| sendAll(worker) < 0)
+		return failCluster(cluster, w);
+
+	/** after a failure the rest of the reply is still read, to keep in step */
+	cluster->nMoving = 0;
+	cluster->moveLen = 0;
+	for (;;) {
+		line = nextLine(worker);
+		if (line == NULL)
+			return failCluster(cluster, w);
+		if (strncmp(line, "END", 3) == 0)
+			break;
+
+		key = line + 6;
+		value = strchr(key, FIELD_CHAR);
+		if (strncmp(line, "ENTRY\t", 6) != 0 || value == NULL)
+			return failCluster(cluster, w);
+		*value++ = '\0';
+
+		/** anything the worker should not have had stays where it is */
+		if (cluster->owner[aaClusterPartition((AAKeyType) key, strlen(key))] != newest)
+			continue;
+
+		if (nCopied < 0 || holdEntry(cluster, key, value) < 0
+				|| (cluster->nMoving == CLUSTER_MOVE_BATCH && flushMove(cluster) < 0)) {
+			nCopied = -1;
+			continue;
+		}
+		nCopied++;
+	}
+
+	if (nCopied < 0 || flushMove(cluster) < 0)
+		return -1;
+	return nCopied;
+}
+
+/** have worker w drop the given partitions, now copied elsewhere */
+static int
+dropPartitions(AACluster *cluster, int w, const char *bitmap)
+{
+	ClusterWorker *worker = &cluster->workers[w];
+	char *line;
+
+	if (queueLine(worker, "DROP", bitmap, PARTITION_DIGITS, NULL) < 0
+			|| sendAll(worker) < 0
+			|| (line = nextLine(worker)) == NULL
+			|| strncmp(line, "OK", 2) != 0)
+		return failCluster(cluster, w);
+	return 1;
+}
+
+/**
+ * Take on the worker serving at socketBase.<nWorkers>, and move its
+ * share of the partitions to it
+ *
+ *  @return the number of keys moved, or -1 on failure
+ */
+int
+aaClusterAddWorker(AACluster *cluster)
+{
+	int oldOwner[AA_CLUSTER_PARTITIONS];
+	char bitmap[PARTITION_DIGITS + 1];
+	long nCopied, nMoved = 0;
+	int w, newest = cluster->nWorkers;
+
+	if (cluster->failed || cluster->nWorkers >= AA_CLUSTER_PARTITIONS)
+		return -1;
+	if (connectWorker(cluster, newest) < 0)
+		return -1;
+
+	memcpy(oldOwner, cluster->owner, sizeof(oldOwner));
+	stealPartitions(cluster->owner, newest);
+	cluster->nWorkers++;
+
+	/** every entry is copied before any is dropped */
+	for (w = 0; w < newest; w++) {
+		if (formatPartitions(bitmap, oldOwner, cluster->owner, w) == 0)
+			continue;
+		nCopied = copyPartitions(cluster, w, bitmap);
+		if (nCopied < 0) {
+			/** the new worker forgets whatever it was sent before going back */
+			formatPartitions(bitmap, cluster->owner, oldOwner, newest);
+			dropPartitions(cluster, newest, bitmap);
+			memcpy(cluster->owner, oldOwner, sizeof(oldOwner));
+			cluster->nWorkers--;
+			disconnectWorker(&cluster->workers[newest]);
+			return -1;
+		}
+		nMoved += nCopied;
+	}
+
+	for (w = 0; w < newest; w++) {
+		if (formatPartitions(bitmap, oldOwner, cluster->owner, w) > 0
+				&& dropPartitions(cluster, w, bitmap) < 0)
+			return -1;
+	}
+	return (int) nMoved;
+}
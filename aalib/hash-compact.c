@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * The compact, insertion-ordered layout.
+ *
+ * Rather than a KeyDataPair in every slot, the entries are kept
+ * densely in the order they were inserted, and each slot holds only
+ * a 4 byte index into them (or AA_INDEX_EMPTY / AA_INDEX_DELETED).
+ * Empty capacity therefore costs 4 bytes a slot instead of a full
+ * KeyDataPair, and iterating the table only visits the entries.
+ *
+ * Deleting an entry leaves a hole in the entry array.  The holes are
+ * squeezed out when the entry array can grow no further, which is
+ * allowed to run a quarter past the number of slots so that each
+ * compaction recovers enough space to pay for itself.
+ */
+
+#define	COMPACT_INITIAL_ENTRIES	16
+
+/** the most entry records we allow before squeezing out the holes */
+static int
+maxEntries(AssociativeArray *aarray)
+{
+	return aarray->size + aarray->size / 4 + 1;
+}
+
+/**
+ * Allocate the index array, with every slot empty, and a small
+ * initial entry array
+ */
+int
+aaCompactCreate(AssociativeArray *aarray)
+{
+	int nEntries = COMPACT_INITIAL_ENTRIES;
+
+	aarray->indices = (int32_t *) aaSlotMemoryAlloc(aarray,
+			aarray->size * sizeof(int32_t));
+	if (aarray->indices == NULL)
+		return -1;
+
+	/** all bits set is AA_INDEX_EMPTY */
+	memset(aarray->indices, 0xff, aarray->size * sizeof(int32_t));
+
+	if (nEntries > maxEntries(aarray))
+		nEntries = maxEntries(aarray);
+	aarray->entries = (KeyDataPair *) malloc(nEntries * aarray->entryStride);
+	if (aarray->entries == NULL) {
+		aaSlotMemoryFree(aarray, aarray->indices, aarray->size * sizeof(int32_t));
+		return -1;
+	}
+	aarray->nEntriesAllocated = nEntries;
+	aarray->nEntriesUsed = 0;
+
+	return 1;
+}
+
+/** release the arrays; the keys are released by the caller */
+void
+aaCompactDestroy(AssociativeArray *aarray)
+{
+	aaSlotMemoryFree(aarray, aarray->indices, aarray->size * sizeof(int32_t));
+	free(aarray->entries);
+	aarray->indices = NULL;
+	aarray->entries = NULL;
+}
+
+/**
+ * Squeeze the deleted entries out of the entry array, keeping the
+ * remaining ones in order, and repoint the slots at their new places
+ */
+static int
+compactEntries(AssociativeArray *aarray)
+{
+	int32_t *newIndex;
+	int i, n = 0;
+
+	newIndex = (int32_t *) malloc(aarray->nEntriesUsed * sizeof(int32_t));
+	if (newIndex == NULL)
+		return -1;
+
+	for (i = 0; i < aarray->nEntriesUsed; i++) {
+		if (aaRecordAt(aarray, aarray->entries, i)->validity == HASH_USED) {
+			if (n != i) {
+				memcpy(aaRecordAt(aarray, aarray->entries, n),
+						aaRecordAt(aarray, aarray->entries, i), aarray->entryStride);
+			}
+			newIndex[i] = n++;
+		} else {
+			newIndex[i] = AA_INDEX_DELETED;
+		}
+	}
+
+	for (i = 0; i < aarray->size; i++) {
+		if (aarray->indices[i] >= 0)
+			aarray->indices[i] = newIndex[aarray->indices[i]];
+	}
+
+	aarray->nEntriesUsed = n;
+	free(newIndex);
+	return 1;
+}
+
+/** make sure there is room to append one more entry */
+static int
+reserveEntry(AssociativeArray *aarray)
+{
+	KeyDataPair *newEntries;
+	int newAllocated;
+
+	if (aarray->nEntriesUsed < aarray->nEntriesAllocated)
+		return 1;
+
+	if (aarray->nEntriesAllocated < maxEntries(aarray)) {
+		newAllocated = aarray->nEntriesAllocated * 2;
+		if (newAllocated > maxEntries(aarray))
+			newAllocated = maxEntries(aarray);
+
+		newEntries = (KeyDataPair *) realloc(aarray->entries,
+				newAllocated * aarray->entryStride);
+		if (newEntries == NULL)
+			return -1;
+		aarray->entries = newEntries;
+		aarray->nEntriesAllocated = newAllocated;
+		return 1;
+	}
+
+	/** at the limit, there must be holes to reclaim */
+	if (compactEntries(aarray) < 0)
+		return -1;
+	return (aarray->nEntriesUsed < aarray->nEntriesAllocated) ? 1 : -1;
+}
+
+/**
+ * Append a new entry, taking over the given (already allocated) key,
+ * and point the given slot at it
+ *
+ *  @return 1 on success, -1 if memory cannot be found for the entry
+ */
+int
+aaCompactPlace(AssociativeArray *aarray, HashIndex slot,
+		AAKeyType ownedKey, size_t keylen, void *value)
+{
+	KeyDataPair *entry;
+
+	if (reserveEntry(aarray) < 0)
+		return -1;
+
+	entry = aaRecordAt(aarray, aarray->entries, aarray->nEntriesUsed);
+	entry->key = ownedKey;
+	entry->keylen = keylen;
+	entry->validity = HASH_USED;
+	if (aarray->valueWidth > 0) {
+		entry->value = NULL;
+		aaCopyInValue(aarray, aaEntryValue(aarray, entry), value);
+	} else {
+		entry->value = value;
+	}
+
+	aarray->indices[slot] = aarray->nEntriesUsed++;
+	return 1;
+}
+
+/**
+ * Turn the given slot into a tombstone, leaving a hole in the entry
+ * array.  The key is freed now, as nothing refers to the hole.
+ */
+void
+aaCompactRemove(AssociativeArray *aarray, HashIndex slot)
+{
+	KeyDataPair *entry = aaRecordAt(aarray, aarray->entries, aarray->indices[slot]);
+
+	if (aarray->keys != NULL && entry->key != NULL)
+		aaKeyStoreRemoved(aarray->keys, entry->key, entry->keylen);
+	else
+		free(entry->key);
+	entry->key = NULL;
+	entry->validity = HASH_DELETED;
+
+	aarray->indices[slot] = AA_INDEX_DELETED;
+}
@@ -0,0 +1,688 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "hashtools.h"
+
+/**
+ * The disk layout: extendible hashing over fixed size pages of a file.
+ *
+ * Each page of the file (after the header page) is a bucket, holding
+ * as many records -- a 16 bit key length, the key, and the value,
+ * which is always stored inline -- as will fit.  A directory of 2^g
+ * page numbers, kept in memory, maps the low g bits of a key's hash
+ * to its bucket, so finding a key reads exactly one page.
+ *
+ * A bucket that fills up is split in two on the next bit of the hash
+ * (doubling the directory first if the bucket already used all of
+ * its bits), so the table grows one bucket at a time and never needs
+ * rehashing as a whole.  Deleted records are squeezed out of their
+ * page at once; buckets are never merged.
+ *
+ * Pages are read and written through a small cache of page frames,
+ * replaced by the CLOCK algorithm.  The directory and the header are
+ * written out when the array is deleted, and read back when an array
+ * is created over an existing file, so the file is a table that can
+ * be loaded once and reopened, but not one that survives a crash.
+ *
+ * Value pointers handed back point into the cache (or, for deletes,
+ * a copy of the value), so are only good until the next operation.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define	DISK_MAGIC			"AADISK1"
+#define	DISK_MIN_PAGE		512
+#define	DISK_MIN_FRAMES		4
+#define	DISK_MAX_DEPTH		32
+
+/** the header page */
+typedef struct DiskHeader {
+	char magic[8];
+	uint32_t pageSize;
+	uint32_t valueWidth;
+	uint32_t globalDepth;
+	uint32_t nPages;
+	uint64_t nEntries;
+	uint64_t directoryOffset;
+} DiskHeader;
+
+/** the start of every bucket page, followed by its records */
+typedef struct BucketHeader {
+	uint32_t used;
+	uint16_t nRecords;
+	uint8_t localDepth;
+	uint8_t unused;
+} BucketHeader;
+
+#define	RECORD_HEADER		sizeof(uint16_t)
+
+typedef struct PageFrame {
+	uint32_t page;
+	int valid;
+	int dirty;
+	int referenced;
+	int pinned;
+	unsigned char *data;
+} PageFrame;
+
+struct AADiskTable {
+	int fd;
+	uint32_t pageSize;
+	uint32_t globalDepth;
+	uint32_t nPages;
+	uint32_t *directory;
+	unsigned char *frameMemory;
+	PageFrame *frames;
+	int nFrames;
+	int clockHand;
+	unsigned char *deletedValue;
+	unsigned long nReads;
+	unsigned long nWrites;
+	unsigned long nHits;
+	unsigned long nSplits;
+};
+
+
+/** write a frame back to its page */
+static int
+writeFrame(AADiskTable *disk, PageFrame *frame)
+{
+	if (pwrite(disk->fd, frame->data, disk->pageSize,
+			(off_t) frame->page * disk->pageSize) != (ssize_t) disk->pageSize) {
+		fprintf(stderr, "Error: cannot write page %u of disk table : %s\n",
+				frame->page, strerror(errno));
+		return -1;
+	}
+	frame->dirty = 0;
+	disk->nWrites++;
+	return 1;
+}
+
+/** choose a frame to reuse, writing back what it holds if need be */
+static PageFrame *
+victimFrame(AADiskTable *disk)
+{
+	PageFrame *frame;
+	int nVisited;
+
+	for (nVisited = 0; nVisited < 3 * disk->nFrames; nVisited++) {
+		frame = &disk->frames[disk->clockHand];
+		disk->clockHand = (disk->clockHand + 1) % disk->nFrames;
+
+		if (frame->pinned)
+			continue;
+		if (frame->valid && frame->referenced) {
+			frame->referenced = 0;
+			continue;
+		}
+		if (frame->valid && frame->dirty && writeFrame(disk, frame) < 0)
+			return NULL;
+		frame->valid = 0;
+		return frame;
+	}
+
+	fprintf(stderr, "Error: every page of the disk table cache is pinned\n");
+	return NULL;
+}
+
+/**
+ * Get a page into the cache
+ *
+ *  @param  forWrite  nonzero if the caller is going to change it
+ *  @param  fresh     nonzero for a newly allocated page, which is
+ *				not read but started off as an empty bucket
+ *  @return the frame holding the page, or NULL on an I/O error
+ */
+static PageFrame *
+fetchPage(AADiskTable *disk, uint32_t page, int forWrite, int fresh)
+{
+	PageFrame *frame;
+	BucketHeader bucket;
+	ssize_t nRead;
+	int i;
+
+	for (i = 0; i < disk->nFrames; i++) {
+		frame = &disk->frames[i];
+		if (frame->valid && frame->page == page) {
+			frame->referenced = 1;
+			frame->dirty |= forWrite;
+			disk->nHits++;
+			return frame;
+		}
+	}
+
+	frame = victimFrame(disk);
+	if (frame == NULL)
+		return NULL;
+
+	if (fresh) {
+		memset(frame->data, 0, disk->pageSize);
+		memset(&bucket, 0, sizeof(BucketHeader));
+		bucket.used = sizeof(BucketHeader);
+		memcpy(frame->data, &bucket, sizeof(BucketHeader));
+		forWrite = 1;
+	} else {
+		nRead = pread(disk->fd, frame->data, disk->pageSize,
+				(off_t) page * disk->pageSize);
+		if (nRead != (ssize_t) disk->pageSize) {
+			fprintf(stderr, "Error: cannot read page %u of disk table : %s\n",
+					page, (nRead < 0) ? strerror(errno) : "file is short");
+			return NULL;
+		}
+		disk->nReads++;
+	}
+
+	frame->page = page;
+	frame->valid = 1;
+	frame->referenced = 1;
+	frame->dirty = forWrite;
+	return frame;
+}
+
+/** the bucket header of a page */
+static BucketHeader *
+bucketOf(PageFrame *frame)
+{
+	return (BucketHeader *) frame->data;
+}
+
+/** the length of the key of the record at the given offset */
+static size_t
+recordKeyLength(PageFrame *frame, uint32_t offset)
+{
+	uint16_t keylen;
+
+	memcpy(&keylen, frame->data + offset, sizeof(uint16_t));
+	return keylen;
+}
+
+/**
+ * Find a key in a bucket page
+ *
+ *  @return the offset of its record, or 0 if it is not there
+ */
+static uint32_t
+findRecord(AssociativeArray *aarray, PageFrame *frame, AAKeyType key, size_t keylen)
+{
+	BucketHeader *bucket = bucketOf(frame);
+	uint32_t offset = sizeof(BucketHeader);
+	size_t recordKeylen;
+	int i;
+
+	for (i = 0; i < bucket->nRecords; i++) {
+		recordKeylen = recordKeyLength(frame, offset);
+		if (recordKeylen == keylen
+				&& memcmp(frame->data + offset + RECORD_HEADER, key, keylen) == 0)
+			return offset;
+		offset += RECORD_HEADER + recordKeylen + aarray->valueWidth;
+	}
+	return 0;
+}
+
+/** add a record to the end of a bucket page, which has room for it */
+static void
+appendRecord(AssociativeArray *aarray, PageFrame *frame,
+		AAKeyType key, size_t keylen, const void *value)
+{
+	BucketHeader *bucket = bucketOf(frame);
+	unsigned char *record = frame->data + bucket->used;
+	uint16_t length = (uint16_t) keylen;
+
+	memcpy(record, &length, RECORD_HEADER);
+	memcpy(record + RECORD_HEADER, key, keylen);
+	aaCopyInValue(aarray, record + RECORD_HEADER + keylen, value);
+
+	bucket->used += RECORD_HEADER + keylen + aarray->valueWidth;
+	bucket->nRecords++;
+	frame->dirty = 1;
+}
+
+/** the bucket page for a hash value */
+static uint32_t
+pageFor(AADiskTable *disk, uint64_t hash)
+{
+	return disk->directory[hash & (((uint64_t) 1 << disk->globalDepth) - 1)];
+}
+
+/**
+ * Split the bucket the given hash value belongs to, moving the records
+ * with the next bit of their hash set into a new page
+ *
+ *  @return 1 on success, -1 if the bucket cannot be split further or
+ *			there is no memory or an I/O error
+ */
+static int
+splitBucket(AssociativeArray *aarray, uint64_t hash)
+{
+	AADiskTable *disk = aarray->disk;
+	PageFrame *oldFrame, *newFrame;
+	unsigned char *saved;
+	uint32_t *directory, oldPage, newPage, offset, step, i, size;
+	BucketHeader *bucket;
+	uint16_t length;
+	size_t keylen;
+	int depth, nRecords, r;
+
+	oldPage = pageFor(disk, hash);
+	oldFrame = fetchPage(disk, oldPage, 1, 0);
+	if (oldFrame == NULL)
+		return -1;
+	depth = bucketOf(oldFrame)->localDepth;
+	if (depth >= DISK_MAX_DEPTH)
+		return -1;
+
+	/** a bucket using every bit of the directory needs it doubled */
+	if ((uint32_t) depth == disk->globalDepth) {
+		size = (uint32_t) 1 << disk->globalDepth;
+		directory = (uint32_t *) realloc(disk->directory, 2 * (size_t) size * sizeof(uint32_t));
+		if (directory == NULL)
+			return -1;
+		memcpy(directory + size, directory, size * sizeof(uint32_t));
+		disk->directory = directory;
+		disk->globalDepth++;
+	}
+
+	saved = (unsigned char *) malloc(disk->pageSize);
+	if (saved == NULL)
+		return -1;
+
+	oldFrame->pinned = 1;
+	newPage = disk->nPages;
+	newFrame = fetchPage(disk, newPage, 1, 1);
+	if (newFrame == NULL) {
+		oldFrame->pinned = 0;
+		free(saved);
+		return -1;
+	}
+	disk->nPages++;
+
+	/** deal the records out again, on bit "depth" of their hash */
+	memcpy(saved, oldFrame->data, disk->pageSize);
+	nRecords = ((BucketHeader *) saved)->nRecords;
+	bucket = bucketOf(oldFrame);
+	bucket->used = sizeof(BucketHeader);
+	bucket->nRecords = 0;
+	bucket->localDepth = depth + 1;
+	bucketOf(newFrame)->localDepth = depth + 1;
+
+	offset = sizeof(BucketHeader);
+	for (r = 0; r < nRecords; r++) {
+		memcpy(&length, saved + offset, RECORD_HEADER);
+		keylen = length;
+		appendRecord(aarray,
+				((aaMixHash64(saved + offset + RECORD_HEADER, keylen) >> depth) & 1)
+					? newFrame : oldFrame,
+				saved + offset + RECORD_HEADER, keylen,
+				saved + offset + RECORD_HEADER + keylen);
+		offset += RECORD_HEADER + keylen + aarray->valueWidth;
+	}
+	oldFrame->pinned = 0;
+	free(saved);
+
+	/** the directory entries for the old bucket with that bit set move */
+	step = (uint32_t) 1 << depth;
+	for (i = (uint32_t) (hash & (step - 1)); i < ((uint32_t) 1 << disk->globalDepth); i += step) {
+		if ((i >> depth) & 1)
+			disk->directory[i] = newPage;
+	}
+
+	disk->nSplits++;
+	aarray->size = disk->nPages - 1;
+	return 1;
+}
+
+/**
+ * Add a key and its value to the table
+ *
+ *  @return 1 on success, or -1 if the key is already present, is too
+ *			long for a page, or the table could not be extended
+ */
+int
+aaDiskInsert(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value, int *cost)
+{
+	AADiskTable *disk = aarray->disk;
+	uint64_t hash = aaMixHash64(key, keylen);
+	size_t recordSize = RECORD_HEADER + keylen + aarray->valueWidth;
+	PageFrame *frame;
+
+	if (keylen > UINT16_MAX || sizeof(BucketHeader) + recordSize > disk->pageSize)
+		return -1;
+
+	for (;;) {
+		frame = fetchPage(disk, pageFor(disk, hash), 1, 0);
+		(*cost)++;
+		if (frame == NULL)
+			return -1;
+		if (findRecord(aarray, frame, key, keylen) != 0)
+			return -1;
+
+		if (bucketOf(frame)->used + recordSize <= disk->pageSize) {
+			appendRecord(aarray, frame, key, keylen, value);
+			aarray->nEntries++;
+			return 1;
+		}
+
+		/** no room, so split the bucket and try again */
+		if (splitBucket(aarray, hash) < 0)
+			return -1;
+	}
+}
+
+/** the value for a key, or NULL if it is not in the table */
+void *
+aaDiskLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen, int *cost)
+{
+	AADiskTable *disk = aarray->disk;
+	PageFrame *frame;
+	uint32_t offset;
+
+	frame = fetchPage(disk, pageFor(disk, aaMixHash64(key, keylen)), 0, 0);
+	(*cost)++;
+	if (frame == NULL)
+		return NULL;
+
+	offset = findRecord(aarray, frame, key, keylen);
+	if (offset == 0)
+		return NULL;
+	return frame->data + offset + RECORD_HEADER + keylen;
+}
+
+/** remove a key, returning a copy of its value, or NULL if not present */
+void *
+aaDiskDelete(AssociativeArray *aarray, AAKeyType key, size_t keylen, int *cost)
+{
+	AADiskTable *disk = aarray->disk;
+	BucketHeader *bucket;
+	PageFrame *frame;
+	uint32_t offset, recordSize;
+
+	frame = fetchPage(disk, pageFor(disk, aaMixHash64(key, keylen)), 0, 0);
+	(*cost)++;
+	if (frame == NULL)
+		return NULL;
+
+	offset = findRecord(aarray, frame, key, keylen);
+	if (offset == 0)
+		return NULL;
+
+	/** keep the value, then close up the gap the record leaves */
+	memcpy(disk->deletedValue, frame->data + offset + RECORD_HEADER + keylen,
+			aarray->valueWidth);
+	bucket = bucketOf(frame);
+	recordSize = RECORD_HEADER + keylen + aarray->valueWidth;
+	memmove(frame->data + offset, frame->data + offset + recordSize,
+			bucket->used - offset - recordSize);
+	bucket->used -= recordSize;
+	bucket->nRecords--;
+	frame->dirty = 1;
+
+	aarray->nEntries--;
+	return disk->deletedValue;
+}
+
+/** call the user function on every record, a page at a time */
+int
+aaDiskIterate(AssociativeArray *aarray,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata)
+{
+	AADiskTable *disk = aarray->disk;
+	PageFrame *frame;
+	uint32_t page, offset;
+	size_t keylen;
+	int r, status = 1;
+
+	for (page = 1; page < disk->nPages && status > 0; page++) {
+		frame = fetchPage(disk, page, 0, 0);
+		if (frame == NULL)
+			return -1;
+
+		frame->pinned = 1;
+		offset = sizeof(BucketHeader);
+		for (r = 0; r < bucketOf(frame)->nRecords; r++) {
+			keylen = recordKeyLength(frame, offset);
+			if ((*userfunction)(frame->data + offset + RECORD_HEADER, keylen,
+					frame->data + offset + RECORD_HEADER + keylen, userdata) < 0) {
+				status = -1;
+				break;
+			}
+			offset += RECORD_HEADER + keylen + aarray->valueWidth;
+		}
+		frame->pinned = 0;
+	}
+	return status;
+}
+
+/** release the cache and everything else, but not the file */
+static void
+freeDisk(AssociativeArray *aarray, AADiskTable *disk)
+{
+	if (disk->fd >= 0)
+		close(disk->fd);
+	free(disk->directory);
+	free(disk->frames);
+	free(disk->deletedValue);
+	aaSlotMemoryFree(aarray, disk->frameMemory,
+			(size_t) disk->nFrames * disk->pageSize);
+	free(disk);
+}
+
+/** read the header and the directory of an existing file */
+static int
+readExisting(AssociativeArray *aarray, AADiskTable *disk, const char *path)
+{
+	DiskHeader header;
+	size_t directoryBytes;
+
+	if (pread(disk->fd, &header, sizeof(DiskHeader), 0) != sizeof(DiskHeader)
+			|| memcmp(header.magic, DISK_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "Error: '%s' is not a disk table\n", path);
+		return -1;
+	}
+	if (header.valueWidth != aarray->valueWidth) {
+		fprintf(stderr, "Error: disk table '%s' holds %u byte values, not %lu\n",
+				path, header.valueWidth, (unsigned long) aarray->valueWidth);
+		return -1;
+	}
+
+	disk->pageSize = header.pageSize;
+	disk->globalDepth = header.globalDepth;
+	disk->nPages = header.nPages;
+	aarray->nEntries = (int) header.nEntries;
+
+	directoryBytes = ((size_t) 1 << disk->globalDepth) * sizeof(uint32_t);
+	disk->directory = (uint32_t *) malloc(directoryBytes);
+	if (disk->directory == NULL
+			|| pread(disk->fd, disk->directory, directoryBytes,
+					(off_t) header.directoryOffset) != (ssize_t) directoryBytes) {
+		fprintf(stderr, "Error: cannot read the directory of disk table '%s'\n", path);
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * Open the file named in the array's options, or create it if it
+ * does not exist
+ *
+ *  @return 1 on success, or -1 (with a message) on failure
+ */
+int
+aaDiskOpen(AssociativeArray *aarray)
+{
+	const char *path = aarray->options.diskPath;
+	AADiskTable *disk;
+	struct stat info;
+	int i, nFrames;
+
+	if (path == NULL || aarray->valueWidth == 0) {
+		fprintf(stderr, "Error: a disk table needs a file and inline values\n");
+		return -1;
+	}
+
+	disk = (AADiskTable *) calloc(1, sizeof(AADiskTable));
+	if (disk == NULL)
+		return -1;
+	disk->pageSize = aarray->options.diskPageSize;
+	if (disk->pageSize < DISK_MIN_PAGE)
+		disk->pageSize = DISK_MIN_PAGE;
+
+	disk->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (disk->fd < 0 || fstat(disk->fd, &info) < 0) {
+		fprintf(stderr, "Error: cannot open disk table '%s' : %s\n", path, strerror(errno));
+		freeDisk(aarray, disk);
+		return -1;
+	}
+
+	if (info.st_size > 0) {
+		if (readExisting(aarray, disk, path) < 0) {
+			freeDisk(aarray, disk);
+			return -1;
+		}
+	} else {
+		/** the header page, and one bucket that everything maps to */
+		disk->globalDepth = 0;
+		disk->nPages = 1;
+		disk->directory = (uint32_t *) malloc(sizeof(uint32_t));
+		if (disk->directory == NULL) {
+			freeDisk(aarray, disk);
+			return -1;
+		}
+		disk->directory[0] = 1;
+		aarray->nEntries = 0;
+	}
+
+	nFrames = aarray->options.diskCachePages;
+	if (nFrames < DISK_MIN_FRAMES)
+		nFrames = DISK_MIN_FRAMES;
+	disk->frames = (PageFrame *) calloc(nFrames, sizeof(PageFrame));
+	disk->frameMemory = (unsigned char *) aaSlotMemoryAlloc(aarray,
+			(size_t) nFrames * disk->pageSize);
+	disk->deletedValue = (unsigned char *) malloc(aarray->valueWidth);
+	if (disk->frames == NULL || disk->frameMemory == NULL || disk->deletedValue == NULL) {
+		freeDisk(aarray, disk);
+		return -1;
+	}
+	disk->nFrames = nFrames;
+	for (i = 0; i < nFrames; i++)
+		disk->frames[i].data = disk->frameMemory + (size_t) i * disk->pageSize;
+
+	aarray->disk = disk;
+
+	if (disk->nPages == 1) {
+		if (fetchPage(disk, 1, 1, 1) == NULL) {
+			aarray->disk = NULL;
+			freeDisk(aarray, disk);
+			return -1;
+		}
+		disk->nPages = 2;
+	}
+	aarray->size = disk->nPages - 1;
+
+	return 1;
+}
+
+/**
+ * Write out everything that is cached, then the directory after the
+ * last page and the header in front, and close the file
+ */
+void
+aaDiskClose(AssociativeArray *aarray)
+{
+	AADiskTable *disk = aarray->disk;
+	unsigned char *headerPage;
+	DiskHeader header;
+	size_t directoryBytes;
+	int i, status = 1;
+
+	if (disk == NULL)
+		return;
+
+	for (i = 0; i < disk->nFrames; i++) {
+		if (disk->frames[i].valid && disk->frames[i].dirty
+				&& writeFrame(disk, &disk->frames[i]) < 0)
+			status = -1;
+	}
+
+	memset(&header, 0, sizeof(DiskHeader));
+	memcpy(header.magic, DISK_MAGIC, sizeof(header.magic));
+	header.pageSize = disk->pageSize;
+	header.valueWidth = (uint32_t) aarray->valueWidth;
+	header.globalDepth = disk->globalDepth;
+	header.nPages = disk->nPages;
+	header.nEntries = (uint64_t) aarray->nEntries;
+	header.directoryOffset = (uint64_t) disk->nPages * disk->pageSize;
+
+	directoryBytes = ((size_t) 1 << disk->globalDepth) * sizeof(uint32_t);
+	headerPage = (unsigned char *) calloc(1, disk->pageSize);
+	if (headerPage == NULL
+			|| pwrite(disk->fd, disk->directory, directoryBytes,
+					(off_t) header.directoryOffset) != (ssize_t) directoryBytes
+			|| ftruncate(disk->fd, (off_t) (header.directoryOffset + directoryBytes)) < 0) {
+		status = -1;
+	} else {
+		memcpy(headerPage, &header, sizeof(DiskHeader));
+		if (pwrite(disk->fd, headerPage, disk->pageSize, 0) != (ssize_t) disk->pageSize)
+			status = -1;
+	}
+	free(headerPage);
+
+	if (status < 0) {
+		fprintf(stderr, "Error: cannot write out disk table '%s' : %s\n",
+				aarray->options.diskPath, strerror(errno));
+	}
+
+	aarray->disk = NULL;
+	freeDisk(aarray, disk);
+}
+
+/** print the records of each bucket */
+void
+aaPrintDiskContents(FILE *fp, AssociativeArray *aarray, char *tag)
+{
+	AADiskTable *disk = aarray->disk;
+	char keybuffer[128];
+	PageFrame *frame;
+	uint32_t page, offset;
+	size_t keylen;
+	int r;
+
+	fprintf(fp, "%sDumping disk table of %u buckets:\n", tag, disk->nPages - 1);
+	for (page = 1; page < disk->nPages; page++) {
+		frame = fetchPage(disk, page, 0, 0);
+		if (frame == NULL)
+			return;
+		fprintf(fp, "%s  bucket %u : depth %d, %d records, %u bytes used\n",
+				tag, page, bucketOf(frame)->localDepth,
+				bucketOf(frame)->nRecords, bucketOf(frame)->used);
+		offset = sizeof(BucketHeader);
+		for (r = 0; r < bucketOf(frame)->nRecords; r++) {
+			keylen = recordKeyLength(frame, offset);
+			printableKey(keybuffer, 128, frame->data + offset + RECORD_HEADER, keylen);
+			fprintf(fp, "%s    '%s'\n", tag, keybuffer);
+			offset += RECORD_HEADER + keylen + aarray->valueWidth;
+		}
+	}
+}
+
+/** print the shape of the file and how the cache has done */
+void
+aaPrintDiskSummary(FILE *fp, AssociativeArray *aarray)
+{
+	AADiskTable *disk = aarray->disk;
+
+	if (disk == NULL)
+		return;
+
+	fprintf(fp, "Disk table '%s': %u buckets of %u bytes, directory of %lu entries, %lu splits\n",
+			aarray->options.diskPath, disk->nPages - 1, disk->pageSize,
+			(unsigned long) 1 << disk->globalDepth, disk->nSplits);
+	fprintf(fp, "  values stored inline: %lu bytes each\n",
+			(unsigned long) aarray->valueWidth);
+	fprintf(fp, "  page cache of %d frames: %lu hits, %lu reads, %lu writes\n",
+			disk->nFrames, disk->nHits, disk->nReads, disk->nWrites);
+}
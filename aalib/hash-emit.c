@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * Writing a frozen array out as C source.
+ *
+ * The source defines an AAStaticTable, with the frozen array's
+ * pilots and seed, and the keys and values of its slots packed into
+ * two byte arrays indexed by offset arrays.  Offsets rather than
+ * pointers keep every array free of relocations, so that the whole
+ * table can go in .rodata.  The slots are written in order, so a key
+ * is found in the static table in the same slot aaLookup() would
+ * find it in the frozen array, using the same hash (aaStaticLookup()
+ * shares its code with the frozen lookup).
+ */
+
+#define	BYTES_PER_LINE		12
+#define	NUMBERS_PER_LINE	8
+
+/**
+ * The bytes of the value in a slot, and how many there are: inline
+ * values are taken as they are, and others through the valueBytes
+ * callback, if there is one.  Shared tables publish values the same way.
+ */
+size_t
+aaSlotValueBytes(AssociativeArray *aarray, KeyDataPair *entry, const void **bytes,
+		size_t (*valueBytes)(void *value, const void **bytes, void *userdata),
+		void *userdata)
+{
+	*bytes = NULL;
+	if (aarray->valueWidth > 0) {
+		*bytes = entry->value;
+		return aarray->valueWidth;
+	}
+	if (valueBytes == NULL)
+		return 0;
+	return (*valueBytes)(entry->value, bytes, userdata);
+}
+
+/** write out an array of bytes as a C initializer */
+static void
+emitBytes(FILE *fp, const unsigned char *bytes, size_t nBytes, size_t *column)
+{
+	size_t i;
+
+	for (i = 0; i < nBytes; i++) {
+		fprintf(fp, "%s0x%02x,", (*column % BYTES_PER_LINE == 0) ? "\n\t" : " ", bytes[i]);
+		(*column)++;
+	}
+}
+
+/** write out one element of an array of numbers as a C initializer */
+static void
+emitNumber(FILE *fp, unsigned long number, size_t *column)
+{
+	fprintf(fp, "%s%lu,", (*column % NUMBERS_PER_LINE == 0) ? "\n\t" : " ", number);
+	(*column)++;
+}
+
+/**
+ * Write a frozen array out as the definition of a static table called
+ * <name>_table in the source file, and a lookup function for it called
+ * <name>_lookup(), both declared in the header file
+ *
+ *  @param  headerName  how the source should #include the header
+ *  @param  valueBytes  gives the bytes of each value; it is not used
+ *				if the array stores its values inline, and without
+ *				it every value is empty
+ *  @return 1 on success, or -1 if the array is not frozen or is too
+ *				large to write out
+ */
+int
+aaEmitStaticTable(FILE *source, FILE *header,
+		AssociativeArray *aarray, const char *name, const char *headerName,
+		size_t (*valueBytes)(void *value, const void **bytes, void *userdata),
+		void *userdata)
+{
+	const uint32_t *pilots;
+	const void *bytes;
+	KeyDataPair entry;
+	uint32_t nBuckets, b;
+	uint64_t seed, offset, nKeyBytes = 0, nValueBytes = 0;
+	size_t column, nBytes;
+	int i;
+
+	pilots = aaFrozenPilots(aarray, &nBuckets, &seed);
+	if (pilots == NULL)
+		return -1;
+
+	/** the offsets are 32 bits, so check the totals before writing anything */
+	for (i = 0; i < aarray->size; i++) {
+		if (aaSlotRead(aarray, i, &entry)) {
+			nKeyBytes += entry.keylen;
+			nValueBytes += aaSlotValueBytes(aarray, &entry, &bytes, valueBytes, userdata);
+		}
+	}
+	if (nKeyBytes > UINT32_MAX || nValueBytes > UINT32_MAX)
+		return -1;
+
+	/** the header: just the table and its lookup */
+	fprintf(header, "/* Generated from a frozen associative array; do not edit. */\n\n");
+	fprintf(header, "#ifndef\t__%s_STATIC_TABLE__\n", name);
+	fprintf(header, "#define\t__%s_STATIC_TABLE__\n\n", name);
+	fprintf(header, "#include \"aarray.h\"\n\n");
+	fprintf(header, "extern const AAStaticTable %s_table;\n\n", name);
+	fprintf(header, "/** the value for a key, or NULL if it is not in the table */\n");
+	fprintf(header, "const void *%s_lookup(AAKeyType key, size_t keylength);\n\n", name);
+	fprintf(header, "#endif\n");
+
+	fprintf(source, "/* Generated from a frozen associative array; do not edit. */\n\n");
+	fprintf(source, "#include \"%s\"\n\n", headerName);
+
+	fprintf(source, "static const uint32_t %s_pilots[%u] = {", name, nBuckets);
+	for (b = 0, column = 0; b < nBuckets; b++)
+		emitNumber(source, pilots[b], &column);
+	fprintf(source, "\n};\n\n");
+
+	/** the keys, then the values, each as offsets and bytes */
+	fprintf(source, "static const uint32_t %s_keyOffsets[%d] = {", name, aarray->size + 1);
+	for (i = 0, offset = 0, column = 0; i < aarray->size; i++) {
+		emitNumber(source, (unsigned long) offset, &column);
+		if (aaSlotRead(aarray, i, &entry))
+			offset += entry.keylen;
+	}
+	emitNumber(source, (unsigned long) offset, &column);
+	fprintf(source, "\n};\n\n");
+
+	fprintf(source, "static const unsigned char %s_keyBytes[%lu] = {",
+			name, (unsigned long) (nKeyBytes > 0 ? nKeyBytes : 1));
+	for (i = 0, column = 0; i < aarray->size; i++) {
+		if (aaSlotRead(aarray, i, &entry))
+			emitBytes(source, entry.key, entry.keylen, &column);
+	}
+	if (nKeyBytes == 0)
+		fprintf(source, " 0");
+	fprintf(source, "\n};\n\n");
+
+	fprintf(source, "static const uint32_t %s_valueOffsets[%d] = {", name, aarray->size + 1);
+	for (i = 0, offset = 0, column = 0; i < aarray->size; i++) {
+		emitNumber(source, (unsigned long) offset, &column);
+		if (aaSlotRead(aarray, i, &entry))
+			offset += aaSlotValueBytes(aarray, &entry, &bytes, valueBytes, userdata);
+	}
+	emitNumber(source, (unsigned long) offset, &column);
+	fprintf(source, "\n};\n\n");
+
+	fprintf(source, "static const unsigned char %s_valueBytes[%lu] = {",
+			name, (unsigned long) (nValueBytes > 0 ? nValueBytes : 1));
+	for (i = 0, column = 0; i < aarray->size; i++) {
+		if (aaSlotRead(aarray, i, &entry)) {
+			nBytes = aaSlotValueBytes(aarray, &entry, &bytes, valueBytes, userdata);
+			emitBytes(source, (const unsigned char *) bytes, nBytes, &column);
+		}
+	}
+	if (nValueBytes == 0)
+		fprintf(source, " 0");
+	fprintf(source, "\n};\n\n");
+
+	fprintf(source, "const AAStaticTable %s_table = {\n", name);
+	fprintf(source, "\t0x%016llxULL, %u, %d, %d,\n",
+			(unsigned long long) seed, nBuckets, aarray->size, aarray->nEntries);
+	fprintf(source, "\t%s_pilots,\n", name);
+	fprintf(source, "\t%s_keyOffsets, %s_keyBytes,\n", name, name);
+	fprintf(source, "\t%s_valueOffsets, %s_valueBytes\n", name, name);
+	fprintf(source, "};\n\n");
+
+	fprintf(source, "const void *\n%s_lookup(AAKeyType key, size_t keylength)\n{\n", name);
+	fprintf(source, "\treturn aaStaticLookup(&%s_table, key, keylength);\n}\n", name);
+
+	if (ferror(source) || ferror(header))
+		return -1;
+	return 1;
+}
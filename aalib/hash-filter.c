@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "hashtools.h"
+
+/**
+ * Blocked Bloom filter in front of the slot array.
+ *
+ * A lookup for a key that is not present has to probe until it
+ * reaches an empty slot, which at high load (or with many tombstones)
+ * is the most expensive thing the table does.  The filter answers
+ * most of those lookups on its own: every key in the table has its
+ * bits set, so a key with any bit clear is certainly absent.
+ *
+ * The filter is "blocked": all of a key's bits fall in one 64 byte
+ * block, chosen by the high half of aaMixHash64(), so checking a key
+ * touches a single cache line.  The bits within the block come from
+ * the low half by double hashing, with the two hashes taken from its
+ * two 16 bit halves so that neither shares bits with the block.
+ *
+ * A Bloom filter cannot forget a key, so deleted keys leave stale
+ * bits behind which only make the filter less selective, never wrong.
+ * Growing the table builds a fresh filter for the new generation as
+ * keys are migrated, which clears them out, but inserts that reuse
+ * tombstones can keep a table from ever growing, so the filter is
+ * also rebuilt once the stale keys reach half of those added.
+ */
+
+#define	FILTER_BLOCK_WORDS		8
+#define	FILTER_BLOCK_BITS		(FILTER_BLOCK_WORDS * 64)
+#define	FILTER_MAX_HASHES		16
+
+struct AAFilter {
+	uint64_t *blocks;
+	uint32_t nBlocks;
+	int nHashes;
+	unsigned long nAdded;
+	unsigned long nStale;
+};
+
+
+/**
+ * Create a filter for up to nKeys keys, using bitsPerKey bits each
+ *
+ *  @return the filter, or NULL if no memory is available
+ */
+AAFilter *
+aaFilterCreate(int nKeys, int bitsPerKey)
+{
+	AAFilter *filter;
+	double nBits;
+
+	filter = (AAFilter *) malloc(sizeof(AAFilter));
+	if (filter == NULL)
+		return NULL;
+
+	nBits = (double) nKeys * bitsPerKey;
+	filter->nBlocks = (uint32_t) ((nBits + FILTER_BLOCK_BITS - 1) / FILTER_BLOCK_BITS);
+	if (filter->nBlocks < 1)
+		filter->nBlocks = 1;
+
+	/** the optimal number of hashes is ln(2) times the bits per key */
+	filter->nHashes = (int) (bitsPerKey * M_LN2 + 0.5);
+	if (filter->nHashes < 1)					filter->nHashes = 1;
+	if (filter->nHashes > FILTER_MAX_HASHES)	filter->nHashes = FILTER_MAX_HASHES;
+
+	filter->blocks = (uint64_t *) calloc(
+			(size_t) filter->nBlocks * FILTER_BLOCK_WORDS, sizeof(uint64_t));
+	if (filter->blocks == NULL) {
+		free(filter);
+		return NULL;
+	}
+
+	filter->nAdded = filter->nStale = 0;
+	return filter;
+}
+
+void
+aaFilterDestroy(AAFilter *filter)
+{
+	if (filter == NULL)
+		return;
+	free(filter->blocks);
+	free(filter);
+}
+
+/** the block for a hash, by multiplying rather than dividing */
+static uint64_t *
+filterBlock(const AAFilter *filter, uint64_t hash)
+{
+	uint64_t block = ((hash >> 32) * filter->nBlocks) >> 32;
+	return &filter->blocks[block * FILTER_BLOCK_WORDS];
+}
+
+/**
+ * The two hashes for the bits within a block, from the low half of the
+ * hash that filterBlock() leaves alone; the step is odd so that it
+ * reaches every bit of the block
+ */
+static void
+filterHashes(uint64_t hash, uint32_t *h1, uint32_t *h2)
+{
+	*h1 = (uint32_t) hash & 0xffff;
+	*h2 = ((uint32_t) (hash >> 16) & 0xffff) | 1;
+}
+
+/** set the bits for a key with the given aaMixHash64() value */
+void
+aaFilterAdd(AAFilter *filter, uint64_t hash)
+{
+	uint64_t *block = filterBlock(filter, hash);
+	uint32_t h1, h2, bit;
+	int i;
+
+	filterHashes(hash, &h1, &h2);
+	for (i = 0; i < filter->nHashes; i++) {
+		bit = (h1 + i * h2) % FILTER_BLOCK_BITS;
+		block[bit / 64] |= (uint64_t) 1 << (bit % 64);
+	}
+	filter->nAdded++;
+}
+
+/**
+ * Check a key against the filter
+ *
+ *  @return 0 if the key is certainly not in the table, or 1 if it
+ *			may be
+ */
+int
+aaFilterMayContain(const AAFilter *filter, uint64_t hash)
+{
+	const uint64_t *block = filterBlock(filter, hash);
+	uint32_t h1, h2, bit;
+	int i;
+
+	filterHashes(hash, &h1, &h2);
+	for (i = 0; i < filter->nHashes; i++) {
+		bit = (h1 + i * h2) % FILTER_BLOCK_BITS;
+		if ((block[bit / 64] & ((uint64_t) 1 << (bit % 64))) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Note that a key has been deleted, and rebuild the filter from the
+ * table if the stale bits have built up
+ */
+void
+aaFilterRemoved(AssociativeArray *aarray)
+{
+	AAFilter *filter = aarray->filter;
+	KeyDataPair entry;
+	int i;
+
+	filter->nStale++;
+	if (filter->nStale * 2 < filter->nAdded)
+		return;
+
+	memset(filter->blocks, 0,
+			(size_t) filter->nBlocks * FILTER_BLOCK_WORDS * sizeof(uint64_t));
+	filter->nAdded = filter->nStale = 0;
+
+	for (i = 0; i < aarray->size; i++) {
+		if (aaSlotValidity(aarray, i) == HASH_USED
+				&& aaSlotRead(aarray, i, &entry)) {
+			aaFilterAdd(filter, aaMixHash64(entry.key, entry.keylen));
+		}
+	}
+	aarray->nFilterRebuilds++;
+}
+
+/** print the size of the filter and how useful it has been */
+void
+aaPrintFilterSummary(FILE *fp, AssociativeArray *aarray)
+{
+	AAFilter *filter = aarray->filter;
+
+	if (filter == NULL)
+		return;
+
+	fprintf(fp, "Lookup filter: %lu bytes, %d hashes, %lu keys (%lu stale), rebuilt %d times\n",
+			(unsigned long) filter->nBlocks * FILTER_BLOCK_WORDS * sizeof(uint64_t),
+			filter->nHashes, filter->nAdded, filter->nStale, aarray->nFilterRebuilds);
+	fprintf(fp, "  %lu lookups answered by the filter alone\n", aarray->lookupsFiltered);
+}
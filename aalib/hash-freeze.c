@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * Freezing a table into a minimal perfect hash.
+ *
+ * A table that is loaded once and then only queried does not need
+ * room to insert into, nor tombstones, nor probe chains.  aaFreeze()
+ * rebuilds it with exactly one slot per key, placed by "hash and
+ * displace" (as in CHD and PTHash): the keys are split by hash into
+ * buckets of four on average, and each bucket is given a pilot value,
+ * found by trial, that sends every key of the bucket to a slot no
+ * other key has taken.  Buckets are placed largest first, while there
+ * are still plenty of free slots for them to land in.
+ *
+ * A lookup then hashes the key once, reads its bucket's pilot, and
+ * checks the single slot that gives.  The slots are those of the
+ * packed layout, so the tag catches most absent keys before their
+ * key bytes are read, and everything that reads slots (iteration,
+ * printing, releasing the keys) works on a frozen table unchanged.
+ */
+
+#define	KEYS_PER_BUCKET		4
+#define	MAX_SEEDS			8
+
+struct AAFrozen {
+	uint32_t *pilots;
+	uint32_t nBuckets;
+	uint64_t seed;
+	int nSeeds;
+};
+
+/** a key on its way into the frozen table */
+typedef struct FreezeKey {
+	AAKeyType key;
+	size_t keylen;
+	void *value;
+	uint64_t hash;
+	uint32_t slot;
+} FreezeKey;
+
+typedef struct FreezeBuild {
+	AssociativeArray *aarray;
+	FreezeKey *keys;
+	uint32_t nKeys;
+	uint32_t nAllocated;
+	unsigned char *values;
+} FreezeBuild;
+
+
+/** the final mix of aaMixHash64(), to spread a pilot over the slots */
+static uint64_t
+mix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/** the bucket of a key, by multiplying rather than dividing */
+static uint32_t
+bucketOf(uint64_t hash, uint32_t nBuckets)
+{
+	return (uint32_t) (((hash >> 32) * nBuckets) >> 32);
+}
+
+/** the slot a key goes to with the given pilot */
+static uint32_t
+slotOf(uint64_t hash, uint64_t seed, uint32_t pilot, uint32_t nSlots)
+{
+	uint64_t x = mix64((hash ^ seed) + pilot * 0x9e3779b97f4a7c15ULL);
+	return (uint32_t) (((x >> 32) * nSlots) >> 32);
+}
+
+/**
+ * iteration callback: take a copy of each key, with the header the
+ * packed layout needs, and of its value if that is stored inline
+ */
+static int
+collectKey(AAKeyType key, size_t keylen, void *value, void *userdata)
+{
+	FreezeBuild *build = (FreezeBuild *) userdata;
+	FreezeKey *entry;
+
+	if (build->nKeys >= build->nAllocated)
+		return -1;
+
+	entry = &build->keys[build->nKeys];
+	entry->key = aaPackedCopyKey(key, keylen);
+	if (entry->key == NULL)
+		return -1;
+	build->nKeys++;
+
+	/** the slot keeps the address in its low bits, so check it fits */
+	if (((uintptr_t) entry->key & ~AA_PACKED_POINTER_MASK) != 0)
+		return -1;
+
+	entry->keylen = keylen;
+	entry->hash = aaMixHash64(key, keylen);
+	entry->value = value;
+	if (build->aarray->valueWidth > 0) {
+		entry->value = build->values
+				+ (size_t) (build->nKeys - 1) * build->aarray->valueWidth;
+		memcpy(entry->value, value, build->aarray->valueWidth);
+	}
+	return 1;
+}
+
+static void
+freeBuild(FreezeBuild *build, int freeKeys)
+{
+	uint32_t i;
+
+	if (freeKeys) {
+		for (i = 0; i < build->nKeys; i++)
+			aaPackedFreeKey(build->keys[i].key);
+	}
+	free(build->keys);
+	free(build->values);
+}
+
+/**
+ * Find a pilot for every bucket with the given seed, filling in the
+ * slot of each key
+ *
+ *  @return 1 on success, 0 if some bucket could not be placed (so
+ *			another seed should be tried), or -1 if out of memory
+ */
+static int
+placeKeys(FreezeBuild *build, AAFrozen *frozen)
+{
+	uint32_t nKeys = build->nKeys, nBuckets = frozen->nBuckets;
+	uint32_t *bucketStart, *members, *order, *sizeStart;
+	uint32_t b, i, j, k, pilot, maxPilot, maxSize = 0, slot;
+	unsigned char *taken;
+	int status = -1;
+
+	bucketStart = (uint32_t *) calloc(nBuckets + 1, sizeof(uint32_t));
+	members = (uint32_t *) malloc(nKeys * sizeof(uint32_t));
+	order = (uint32_t *) malloc(nBuckets * sizeof(uint32_t));
+	taken = (unsigned char *) calloc(nKeys, 1);
+	sizeStart = NULL;
+	if (bucketStart == NULL || members == NULL || order == NULL || taken == NULL)
+		goto done;
+
+	/** group the keys by bucket */
+	for (i = 0; i < nKeys; i++)
+		bucketStart[bucketOf(build->keys[i].hash, nBuckets) + 1]++;
+	for (b = 0; b < nBuckets; b++) {
+		if (bucketStart[b + 1] > maxSize)
+			maxSize = bucketStart[b + 1];
+		bucketStart[b + 1] += bucketStart[b];
+	}
+	for (i = 0; i < nKeys; i++) {
+		b = bucketOf(build->keys[i].hash, nBuckets);
+		members[bucketStart[b]++] = i;
+	}
+	for (b = nBuckets; b > 0; b--)
+		bucketStart[b] = bucketStart[b - 1];
+	bucketStart[0] = 0;
+
+	/** and order the buckets largest first, by counting their sizes */
+	sizeStart = (uint32_t *) calloc(maxSize + 2, sizeof(uint32_t));
+	if (sizeStart == NULL)
+		goto done;
+	for (b = 0; b < nBuckets; b++)
+		sizeStart[maxSize - (bucketStart[b + 1] - bucketStart[b]) + 1]++;
+	for (i = 0; i <= maxSize; i++)
+		sizeStart[i + 1] += sizeStart[i];
+	for (b = 0; b < nBuckets; b++)
+		order[sizeStart[maxSize - (bucketStart[b + 1] - bucketStart[b])]++] = b;
+
+	/**
+	 * the last buckets placed may have to find the last free slots,
+	 * which takes about nKeys tries each, so allow plenty more than
+	 * that before giving up on this seed
+	 */
+	maxPilot = 64 * nKeys + 65536;
+
+	for (k = 0; k < nBuckets; k++) {
+		b = order[k];
+		if (bucketStart[b + 1] == bucketStart[b]) {
+			frozen->pilots[b] = 0;
+			continue;
+		}
+
+		for (pilot = 0; pilot < maxPilot; pilot++) {
+			for (j = bucketStart[b]; j < bucketStart[b + 1]; j++) {
+				slot = slotOf(build->keys[members[j]].hash, frozen->seed, pilot, nKeys);
+				if (taken[slot])
+					break;
+				taken[slot] = 1;
+				build->keys[members[j]].slot = slot;
+			}
+			if (j == bucketStart[b + 1])
+				break;
+
+			/** a collision: give back the slots this pilot took */
+			while (j-- > bucketStart[b])
+				taken[build->keys[members[j]].slot] = 0;
+		}
+		if (pilot == maxPilot) {
+			status = 0;
+			goto done;
+		}
+		frozen->pilots[b] = pilot;
+	}
+	status = 1;
+
+done:
+	free(bucketStart);
+	free(members);
+	free(order);
+	free(taken);
+	free(sizeStart);
+	return status;
+}
+
+/**
+ * Convert a populated array into a minimal perfect hash, with one
+ * slot per key and a single probe per lookup.  After this the array
+ * can only be queried: aaInsert() fails and aaDelete() finds nothing.
+ *
+ *  @return 1 on success, or -1 if the array could not be frozen (or
+ *			is a disk or shared table), in which case it is left as
+ *			it was
+ */
+int
+aaFreeze(AssociativeArray *aarray)
+{
+	FreezeBuild build;
+	AAFrozen *frozen;
+	PackedSlot *slots;
+	int nEntries, status, newPages = 0, newNuma = 0, oldPages, oldNuma, i;
+	size_t stride;
+
+	if (aarray->frozen != NULL)
+		return 1;
+
+	/**
+	 * the keys of a disk table stay on disk, a shared one is fixed,
+	 * and a cache must be able to take more
+	 */
+	if (aarray->layout == AA_LAYOUT_DISK || aarray->layout == AA_LAYOUT_SHARED
+			|| aarray->cache != NULL)
+		return -1;
+
+	nEntries = aarray->nEntries;
+	if (aarray->retiring != NULL)
+		nEntries += aarray->retiring->nEntries;
+
+	/** copy every key (and inline value) out of the current storage */
+	memset(&build, 0, sizeof(FreezeBuild));
+	build.aarray = aarray;
+	build.nAllocated = (uint32_t) nEntries;
+	build.keys = (FreezeKey *) malloc((nEntries + 1) * sizeof(FreezeKey));
+	if (aarray->valueWidth > 0)
+		build.values = (unsigned char *) malloc((nEntries + 1) * aarray->valueWidth);
+	if (build.keys == NULL || (aarray->valueWidth > 0 && build.values == NULL)) {
+		freeBuild(&build, 1);
+		return -1;
+	}
+	if (aaIterateAction(aarray, collectKey, &build) < 0 || build.nKeys != (uint32_t) nEntries) {
+		freeBuild(&build, 1);
+		return -1;
+	}
+
+	frozen = (AAFrozen *) malloc(sizeof(AAFrozen));
+	if (frozen == NULL) {
+		freeBuild(&build, 1);
+		return -1;
+	}
+	frozen->nBuckets = build.nKeys / KEYS_PER_BUCKET + 1;
+	frozen->pilots = (uint32_t *) malloc(frozen->nBuckets * sizeof(uint32_t));
+	if (frozen->pilots == NULL) {
+		free(frozen);
+		freeBuild(&build, 1);
+		return -1;
+	}
+
+	/** a bucket that cannot be placed needs a fresh start with a new seed */
+	status = (build.nKeys == 0) ? 1 : 0;
+	for (frozen->nSeeds = 1; frozen->nSeeds <= MAX_SEEDS && status == 0; frozen->nSeeds++) {
+		frozen->seed = mix64(0x9e3779b97f4a7c15ULL * frozen->nSeeds);
+		status = placeKeys(&build, frozen);
+	}
+	frozen->nSeeds--;
+
+	/** allocate the slots before letting go of anything */
+	stride = aaPackedStride(aarray->valueWidth);
+	slots = NULL;
+	if (status > 0) {
+		oldPages = aarray->slotPages;
+		oldNuma = aarray->slotNumaApplied;
+		slots = (PackedSlot *) aaSlotMemoryAlloc(aarray,
+				(build.nKeys > 0 ? build.nKeys : 1) * stride);
+		newPages = aarray->slotPages;
+		newNuma = aarray->slotNumaApplied;
+		aarray->slotPages = oldPages;
+		aarray->slotNumaApplied = oldNuma;
+	}
+	if (slots == NULL) {
+		free(frozen->pilots);
+		free(frozen);
+		freeBuild(&build, 1);
+		return -1;
+	}
+
+	/** the old storage goes, and the array becomes a full packed one */
+	aaReleaseStorage(aarray);
+	aarray->slotPages = newPages;
+	aarray->slotNumaApplied = newNuma;
+
+	aarray->layout = aarray->options.layout = AA_LAYOUT_PACKED;
+	aarray->options.growAtLoad = 0;
+	aarray->options.filterBitsPerKey = 0;
+	aarray->options.keyStore = AA_KEYS_MALLOC;
+	aarray->entryStride = stride;
+	aarray->packed = slots;
+	aarray->size = (build.nKeys > 0) ? build.nKeys : 1;
+	aarray->nEntries = 0;
+	aarray->nTombstones = 0;
+
+	for (i = 0; i < (int) build.nKeys; i++) {
+		aaPackedPlace(aarray, build.keys[i].slot,
+				build.keys[i].key, build.keys[i].keylen, build.keys[i].value);
+		aarray->nEntries++;
+	}
+	aarray->frozen = frozen;
+
+	/** the keys now belong to the slots */
+	freeBuild(&build, 0);
+	return 1;
+}
+
+/**
+ * Find the slot of a key in a frozen array: the only place it can be
+ *
+ *  @return the slot, or (HashIndex) -1 if the key is not present
+ */
+HashIndex
+aaFrozenFind(AssociativeArray *aarray, AAKeyType key, size_t keylen, int *cost)
+{
+	AAFrozen *frozen = aarray->frozen;
+	uint64_t hash = aaMixHash64(key, keylen);
+	uint32_t slot;
+
+	if (aarray->nEntries == 0)
+		return (HashIndex) -1;
+
+	slot = slotOf(hash, frozen->seed,
+			frozen->pilots[bucketOf(hash, frozen->nBuckets)], (uint32_t) aarray->size);
+	(*cost)++;
+
+	/** the packed layout's tag is the top of the same hash */
+	if ( ! aaSlotHoldsKey(aarray, slot, key, keylen, (uint16_t) (hash >> 48)))
+		return (HashIndex) -1;
+	return slot;
+}
+
+/** the pilots and seed of a frozen array, for writing it out */
+const uint32_t *
+aaFrozenPilots(AssociativeArray *aarray, uint32_t *nBuckets, uint64_t *seed)
+{
+	if (aarray->frozen == NULL)
+		return NULL;
+	*nBuckets = aarray->frozen->nBuckets;
+	*seed = aarray->frozen->seed;
+	return aarray->frozen->pilots;
+}
+
+/**
+ * Look a key up in a static table, which is laid out slot for slot
+ * like the frozen array it was written from
+ *
+ *  @return the value's bytes, or NULL if the key is not present
+ */
+const void *
+aaStaticLookup(const AAStaticTable *table, AAKeyType key, size_t keylen)
+{
+	uint64_t hash;
+	uint32_t slot, start;
+
+	if (table->nKeys == 0)
+		return NULL;
+
+	hash = aaMixHash64(key, keylen);
+	slot = slotOf(hash, table->seed,
+			table->pilots[bucketOf(hash, table->nBuckets)], table->nSlots);
+
+	start = table->keyOffsets[slot];
+	if (table->keyOffsets[slot + 1] - start != keylen
+			|| memcmp(table->keyBytes + start, key, keylen) != 0)
+		return NULL;
+	return table->valueBytes + table->valueOffsets[slot];
+}
+
+void
+aaFrozenDestroy(AAFrozen *frozen)
+{
+	if (frozen == NULL)
+		return;
+	free(frozen->pilots);
+	free(frozen);
+}
+
+/** print the size of the frozen index */
+void
+aaPrintFrozenSummary(FILE *fp, AssociativeArray *aarray)
+{
+	AAFrozen *frozen = aarray->frozen;
+
+	if (frozen == NULL)
+		return;
+
+	fprintf(fp, "Frozen: one slot per key, %u buckets with %lu bytes of pilots (%.2f bits a key), %d seed%s tried\n",
+			frozen->nBuckets,
+			(unsigned long) frozen->nBuckets * sizeof(uint32_t),
+			(aarray->nEntries > 0)
+				? frozen->nBuckets * sizeof(uint32_t) * 8.0 / aarray->nEntries : 0.0,
+			frozen->nSeeds, (frozen->nSeeds == 1) ? "" : "s");
+}
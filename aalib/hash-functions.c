@@ -133,6 +133,47 @@ HashIndex hashByPrime(AAKeyType key, size_t keyLength, HashIndex size)
 	return primeSum;
 }
 
+/**
+ * A full 64 bit hash of the key, for structures kept alongside the
+ * table (such as the lookup filter) that need well mixed bits rather
+ * than an index.  This is FNV-1a over the bytes, followed by the
+ * MurmurHash3 finalizer so that the high bits depend on every byte.
+ *
+ *  @param  key  key to calculate the hash of
+ *  @return      the 64 bit hash value
+ */
+uint64_t aaMixHash64(AAKeyType key, size_t keyLength)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < keyLength; i++) {
+		hash ^= key[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/**
+ * Calculate a hash value from the full 64 bit hash above, for tables
+ * whose keys the simpler hashes spread poorly
+ *
+ *  @param  key  key to calculate mapping upon
+ *  @param  size boundary for range of allowable return values
+ *  @return      integer index associated with key
+ */
+HashIndex hashByMix(AAKeyType key, size_t keyLength, HashIndex size)
+{
+	return (HashIndex) (aaMixHash64(key, keyLength) % size);
+}
+
 
 /**
  * Locate an empty position in the given array, starting the
@@ -175,6 +216,7 @@ HashIndex linearProbe(AssociativeArray *hashTable,
 	 * strategy, such as that discussed in class.
 	 */
 	HashIndex j = index;
+	uint16_t tag = aaKeyTag(hashTable, key, keylength); //lets packed slots skip most key comparisons
 
 	//set up the stopping condition
 	int contSearch = 1;
@@ -189,7 +231,7 @@ HashIndex linearProbe(AssociativeArray *hashTable,
 
 	//loop until a spot has been found
 	while (contSearch) {
-		keyDataPairValidity = (hashTable->table)[j].validity;
+		keyDataPairValidity = aaSlotValidity(hashTable, j);
 		//count this itteration towards the total cost
 		(*cost)++;
 		
@@ -201,9 +243,7 @@ HashIndex linearProbe(AssociativeArray *hashTable,
 		*/
 
 		// test to see if this index has the provided key in it
-		if ((hashTable->table)[j].key != NULL 
-			&& (hashTable->table)[j].validity == HASH_USED 
-			&& doKeysMatch((hashTable->table)[j].key, (hashTable->table)[j].keylen, key, keylength) == 1)
+		if (aaSlotHoldsKey(hashTable, j, key, keylength, tag))
 		{
 			contSearch = 0;
 			return j;
@@ -222,7 +262,7 @@ HashIndex linearProbe(AssociativeArray *hashTable,
 			//ensure that the key in this tombstone is freed since is it about to be overwitten by a new insetion
 			if (key != NULL)
 			{
-				free((hashTable->table)[j].key);
+				aaSlotReleaseKey(hashTable, j);
 			}
 
 			return j;
@@ -288,6 +328,7 @@ HashIndex quadraticProbe(AssociativeArray *hashTable, AAKeyType key, size_t keyl
 
 	int step = 0;
 	HashIndex j = startIndex;
+	uint16_t tag = aaKeyTag(hashTable, key, keylen); //lets packed slots skip most key comparisons
 
 	//set up the stopping condition
 	int contSearch = 1;
@@ -302,7 +343,7 @@ HashIndex quadraticProbe(AssociativeArray *hashTable, AAKeyType key, size_t keyl
 
 	//loop until a spot has been found
 	while (contSearch) {
-		keyDataPairValidity = (hashTable->table)[j].validity;
+		keyDataPairValidity = aaSlotValidity(hashTable, j);
 		//count this itteration towards the total cost
 		(*cost)++;
 		
@@ -314,9 +355,7 @@ HashIndex quadraticProbe(AssociativeArray *hashTable, AAKeyType key, size_t keyl
 		*/
 
 		// test to see if this index has the provided key in it
-		if ((hashTable->table)[j].key != NULL 
-			&& (hashTable->table)[j].validity == HASH_USED 
-			&& doKeysMatch((hashTable->table)[j].key, (hashTable->table)[j].keylen, key, keylen) == 1)
+		if (aaSlotHoldsKey(hashTable, j, key, keylen, tag))
 		{
 			contSearch = 0;
 			return j;
@@ -335,7 +374,7 @@ HashIndex quadraticProbe(AssociativeArray *hashTable, AAKeyType key, size_t keyl
 			//ensure that the key in this tombstone is freed since is it about to be overwitten by a new insetion
 			if (key != NULL)
 			{
-				free((hashTable->table)[j].key);
+				aaSlotReleaseKey(hashTable, j);
 			}
 
 			return j;
@@ -343,7 +382,7 @@ HashIndex quadraticProbe(AssociativeArray *hashTable, AAKeyType key, size_t keyl
 
 		//if we have not reached an empty spot quaddratically probe the next spot
 		step++;
-		j = (startIndex + (step * step)) % hashTable->size;
+		j = (startIndex + ((HashIndex) step * step)) % hashTable->size;
 		
 		if (step == hashTable->size) { //if a single step is larger than the table there is no room left
 			//the hash table is full :(
@@ -392,6 +431,7 @@ HashIndex doubleHashProbe(AssociativeArray *hashTable, AAKeyType key, size_t key
 
 	HashIndex step = (*(hashTable->hashAlgorithmSecondary))(key, keylen, hashTable->size); //get the step size
 	HashIndex j = startIndex;
+	uint16_t tag = aaKeyTag(hashTable, key, keylen); //lets packed slots skip most key comparisons
 
 	//set up the stopping condition
 	int contSearch = 1;
@@ -399,14 +439,12 @@ HashIndex doubleHashProbe(AssociativeArray *hashTable, AAKeyType key, size_t key
 
 	//loop until a spot has been found
 	while (contSearch) {
-		keyDataPairValidity = (hashTable->table)[j].validity;
+		keyDataPairValidity = aaSlotValidity(hashTable, j);
 		//count this itteration towards the total cost
 		(*cost)++;
 
 		// test to see if this index has the provided key in it
-		if ((hashTable->table)[j].key != NULL 
-			&& (hashTable->table)[j].validity == HASH_USED 
-			&& doKeysMatch((hashTable->table)[j].key, (hashTable->table)[j].keylen, key, keylen) == 1)
+		if (aaSlotHoldsKey(hashTable, j, key, keylen, tag))
 		{
 			contSearch = 0;
 			return j;
@@ -425,7 +463,7 @@ HashIndex doubleHashProbe(AssociativeArray *hashTable, AAKeyType key, size_t key
 			//ensure that the key in this tombstone is freed since is it about to be overwitten by a new insetion
 			if (key != NULL)
 			{
-				free((hashTable->table)[j].key);
+				aaSlotReleaseKey(hashTable, j);
 			}
 
 			return j;
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hashtools.h"
+
+/**
+ * Hash joins between two sets of rows.
+ *
+ * The smaller input is the build side: its rows go into a table, and
+ * each row of the other (probe) input is looked up in it.  One table
+ * for the whole build side would be far bigger than the cache for any
+ * input worth joining, so that every probe would miss, so both inputs
+ * are first radix partitioned on the high bits of the hash of their
+ * keys.  Matching keys always land in the same partition, and each
+ * partition's table is small enough to stay in cache while the
+ * partition's probe rows are run against it.
+ *
+ * Partitions are independent, so worker threads take them one at a
+ * time until there are none left.  Rows are only referred to by
+ * index: the partitioning moves an index and the key's hash, not the
+ * rows.  The partition tables hash by "mix", so the hash carried with
+ * each row gives its home slot without hashing the key again, and the
+ * probe loop uses it to prefetch the slots of the rows a few ahead.
+ * Results are gathered into batches, each handed to the caller's emit
+ * function under a lock, so that the workers seldom wait on one
+ * another.
+ *
+ * A build key may appear on several rows: the table maps each key to
+ * the first of them, and the others are chained from it.  When the
+ * build side is the left input of a left or anti join, each build row
+ * remembers whether it was matched, and the unmatched ones are emitted
+ * once the partition's probe rows are done.
+ */
+
+#define	PARTITION_ROWS		1024
+#define	MAX_PARTITION_BITS	16
+#define	PARTITIONS_PER_THREAD	4
+#define	EMIT_BATCH			256
+#define	PREFETCH_DISTANCE	8
+
+#define	NO_ROW				((size_t) -1)
+
+/** a row placed in a partition: its index in the input, and its hash */
+typedef struct PartitionedRow {
+	uint64_t hash;
+	size_t row;
+} PartitionedRow;
+
+/** an input's rows grouped by partition, partition p in [starts[p], starts[p+1]) */
+typedef struct Partitioned {
+	PartitionedRow *rows;
+	size_t *starts;
+} Partitioned;
+
+typedef struct JoinResult {
+	AAKeyType key;
+	size_t keylen;
+	void *leftValue;
+	void *rightValue;
+} JoinResult;
+
+/** what the workers share */
+typedef struct JoinState {
+	const AAJoinInput *build;
+	const AAJoinInput *probe;
+	int buildIsLeft;
+	int joinType;
+	int partitionBits;
+	size_t nPartitions;
+	Partitioned buildParts;
+	Partitioned probeParts;
+	size_t nextPartition;
+	int failed;
+	pthread_mutex_t emitLock;
+	int (*emit)(AAKeyType key, size_t keylen,
+			void *leftValue, void *rightValue, void *userdata);
+	void *userdata;
+	long nEmitted;
+} JoinState;
+
+typedef struct JoinWorker {
+	JoinState *state;
+	JoinResult results[EMIT_BATCH];
+	int nResults;
+} JoinWorker;
+
+
+/** the partition of a hash, from its top bits */
+static size_t
+partitionOf(uint64_t hash, int bits)
+{
+	return (bits == 0) ? 0 : (size_t) (hash >> (64 - bits));
+}
+
+/**
+ * Partition an input: hash every key, count the rows that fall in
+ * each partition, and then scatter the rows into place
+ */
+static int
+partitionInput(const AAJoinInput *input, int bits, size_t nPartitions, Partitioned *out)
+{
+	uint64_t *hashes;
+	size_t *cursor, i, p;
+
+	out->rows = (PartitionedRow *) malloc((input->nRows + 1) * sizeof(PartitionedRow));
+	out->starts = (size_t *) calloc(nPartitions + 1, sizeof(size_t));
+	hashes = (uint64_t *) malloc((input->nRows + 1) * sizeof(uint64_t));
+	cursor = (size_t *) malloc(nPartitions * sizeof(size_t));
+	if (out->rows == NULL || out->starts == NULL || hashes == NULL || cursor == NULL) {
+		free(hashes);
+		free(cursor);
+		return -1;
+	}
+
+	for (i = 0; i < input->nRows; i++) {
+		hashes[i] = aaMixHash64(input->keys[i], input->keylens[i]);
+		out->starts[partitionOf(hashes[i], bits) + 1]++;
+	}
+	for (p = 0; p < nPartitions; p++) {
+		out->starts[p + 1] += out->starts[p];
+		cursor[p] = out->starts[p];
+	}
+	for (i = 0; i < input->nRows; i++) {
+		p = partitionOf(hashes[i], bits);
+		out->rows[cursor[p]].hash = hashes[i];
+		out->rows[cursor[p]].row = i;
+		cursor[p]++;
+	}
+
+	free(hashes);
+	free(cursor);
+	return 1;
+}
+
+/** hand the worker's gathered results to the caller */
+static void
+flushResults(JoinWorker *worker)
+{
+	JoinState *state = worker->state;
+	int i;
+
+	if (worker->nResults == 0)
+		return;
+
+	pthread_mutex_lock(&state->emitLock);
+	for (i = 0; i < worker->nResults && ! __atomic_load_n(&state->failed, __ATOMIC_RELAXED); i++) {
+		if ((*state->emit)(worker->results[i].key, worker->results[i].keylen,
+				worker->results[i].leftValue, worker->results[i].rightValue,
+				state->userdata) < 0) {
+			__atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+		} else {
+			state->nEmitted++;
+		}
+	}
+	pthread_mutex_unlock(&state->emitLock);
+	worker->nResults = 0;
+}
+
+static void
+addResult(JoinWorker *worker, AAKeyType key, size_t keylen,
+		void *leftValue, void *rightValue)
+{
+	JoinResult *result = &worker->results[worker->nResults++];
+
+	result->key = key;
+	result->keylen = keylen;
+	result->leftValue = leftValue;
+	result->rightValue = rightValue;
+	if (worker->nResults == EMIT_BATCH)
+		flushResults(worker);
+}
+
+/** build a table on one partition of the build side, and probe it */
+static int
+joinPartition(JoinWorker *worker, size_t partition)
+{
+	JoinState *state = worker->state;
+	const AAJoinInput *build = state->build, *probe = state->probe;
+	PartitionedRow *buildRows, *probeRows;
+	size_t nBuild, nProbe, nHeads = 0, *heads = NULL, *chain = NULL, *head, i, j, r;
+	AssociativeArray *table = NULL;
+	unsigned char *matched = NULL;
+	AAOptions options;
+	int status = 1;
+
+	buildRows = state->buildParts.rows + state->buildParts.starts[partition];
+	nBuild = state->buildParts.starts[partition + 1] - state->buildParts.starts[partition];
+	probeRows = state->probeParts.rows + state->probeParts.starts[partition];
+	nProbe = state->probeParts.starts[partition + 1] - state->probeParts.starts[partition];
+
+	/** an inner join with either side empty has nothing to give */
+	if (state->joinType == AA_JOIN_INNER && (nBuild == 0 || nProbe == 0))
+		return 1;
+
+	if (nBuild > 0) {
+		aaInitOptions(&options);
+		table = aaCreateConfiguredArray(2 * nBuild + 1, "lin", "mix", "len", &options);
+		heads = (size_t *) malloc(nBuild * sizeof(size_t));
+		chain = (size_t *) malloc(nBuild * sizeof(size_t));
+		if (state->buildIsLeft && state->joinType != AA_JOIN_INNER)
+			matched = (unsigned char *) calloc(nBuild, 1);
+		if (table == NULL || heads == NULL || chain == NULL
+				|| (state->buildIsLeft && state->joinType != AA_JOIN_INNER && matched == NULL)) {
+			status = -1;
+			goto done;
+		}
+	}
+
+	/** each key maps to its first row, and later rows chain from it */
+	for (i = 0; i < nBuild; i++) {
+		r = buildRows[i].row;
+		head = (size_t *) aaLookupHashed(table, build->keys[r], build->keylens[r],
+				buildRows[i].hash);
+		if (head != NULL) {
+			chain[i] = *head;
+			*head = i;
+		} else {
+			chain[i] = NO_ROW;
+			heads[nHeads] = i;
+			if (aaInsertHashed(table, build->keys[r], build->keylens[r],
+					&heads[nHeads], buildRows[i].hash) < 0) {
+				status = -1;
+				goto done;
+			}
+			nHeads++;
+		}
+	}
+
+	for (j = 0; j < nProbe && ! __atomic_load_n(&state->failed, __ATOMIC_RELAXED); j++) {
+		if (table != NULL && j + PREFETCH_DISTANCE < nProbe)
+			aaPrefetchHashed(table, probeRows[j + PREFETCH_DISTANCE].hash);
+
+		r = probeRows[j].row;
+		head = (table == NULL) ? NULL
+				: (size_t *) aaLookupHashed(table, probe->keys[r], probe->keylens[r],
+						probeRows[j].hash);
+
+		if (state->buildIsLeft) {
+			for (i = (head != NULL) ? *head : NO_ROW; i != NO_ROW; i = chain[i]) {
+				if (matched != NULL)
+					matched[i] = 1;
+				if (state->joinType != AA_JOIN_ANTI) {
+					addResult(worker, probe->keys[r], probe->keylens[r],
+							build->values[buildRows[i].row], probe->values[r]);
+				}
+			}
+		} else if (head == NULL) {
+			if (state->joinType != AA_JOIN_INNER)
+				addResult(worker, probe->keys[r], probe->keylens[r], probe->values[r], NULL);
+		} else if (state->joinType != AA_JOIN_ANTI) {
+			for (i = *head; i != NO_ROW; i = chain[i]) {
+				addResult(worker, probe->keys[r], probe->keylens[r],
+						probe->values[r], build->values[buildRows[i].row]);
+			}
+		}
+	}
+
+	/** left rows on the build side that nothing matched */
+	for (i = 0; matched != NULL && i < nBuild; i++) {
+		if ( ! matched[i]) {
+			r = buildRows[i].row;
+			addResult(worker, build->keys[r], build->keylens[r], build->values[r], NULL);
+		}
+	}
+
+done:
+	if (table != NULL)
+		aaDeleteAssociativeArray(table);
+	free(heads);
+	free(chain);
+	free(matched);
+	return status;
+}
+
+/** worker thread: join partitions until there are none left */
+static void *
+joinPartitions(void *arg)
+{
+	JoinWorker *worker = (JoinWorker *) arg;
+	JoinState *state = worker->state;
+	size_t partition;
+
+	while ( ! __atomic_load_n(&state->failed, __ATOMIC_RELAXED)) {
+		partition = __atomic_fetch_add(&state->nextPartition, 1, __ATOMIC_RELAXED);
+		if (partition >= state->nPartitions)
+			break;
+		if (joinPartition(worker, partition) < 0)
+			__atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+	}
+	flushResults(worker);
+	return NULL;
+}
+
+/**
+ * Join two inputs on their keys, as described in aarray.h
+ *
+ *  @return the number of rows emitted, or -1 if the join could not be
+ *				completed (no memory, or emit asked us to stop)
+ */
+long
+aaHashJoin(const AAJoinInput *left, const AAJoinInput *right,
+		int joinType, int nThreads,
+		int (*emit)(AAKeyType key, size_t keylen,
+				void *leftValue, void *rightValue, void *userdata),
+		void *userdata)
+{
+	JoinState state;
+	JoinWorker *workers;
+	pthread_t *threads;
+	int i, status = 1;
+
+	if (joinType != AA_JOIN_INNER && joinType != AA_JOIN_LEFT && joinType != AA_JOIN_ANTI)
+		return -1;
+	if (nThreads < 1)
+		nThreads = 1;
+
+	memset(&state, 0, sizeof(JoinState));
+	state.joinType = joinType;
+	state.emit = emit;
+	state.userdata = userdata;
+
+	/** build on the smaller side */
+	state.buildIsLeft = (left->nRows < right->nRows);
+	state.build = state.buildIsLeft ? left : right;
+	state.probe = state.buildIsLeft ? right : left;
+
+	/** enough partitions to keep each table small, and every thread busy */
+	while (state.partitionBits < MAX_PARTITION_BITS
+			&& (((size_t) PARTITION_ROWS << state.partitionBits) < state.build->nRows
+				|| ((size_t) 1 << state.partitionBits) < (size_t) nThreads * PARTITIONS_PER_THREAD))
+		state.partitionBits++;
+	state.nPartitions = (size_t) 1 << state.partitionBits;
+
+	workers = (JoinWorker *) calloc(nThreads, sizeof(JoinWorker));
+	threads = (pthread_t *) malloc(nThreads * sizeof(pthread_t));
+	if (workers == NULL || threads == NULL
+			|| partitionInput(state.build, state.partitionBits, state.nPartitions,
+					&state.buildParts) < 0
+			|| partitionInput(state.probe, state.partitionBits, state.nPartitions,
+					&state.probeParts) < 0) {
+		status = -1;
+		goto done;
+	}
+
+	pthread_mutex_init(&state.emitLock, NULL);
+	for (i = 0; i < nThreads; i++) {
+		workers[i].state = &state;
+		if (i == 0 || pthread_create(&threads[i], NULL, joinPartitions, &workers[i]) != 0)
+			threads[i] = pthread_self();
+	}
+
+	/** this thread is a worker too */
+	joinPartitions(&workers[0]);
+	for (i = 1; i < nThreads; i++) {
+		if ( ! pthread_equal(threads[i], pthread_self()))
+			pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&state.emitLock);
+
+	if (state.failed)
+		status = -1;
+
+done:
+	free(state.buildParts.rows);
+	free(state.buildParts.starts);
+	free(state.probeParts.rows);
+	free(state.probeParts.starts);
+	free(workers);
+	free(threads);
+	return (status < 0) ? -1 : state.nEmitted;
+}
@@ -0,0 +1,414 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * The compressed key store.
+ *
+ * Rather than a malloc(3) of its own, each key is appended to one of
+ * a list of large blocks, which saves the allocator's header and
+ * rounding on every key.  Keys that share long prefixes (URLs, product
+ * codes) are also front coded: each is stored as the number of a key
+ * in a small dictionary, the length of the prefix it shares with that
+ * key, and then only the rest of its own bytes.
+ *
+ * Front coding usually runs against the previous key in sorted order,
+ * but a hash table's keys come in any order, so the dictionary stands
+ * in for the neighbours instead: it is a sorted sample of the keys,
+ * given when the array is created, and the key coded against is the
+ * one of those sharing the longest prefix -- always one of the two
+ * either side of where the key would sort among them.
+ *
+ * A stored key is coded as
+ *
+ *		varint	dictionary number + 1, or 0 for none
+ *		varint	length of the prefix shared with it
+ *		bytes	the rest of the key
+ *
+ * and the full length is kept in the slot's record, as always.  Keys
+ * are compared in this coded form, a prefix and a suffix at a time,
+ * and are only decoded (into a buffer kept with the store) to be
+ * handed out.  Space is never taken back from a block, so deleted
+ * keys are only counted, and go when the array does.  The store is
+ * shared with the old generation while a table grows.
+ */
+
+#define	KEY_BLOCK_SIZE		(1024 * 1024)
+#define	MAX_VARINT_BYTES	10
+
+struct AAKeyStore {
+	unsigned char **blocks;
+	int nBlocks;
+	int nBlocksAllocated;
+	size_t lastBlockUsed;
+	size_t lastBlockSize;
+	AAKeyType *dictionary;
+	size_t *dictionaryLengths;
+	int nDictionary;
+	unsigned char *scratch;
+	size_t scratchSize;
+	int nUsers;
+	unsigned long nKeys;
+	unsigned long nReleased;
+	unsigned long rawBytes;
+	unsigned long codedBytes;
+	unsigned long deadBytes;
+};
+
+static size_t
+putVarint(unsigned char *out, size_t value)
+{
+	size_t n = 0;
+
+	while (value >= 0x80) {
+		out[n++] = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	out[n++] = (unsigned char) value;
+	return n;
+}
+
+static size_t
+getVarint(const unsigned char *in, size_t *value)
+{
+	size_t n = 0;
+	int shift = 0;
+
+	*value = 0;
+	do {
+		*value |= (size_t) (in[n] & 0x7f) << shift;
+		shift += 7;
+	} while (in[n++] & 0x80);
+	return n;
+}
+
+/** order keys as memcmp(3) does, shorter first on a common prefix */
+static int
+compareKeys(AAKeyType key1, size_t key1len, AAKeyType key2, size_t key2len)
+{
+	int result = memcmp(key1, key2, (key1len < key2len) ? key1len : key2len);
+
+	if (result != 0)
+		return result;
+	return (key1len < key2len) ? -1 : (key1len > key2len);
+}
+
+static size_t
+commonPrefix(AAKeyType key1, size_t key1len, AAKeyType key2, size_t key2len)
+{
+	size_t n = 0, limit = (key1len < key2len) ? key1len : key2len;
+
+	while (n < limit && key1[n] == key2[n])
+		n++;
+	return n;
+}
+
+/** the dictionary keys go in sorted order, for the binary search */
+static AAKeyStore *sortingStore;
+
+static int
+compareDictionaryEntries(const void *a, const void *b)
+{
+	int i = *(const int *) a, j = *(const int *) b;
+
+	return compareKeys(sortingStore->dictionary[i], sortingStore->dictionaryLengths[i],
+			sortingStore->dictionary[j], sortingStore->dictionaryLengths[j]);
+}
+
+/** copy and sort the dictionary, dropping duplicates */
+static int
+loadDictionary(AAKeyStore *store, const AAOptions *options)
+{
+	AAKeyType *sorted;
+	size_t *sortedLengths;
+	int *order, i, n;
+
+	store->nDictionary = options->nDictionaryKeys;
+	store->dictionary = (AAKeyType *) calloc(store->nDictionary, sizeof(AAKeyType));
+	store->dictionaryLengths = (size_t *) calloc(store->nDictionary, sizeof(size_t));
+	order = (int *) malloc(store->nDictionary * sizeof(int));
+	if (store->dictionary == NULL || store->dictionaryLengths == NULL || order == NULL) {
+		free(order);
+		return -1;
+	}
+
+	for (i = 0; i < store->nDictionary; i++) {
+		store->dictionaryLengths[i] = options->keyDictionaryLengths[i];
+		store->dictionary[i] = (AAKeyType) malloc(store->dictionaryLengths[i] + 1);
+		if (store->dictionary[i] == NULL) {
+			free(order);
+			return -1;
+		}
+		memcpy(store->dictionary[i], options->keyDictionary[i], store->dictionaryLengths[i]);
+		order[i] = i;
+	}
+
+	/** (creating arrays is not expected to be done from several threads) */
+	sortingStore = store;
+	qsort(order, store->nDictionary, sizeof(int), compareDictionaryEntries);
+	sortingStore = NULL;
+
+	sorted = (AAKeyType *) malloc(store->nDictionary * sizeof(AAKeyType));
+	sortedLengths = (size_t *) malloc(store->nDictionary * sizeof(size_t));
+	if (sorted == NULL || sortedLengths == NULL) {
+		free(sorted);
+		free(sortedLengths);
+		free(order);
+		return -1;
+	}
+	for (i = 0, n = 0; i < store->nDictionary; i++) {
+		if (n > 0 && compareKeys(sorted[n - 1], sortedLengths[n - 1],
+				store->dictionary[order[i]], store->dictionaryLengths[order[i]]) == 0) {
+			free(store->dictionary[order[i]]);
+			continue;
+		}
+		sorted[n] = store->dictionary[order[i]];
+		sortedLengths[n] = store->dictionaryLengths[order[i]];
+		n++;
+	}
+	free(store->dictionary);
+	free(store->dictionaryLengths);
+	free(order);
+	store->dictionary = sorted;
+	store->dictionaryLengths = sortedLengths;
+	store->nDictionary = n;
+	return 1;
+}
+
+/**
+ * Create a key store, with the dictionary given in the options (if
+ * any)
+ *
+ *  @return the store, or NULL if no memory is available
+ */
+AAKeyStore *
+aaKeyStoreCreate(const AAOptions *options)
+{
+	AAKeyStore *store;
+
+	store = (AAKeyStore *) calloc(1, sizeof(AAKeyStore));
+	if (store == NULL)
+		return NULL;
+	store->nUsers = 1;
+
+	if (options->nDictionaryKeys > 0 && loadDictionary(store, options) < 0) {
+		store->nUsers = 0;
+		aaKeyStoreDestroy(store);
+		return NULL;
+	}
+	return store;
+}
+
+/** another array (the old generation of a growing one) uses the store too */
+AAKeyStore *
+aaKeyStoreShare(AAKeyStore *store)
+{
+	store->nUsers++;
+	return store;
+}
+
+/** let go of the store, freeing it when its last user does */
+void
+aaKeyStoreDestroy(AAKeyStore *store)
+{
+	int i;
+
+	if (store == NULL || --store->nUsers > 0)
+		return;
+
+	for (i = 0; i < store->nBlocks; i++)
+		free(store->blocks[i]);
+	free(store->blocks);
+	for (i = 0; i < store->nDictionary; i++)
+		free(store->dictionary[i]);
+	free(store->dictionary);
+	free(store->dictionaryLengths);
+	free(store->scratch);
+	free(store);
+}
+
+/**
+ * Find the dictionary key sharing the longest prefix with the key
+ *
+ *  @return its number, or -1 if none shares anything with it
+ */
+static int
+closestDictionaryKey(AAKeyStore *store, AAKeyType key, size_t keylen, size_t *shared)
+{
+	int low = 0, high = store->nDictionary, middle, best = -1;
+	size_t length;
+
+	/** find the first dictionary key that sorts after this one */
+	while (low < high) {
+		middle = (low + high) / 2;
+		if (compareKeys(store->dictionary[middle], store->dictionaryLengths[middle],
+				key, keylen) <= 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	*shared = 0;
+	for (middle = low - 1; middle <= low; middle++) {
+		if (middle < 0 || middle >= store->nDictionary)
+			continue;
+		length = commonPrefix(store->dictionary[middle], store->dictionaryLengths[middle],
+				key, keylen);
+		if (length > *shared) {
+			*shared = length;
+			best = middle;
+		}
+	}
+	return best;
+}
+
+/** find room for a coded key of the given size */
+static unsigned char *
+reserveBytes(AAKeyStore *store, size_t nBytes)
+{
+	unsigned char **blocks;
+	size_t blockSize;
+
+	if (store->nBlocks == 0 || store->lastBlockUsed + nBytes > store->lastBlockSize) {
+		if (store->nBlocks == store->nBlocksAllocated) {
+			blocks = (unsigned char **) realloc(store->blocks,
+					(store->nBlocksAllocated * 2 + 1) * sizeof(unsigned char *));
+			if (blocks == NULL)
+				return NULL;
+			store->blocks = blocks;
+			store->nBlocksAllocated = store->nBlocksAllocated * 2 + 1;
+		}
+
+		/** a key too large for a block gets one of its own */
+		blockSize = (nBytes > KEY_BLOCK_SIZE) ? nBytes : KEY_BLOCK_SIZE;
+		store->blocks[store->nBlocks] = (unsigned char *) malloc(blockSize);
+		if (store->blocks[store->nBlocks] == NULL)
+			return NULL;
+		store->nBlocks++;
+		store->lastBlockUsed = 0;
+		store->lastBlockSize = blockSize;
+	}
+
+	store->lastBlockUsed += nBytes;
+	return store->blocks[store->nBlocks - 1] + store->lastBlockUsed - nBytes;
+}
+
+/**
+ * Code a key and add it to the store
+ *
+ *  @return the coded key, to keep in the slot in place of the key
+ *			itself, or NULL if no memory is available
+ */
+AAKeyType
+aaKeyStoreAdd(AAKeyStore *store, AAKeyType key, size_t keylen)
+{
+	unsigned char header[2 * MAX_VARINT_BYTES], *coded;
+	size_t shared, headerLen;
+	int closest;
+
+	closest = closestDictionaryKey(store, key, keylen, &shared);
+	headerLen = putVarint(header, (size_t) (closest + 1));
+	headerLen += putVarint(header + headerLen, shared);
+
+	coded = reserveBytes(store, headerLen + keylen - shared);
+	if (coded == NULL)
+		return NULL;
+	memcpy(coded, header, headerLen);
+	memcpy(coded + headerLen, key + shared, keylen - shared);
+
+	store->nKeys++;
+	store->rawBytes += keylen;
+	store->codedBytes += headerLen + keylen - shared;
+	return (AAKeyType) coded;
+}
+
+/** split a coded key into its dictionary prefix and its own suffix */
+static const unsigned char *
+splitCoded(AAKeyStore *store, AAKeyType coded, AAKeyType *prefix, size_t *shared)
+{
+	size_t number, n;
+
+	n = getVarint(coded, &number);
+	n += getVarint(coded + n, shared);
+	*prefix = (number > 0) ? store->dictionary[number - 1] : NULL;
+	return coded + n;
+}
+
+/** a coded key is no longer referred to: only count it */
+void
+aaKeyStoreRemoved(AAKeyStore *store, AAKeyType coded, size_t keylen)
+{
+	AAKeyType prefix;
+	size_t shared;
+	const unsigned char *suffix;
+
+	suffix = splitCoded(store, coded, &prefix, &shared);
+	store->nReleased++;
+	store->deadBytes += (suffix - coded) + keylen - shared;
+}
+
+/** does the coded key (of the given length) match the plain one? */
+int
+aaKeyStoreMatches(AAKeyStore *store, AAKeyType coded, size_t codedlen,
+		AAKeyType key, size_t keylen)
+{
+	const unsigned char *suffix;
+	AAKeyType prefix;
+	size_t shared;
+
+	if (codedlen != keylen)
+		return 0;
+
+	suffix = splitCoded(store, coded, &prefix, &shared);
+	if (shared > 0 && memcmp(prefix, key, shared) != 0)
+		return 0;
+	return memcmp(suffix, key + shared, keylen - shared) == 0;
+}
+
+/**
+ * Decode a key to hand out.  The bytes are only good until the next
+ * key is decoded.
+ */
+AAKeyType
+aaKeyStoreDecode(AAKeyStore *store, AAKeyType coded, size_t keylen)
+{
+	const unsigned char *suffix;
+	unsigned char *scratch;
+	AAKeyType prefix;
+	size_t shared;
+
+	if (keylen > store->scratchSize || store->scratch == NULL) {
+		scratch = (unsigned char *) realloc(store->scratch, keylen + 1);
+		if (scratch == NULL)
+			return NULL;
+		store->scratch = scratch;
+		store->scratchSize = keylen;
+	}
+
+	suffix = splitCoded(store, coded, &prefix, &shared);
+	if (shared > 0)
+		memcpy(store->scratch, prefix, shared);
+	memcpy(store->scratch + shared, suffix, keylen - shared);
+	return store->scratch;
+}
+
+/** print how much the keys have been squeezed */
+void
+aaPrintKeyStoreSummary(FILE *fp, AssociativeArray *aarray)
+{
+	AAKeyStore *store = aarray->keys;
+
+	if (store == NULL)
+		return;
+
+	fprintf(fp, "Key store: %lu keys of %lu bytes coded into %lu bytes in %d blocks,"
+			" against %d dictionary keys\n",
+			store->nKeys, store->rawBytes, store->codedBytes, store->nBlocks,
+			store->nDictionary);
+	if (store->nReleased > 0) {
+		fprintf(fp, "Key store: %lu keys released, leaving %lu bytes unused\n",
+				store->nReleased, store->deadBytes);
+	}
+}
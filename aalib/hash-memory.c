@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "hashtools.h"
+
+/**
+ * Memory for the slot array.
+ *
+ * Probing lands on effectively random slots, so once the slot array
+ * is much larger than the TLB can cover with 4K pages nearly every
+ * probe also pays for a page walk.  Mapping the array in 2M huge
+ * pages cuts the number of TLB entries it needs by a factor of 512.
+ *
+ * Anonymous mappings also come back zeroed, a page at a time as they
+ * are first touched, so a new table costs nothing up front rather
+ * than a memset(3) of the whole array, and the pages end up on the
+ * NUMA node of whichever thread touches them first -- unless a NUMA
+ * policy is set on the mapping before then, which is done here.
+ *
+ * Only the slot array (or the index array of the compact layout) is
+ * placed this way; the keys, and the compact layout's entries, are
+ * allocated piecemeal and stay with malloc(3).
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define	HUGE_PAGE_SIZE		((size_t) 2 * 1024 * 1024)
+
+/** huge pages that were asked for but come from the transparent pool */
+#define	PAGES_TRANSPARENT	3
+
+#define	NODE_ONLINE_FILE	"/sys/devices/system/node/online"
+
+
+/** the length actually mapped for an array of the given size */
+static size_t
+mappedLength(int pages, size_t bytes)
+{
+	size_t unit = (size_t) sysconf(_SC_PAGESIZE);
+
+	if (pages == AA_PAGES_HUGE || pages == PAGES_TRANSPARENT)
+		unit = HUGE_PAGE_SIZE;
+	return (bytes + unit - 1) & ~(unit - 1);
+}
+
+/**
+ * Map the given length aligned to a huge page boundary, so that the
+ * kernel can back all of it with transparent huge pages
+ */
+static void *
+mapTransparent(size_t length)
+{
+	char *mapping, *aligned;
+	size_t head, tail;
+
+	mapping = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	/** trim the mapping down to the aligned part */
+	aligned = (char *) (((uintptr_t) mapping + HUGE_PAGE_SIZE - 1)
+			& ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+	head = aligned - mapping;
+	tail = HUGE_PAGE_SIZE - head;
+	if (head > 0)
+		munmap(mapping, head);
+	if (tail > 0)
+		munmap(aligned + length, tail);
+
+	/** only advice: if THP is turned off we still have the memory */
+	madvise(aligned, length, MADV_HUGEPAGE);
+	return aligned;
+}
+
+/**
+ * The NUMA nodes that are online, as a bit mask, from the list the
+ * kernel gives in sysfs (such as "0-1,3")
+ */
+static unsigned long
+onlineNodes(void)
+{
+	unsigned long mask = 0;
+	int first, last, node;
+	char separator;
+	FILE *fp;
+
+	fp = fopen(NODE_ONLINE_FILE, "r");
+	if (fp == NULL)
+		return 1;
+
+	while (fscanf(fp, "%d", &first) == 1) {
+		last = first;
+		separator = (char) fgetc(fp);
+		if (separator == '-') {
+			if (fscanf(fp, "%d", &last) != 1)
+				break;
+			separator = (char) fgetc(fp);
+		}
+		for (node = first; node <= last && node < (int) (sizeof(mask) * CHAR_BIT); node++)
+			mask |= 1UL << node;
+		if (separator != ',')
+			break;
+	}
+	fclose(fp);
+
+	return (mask == 0) ? 1 : mask;
+}
+
+/**
+ * Set the NUMA policy from the options on a fresh mapping, before
+ * anything has touched it
+ *
+ *  @return 1 if the policy was set, or 0 if the kernel refused it
+ */
+static int
+applyNumaPolicy(AssociativeArray *aarray, void *memory, size_t length)
+{
+	unsigned long nodeMask;
+	int mode;
+
+	if (aarray->options.numaPolicy == AA_NUMA_INTERLEAVE) {
+		mode = MPOL_INTERLEAVE;
+		nodeMask = onlineNodes();
+	} else {
+		if (aarray->options.numaNode < 0
+				|| aarray->options.numaNode >= (int) (sizeof(nodeMask) * CHAR_BIT))
+			return 0;
+		mode = MPOL_BIND;
+		nodeMask = 1UL << aarray->options.numaNode;
+	}
+
+	/** the kernel counts one more node than the mask holds */
+	if (syscall(SYS_mbind, memory, length, mode,
+			&nodeMask, sizeof(nodeMask) * CHAR_BIT + 1, 0) != 0)
+		return 0;
+	return 1;
+}
+
+/**
+ * Allocate a zero filled slot array of the given size, in the kind
+ * of memory the array's options ask for
+ *
+ *  @return the memory, or NULL if none is available
+ */
+void *
+aaSlotMemoryAlloc(AssociativeArray *aarray, size_t bytes)
+{
+	int pages = aarray->options.pages;
+	void *memory = NULL;
+	size_t length = bytes;
+
+	aarray->slotNumaApplied = 0;
+
+	/** a policy can only be set on memory nobody has touched yet */
+	if (pages == AA_PAGES_MALLOC && aarray->options.numaPolicy != AA_NUMA_DEFAULT)
+		pages = AA_PAGES_MMAP;
+
+	if (pages == AA_PAGES_MALLOC) {
+		aarray->slotPages = AA_PAGES_MALLOC;
+		return calloc(1, bytes);
+	}
+
+	if (pages == AA_PAGES_HUGE) {
+		length = mappedLength(AA_PAGES_HUGE, bytes);
+		memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (memory == MAP_FAILED) {
+			/** no reserved huge pages, so ask for transparent ones */
+			pages = PAGES_TRANSPARENT;
+			memory = mapTransparent(length);
+		}
+		if (memory == NULL)
+			pages = AA_PAGES_MMAP;
+	}
+
+	if (pages == AA_PAGES_MMAP) {
+		length = mappedLength(AA_PAGES_MMAP, bytes);
+		memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+			return NULL;
+	}
+
+	aarray->slotPages = pages;
+	if (memory != NULL && aarray->options.numaPolicy != AA_NUMA_DEFAULT)
+		aarray->slotNumaApplied = applyNumaPolicy(aarray, memory, length);
+
+	return memory;
+}
+
+/** release a slot array from aaSlotMemoryAlloc() */
+void
+aaSlotMemoryFree(AssociativeArray *aarray, void *memory, size_t bytes)
+{
+	if (memory == NULL)
+		return;
+
+	if (aarray->slotPages == AA_PAGES_MALLOC) {
+		free(memory);
+	} else {
+		munmap(memory, mappedLength(aarray->slotPages, bytes));
+	}
+}
+
+/** say where the slot array is, if it is anywhere special */
+void
+aaPrintSlotMemorySummary(FILE *fp, AssociativeArray *aarray)
+{
+	const char *pages = "ordinary pages";
+
+	if (aarray->options.pages == AA_PAGES_MALLOC
+			&& aarray->options.numaPolicy == AA_NUMA_DEFAULT)
+		return;
+
+	if (aarray->slotPages == AA_PAGES_HUGE) {
+		pages = "reserved huge pages";
+	} else if (aarray->slotPages == PAGES_TRANSPARENT) {
+		pages = "transparent huge pages";
+	}
+	fprintf(fp, "Slot memory: mapped in %s", pages);
+
+	if (aarray->options.numaPolicy == AA_NUMA_INTERLEAVE) {
+		fprintf(fp, ", %s", aarray->slotNumaApplied
+				? "interleaved over all nodes" : "interleave refused by the kernel");
+	} else if (aarray->options.numaPolicy == AA_NUMA_BIND) {
+		if (aarray->slotNumaApplied) {
+			fprintf(fp, ", bound to node %d", aarray->options.numaNode);
+		} else {
+			fprintf(fp, ", binding to node %d refused by the kernel",
+					aarray->options.numaNode);
+		}
+	}
+	fprintf(fp, "\n");
+}
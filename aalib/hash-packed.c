@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * The packed, 16 byte slot layout.
+ *
+ * A KeyDataPair is 32 bytes on a 64 bit machine, so only two fit in
+ * a cache line.  A PackedSlot (see hashtools.h) keeps the same
+ * information in half the space by moving the key length in front
+ * of the key bytes and folding the validity and a hash tag into the
+ * spare bits of the key pointer, so four slots share a cache line
+ * and most probes that reach the wrong key are rejected on the tag
+ * without touching the key at all.
+ */
+
+/** the distance between slots for the given inline value width */
+size_t
+aaPackedStride(size_t valueWidth)
+{
+	/** a packed slot's inline value takes the place of its value pointer */
+	if (valueWidth <= sizeof(void *))
+		return sizeof(PackedSlot);
+	return sizeof(uintptr_t)
+			+ ((valueWidth + sizeof(void *) - 1) & ~(sizeof(void *) - 1));
+}
+
+/** allocate the slots, all of them empty */
+int
+aaPackedCreate(AssociativeArray *aarray)
+{
+	aarray->packed = (PackedSlot *) aaSlotMemoryAlloc(aarray,
+			(size_t) aarray->size * aarray->entryStride);
+	return (aarray->packed == NULL) ? -1 : 1;
+}
+
+/** release the slots; the keys are released by the caller */
+void
+aaPackedDestroy(AssociativeArray *aarray)
+{
+	aaSlotMemoryFree(aarray, aarray->packed,
+			(size_t) aarray->size * aarray->entryStride);
+	aarray->packed = NULL;
+}
+
+/**
+ * Copy a key onto the heap with its length in front of it
+ *
+ *  @return the copy of the key bytes, or NULL if the key is too long
+ *			or there is no memory
+ */
+AAKeyType
+aaPackedCopyKey(AAKeyType key, size_t keylen)
+{
+	unsigned char *copy;
+	uint32_t header = (uint32_t) keylen;
+
+	if (keylen > UINT32_MAX)
+		return NULL;
+
+	copy = (unsigned char *) malloc(AA_PACKED_KEY_HEADER + keylen);
+	if (copy == NULL)
+		return NULL;
+
+	memcpy(copy, &header, AA_PACKED_KEY_HEADER);
+	memcpy(copy + AA_PACKED_KEY_HEADER, key, keylen);
+	return copy + AA_PACKED_KEY_HEADER;
+}
+
+/**
+ * Fill in the given slot, taking over a key made by aaPackedCopyKey()
+ *
+ *  @return 1 on success, -1 if the key's address does not fit in the
+ *			pointer bits of the slot
+ */
+int
+aaPackedPlace(AssociativeArray *aarray, HashIndex slot,
+		AAKeyType ownedKey, size_t keylen, void *value)
+{
+	PackedSlot *packed = aaPackedAt(aarray, slot);
+	uintptr_t address = (uintptr_t) ownedKey;
+	uintptr_t tag = aaKeyTag(aarray, ownedKey, keylen);
+
+	if ((address & ~AA_PACKED_POINTER_MASK) != 0)
+		return -1;
+
+	packed->keyWord = (tag << AA_PACKED_TAG_SHIFT) | address | HASH_USED;
+	if (aarray->valueWidth > 0)
+		aaCopyInValue(aarray, &packed->value, value);
+	else
+		packed->value = value;
+
+	return 1;
+}
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * Hardware performance counter sampling around the table operations.
+ *
+ * When enabled, each aaInsert(), aaLookup() and aaDelete() reads a
+ * group of hardware counters before and after doing its work, and
+ * the differences are accumulated per operation type.  This shows
+ * whether a strategy is slow because its probe chains are long or
+ * because each probe misses in the cache.
+ *
+ * This uses perf_event_open(2), so is only available on Linux, and
+ * only where the kernel allows unprivileged users to count their own
+ * user-space events (see /proc/sys/kernel/perf_event_paranoid).
+ * Reading the counters costs a system call per operation, so this is
+ * meant for staging and analysis rather than production.
+ */
+
+static const char *sCounterNames[AA_PERF_NCOUNTERS] = {
+		"cycles",
+		"instructions",
+		"L1d misses",
+		"LLC misses",
+		"branch misses"
+	};
+
+static const char *sOperationNames[AA_PERF_NOPS] = {
+		"Insertion",
+		"Search",
+		"Deletion"
+	};
+
+#ifdef	__linux__
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/** the layout of a read(2) of a counter group with PERF_FORMAT_GROUP */
+typedef struct PerfGroupRead {
+	unsigned long long nr;
+	unsigned long long values[AA_PERF_NCOUNTERS];
+} PerfGroupRead;
+
+static int
+openCounter(unsigned int type, unsigned long long config, int groupFd)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = (groupFd == -1) ? 1 : 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+
+	return (int) syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+/**
+ * Turn on counter sampling for the given array
+ *
+ *  @return 1 if at least the cycle counter could be opened,
+ *			or -1 if counters are not available here
+ */
+int
+aaEnablePerfCounters(AssociativeArray *aarray)
+{
+	AAPerfCounters *perf;
+	int i, fd;
+	static const struct { unsigned int type; unsigned long long config; } events[] = {
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+			{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+					| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+					| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+		};
+
+	if (aarray->perf != NULL)
+		return 1;
+
+	perf = (AAPerfCounters *) calloc(1, sizeof(AAPerfCounters));
+	if (perf == NULL)
+		return -1;
+
+	/** the cycle counter leads the group, and must open */
+	perf->leaderFd = openCounter(events[0].type, events[0].config, -1);
+	if (perf->leaderFd < 0) {
+		free(perf);
+		return -1;
+	}
+	perf->available[0] = 1;
+	perf->groupSlot[0] = 0;
+	perf->nOpen = 1;
+
+	/** any other counter that the hardware lacks is simply skipped */
+	for (i = 1; i < AA_PERF_NCOUNTERS; i++) {
+		fd = openCounter(events[i].type, events[i].config, perf->leaderFd);
+		perf->fds[i] = fd;
+		if (fd >= 0) {
+			perf->available[i] = 1;
+			perf->groupSlot[i] = perf->nOpen++;
+		}
+	}
+
+	ioctl(perf->leaderFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(perf->leaderFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+	aarray->perf = perf;
+	return 1;
+}
+
+/** release the counters, if they were in use */
+void
+aaDisablePerfCounters(AssociativeArray *aarray)
+{
+	AAPerfCounters *perf = aarray->perf;
+	int i;
+
+	if (perf == NULL)
+		return;
+
+	for (i = 1; i < AA_PERF_NCOUNTERS; i++) {
+		if (perf->available[i])
+			close(perf->fds[i]);
+	}
+	close(perf->leaderFd);
+	free(perf);
+	aarray->perf = NULL;
+}
+
+/** read the current counter values into the given array */
+static int
+readCounters(AAPerfCounters *perf, unsigned long long *values)
+{
+	PerfGroupRead group;
+	int i;
+
+	if (read(perf->leaderFd, &group, sizeof(group)) < (ssize_t) sizeof(unsigned long long))
+		return -1;
+
+	for (i = 0; i < AA_PERF_NCOUNTERS; i++) {
+		values[i] = perf->available[i] ? group.values[perf->groupSlot[i]] : 0;
+	}
+	return 1;
+}
+
+/** take the counter readings at the start of an operation */
+void
+aaPerfBegin(AssociativeArray *aarray)
+{
+	if (aarray->perf == NULL)
+		return;
+	if (readCounters(aarray->perf, aarray->perf->start) < 0)
+		aarray->perf->startValid = 0;
+	else
+		aarray->perf->startValid = 1;
+}
+
+/** take the readings at the end, and charge the difference to the operation */
+void
+aaPerfEnd(AssociativeArray *aarray, int operation)
+{
+	AAPerfCounters *perf = aarray->perf;
+	unsigned long long end[AA_PERF_NCOUNTERS];
+	int i;
+
+	if (perf == NULL || ! perf->startValid)
+		return;
+	if (readCounters(perf, end) < 0)
+		return;
+
+	for (i = 0; i < AA_PERF_NCOUNTERS; i++) {
+		perf->totals[operation][i] += end[i] - perf->start[i];
+	}
+	perf->nOps[operation]++;
+}
+
+#else	/* ! __linux__ */
+
+int
+aaEnablePerfCounters(AssociativeArray *aarray)
+{
+	return -1;
+}
+
+void
+aaDisablePerfCounters(AssociativeArray *aarray)
+{
+}
+
+void
+aaPerfBegin(AssociativeArray *aarray)
+{
+}
+
+void
+aaPerfEnd(AssociativeArray *aarray, int operation)
+{
+}
+
+#endif	/* __linux__ */
+
+
+/**
+ * Print the per-operation averages of each counter
+ */
+void
+aaPrintPerfCounters(FILE *fp, AssociativeArray *aarray)
+{
+	AAPerfCounters *perf = aarray->perf;
+	int op, i;
+
+	if (perf == NULL)
+		return;
+
+	fprintf(fp, "Hardware counters per operation:\n");
+	fprintf(fp, "  %-9s   %10s", "", "ops");
+	for (i = 0; i < AA_PERF_NCOUNTERS; i++) {
+		fprintf(fp, "  %13s", sCounterNames[i]);
+	}
+	fprintf(fp, "\n");
+
+	for (op = 0; op < AA_PERF_NOPS; op++) {
+		fprintf(fp, "  %-9s : %10lu", sOperationNames[op], perf->nOps[op]);
+		for (i = 0; i < AA_PERF_NCOUNTERS; i++) {
+			if ( ! perf->available[i]) {
+				fprintf(fp, "  %13s", "n/a");
+			} else if (perf->nOps[op] == 0) {
+				fprintf(fp, "  %13s", "-");
+			} else {
+				fprintf(fp, "  %13.1f",
+						(double) perf->totals[op][i] / perf->nOps[op]);
+			}
+		}
+		fprintf(fp, "\n");
+	}
+}
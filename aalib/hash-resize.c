@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * Table growth and incremental rehashing.
+ *
+ * When growAtLoad is set in the options, the insert that would take
+ * the table past that load allocates a new slot array and makes the
+ * old one the "retiring" generation.  Rather than moving every entry
+ * across there and then -- which for a large table would stall that
+ * one insert for seconds -- each following operation migrates the
+ * next rehashStep slots of the old generation, so the cost of the
+ * rehash is spread evenly over the operations that follow.
+ *
+ * While a migration is under way new keys always go into the new
+ * generation, and lookups and deletes that miss there go on to look
+ * in the old one, so each key is held in exactly one of them.
+ * Migrated slots are left as tombstones so that the probe chains of
+ * the keys still waiting in the old generation stay intact.  Each
+ * generation has its own lookup filter, and the new one is filled in
+ * as the keys arrive, which also rids it of any deleted keys.
+ *
+ * A compressed key store (see hash-keys.c) is not copied: both
+ * generations use it, and the coded keys are moved as they are.
+ *
+ * A cache (see hash-cache.c) never doubles: it only rehashes at the
+ * same size to clear out the tombstones its evictions leave.
+ */
+
+/** exchange the storage, but not the strategies, of two arrays */
+static void
+swapStorage(AssociativeArray *a, AssociativeArray *b)
+{
+	AssociativeArray saved = *a;
+
+	a->table = b->table;
+	a->packed = b->packed;
+	a->indices = b->indices;
+	a->entries = b->entries;
+	a->nEntriesUsed = b->nEntriesUsed;
+	a->nEntriesAllocated = b->nEntriesAllocated;
+	a->size = b->size;
+	a->nEntries = b->nEntries;
+	a->nTombstones = b->nTombstones;
+	a->filter = b->filter;
+	a->slotPages = b->slotPages;
+	a->slotNumaApplied = b->slotNumaApplied;
+
+	b->table = saved.table;
+	b->packed = saved.packed;
+	b->indices = saved.indices;
+	b->entries = saved.entries;
+	b->nEntriesUsed = saved.nEntriesUsed;
+	b->nEntriesAllocated = saved.nEntriesAllocated;
+	b->size = saved.size;
+	b->nEntries = saved.nEntries;
+	b->nTombstones = saved.nTombstones;
+	b->filter = saved.filter;
+	b->slotPages = saved.slotPages;
+	b->slotNumaApplied = saved.slotNumaApplied;
+}
+
+/**
+ * Move the entry in the given slot of the old generation into the
+ * new one.  The key changes hands rather than being copied.
+ *
+ *  @return 1 if the entry was moved, -1 if there was no room for it
+ */
+static int
+migrateSlot(AssociativeArray *aarray, HashIndex oldSlot)
+{
+	AssociativeArray *old = aarray->retiring;
+	KeyDataPair entry;
+	AAKeyType ownedKey;
+	HashIndex home, slot;
+	int cost = 0;
+
+	aaSlotRead(old, oldSlot, &entry);
+
+	/** a compressed key is hashed decoded, but moved as it is stored */
+	ownedKey = entry.key;
+	if (old->keys != NULL)
+		ownedKey = aaSlotEntry(old, oldSlot)->key;
+
+	home = (*(aarray->hashAlgorithmPrimary))(entry.key, entry.keylen, aarray->size);
+	slot = (*(aarray->hashProbe))(aarray, entry.key, entry.keylen, home, 1, &cost);
+	if (slot == (HashIndex) -1)
+		return -1;
+
+	if (aaStoreEntry(aarray, slot, ownedKey, entry.keylen, entry.value) < 0)
+		return -1;
+	if (aarray->cache != NULL)
+		aaCacheMoved(aarray, oldSlot, slot);
+	if (aarray->filter != NULL)
+		aaFilterAdd(aarray->filter, aaMixHash64(entry.key, entry.keylen));
+
+	/** the key now belongs to the new generation */
+	if (old->layout == AA_LAYOUT_COMPACT) {
+		aaSlotEntry(old, oldSlot)->key = NULL;
+		aaCompactRemove(old, oldSlot);
+	} else if (old->layout == AA_LAYOUT_PACKED) {
+		aaPackedAt(old, oldSlot)->keyWord = HASH_DELETED;
+	} else {
+		aaSlotEntry(old, oldSlot)->key = NULL;
+		aaSlotEntry(old, oldSlot)->validity = HASH_DELETED;
+	}
+	old->nEntries--;
+	old->nTombstones++;
+
+	return 1;
+}
+
+/**
+ * Migrate up to the given number of slots of the old generation,
+ * releasing it once every slot has been visited
+ */
+static void
+migrateSlots(AssociativeArray *aarray, int nSlots)
+{
+	AssociativeArray *old = aarray->retiring;
+
+	while (nSlots-- > 0 && aarray->migrateCursor < old->size) {
+		if (aaSlotValidity(old, aarray->migrateCursor) == HASH_USED) {
+			/** no room (or memory) to move it: try again next time */
+			if (migrateSlot(aarray, aarray->migrateCursor) < 0)
+				return;
+		}
+		aarray->migrateCursor++;
+	}
+
+	if (aarray->migrateCursor >= old->size) {
+		aarray->retiring = NULL;
+		aarray->migrateCursor = 0;
+		aaDeleteAssociativeArray(old);
+	}
+}
+
+/** do this operation's share of any migration under way */
+void
+aaMigrateStep(AssociativeArray *aarray)
+{
+	if (aarray->retiring == NULL)
+		return;
+	migrateSlots(aarray, (aarray->options.rehashStep > 0)
+			? aarray->options.rehashStep : aarray->retiring->size);
+}
+
+/**
+ * Start a resize if one more entry would take the table past the
+ * configured load
+ *
+ *  @return 1 if a resize was started, 0 if none was needed, or -1
+ *			if the new table could not be allocated (in which case
+ *			the current one carries on as it is)
+ */
+int
+aaGrowIfNeeded(AssociativeArray *aarray)
+{
+	AssociativeArray *next;
+	AAOptions options;
+	size_t newSize;
+
+	if (aarray->options.growAtLoad <= 0)
+		return 0;
+	if (aarray->nEntries + aarray->nTombstones + 1
+			<= aarray->options.growAtLoad * aarray->size)
+		return 0;
+
+	/** only one old generation at a time, so finish off any earlier one */
+	if (aarray->retiring != NULL)
+		migrateSlots(aarray, aarray->retiring->size);
+	if (aarray->retiring != NULL)
+		return -1;
+
+	/**
+	 * double if the live entries fill at least half the allowed load,
+	 * otherwise it is the tombstones that need clearing out
+	 */
+	newSize = aarray->size;
+	if (aarray->cache == NULL
+			&& aarray->nEntries * 2 >= aarray->options.growAtLoad * aarray->size)
+		newSize = (size_t) aarray->size * 2;
+
+	/** the new generation never grows by itself, and the cache state stays with us */
+	options = aarray->options;
+	options.growAtLoad = 0;
+	options.cacheEntries = 0;
+	options.cacheBytes = 0;
+	options.keyStore = AA_KEYS_MALLOC;
+	next = aaCreateConfiguredArray(newSize, aarray->probeName,
+			aarray->hashNamePrimary, aarray->hashNameSecondary, &options);
+	if (next == NULL)
+		return -1;
+
+	/** the new, empty storage becomes ours, and the old is retired */
+	swapStorage(aarray, next);
+	if (aarray->keys != NULL)
+		next->keys = aaKeyStoreShare(aarray->keys);
+	if (aarray->cache != NULL)
+		aaCacheRehashBegin(aarray);
+	aarray->retiring = next;
+	aarray->migrateCursor = 0;
+	aarray->nResizes++;
+
+	if (aarray->options.rehashStep <= 0)
+		migrateSlots(aarray, next->size);
+
+	return 1;
+}
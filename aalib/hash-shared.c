@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "hashtools.h"
+
+/**
+ * Tables in POSIX shared memory.
+ *
+ * A frozen array is published as one shared memory segment holding
+ * the same thing aaEmitStaticTable() writes out as C source: the
+ * pilots, and the keys and values of the slots packed into byte
+ * arrays indexed by offset arrays.  With offsets in place of pointers
+ * the image means the same wherever a process maps it, so any number
+ * of readers can attach to it (as the shared layout) and look keys up
+ * in place, through aaStaticLookup(), without copying anything.
+ *
+ * Rebuilt tables are published under a new generation number: each
+ * image is its own segment, "<name>.<generation>", and a small
+ * control segment, "<name>", holds the generation readers should use.
+ * The loader writes the whole of the new image before it stores the
+ * new generation, then unlinks the old image; a reader that still has
+ * the old one mapped keeps serving from it (unlinking only removes
+ * the name) until it calls aaRefreshShared() to move on.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define	SHARED_MAGIC			"AASHM01"
+#define	SHARED_NAME_MAX			256
+#define	SHARED_ATTACH_TRIES		8
+
+/** the control segment: which image is current */
+typedef struct SharedControl {
+	char magic[8];
+	uint64_t generation;
+} SharedControl;
+
+/** the start of an image, giving where each of its arrays is */
+typedef struct SharedHeader {
+	char magic[8];
+	uint64_t generation;
+	uint64_t seed;
+	uint32_t nBuckets;
+	uint32_t nSlots;
+	uint32_t nKeys;
+	uint32_t unused;
+	uint64_t pilotsOffset;
+	uint64_t keyOffsetsOffset;
+	uint64_t keyBytesOffset;
+	uint64_t valueOffsetsOffset;
+	uint64_t valueBytesOffset;
+	uint64_t imageSize;
+} SharedHeader;
+
+struct AASharedTable {
+	SharedControl *control;
+	unsigned char *image;
+	size_t imageSize;
+	uint64_t generation;
+	AAStaticTable table;
+	unsigned long nRefreshes;
+};
+
+
+/** the segment name of the control segment, or of an image */
+static void
+segmentName(char *buffer, const char *name, uint64_t generation)
+{
+	const char *slash = (name[0] == '/') ? "" : "/";
+
+	if (generation == 0) {
+		snprintf(buffer, SHARED_NAME_MAX, "%s%s", slash, name);
+	} else {
+		snprintf(buffer, SHARED_NAME_MAX, "%s%s.%llu", slash, name,
+				(unsigned long long) generation);
+	}
+}
+
+/** round up to keep each array of the image aligned */
+static uint64_t
+aligned(uint64_t offset)
+{
+	return (offset + sizeof(uint64_t) - 1) & ~(uint64_t) (sizeof(uint64_t) - 1);
+}
+
+/** map the control segment, creating it if the loader asks */
+static SharedControl *
+mapControl(const char *name, int create)
+{
+	char segment[SHARED_NAME_MAX];
+	SharedControl *control;
+	int fd;
+
+	segmentName(segment, name, 0);
+	fd = shm_open(segment, create ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+	if (fd < 0)
+		return NULL;
+	if (create && ftruncate(fd, sizeof(SharedControl)) < 0) {
+		close(fd);
+		return NULL;
+	}
+	control = (SharedControl *) mmap(NULL, sizeof(SharedControl),
+			create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (control == MAP_FAILED)
+		return NULL;
+
+	/** a new segment comes back zeroed, with no image published yet */
+	if (create && control->magic[0] == '\0')
+		memcpy(control->magic, SHARED_MAGIC, sizeof(control->magic));
+	if (memcmp(control->magic, SHARED_MAGIC, sizeof(control->magic)) != 0) {
+		munmap(control, sizeof(SharedControl));
+		return NULL;
+	}
+	return control;
+}
+
+/**
+ * Publish a frozen array into shared memory under the given name,
+ * replacing any table published there before
+ *
+ *  @param  valueBytes  gives the bytes of each value, as for
+ *				aaEmitStaticTable()
+ *  @return 1 on success, or -1 if the array is not frozen or the
+ *				segments cannot be made
+ */
+int
+aaPublishShared(AssociativeArray *aarray, const char *name,
+		size_t (*valueBytes)(void *value, const void **bytes, void *userdata),
+		void *userdata)
+{
+	char segment[SHARED_NAME_MAX];
+	const uint32_t *pilots;
+	const void *bytes;
+	SharedControl *control;
+	SharedHeader header;
+	KeyDataPair entry;
+	unsigned char *image;
+	uint32_t *keyOffsets, *valueOffsets;
+	uint64_t keyBytes = 0, valueTotal = 0, previous;
+	size_t nBytes;
+	int fd, i;
+
+	memset(&header, 0, sizeof(SharedHeader));
+	pilots = aaFrozenPilots(aarray, &header.nBuckets, &header.seed);
+	if (pilots == NULL)
+		return -1;
+
+	/** size the image */
+	for (i = 0; i < aarray->size; i++) {
+		if (aaSlotRead(aarray, i, &entry)) {
+			keyBytes += entry.keylen;
+			valueTotal += aaSlotValueBytes(aarray, &entry, &bytes, valueBytes, userdata);
+		}
+	}
+	if (keyBytes > UINT32_MAX || valueTotal > UINT32_MAX)
+		return -1;
+
+	memcpy(header.magic, SHARED_MAGIC, sizeof(header.magic));
+	header.nSlots = (uint32_t) aarray->size;
+	header.nKeys = (uint32_t) aarray->nEntries;
+	header.pilotsOffset = aligned(sizeof(SharedHeader));
+	header.keyOffsetsOffset = aligned(header.pilotsOffset
+			+ (uint64_t) header.nBuckets * sizeof(uint32_t));
+	header.valueOffsetsOffset = aligned(header.keyOffsetsOffset
+			+ ((uint64_t) header.nSlots + 1) * sizeof(uint32_t));
+	header.keyBytesOffset = aligned(header.valueOffsetsOffset
+			+ ((uint64_t) header.nSlots + 1) * sizeof(uint32_t));
+	header.valueBytesOffset = aligned(header.keyBytesOffset + keyBytes);
+	header.imageSize = header.valueBytesOffset + valueTotal;
+
+	control = mapControl(name, 1);
+	if (control == NULL) {
+		fprintf(stderr, "Error: cannot create shared table '%s' : %s\n", name, strerror(errno));
+		return -1;
+	}
+	previous = __atomic_load_n(&control->generation, __ATOMIC_ACQUIRE);
+	header.generation = previous + 1;
+
+	segmentName(segment, name, header.generation);
+	fd = shm_open(segment, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0 || ftruncate(fd, (off_t) header.imageSize) < 0) {
+		fprintf(stderr, "Error: cannot create shared image '%s' : %s\n", segment, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			shm_unlink(segment);
+		}
+		munmap(control, sizeof(SharedControl));
+		return -1;
+	}
+	image = (unsigned char *) mmap(NULL, header.imageSize,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) {
+		shm_unlink(segment);
+		munmap(control, sizeof(SharedControl));
+		return -1;
+	}
+
+	/** fill the image in, slot by slot as for a static table */
+	memcpy(image, &header, sizeof(SharedHeader));
+	memcpy(image + header.pilotsOffset, pilots, header.nBuckets * sizeof(uint32_t));
+	keyOffsets = (uint32_t *) (image + header.keyOffsetsOffset);
+	valueOffsets = (uint32_t *) (image + header.valueOffsetsOffset);
+	keyBytes = valueTotal = 0;
+	for (i = 0; i < aarray->size; i++) {
+		keyOffsets[i] = (uint32_t) keyBytes;
+		valueOffsets[i] = (uint32_t) valueTotal;
+		if (aaSlotRead(aarray, i, &entry)) {
+			memcpy(image + header.keyBytesOffset + keyBytes, entry.key, entry.keylen);
+			keyBytes += entry.keylen;
+			nBytes = aaSlotValueBytes(aarray, &entry, &bytes, valueBytes, userdata);
+			if (nBytes > 0)
+				memcpy(image + header.valueBytesOffset + valueTotal, bytes, nBytes);
+			valueTotal += nBytes;
+		}
+	}
+	keyOffsets[aarray->size] = (uint32_t) keyBytes;
+	valueOffsets[aarray->size] = (uint32_t) valueTotal;
+	munmap(image, header.imageSize);
+
+	/** the image is complete before any reader can be sent to it */
+	__atomic_store_n(&control->generation, header.generation, __ATOMIC_RELEASE);
+	munmap(control, sizeof(SharedControl));
+
+	/** readers of the old image keep it until they unmap it */
+	if (previous > 0) {
+		segmentName(segment, name, previous);
+		shm_unlink(segment);
+	}
+	return 1;
+}
+
+/**
+ * Map the current image of a shared table read-only, following the
+ * control segment if a new image is published while we are at it
+ *
+ *  @return 1 on success, or -1 if there is no image to map
+ */
+static int
+mapCurrentImage(AASharedTable *shared, const char *name)
+{
+	char segment[SHARED_NAME_MAX];
+	SharedHeader *header;
+	struct stat info;
+	unsigned char *image;
+	uint64_t generation;
+	int fd, tries;
+
+	for (tries = 0; tries < SHARED_ATTACH_TRIES; tries++) {
+		generation = __atomic_load_n(&shared->control->generation, __ATOMIC_ACQUIRE);
+		if (generation == 0)
+			return -1;
+
+		/** a loader may unlink this image between the load and the open */
+		segmentName(segment, name, generation);
+		fd = shm_open(segment, O_RDONLY, 0);
+		if (fd < 0)
+			continue;
+		if (fstat(fd, &info) < 0 || (size_t) info.st_size < sizeof(SharedHeader)) {
+			close(fd);
+			return -1;
+		}
+		image = (unsigned char *) mmap(NULL, (size_t) info.st_size,
+				PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (image == MAP_FAILED)
+			return -1;
+
+		header = (SharedHeader *) image;
+		if (memcmp(header->magic, SHARED_MAGIC, sizeof(header->magic)) != 0
+				|| header->imageSize != (uint64_t) info.st_size) {
+			munmap(image, (size_t) info.st_size);
+			return -1;
+		}
+
+		shared->image = image;
+		shared->imageSize = (size_t) info.st_size;
+		shared->generation = generation;
+		shared->table.seed = header->seed;
+		shared->table.nBuckets = header->nBuckets;
+		shared->table.nSlots = header->nSlots;
+		shared->table.nKeys = header->nKeys;
+		shared->table.pilots = (const uint32_t *) (image + header->pilotsOffset);
+		shared->table.keyOffsets = (const uint32_t *) (image + header->keyOffsetsOffset);
+		shared->table.keyBytes = image + header->keyBytesOffset;
+		shared->table.valueOffsets = (const uint32_t *) (image + header->valueOffsetsOffset);
+		shared->table.valueBytes = image + header->valueBytesOffset;
+		return 1;
+	}
+	return -1;
+}
+
+/** the array's size and entry count follow the image it is using */
+static void
+matchImage(AssociativeArray *aarray)
+{
+	aarray->size = (int) aarray->shared->table.nSlots;
+	aarray->nEntries = (int) aarray->shared->table.nKeys;
+}
+
+/**
+ * Attach to the shared table named in the array's options
+ *
+ *  @return 1 on success, or -1 (with a message) on failure
+ */
+int
+aaSharedAttach(AssociativeArray *aarray)
+{
+	const char *name = aarray->options.sharedName;
+	AASharedTable *shared;
+
+	if (name == NULL) {
+		fprintf(stderr, "Error: a shared table needs a name\n");
+		return -1;
+	}
+
+	shared = (AASharedTable *) calloc(1, sizeof(AASharedTable));
+	if (shared == NULL)
+		return -1;
+
+	shared->control = mapControl(name, 0);
+	if (shared->control == NULL || mapCurrentImage(shared, name) < 0) {
+		fprintf(stderr, "Error: no table has been published as '%s'\n", name);
+		if (shared->control != NULL)
+			munmap(shared->control, sizeof(SharedControl));
+		free(shared);
+		return -1;
+	}
+
+	aarray->shared = shared;
+	aarray->valueWidth = 0;
+	matchImage(aarray);
+	return 1;
+}
+
+/** unmap the image and the control segment */
+void
+aaSharedDetach(AssociativeArray *aarray)
+{
+	AASharedTable *shared = aarray->shared;
+
+	if (shared == NULL)
+		return;
+	munmap(shared->image, shared->imageSize);
+	munmap(shared->control, sizeof(SharedControl));
+	free(shared);
+	aarray->shared = NULL;
+}
+
+/**
+ * Move an attached array on to the latest table published under its
+ * name, if there is a newer one.  Values looked up before this point
+ * to the old table, so must not be used after it.
+ *
+ *  @return 1 if the array moved to a new table, 0 if it already had
+ *			the latest one, or -1 on failure, in which case the
+ *			array is still using the table it had
+ */
+int
+aaRefreshShared(AssociativeArray *aarray)
+{
+	AASharedTable *shared = aarray->shared, next;
+
+	if (shared == NULL)
+		return -1;
+	if (__atomic_load_n(&shared->control->generation, __ATOMIC_ACQUIRE) == shared->generation)
+		return 0;
+
+	next = *shared;
+	if (mapCurrentImage(&next, aarray->options.sharedName) < 0)
+		return -1;
+
+	munmap(shared->image, shared->imageSize);
+	*shared = next;
+	shared->nRefreshes++;
+	matchImage(aarray);
+	return 1;
+}
+
+/**
+ * Remove a published table's names, so no more readers can attach;
+ * readers already attached carry on with what they have mapped
+ *
+ *  @return 1 on success, or -1 if nothing was published as that name
+ */
+int
+aaUnlinkShared(const char *name)
+{
+	char segment[SHARED_NAME_MAX];
+	SharedControl *control;
+	uint64_t generation;
+
+	control = mapControl(name, 0);
+	if (control == NULL)
+		return -1;
+	generation = __atomic_load_n(&control->generation, __ATOMIC_ACQUIRE);
+	munmap(control, sizeof(SharedControl));
+
+	if (generation > 0) {
+		segmentName(segment, name, generation);
+		shm_unlink(segment);
+	}
+	segmentName(segment, name, 0);
+	return (shm_unlink(segment) == 0) ? 1 : -1;
+}
+
+/** look a key up in the mapped image */
+void *
+aaSharedLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen, int *cost)
+{
+	(*cost)++;
+	return (void *) aaStaticLookup(&aarray->shared->table, key, keylen);
+}
+
+/** call the user function on every key in the image */
+int
+aaSharedIterate(AssociativeArray *aarray,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata)
+{
+	const AAStaticTable *table = &aarray->shared->table;
+	uint32_t slot;
+
+	if (table->nKeys == 0)
+		return 1;
+
+	for (slot = 0; slot < table->nSlots; slot++) {
+		if ((*userfunction)((AAKeyType) (table->keyBytes + table->keyOffsets[slot]),
+				table->keyOffsets[slot + 1] - table->keyOffsets[slot],
+				(void *) (table->valueBytes + table->valueOffsets[slot]),
+				userdata) < 0)
+			return -1;
+	}
+	return 1;
+}
+
+/** print the keys of the image, slot by slot */
+void
+aaPrintSharedContents(FILE *fp, AssociativeArray *aarray, char *tag)
+{
+	const AAStaticTable *table = &aarray->shared->table;
+	char keybuffer[128];
+	uint32_t slot;
+
+	fprintf(fp, "%sDumping shared table of %u slots:\n", tag, table->nSlots);
+	for (slot = 0; table->nKeys > 0 && slot < table->nSlots; slot++) {
+		printableKey(keybuffer, 128,
+				(AAKeyType) (table->keyBytes + table->keyOffsets[slot]),
+				table->keyOffsets[slot + 1] - table->keyOffsets[slot]);
+		fprintf(fp, "%s  %u : in use : '%s'\n", tag, slot, keybuffer);
+	}
+}
+
+/** say which image the array is reading */
+void
+aaPrintSharedSummary(FILE *fp, AssociativeArray *aarray)
+{
+	AASharedTable *shared = aarray->shared;
+
+	if (shared == NULL)
+		return;
+
+	fprintf(fp, "Shared table '%s': generation %llu, %lu bytes mapped, %lu refreshes\n",
+			aarray->options.sharedName, (unsigned long long) shared->generation,
+			(unsigned long) shared->imageSize, shared->nRefreshes);
+}
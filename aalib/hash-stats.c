@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * Statistics gathering for the associative array.
+ *
+ * Every insert, lookup and delete records how long its probe was,
+ * both as a running total and in a histogram bucketed by powers
+ * of two, so that the shape of the distribution (and not just its
+ * sum) can be reported.
+ */
+
+
+/** find the histogram bucket for a given probe length */
+static int
+probeBucket(unsigned long probes)
+{
+	int bucket = 0;
+
+	while (probes > 1 && bucket < AA_HISTOGRAM_BUCKETS - 1) {
+		probes >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/**
+ * Record the cost of a single operation
+ *
+ *  @param  opstats  the statistics for the operation type
+ *  @param  cost     the number of probes the operation took
+ */
+void
+aaRecordProbes(AAOpStats *opstats, int cost)
+{
+	unsigned long probes = (cost < 0) ? 0 : (unsigned long) cost;
+
+	opstats->count++;
+	opstats->totalProbes += probes;
+	if (probes > opstats->maxProbes)
+		opstats->maxProbes = probes;
+	opstats->histogram[probeBucket(probes)]++;
+}
+
+/**
+ * Add the lookups made by aaLookupConcurrent() into the array's own
+ * search statistics
+ */
+void
+aaMergeSearchStats(AssociativeArray *aarray, const AASearchStats *stats)
+{
+	AAOpStats *search = &aarray->searchStats;
+	int i;
+
+	search->count += stats->search.count;
+	search->totalProbes += stats->search.totalProbes;
+	if (stats->search.maxProbes > search->maxProbes)
+		search->maxProbes = stats->search.maxProbes;
+	for (i = 0; i < AA_HISTOGRAM_BUCKETS; i++) {
+		search->histogram[i] += stats->search.histogram[i];
+	}
+
+	aarray->lookupHits += stats->hits;
+	aarray->lookupMisses += stats->misses;
+	aarray->lookupsFiltered += stats->filtered;
+}
+
+/**
+ * Fill in a snapshot of the current table statistics
+ *
+ *  @return 1 on success, or -1 if no array was given
+ */
+int
+aaGetStats(AssociativeArray *aarray, AAStats *stats)
+{
+	if (aarray == NULL || stats == NULL)
+		return -1;
+
+	memset(stats, 0, sizeof(AAStats));
+	stats->size = aarray->size;
+	stats->nEntries = aarray->nEntries;
+	stats->nTombstones = aarray->nTombstones;
+
+	/** entries still waiting to be migrated out of an old generation count too */
+	if (aarray->retiring != NULL)
+		stats->nEntries += aarray->retiring->nEntries;
+
+	stats->loadFactor = (aarray->size > 0)
+			? (double) stats->nEntries / (double) aarray->size : 0.0;
+
+	stats->insertion = aarray->insertStats;
+	stats->search = aarray->searchStats;
+	stats->deletion = aarray->deleteStats;
+
+	stats->lookupHits = aarray->lookupHits;
+	stats->lookupMisses = aarray->lookupMisses;
+
+	return 1;
+}
+
+/** the mean probe length, or zero if no operations have been done */
+double
+aaStatsMeanProbes(const AAOpStats *opstats)
+{
+	if (opstats->count == 0)
+		return 0.0;
+	return (double) opstats->totalProbes / (double) opstats->count;
+}
+
+/**
+ * Estimate a percentile of the probe lengths from the histogram.
+ *
+ * As the histogram is bucketed by powers of two, the value returned
+ * is the upper bound of the bucket holding the requested percentile,
+ * clipped to the largest probe length actually seen.
+ *
+ *  @param  percentile  value in the range [0...100]
+ */
+unsigned long
+aaStatsPercentile(const AAOpStats *opstats, double percentile)
+{
+	unsigned long target, seen = 0, upper;
+	int i;
+
+	if (opstats->count == 0)
+		return 0;
+
+	if (percentile < 0)		percentile = 0;
+	if (percentile > 100)	percentile = 100;
+
+	/** the rank of the operation we are looking for, counting from one */
+	target = (unsigned long) ((percentile / 100.0) * opstats->count + 0.5);
+	if (target < 1) target = 1;
+
+	for (i = 0; i < AA_HISTOGRAM_BUCKETS; i++) {
+		seen += opstats->histogram[i];
+		if (seen >= target) {
+			upper = (2UL << i) - 1;
+			return (upper < opstats->maxProbes) ? upper : opstats->maxProbes;
+		}
+	}
+	return opstats->maxProbes;
+}
+
+/** print one line of the stats table, and its histogram */
+void
+aaPrintOpStats(FILE *fp, const char *label, const AAOpStats *opstats)
+{
+	int i, last = -1;
+
+	fprintf(fp, "  %-9s : %10lu ops  mean %8.2f  p50 %6lu  p99 %6lu  max %6lu\n",
+			label, opstats->count, aaStatsMeanProbes(opstats),
+			aaStatsPercentile(opstats, 50.0),
+			aaStatsPercentile(opstats, 99.0),
+			opstats->maxProbes);
+
+	for (i = 0; i < AA_HISTOGRAM_BUCKETS; i++) {
+		if (opstats->histogram[i] != 0)
+			last = i;
+	}
+	for (i = 0; i <= last; i++) {
+		fprintf(fp, "      [%8lu, %8lu] : %lu\n",
+				(i == 0) ? 0UL : (1UL << i), (2UL << i) - 1,
+				opstats->histogram[i]);
+	}
+}
+
+/**
+ * Print out the full statistics, including the histograms
+ */
+void
+aaPrintStats(FILE *fp, AssociativeArray *aarray)
+{
+	AAStats stats;
+
+	aaGetStats(aarray, &stats);
+
+	fprintf(fp, "Table statistics:\n");
+	fprintf(fp, "  Load factor %.3f (%lu entries, %lu tombstones, %lu slots)\n",
+			stats.loadFactor, (unsigned long) stats.nEntries,
+			(unsigned long) stats.nTombstones, (unsigned long) stats.size);
+	fprintf(fp, "  Lookups: %lu hits, %lu misses\n",
+			stats.lookupHits, stats.lookupMisses);
+	fprintf(fp, "Probe lengths:\n");
+	aaPrintOpStats(fp, "Insertion", &stats.insertion);
+	aaPrintOpStats(fp, "Search", &stats.search);
+	aaPrintOpStats(fp, "Deletion", &stats.deletion);
+}
@@ -6,6 +6,15 @@
 
 #include "hashtools.h"
 
+/** how many keys ahead a batch insert fetches the home slots of */
+#define	PREFETCH_DISTANCE	8
+
+/** the home slot of a key, and the table size it was found for */
+typedef struct KnownHome {
+	HashIndex slot;
+	HashIndex tableSize;
+} KnownHome;
+
 /** forward declaration */
 static HashAlgorithm lookupNamedHashStrategy(const char *name);
 static HashProbe lookupNamedProbingStrategy(const char *name);
@@ -13,6 +22,35 @@ static HashProbe lookupNamedProbingStrategy(const char *name);
 /** Custom forward declaration for function created by Lukas*/
 static int deleteKeys(AssociativeArray *);
 
+/**
+ * Fill in the default creation options
+ */
+void
+aaInitOptions(AAOptions *options)
+{
+	memset(options, 0, sizeof(AAOptions));
+	options->layout = AA_LAYOUT_SLOTS;
+	options->growAtLoad = 0;
+	options->rehashStep = AA_DEFAULT_REHASH_STEP;
+	options->filterBitsPerKey = 0;
+	options->valueWidth = 0;
+	options->pages = AA_PAGES_MALLOC;
+	options->numaPolicy = AA_NUMA_DEFAULT;
+	options->numaNode = 0;
+	options->diskPath = NULL;
+	options->diskPageSize = AA_DEFAULT_DISK_PAGE;
+	options->diskCachePages = AA_DEFAULT_DISK_CACHE;
+	options->sharedName = NULL;
+	options->cacheEntries = 0;
+	options->cacheBytes = 0;
+	options->evicted = NULL;
+	options->evictUserdata = NULL;
+	options->keyStore = AA_KEYS_MALLOC;
+	options->keyDictionary = NULL;
+	options->keyDictionaryLengths = NULL;
+	options->nDictionaryKeys = 0;
+}
+
 /**
  * Create a hash table of the given size,
  * which will use the given algorithm to create hash values,
@@ -38,8 +76,31 @@ aaCreateAssociativeArray(
 		char *hashPrimary,
 		char *hashSecondary
 	)
+{
+	AAOptions options;
+
+	aaInitOptions(&options);
+	return aaCreateConfiguredArray(size,
+			probingStrategy, hashPrimary, hashSecondary, &options);
+}
+
+/**
+ * Create a hash table as above, with the extra choices given in
+ * the options
+ *
+ *  @see         AAOptions
+ */
+AssociativeArray *
+aaCreateConfiguredArray(
+		size_t size,
+		char *probingStrategy,
+		char *hashPrimary,
+		char *hashSecondary,
+		const AAOptions *options
+	)
 {
 	AssociativeArray *newTable;
+	int isCache;
 
 	newTable = (AssociativeArray *) malloc(sizeof(AssociativeArray));
 
@@ -50,6 +111,13 @@ aaCreateAssociativeArray(
 	newTable->hashProbe = lookupNamedProbingStrategy(probingStrategy);
 	newTable->probeName = strdup(probingStrategy);
 
+	/** a cache holds its entries to half of the slots */
+	isCache = (options->cacheEntries > 0 || options->cacheBytes > 0)
+			&& options->layout != AA_LAYOUT_DISK && options->layout != AA_LAYOUT_SHARED;
+	if (isCache && options->cacheEntries > 0 && size < 2 * (size_t) options->cacheEntries) {
+		size = 2 * (size_t) options->cacheEntries;
+	}
+
 	newTable->size = getLargerPrime(size);
 
 	if (newTable->size < 1) {
@@ -58,14 +126,141 @@ aaCreateAssociativeArray(
 		return NULL;
 	}
 
-	newTable->table = (KeyDataPair *) malloc(newTable->size * sizeof(KeyDataPair));
+	newTable->options = *options;
+	newTable->nEntries = 0;
+	newTable->layout = options->layout;
+
+	/** inline values follow each record, keeping the records aligned */
+	newTable->valueWidth = options->valueWidth;
+	newTable->entryStride = sizeof(KeyDataPair);
+	if (newTable->valueWidth > 0) {
+		newTable->entryStride += (newTable->valueWidth + sizeof(void *) - 1)
+				& ~(sizeof(void *) - 1);
+	}
+
+	if (newTable->layout == AA_LAYOUT_PACKED) {
+		newTable->entryStride = aaPackedStride(newTable->valueWidth);
+	}
 
-	/** initialize everything with zeros */
-	memset(newTable->table, 0, newTable->size * sizeof(KeyDataPair));
+	newTable->table = NULL;
+	newTable->packed = NULL;
+	newTable->slotPages = AA_PAGES_MALLOC;
+	newTable->slotNumaApplied = 0;
+	newTable->indices = NULL;
+	newTable->entries = NULL;
+	newTable->nEntriesUsed = newTable->nEntriesAllocated = 0;
+	newTable->disk = NULL;
+	newTable->shared = NULL;
+	newTable->keys = NULL;
 
-	newTable->nEntries = 0;
+	/** disk and shared tables have no use for growth or a filter */
+	if (newTable->layout == AA_LAYOUT_DISK || newTable->layout == AA_LAYOUT_SHARED) {
+		newTable->options.growAtLoad = 0;
+		newTable->options.filterBitsPerKey = 0;
+		newTable->options.cacheEntries = 0;
+		newTable->options.cacheBytes = 0;
+	}
 
-	newTable->insertCost = newTable->searchCost = newTable->deleteCost = 0;
+	/** packed keys carry a length header and their slots a tag, so they keep their own */
+	if (newTable->layout != AA_LAYOUT_SLOTS && newTable->layout != AA_LAYOUT_COMPACT) {
+		newTable->options.keyStore = AA_KEYS_MALLOC;
+	}
+
+	/** nor does a cache grow: it rehashes in place, at once, to clear out tombstones */
+	if (isCache) {
+		newTable->options.growAtLoad = AA_CACHE_PURGE_LOAD;
+		newTable->options.rehashStep = 0;
+	}
+
+	if (newTable->layout == AA_LAYOUT_COMPACT) {
+		if (aaCompactCreate(newTable) < 0) {
+			fprintf(stderr, "Cannot allocate compact table of size %d\n", newTable->size);
+			free(newTable);
+			return NULL;
+		}
+	} else if (newTable->layout == AA_LAYOUT_PACKED) {
+		if (aaPackedCreate(newTable) < 0) {
+			fprintf(stderr, "Cannot allocate packed table of size %d\n", newTable->size);
+			free(newTable);
+			return NULL;
+		}
+	} else if (newTable->layout == AA_LAYOUT_DISK) {
+		/** sets the size and the entry count from the file */
+		if (aaDiskOpen(newTable) < 0) {
+			free(newTable);
+			return NULL;
+		}
+	} else if (newTable->layout == AA_LAYOUT_SHARED) {
+		/** and this from the published image */
+		if (aaSharedAttach(newTable) < 0) {
+			free(newTable);
+			return NULL;
+		}
+	} else {
+		/** comes back initialized with zeros */
+		newTable->table = (KeyDataPair *) aaSlotMemoryAlloc(newTable,
+				(size_t) newTable->size * newTable->entryStride);
+		if (newTable->table == NULL) {
+			fprintf(stderr, "Cannot allocate table of size %d\n", newTable->size);
+			free(newTable);
+			return NULL;
+		}
+	}
+
+	/** the filter is sized for a full table */
+	newTable->filter = NULL;
+	if (options->filterBitsPerKey > 0) {
+		newTable->filter = aaFilterCreate(newTable->size, options->filterBitsPerKey);
+		if (newTable->filter == NULL) {
+			fprintf(stderr, "Cannot allocate lookup filter for table of size %d\n", newTable->size);
+			if (newTable->layout == AA_LAYOUT_COMPACT) {
+				aaCompactDestroy(newTable);
+			} else if (newTable->layout == AA_LAYOUT_PACKED) {
+				aaPackedDestroy(newTable);
+			} else {
+				aaSlotMemoryFree(newTable, newTable->table,
+						(size_t) newTable->size * newTable->entryStride);
+			}
+			free(newTable);
+			return NULL;
+		}
+	}
+	newTable->nFilterRebuilds = 0;
+	newTable->lookupsFiltered = 0;
+
+	newTable->nTombstones = 0;
+
+	/** all of the statistics start out at zero */
+	memset(&newTable->insertStats, 0, sizeof(AAOpStats));
+	memset(&newTable->searchStats, 0, sizeof(AAOpStats));
+	memset(&newTable->deleteStats, 0, sizeof(AAOpStats));
+	newTable->lookupHits = newTable->lookupMisses = 0;
+
+	/** counters are opt-in, see aaEnablePerfCounters() */
+	newTable->perf = NULL;
+	newTable->trace = NULL;
+	newTable->wal = NULL;
+
+	newTable->retiring = NULL;
+	newTable->migrateCursor = 0;
+	newTable->nResizes = 0;
+	newTable->frozen = NULL;
+
+	newTable->cache = NULL;
+	if (isCache && aaCacheCreate(newTable) < 0) {
+		fprintf(stderr, "Cannot allocate cache state for table of size %d\n", newTable->size);
+		aaDeleteAssociativeArray(newTable);
+		return NULL;
+	}
+
+	if (newTable->options.keyStore == AA_KEYS_COMPRESSED) {
+		newTable->keys = aaKeyStoreCreate(&newTable->options);
+		if (newTable->keys == NULL) {
+			fprintf(stderr, "Cannot allocate key store for table of size %d\n", newTable->size);
+			aaDeleteAssociativeArray(newTable);
+			return NULL;
+		}
+	}
 
 	return newTable;
 }
@@ -84,11 +279,13 @@ aaDeleteAssociativeArray(AssociativeArray *aarray)
 	 * Note that memory for keys are managed, values are the
 	 * responsibility of the user
 	 */
-	//dealloc all the keys
-	deleteKeys(aarray);
+	//stop any instrumentation
+	aaDisablePerfCounters(aarray);
+	aaStopTrace(aarray);
+	aaStopLog(aarray);
 
-	//dealloc the array
-	free(aarray->table);
+	//dealloc the keys and the array
+	aaReleaseStorage(aarray);
 
 	//dealloc the strings
 	free(aarray->hashNamePrimary);
@@ -100,6 +297,58 @@ aaDeleteAssociativeArray(AssociativeArray *aarray)
 
 }
 
+/**
+ * deallocate the keys and everything that holds them, leaving the
+ * strategies and the instrumentation of the array alone
+ */
+void
+aaReleaseStorage(AssociativeArray *aarray)
+{
+	//a disk table keeps its keys in the file, which is brought up to date
+	if (aarray->layout == AA_LAYOUT_DISK) {
+		aaDiskClose(aarray);
+		return;
+	}
+
+	//nothing of a shared table is ours but the mapping
+	if (aarray->layout == AA_LAYOUT_SHARED) {
+		aaSharedDetach(aarray);
+		return;
+	}
+
+	//dealloc all the keys, which a key store holds in bulk
+	if (aarray->keys != NULL) {
+		aaKeyStoreDestroy(aarray->keys);
+		aarray->keys = NULL;
+	} else {
+		deleteKeys(aarray);
+	}
+
+	//a table part way through growing still owns its old generation
+	if (aarray->retiring != NULL) {
+		aaDeleteAssociativeArray(aarray->retiring);
+		aarray->retiring = NULL;
+		aarray->migrateCursor = 0;
+	}
+
+	//dealloc the array
+	if (aarray->layout == AA_LAYOUT_COMPACT) {
+		aaCompactDestroy(aarray);
+	} else if (aarray->layout == AA_LAYOUT_PACKED) {
+		aaPackedDestroy(aarray);
+	} else {
+		aaSlotMemoryFree(aarray, aarray->table,
+				(size_t) aarray->size * aarray->entryStride);
+		aarray->table = NULL;
+	}
+	aaFilterDestroy(aarray->filter);
+	aarray->filter = NULL;
+	aaFrozenDestroy(aarray->frozen);
+	aarray->frozen = NULL;
+	aaCacheDestroy(aarray->cache);
+	aarray->cache = NULL;
+}
+
 /**
  * iterate over the array, calling the user function on each valid value
  */
@@ -109,14 +358,51 @@ int aaIterateAction(
 		void *userdata
 	)
 {
-	int i;
+	KeyDataPair *entries = aarray->table, *entry, found;
+	int i, nEntries = aarray->size;
 
-	for (i = 0; i < aarray->size; i++) {
-		if (aarray->table[i].validity == HASH_USED) {
+	/** entries not yet migrated out of an old generation come first */
+	if (aarray->retiring != NULL) {
+		if (aaIterateAction(aarray->retiring, userfunction, userdata) < 0)
+			return -1;
+	}
+
+	/** disk tables are walked a page at a time */
+	if (aarray->layout == AA_LAYOUT_DISK) {
+		return aaDiskIterate(aarray, userfunction, userdata);
+	}
+	if (aarray->layout == AA_LAYOUT_SHARED) {
+		return aaSharedIterate(aarray, userfunction, userdata);
+	}
+
+	/** packed slots have no records to walk, so read each slot */
+	if (aarray->layout == AA_LAYOUT_PACKED) {
+		for (i = 0; i < aarray->size; i++) {
+			if (aaSlotRead(aarray, i, &found) && found.validity == HASH_USED) {
+				if ((*userfunction)(found.key, found.keylen,
+						found.value, userdata) < 0) {
+					return -1;
+				}
+			}
+		}
+		return 1;
+	}
+
+	/** the compact layout lets us visit just the entries, in order */
+	if (aarray->layout == AA_LAYOUT_COMPACT) {
+		entries = aarray->entries;
+		nEntries = aarray->nEntriesUsed;
+	}
+
+	for (i = 0; i < nEntries; i++) {
+		entry = aaRecordAt(aarray, entries, i);
+		if (entry->validity == HASH_USED) {
 			if ((*userfunction)(
-					aarray->table[i].key,
-					aarray->table[i].keylen,
-					aarray->table[i].value,
+					(aarray->keys != NULL)
+						? aaKeyStoreDecode(aarray->keys, entry->key, entry->keylen)
+						: entry->key,
+					entry->keylen,
+					aaEntryValue(aarray, entry),
 					userdata) < 0) {
 				return -1;
 			}
@@ -136,6 +422,8 @@ static HashAlgorithm lookupNamedHashStrategy(const char *name)
 	else if (strncmp(name, "pri", 3) == 0)
 	{ // DONE: add in your own strategy here
 		return hashByPrime;
+	} else if (strncmp(name, "mix", 3) == 0) {
+		return hashByMix;
 	}
 
 	fprintf(stderr, "Invalid hash strategy '%s' - using 'sum'\n", name);
@@ -156,15 +444,190 @@ static HashProbe lookupNamedProbingStrategy(const char *name)
 	return linearProbe;
 }
 
+/**
+ * Take over an allocated key and store it with its value in the
+ * given slot, which the insertion probe has chosen for it
+ *
+ *  @return 1 on success, or -1 if no memory is available
+ */
+int aaStoreEntry(AssociativeArray *aarray, HashIndex slot,
+		AAKeyType ownedKey, size_t keylen, void *value)
+{
+	KeyDataPair *entry;
+
+	//reusing a tombstone takes it out of the count
+	if (aaSlotValidity(aarray, slot) == HASH_DELETED) {
+		aarray->nTombstones--;
+	}
+
+	if (aarray->layout == AA_LAYOUT_COMPACT) {
+		if (aaCompactPlace(aarray, slot, ownedKey, keylen, value) < 0) {
+			return -1;
+		}
+	} else if (aarray->layout == AA_LAYOUT_PACKED) {
+		if (aaPackedPlace(aarray, slot, ownedKey, keylen, value) < 0) {
+			return -1;
+		}
+	} else {
+		entry = aaRecordAt(aarray, aarray->table, slot);
+		entry->key = ownedKey;
+		entry->keylen = keylen;
+		entry->validity = HASH_USED;
+		if (aarray->valueWidth > 0) {
+			entry->value = NULL;
+			aaCopyInValue(aarray, aaEntryValue(aarray, entry), value);
+		} else {
+			entry->value = value;
+		}
+	}
+
+	//count the newly added entry
+	aarray->nEntries++;
+	return 1;
+}
+
+/**
+ * Probe a single generation of the table for the given key
+ *
+ *  @param  what  the operation, for the error message
+ *  @return       the slot holding the key, or (HashIndex) -1 if it
+ *				  is not present in this generation
+ */
+static HashIndex findKey(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		const char *what, int *cost, const KnownHome *known)
+{
+	//a frozen table has exactly one place to look
+	if (aarray->frozen != NULL) {
+		return aaFrozenFind(aarray, key, keylen, cost);
+	}
+
+	//the filter can rule the key out without touching the slots at all
+	if (aarray->filter != NULL
+			&& ! aaFilterMayContain(aarray->filter, aaMixHash64(key, keylen))) {
+		return (HashIndex) -1;
+	}
+
+	// will need to use the hash algorithm from aarray, use the primary
+	// this gives us the first possible index. Will begin the search here
+	HashIndex hasedIndex; // the index in the hash table. Indexing starts at 0
+	if (known != NULL && known->tableSize == (HashIndex) aarray->size) {
+		hasedIndex = known->slot;
+	} else {
+		hasedIndex = (*(aarray->hashAlgorithmPrimary))(key, keylen, aarray->size);
+	}
+
+	// then look at the index in the location found above
+	// call the probe method to get the next index
+	HashIndex finalIndex = (*(aarray->hashProbe))(aarray, key, keylen, hasedIndex, 0, cost);
+
+	// see if the finalIndex is in the table
+	// check to see if the returned index is used
+	if (finalIndex != (HashIndex) -1 && aaSlotValidity(aarray, finalIndex) == HASH_USED)
+	{
+		// if the index is in use make sure it is the correct one
+		if (aaSlotHoldsKey(aarray, finalIndex, key, keylen,
+				aaKeyTag(aarray, key, keylen)))
+		{
+			return finalIndex;
+		}
+
+		// this is probably never called
+		fprintf(stderr, "Error: Failed to probe correctly with: '%s' when %s", aarray->probeName, what);
+	}
+
+	//not here in all other conditions
+	return (HashIndex) -1;
+}
+
+/**
+ * Probe for a slot to insert the key into, from its home slot.  A
+ * cache evicts to make room where any other table would fail.
+ *
+ *  @return the slot, which holds the key if it is already present,
+ *			or (HashIndex) -1 if there is no room
+ */
+static HashIndex probeForRoom(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		HashIndex hasedIndex, int *cost)
+{
+	HashIndex finalIndex = (*(aarray->hashProbe))(aarray, key, keylen, hasedIndex, 1, cost);
+
+	if (aarray->cache != NULL) {
+		while (finalIndex == (HashIndex) -1 && aaCacheEvict(aarray) > 0) {
+			finalIndex = (*(aarray->hashProbe))(aarray, key, keylen, hasedIndex, 1, cost);
+		}
+	}
+	return finalIndex;
+}
+
+/**
+ * Store a key not already in the table, with its value, in the free
+ * slot the probe chose for it
+ *
+ *  @return the slot, or -1 if there is no memory (or a cache cannot
+ *			make room for it)
+ */
+static int storeNewKey(AssociativeArray *aarray, HashIndex finalIndex,
+		AAKeyType key, size_t keylen, void *value)
+{
+	AAKeyType ownedKey;
+
+	//evictions only leave tombstones, so the chosen slot stays free
+	if (aarray->cache != NULL && aaCacheMakeRoom(aarray, keylen) < 0) {
+		return -1;
+	}
+
+	//add it into the array
+	//DONE: Check to see if this strdup call causes issues with null terminator when in useIntKey mode
+	//It does cause issues so instead use malloc and memdup
+	//(the packed layout keeps the length in a header in front of the key)
+	//(and a compressed key store keeps a coded copy in one of its blocks)
+	if (aarray->layout == AA_LAYOUT_PACKED) {
+		ownedKey = aaPackedCopyKey(key, keylen);
+	} else if (aarray->keys != NULL) {
+		ownedKey = aaKeyStoreAdd(aarray->keys, key, keylen);
+	} else {
+		ownedKey = (AAKeyType)malloc(keylen);
+		if (ownedKey != NULL) {
+			memcpy(ownedKey, key, keylen);
+		}
+	}
+	if (ownedKey == NULL) {
+		return -1;
+	}
+
+	if (aaStoreEntry(aarray, finalIndex, ownedKey, keylen, value) < 0) {
+		if (aarray->layout == AA_LAYOUT_PACKED) {
+			aaPackedFreeKey(ownedKey);
+		} else if (aarray->keys != NULL) {
+			aaKeyStoreRemoved(aarray->keys, ownedKey, keylen);
+		} else {
+			free(ownedKey);
+		}
+		return -1;
+	}
+	if (aarray->filter != NULL) {
+		aaFilterAdd(aarray->filter, aaMixHash64(key, keylen));
+	}
+	if (aarray->cache != NULL) {
+		aaCacheStored(aarray, finalIndex, keylen);
+	}
+
+	return finalIndex;
+}
+
 /**
  * Add another key and data value to the table, provided there is room.
  *
  *  @param  key  a string value used for searching later
  *  @param  value a data value associated with the key
+ *  @param  known the key's home slot if the caller has already hashed
+ *				 it, or NULL; it is only used if the table is still the
+ *				 size it was found for
  *  @return      the location the data is placed within the hash table,
  *				 or a negative number if no place can be found
  */
-int aaInsert(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value)
+static int insertIntoTable(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value,
+		const KnownHome *known)
 {
 	/**
 	 * DONE:  Search for a location where this key can go, stopping
@@ -173,44 +636,145 @@ int aaInsert(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value
 	 * If a suitable location is found, we then initialize that
 	 * slot with the new key and data
 	 */
+	int cost = 0, result;
+
+	//a frozen (or shared) table has no room for anything more
+	if (aarray->frozen != NULL || aarray->layout == AA_LAYOUT_SHARED) {
+		return -1;
+	}
+
+	//a disk table finds room by splitting pages, not by probing
+	if (aarray->layout == AA_LAYOUT_DISK) {
+		result = aaDiskInsert(aarray, key, keylen, value, &cost);
+		aaRecordProbes(&aarray->insertStats, cost);
+		return result;
+	}
+
+	//a key still waiting in the old generation is a duplicate too
+	if (aarray->retiring != NULL
+			&& findKey(aarray->retiring, key, keylen, "inserting", &cost, NULL) != (HashIndex) -1) {
+		aaRecordProbes(&aarray->insertStats, cost);
+		return -1;
+	}
 
 	//will need to use the hash algorithm from aarray, use the primary
 	//this gives us the first possible index. Might not store the value here as a collision is possible.
 	//will need to run through a probing strategy before storing the value
-	HashIndex hasedIndex = (*(aarray->hashAlgorithmPrimary))(key, keylen, aarray->size); //the index in the hash table. Indexing starts at 0
+	HashIndex hasedIndex; //the index in the hash table. Indexing starts at 0
+	if (known != NULL && known->tableSize == (HashIndex) aarray->size) {
+		hasedIndex = known->slot;
+	} else {
+		hasedIndex = (*(aarray->hashAlgorithmPrimary))(key, keylen, aarray->size);
+	}
 
 	//then look at the index in the location found above
 	//call the probe method to get the index
-	HashIndex finalIndex = (*(aarray->hashProbe))(aarray, key, keylen, hasedIndex, 1, &aarray->insertCost);
+	HashIndex finalIndex = probeForRoom(aarray, key, keylen, hasedIndex, &cost);
+	aaRecordProbes(&aarray->insertStats, cost);
+
+	//a full table gives us nowhere to put the key
+	if (finalIndex == (HashIndex) -1) {
+		return -1;
+	}
 
 	//check for a used index
-	if (aarray->table[finalIndex].validity == HASH_USED) {
+	if (aaSlotValidity(aarray, finalIndex) == HASH_USED) {
 		//this is called when the probe returns an index that would work but is already used
 		//such a a case occurs when inserting duplicate keys
 		fprintf(stderr, "Error: Failed to probe correctly with: '%s' when inserting\n", aarray->probeName);
 
 		//set the finalIndex to be an error state
-		finalIndex = -1;
-	} else if (finalIndex >= 0) {
+		return -1;
+	}
 
-		//add it into the array
-		//DONE: Check to see if this strdup call causes issues with null terminator when in useIntKey mode
-		//It does cause issues so instead use malloc and memdup
-		aarray->table[finalIndex].key = (AAKeyType)malloc(keylen);
-		memcpy(aarray->table[finalIndex].key, key, keylen);
+	return storeNewKey(aarray, finalIndex, key, keylen, value);
+}
 
-		//aarray->table[finalIndex].key = (AAKeyType)strdup((char*)key); //Do not forget to free this later
-		aarray->table[finalIndex].keylen = keylen;
-		aarray->table[finalIndex].value = value;
-		aarray->table[finalIndex].validity = HASH_USED;
+/** fold an amount into an accumulator */
+static void foldAmount(void *accumulator, int operation, int64_t amount)
+{
+	int64_t total;
 
-		//count the newly added entry
-		aarray->nEntries++;
+	memcpy(&total, accumulator, sizeof(int64_t));
+	if (operation == AA_AGGREGATE_COUNT) {
+		total++;
+	} else if (operation == AA_AGGREGATE_SUM) {
+		total += amount;
+	} else if (operation == AA_AGGREGATE_MIN) {
+		if (amount < total)	total = amount;
+	} else if (operation == AA_AGGREGATE_MAX) {
+		if (amount > total)	total = amount;
 	}
-
-	return finalIndex; //can always return the finalIndex b/c all the probing algos return -1 if they fail, so we can just pass it forward always
+	memcpy(accumulator, &total, sizeof(int64_t));
 }
 
+/**
+ * Fold an amount into the accumulator for a key, adding the key if
+ * it is not there yet.
+ *
+ * A lookup probe stops either at the key or at the empty slot that
+ * ends its chain, which is also a place the key can go, so the one
+ * probe both finds the key and places it.  It passes over tombstones
+ * rather than reusing them; only if there is no empty slot on the
+ * chain at all is there a second, inserting, probe.
+ *
+ *  @return 1 if the key was added, 0 if it was already present, or -1
+ *			if it could not be added (or the table cannot be updated)
+ */
+static int accumulateInTable(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		int operation, int64_t amount, int64_t *total)
+{
+	AssociativeArray *generation = aarray;
+	HashIndex hasedIndex, finalIndex, oldIndex;
+	int64_t initial;
+	int cost = 0;
+
+	//the accumulators are changed where they lie, so must be inline and ours
+	if (aarray->frozen != NULL || aarray->layout == AA_LAYOUT_DISK
+			|| aarray->layout == AA_LAYOUT_SHARED
+			|| aarray->valueWidth != sizeof(int64_t)) {
+		return -1;
+	}
+
+	hasedIndex = (*(aarray->hashAlgorithmPrimary))(key, keylen, aarray->size);
+	finalIndex = (*(aarray->hashProbe))(aarray, key, keylen, hasedIndex, 0, &cost);
+
+	//a key still waiting in the old generation is updated there
+	if (aarray->retiring != NULL
+			&& (finalIndex == (HashIndex) -1 || aaSlotValidity(aarray, finalIndex) != HASH_USED)) {
+		oldIndex = findKey(aarray->retiring, key, keylen, "accumulating", &cost, NULL);
+		if (oldIndex != (HashIndex) -1) {
+			generation = aarray->retiring;
+			finalIndex = oldIndex;
+		}
+	}
+
+	if (finalIndex != (HashIndex) -1 && aaSlotValidity(generation, finalIndex) == HASH_USED) {
+		aaRecordProbes(&aarray->insertStats, cost);
+		foldAmount(aaSlotValue(generation, finalIndex), operation, amount);
+		memcpy(total, aaSlotValue(generation, finalIndex), sizeof(int64_t));
+		if (generation->cache != NULL) {
+			aaCacheReferenced(generation, finalIndex);
+		}
+		return 0;
+	}
+
+	//the chain has no empty slot to end it, only tombstones
+	if (finalIndex == (HashIndex) -1) {
+		finalIndex = probeForRoom(aarray, key, keylen, hasedIndex, &cost);
+	}
+	aaRecordProbes(&aarray->insertStats, cost);
+	if (finalIndex == (HashIndex) -1) {
+		return -1;
+	}
+
+	initial = (operation == AA_AGGREGATE_COUNT) ? 1 : amount;
+	if (storeNewKey(aarray, finalIndex, key, keylen, &initial) < 0) {
+		return -1;
+	}
+	*total = initial;
+	return 1;
+}
 
 /**
  * Locates the KeyDataPair associated with the given key, if
@@ -221,51 +785,105 @@ int aaInsert(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value
  *				 was present in the table, or NULL, if it was not
  *  @see         KeyDataPair
  */
-void *aaLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen
-	)
+static void *lookupInTable(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		const KnownHome *known)
 {
 	/**
 	 * DONE: perform a similar search to the insert, but here a
 	 * deleted location means we have not found the key
 	 */
+	AssociativeArray *generation = aarray;
+	void *value;
+	int cost = 0;
+	HashIndex finalIndex;
 
-	// will need to use the hash algorithm from aarray, use the primary
-	// this gives us the first possible index. Will begin the search here
-	// will need to run through a probing strategy before storing the value
-	HashIndex hasedIndex = (*(aarray->hashAlgorithmPrimary))(key, keylen, aarray->size); // the index in the hash table. Indexing starts at 0
-
-	// then look at the index in the location found above
-	// call the probe method to get the next index
-	HashIndex finalIndex = (*(aarray->hashProbe))(aarray, key, keylen, hasedIndex, 0, &aarray->searchCost);
+	//a disk table reads the one page the key can be in, and a
+	//shared one the one slot
+	if (aarray->layout == AA_LAYOUT_DISK || aarray->layout == AA_LAYOUT_SHARED) {
+		value = (aarray->layout == AA_LAYOUT_DISK)
+				? aaDiskLookup(aarray, key, keylen, &cost)
+				: aaSharedLookup(aarray, key, keylen, &cost);
+		aaRecordProbes(&aarray->searchStats, cost);
+		if (value != NULL) {
+			aarray->lookupHits++;
+		} else {
+			aarray->lookupMisses++;
+		}
+		return value;
+	}
 
-	//Debug the lookup process
-	/* 
-	printf("finalIndex: %ld, validity: %d\n", finalIndex, aarray->table[finalIndex].validity);
-	*/
+	finalIndex = findKey(aarray, key, keylen, "querying", &cost, known);
 
-	//debug the status of an entry especially after deletion
-	//printf("\tLookup for: %s, has finalIndex of: %ld, with validity of: %d\n", (char*)key, finalIndex, aarray->table[finalIndex].validity);
+	//a key not yet migrated is still in the old generation
+	if (finalIndex == (HashIndex) -1 && aarray->retiring != NULL) {
+		generation = aarray->retiring;
+		finalIndex = findKey(generation, key, keylen, "querying", &cost, NULL);
+	}
+	aaRecordProbes(&aarray->searchStats, cost);
 
-	// see if the finalIndex is in the table
-	// check to see if the returned index is used
-	if (finalIndex >= 0 && aarray->table[finalIndex].validity == HASH_USED)
+	if (finalIndex != (HashIndex) -1)
 	{
-		// if the index is in use make sure it is the correct one
-		// return NULL if the wrong index is returned
-		if ((aarray->table)[finalIndex].key != NULL 
-			&& doKeysMatch((aarray->table)[finalIndex].key, (aarray->table)[finalIndex].keylen, key, keylen) == 1)
-		{
-			return aarray->table[finalIndex].value;
-		}
-		else
-		{
-			// this is probably never called
-			fprintf(stderr, "Error: Failed to probe correctly with: '%s' when querying", aarray->probeName);
-			return NULL;
+		aarray->lookupHits++;
+		if (generation->cache != NULL) {
+			aaCacheReferenced(generation, finalIndex);
 		}
+		return aaSlotValue(generation, finalIndex);
 	}
 
 	//return NULL in all other conditions
+	aarray->lookupMisses++;
+	if (cost == 0) {
+		//no probes at all means the filter answered for us
+		aarray->lookupsFiltered++;
+	}
+	return NULL;
+}
+
+/**
+ * A lookup as above which changes nothing in the array, so that
+ * several threads can share it (except for disk tables, whose page
+ * cache changes on every lookup).  In particular a hit here does not
+ * save a cache entry from eviction.
+ *
+ *  @param  stats  where the probe length and the hit or miss are counted
+ */
+void *aaLookupConcurrent(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		AASearchStats *stats)
+{
+	AssociativeArray *generation = aarray;
+	void *value;
+	int cost = 0;
+	HashIndex finalIndex;
+
+	if (aarray->layout == AA_LAYOUT_DISK || aarray->layout == AA_LAYOUT_SHARED) {
+		value = (aarray->layout == AA_LAYOUT_DISK)
+				? aaDiskLookup(aarray, key, keylen, &cost)
+				: aaSharedLookup(aarray, key, keylen, &cost);
+		aaRecordProbes(&stats->search, cost);
+		if (value != NULL) {
+			stats->hits++;
+		} else {
+			stats->misses++;
+		}
+		return value;
+	}
+
+	finalIndex = findKey(aarray, key, keylen, "querying", &cost, NULL);
+	if (finalIndex == (HashIndex) -1 && aarray->retiring != NULL) {
+		generation = aarray->retiring;
+		finalIndex = findKey(generation, key, keylen, "querying", &cost, NULL);
+	}
+	aaRecordProbes(&stats->search, cost);
+
+	if (finalIndex != (HashIndex) -1) {
+		stats->hits++;
+		return aaSlotValue(generation, finalIndex);
+	}
+
+	stats->misses++;
+	if (cost == 0) {
+		stats->filtered++;
+	}
 	return NULL;
 }
 
@@ -279,7 +897,7 @@ void *aaLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen
  *				 if no key was found
  *  @see         KeyDataPair
  */
-void *aaDelete(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+static void *deleteFromTable(AssociativeArray *aarray, AAKeyType key, size_t keylen)
 {
 	/**
 	 * DONE: Deletion is closely related to lookup;
@@ -289,44 +907,263 @@ void *aaDelete(AssociativeArray *aarray, AAKeyType key, size_t keylen)
 	 * Implement a deletion algorithm based on tombstones,
 	 * as described in class
 	 */
+	AssociativeArray *generation = aarray;
+	void *value;
+	int cost = 0;
+	HashIndex finalIndex;
 
-	// will need to use the hash algorithm from aarray, use the primary
-	// this gives us the first possible index. Will begin the deletion search here
-	// will need to run through a probing strategy before storing the value
-	HashIndex hasedIndex = (*(aarray->hashAlgorithmPrimary))(key, keylen, aarray->size); // the index in the hash table. Indexing starts at 0
+	//nor can anything be taken out of one
+	if (aarray->frozen != NULL || aarray->layout == AA_LAYOUT_SHARED) {
+		return NULL;
+	}
 
-	// then look at the index in the location found above
-	// call the probe method to get the next index
-	HashIndex finalIndex = (*(aarray->hashProbe))(aarray, key, keylen, hasedIndex, 0, &aarray->deleteCost);
+	//a disk table closes up the page it takes the key out of
+	if (aarray->layout == AA_LAYOUT_DISK) {
+		value = aaDiskDelete(aarray, key, keylen, &cost);
+		aaRecordProbes(&aarray->deleteStats, cost);
+		return value;
+	}
 
-	// see if the finalIndex is in the table
-	// check to see if the returned index is used
-	if (finalIndex >= 0 && aarray->table[finalIndex].validity == HASH_USED)
+	finalIndex = findKey(aarray, key, keylen, "deleting", &cost, NULL);
+
+	if (finalIndex == (HashIndex) -1 && aarray->retiring != NULL) {
+		generation = aarray->retiring;
+		finalIndex = findKey(generation, key, keylen, "deleting", &cost, NULL);
+	}
+	aaRecordProbes(&aarray->deleteStats, cost);
+
+	if (finalIndex == (HashIndex) -1)
 	{
-		// if the index is in use make sure it is the correct one
-		// return NULL if the wrong index is returned
-		if ((aarray->table)[finalIndex].key != NULL 
-			&& doKeysMatch((aarray->table)[finalIndex].key, (aarray->table)[finalIndex].keylen, key, keylen) == 1)
-		{
-			//now need to delete the entry by marking it as a tombstone
-			(aarray->table)[finalIndex].validity = HASH_DELETED;
-			//keep the key as is so it can be displayed at the print out of the hash table
+		return NULL;
+	}
+
+	value = aaSlotValue(generation, finalIndex);
+	aaRemoveEntry(generation, finalIndex);
 
-			//count the newly deleted entry
-			aarray->nEntries--;
+	//the old generation's filter is discarded with it, so only ours matters
+	if (generation == aarray && aarray->filter != NULL) {
+		aaFilterRemoved(aarray);
+	}
+
+	return value;
+}
 
-			return (aarray->table)[finalIndex].value;
+/**
+ * Turn the entry in a used slot into a tombstone.  The key is kept as
+ * is so it can be displayed at the print out of the hash table (the
+ * compact layout frees it, as the entry itself is released).
+ */
+void aaRemoveEntry(AssociativeArray *aarray, HashIndex slot)
+{
+	if (aarray->cache != NULL) {
+		aaCacheRemoved(aarray, slot);
+	}
+
+	if (aarray->layout == AA_LAYOUT_COMPACT) {
+		aaCompactRemove(aarray, slot);
+	} else if (aarray->layout == AA_LAYOUT_PACKED) {
+		aaPackedAt(aarray, slot)->keyWord &= ~AA_PACKED_VALIDITY_MASK;
+		aaPackedAt(aarray, slot)->keyWord |= HASH_DELETED;
+	} else {
+		aaSlotEntry(aarray, slot)->validity = HASH_DELETED;
+	}
+
+	//count the newly deleted entry
+	aarray->nEntries--;
+	aarray->nTombstones++;
+}
+
+/**
+ * The public entry points wrap the table operations above with any
+ * instrumentation that has been turned on for this array, and do
+ * the next step of any resize that is under way
+ */
+static int insertWithHome(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value,
+		const KnownHome *known)
+{
+	int result;
+
+	aaPerfBegin(aarray);
+	aaMigrateStep(aarray);
+	aaGrowIfNeeded(aarray);
+	result = insertIntoTable(aarray, key, keylen, value, known);
+	aaPerfEnd(aarray, AA_PERF_INSERT);
+	aaTraceRecord(aarray, AA_TRACE_INSERT, key, keylen, result >= 0);
+	if (result >= 0) {
+		aaLogInsert(aarray, key, keylen, value);
+	}
+
+	return result;
+}
+
+int aaInsert(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value)
+{
+	return insertWithHome(aarray, key, keylen, value, NULL);
+}
+
+/** can the home slots of this table be found, and fetched, ahead of time? */
+static int probesSlots(AssociativeArray *aarray)
+{
+	return aarray->frozen == NULL && aarray->layout != AA_LAYOUT_DISK
+			&& aarray->layout != AA_LAYOUT_SHARED;
+}
+
+/** start a slot on its way into the cache */
+static void prefetchSlot(AssociativeArray *aarray, HashIndex home)
+{
+	if (aarray->layout == AA_LAYOUT_COMPACT) {
+		__builtin_prefetch(&aarray->indices[home], 1);
+	} else if (aarray->layout == AA_LAYOUT_PACKED) {
+		__builtin_prefetch(aaPackedAt(aarray, home), 1);
+	} else {
+		__builtin_prefetch(aaRecordAt(aarray, aarray->table, home), 1);
+	}
+}
+
+/**
+ * Start the home slot of a key on its way into the cache, keeping it
+ * so that the insert need not hash the key again.  The table may grow
+ * before the key is inserted, but then the home is only wasted.
+ */
+static void prefetchHome(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		KnownHome *known)
+{
+	known->tableSize = 0;
+	if ( ! probesSlots(aarray)) {
+		return;
+	}
+
+	known->slot = (*(aarray->hashAlgorithmPrimary))(key, keylen, aarray->size);
+	known->tableSize = (HashIndex) aarray->size;
+	prefetchSlot(aarray, known->slot);
+}
+
+/**
+ * The home slot of a key whose aaMixHash64() the caller already has,
+ * if the table hashes by "mix"; otherwise the home is left unknown
+ */
+static void mixHome(AssociativeArray *aarray, uint64_t hash, KnownHome *known)
+{
+	known->tableSize = 0;
+	if (probesSlots(aarray) && aarray->hashAlgorithmPrimary == hashByMix) {
+		known->slot = (HashIndex) (hash % aarray->size);
+		known->tableSize = (HashIndex) aarray->size;
+	}
+}
+
+int aaInsertBatch(AssociativeArray *aarray, int nKeys,
+		AAKeyType *keys, size_t *keylens, void **values)
+{
+	KnownHome homes[PREFETCH_DISTANCE];
+	KnownHome known;
+	int i;
+
+	for (i = 0; i < nKeys && i < PREFETCH_DISTANCE; i++) {
+		prefetchHome(aarray, keys[i], keylens[i], &homes[i]);
+	}
+
+	//homes are kept in a ring, each slot reused once its key is inserted
+	for (i = 0; i < nKeys; i++) {
+		known = homes[i % PREFETCH_DISTANCE];
+		if (i + PREFETCH_DISTANCE < nKeys) {
+			prefetchHome(aarray, keys[i + PREFETCH_DISTANCE], keylens[i + PREFETCH_DISTANCE],
+					&homes[i % PREFETCH_DISTANCE]);
 		}
-		else
-		{
-			// this is probably never called
-			fprintf(stderr, "Error: Failed to probe correctly with: '%s' when deleting", aarray->probeName);
-			return NULL;
+		if (insertWithHome(aarray, keys[i], keylens[i], values[i], &known) < 0) {
+			break;
 		}
 	}
 
-	//return NULL in all other conditions
-	return NULL;
+	return i;
+}
+
+int aaAccumulate(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		int operation, int64_t amount)
+{
+	int64_t total;
+	int result;
+
+	aaPerfBegin(aarray);
+	aaMigrateStep(aarray);
+	aaGrowIfNeeded(aarray);
+	result = accumulateInTable(aarray, key, keylen, operation, amount, &total);
+	aaPerfEnd(aarray, AA_PERF_INSERT);
+	aaTraceAccumulate(aarray, key, keylen, operation, amount, result >= 0);
+
+	//the log holds the new total, which replays as a plain insert
+	if (result >= 0) {
+		aaLogInsert(aarray, key, keylen, &total);
+	}
+
+	return result;
+}
+
+static void *lookupWithHome(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		const KnownHome *known)
+{
+	void *result;
+
+	aaPerfBegin(aarray);
+	aaMigrateStep(aarray);
+	result = lookupInTable(aarray, key, keylen, known);
+	aaPerfEnd(aarray, AA_PERF_SEARCH);
+	aaTraceRecord(aarray, AA_TRACE_LOOKUP, key, keylen, result != NULL);
+
+	return result;
+}
+
+void *aaLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	return lookupWithHome(aarray, key, keylen, NULL);
+}
+
+/**
+ * Inserts and lookups for callers that already have the aaMixHash64()
+ * of the key, as the hash join does, so that a table hashing by "mix"
+ * need not hash it again; any other table hashes the key as usual
+ */
+int aaInsertHashed(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		void *value, uint64_t hash)
+{
+	KnownHome known;
+
+	mixHome(aarray, hash, &known);
+	return insertWithHome(aarray, key, keylen, value, &known);
+}
+
+void *aaLookupHashed(AssociativeArray *aarray, AAKeyType key, size_t keylen, uint64_t hash)
+{
+	KnownHome known;
+
+	mixHome(aarray, hash, &known);
+	return lookupWithHome(aarray, key, keylen, &known);
+}
+
+/** start the home slot of a key with the given aaMixHash64() on its way into the cache */
+void aaPrefetchHashed(AssociativeArray *aarray, uint64_t hash)
+{
+	KnownHome known;
+
+	mixHome(aarray, hash, &known);
+	if (known.tableSize != 0) {
+		prefetchSlot(aarray, known.slot);
+	}
+}
+
+void *aaDelete(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	void *result;
+
+	aaPerfBegin(aarray);
+	aaMigrateStep(aarray);
+	result = deleteFromTable(aarray, key, keylen);
+	aaPerfEnd(aarray, AA_PERF_DELETE);
+	aaTraceRecord(aarray, AA_TRACE_DELETE, key, keylen, result != NULL);
+	if (result != NULL) {
+		aaLogDelete(aarray, key, keylen);
+	}
+
+	return result;
 }
 
 /**
@@ -335,30 +1172,45 @@ void *aaDelete(AssociativeArray *aarray, AAKeyType key, size_t keylen)
 void aaPrintContents(FILE *fp, AssociativeArray *aarray, char * tag)
 {
 	char keybuffer[128];
-	int i;
+	KeyDataPair entry;
+	int i, validity, hasKey;
+
+	if (aarray->layout == AA_LAYOUT_DISK) {
+		aaPrintDiskContents(fp, aarray, tag);
+		return;
+	}
+	if (aarray->layout == AA_LAYOUT_SHARED) {
+		aaPrintSharedContents(fp, aarray, tag);
+		return;
+	}
 
 	fprintf(fp, "%sDumping aarray of %d entries:\n", tag, aarray->size);
 	for (i = 0; i < aarray->size; i++) {
 		fprintf(fp, "%s  ", tag);
-		if (aarray->table[i].validity == HASH_USED) {
-			printableKey(keybuffer, 128,
-					aarray->table[i].key,
-					aarray->table[i].keylen);
+		validity = aaSlotValidity(aarray, i);
+		hasKey = aaSlotRead(aarray, i, &entry);
+		if (validity == HASH_USED) {
+			printableKey(keybuffer, 128, entry.key, entry.keylen);
 			fprintf(fp, "%d : in use : '%s'\n", i, keybuffer);
 		} else {
-			if (aarray->table[i].validity == HASH_EMPTY) {
+			if (validity == HASH_EMPTY) {
 				fprintf(fp, "%d : empty (NULL)\n", i);
-			} else if ( aarray->table[i].validity == HASH_DELETED) {
-				printableKey(keybuffer, 128,
-						aarray->table[i].key,
-						aarray->table[i].keylen);
+			} else if (validity == HASH_DELETED && ! hasKey) {
+				fprintf(fp, "%d : empty (deleted)\n", i);
+			} else if (validity == HASH_DELETED) {
+				printableKey(keybuffer, 128, entry.key, entry.keylen);
 				fprintf(fp, "%d : empty (deleted - was '%s')\n", i, keybuffer);
 			} else {
-				fprintf(fp, "%d : invalid validity state %d\n", i,
-						aarray->table[i].validity);
+				fprintf(fp, "%d : invalid validity state %d\n", i, validity);
 			}
 		}
 	}
+
+	if (aarray->retiring != NULL) {
+		fprintf(fp, "%sOld generation, migrated up to slot %d:\n",
+				tag, aarray->migrateCursor);
+		aaPrintContents(fp, aarray->retiring, tag);
+	}
 }
 
 
@@ -367,14 +1219,49 @@ void aaPrintContents(FILE *fp, AssociativeArray *aarray, char * tag)
  */
 void aaPrintSummary(FILE *fp, AssociativeArray *aarray)
 {
+	int nEntries = aarray->nEntries;
+
+	if (aarray->retiring != NULL) {
+		nEntries += aarray->retiring->nEntries;
+	}
+
 	fprintf(fp, "Associative array contains %d entries in a table of %d size\n",
-			aarray->nEntries, aarray->size);
+			nEntries, aarray->size);
+	if (aarray->nResizes > 0) {
+		fprintf(fp, "Table has been resized %d time%s\n",
+				aarray->nResizes, (aarray->nResizes == 1) ? "" : "s");
+	}
+	if (aarray->retiring != NULL) {
+		fprintf(fp, "Resize in progress: %d of %d slots of the old table migrated\n",
+				aarray->migrateCursor, aarray->retiring->size);
+	}
+	if (aarray->layout == AA_LAYOUT_COMPACT) {
+		fprintf(fp, "Compact layout: %d entry records in use of %d allocated\n",
+				aarray->nEntriesUsed, aarray->nEntriesAllocated);
+	}
+	if (aarray->layout == AA_LAYOUT_PACKED) {
+		fprintf(fp, "Packed layout: %lu byte slots\n",
+				(unsigned long) aarray->entryStride);
+	}
+	if (aarray->valueWidth > 0 && aarray->layout != AA_LAYOUT_DISK) {
+		fprintf(fp, "Values stored inline: %lu bytes each, %lu byte records\n",
+				(unsigned long) aarray->valueWidth, (unsigned long) aarray->entryStride);
+	}
 	fprintf(fp, "Strategies used: '%s' hash, '%s' secondary hash and '%s' probing\n",
 			aarray->hashNamePrimary, aarray->hashNameSecondary, aarray->probeName);
 	fprintf(fp, "Costs accrued due to probing:\n");
-	fprintf(fp, "  Insertion : %d\n", aarray->insertCost);
-	fprintf(fp, "  Search    : %d\n", aarray->searchCost);
-	fprintf(fp, "  Deletion  : %d\n", aarray->deleteCost);
+	fprintf(fp, "  Insertion : %lu\n", aarray->insertStats.totalProbes);
+	fprintf(fp, "  Search    : %lu\n", aarray->searchStats.totalProbes);
+	fprintf(fp, "  Deletion  : %lu\n", aarray->deleteStats.totalProbes);
+	aaPrintFrozenSummary(fp, aarray);
+	aaPrintDiskSummary(fp, aarray);
+	aaPrintSharedSummary(fp, aarray);
+	aaPrintCacheSummary(fp, aarray);
+	aaPrintKeyStoreSummary(fp, aarray);
+	aaPrintLogSummary(fp, aarray);
+	aaPrintSlotMemorySummary(fp, aarray);
+	aaPrintFilterSummary(fp, aarray);
+	aaPrintPerfCounters(fp, aarray);
 }
 
 //Custom functions created by Lukas
@@ -392,14 +1279,40 @@ int deleteKey(AAKeyType key)
  */
 static int deleteKeys(AssociativeArray *aarray)
 {
+	KeyDataPair *entry;
 	int i;
 
+	//the compact layout frees its keys as they are deleted, so only the live ones remain
+	if (aarray->layout == AA_LAYOUT_COMPACT)
+	{
+		for (i = 0; i < aarray->nEntriesUsed; i++)
+		{
+			entry = aaRecordAt(aarray, aarray->entries, i);
+			if (entry->validity == HASH_USED)
+			{
+				deleteKey(entry->key);
+			}
+		}
+		return 1;
+	}
+
+	//packed keys carry their length in front, and tombstones may keep theirs
+	if (aarray->layout == AA_LAYOUT_PACKED)
+	{
+		for (i = 0; i < aarray->size; i++)
+		{
+			aaPackedFreeKey(aaPackedKey(aaPackedAt(aarray, i)->keyWord));
+		}
+		return 1;
+	}
+
 	for (i = 0; i < aarray->size; i++)
 	{
 		//this allows both used and tombstone keys to be dealloc'd
-		if (aarray->table[i].validity != HASH_EMPTY)
+		entry = aaRecordAt(aarray, aarray->table, i);
+		if (entry->validity != HASH_EMPTY)
 		{
-			deleteKey(aarray->table[i].key);			
+			deleteKey(entry->key);			
 		}
 	}
 	return 1;
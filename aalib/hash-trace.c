@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashtools.h"
+
+/**
+ * Operation trace capture.
+ *
+ * While a trace is active every insert, lookup, delete and
+ * accumulate is appended to a compact binary file, which can then be replayed
+ * against other table configurations (see replay.c).
+ *
+ * The file starts with the 8 byte magic string "AATRACE1", followed
+ * by one record per operation:
+ *
+ *   1 byte   operation code (AA_TRACE_INSERT etc.) in the low 7 bits,
+ *            with the top bit set if the operation succeeded
+ *   varint   nanoseconds since the previous record
+ *   varint   key length
+ *   bytes    the key itself
+ *
+ * and, for AA_TRACE_ACCUMULATE only:
+ *
+ *   1 byte   the aggregate (AA_AGGREGATE_SUM etc.)
+ *   varint   the amount, zigzag encoded so small negatives stay short
+ *
+ * Varints are little-endian base 128, so small values take a single
+ * byte and a typical record is only a few bytes more than its key.
+ */
+
+#define	TRACE_MAGIC			"AATRACE1"
+#define	TRACE_MAGIC_LEN		8
+#define	TRACE_SUCCESS_BIT	0x80
+#define	TRACE_BUFFER_SIZE	(1024 * 1024)
+
+struct AATraceWriter {
+	FILE *fp;
+	char *buffer;
+	unsigned long long lastTime;
+	unsigned long nRecords;
+};
+
+struct AATraceReader {
+	FILE *fp;
+	unsigned char *key;
+	size_t keyBufferLen;
+	unsigned long long time;
+};
+
+
+static unsigned long long
+nanoTime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+writeVarint(FILE *fp, unsigned long long value)
+{
+	while (value >= 0x80) {
+		putc((int) ((value & 0x7f) | 0x80), fp);
+		value >>= 7;
+	}
+	putc((int) value, fp);
+}
+
+static int
+readVarint(FILE *fp, unsigned long long *value)
+{
+	unsigned long long result = 0;
+	int shift = 0, c;
+
+	do {
+		if ((c = getc(fp)) == EOF || shift > 63)
+			return -1;
+		result |= (unsigned long long) (c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	*value = result;
+	return 1;
+}
+
+/**
+ * Start recording all operations on the array into the named file,
+ * replacing any trace already being recorded
+ *
+ *  @return 1 on success, -1 if the file cannot be created
+ */
+int
+aaStartTrace(AssociativeArray *aarray, const char *filename)
+{
+	AATraceWriter *trace;
+
+	aaStopTrace(aarray);
+
+	trace = (AATraceWriter *) malloc(sizeof(AATraceWriter));
+	if (trace == NULL)
+		return -1;
+
+	trace->fp = fopen(filename, "wb");
+	if (trace->fp == NULL) {
+		free(trace);
+		return -1;
+	}
+
+	/** records are small, so give stdio a large buffer to batch them */
+	trace->buffer = (char *) malloc(TRACE_BUFFER_SIZE);
+	if (trace->buffer != NULL)
+		setvbuf(trace->fp, trace->buffer, _IOFBF, TRACE_BUFFER_SIZE);
+
+	fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, trace->fp);
+	trace->lastTime = nanoTime();
+	trace->nRecords = 0;
+
+	aarray->trace = trace;
+	return 1;
+}
+
+/**
+ * Stop recording, flushing and closing the trace file
+ *
+ *  @return the number of records written, or 0 if no trace was active
+ */
+unsigned long
+aaStopTrace(AssociativeArray *aarray)
+{
+	AATraceWriter *trace = aarray->trace;
+	unsigned long nRecords;
+
+	if (trace == NULL)
+		return 0;
+
+	nRecords = trace->nRecords;
+	fclose(trace->fp);
+	if (trace->buffer != NULL)
+		free(trace->buffer);
+	free(trace);
+	aarray->trace = NULL;
+
+	return nRecords;
+}
+
+/** write the fields every record has */
+static void
+writeRecord(AATraceWriter *trace, int operation,
+		AAKeyType key, size_t keylen, int succeeded)
+{
+	unsigned long long time;
+
+	time = nanoTime();
+	putc(operation | (succeeded ? TRACE_SUCCESS_BIT : 0), trace->fp);
+	writeVarint(trace->fp, time - trace->lastTime);
+	writeVarint(trace->fp, keylen);
+	fwrite(key, 1, keylen, trace->fp);
+
+	trace->lastTime = time;
+	trace->nRecords++;
+}
+
+/** append one operation to the trace, if one is being recorded */
+void
+aaTraceRecord(AssociativeArray *aarray, int operation,
+		AAKeyType key, size_t keylen, int succeeded)
+{
+	if (aarray->trace == NULL)
+		return;
+
+	writeRecord(aarray->trace, operation, key, keylen, succeeded);
+}
+
+/** append an accumulate, with the amount folded in, to the trace */
+void
+aaTraceAccumulate(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		int aggregate, int64_t amount, int succeeded)
+{
+	AATraceWriter *trace = aarray->trace;
+
+	if (trace == NULL)
+		return;
+
+	writeRecord(trace, AA_TRACE_ACCUMULATE, key, keylen, succeeded);
+	putc(aggregate, trace->fp);
+	writeVarint(trace->fp, ((uint64_t) amount << 1) ^ (uint64_t) (amount >> 63));
+}
+
+
+/**
+ * Open a trace file for reading
+ *
+ *  @return the reader, or NULL if the file cannot be opened or
+ *			is not a trace
+ */
+AATraceReader *
+aaTraceOpen(const char *filename)
+{
+	AATraceReader *reader;
+	char magic[TRACE_MAGIC_LEN];
+
+	reader = (AATraceReader *) calloc(1, sizeof(AATraceReader));
+	if (reader == NULL)
+		return NULL;
+
+	reader->fp = fopen(filename, "rb");
+	if (reader->fp == NULL) {
+		free(reader);
+		return NULL;
+	}
+
+	if (fread(magic, 1, TRACE_MAGIC_LEN, reader->fp) != TRACE_MAGIC_LEN
+			|| memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+		fclose(reader->fp);
+		free(reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+/**
+ * Read the next record from the trace.  The key in the record
+ * belongs to the reader, and is only valid until the next call.
+ *
+ *  @return 1 if a record was read, 0 at the end of the trace,
+ *			or -1 if the trace is corrupt
+ */
+int
+aaTraceNext(AATraceReader *reader, AATraceRecord *record)
+{
+	unsigned long long delta, keylen, amount;
+	int c, aggregate;
+
+	if ((c = getc(reader->fp)) == EOF)
+		return 0;
+
+	if (readVarint(reader->fp, &delta) < 0
+			|| readVarint(reader->fp, &keylen) < 0)
+		return -1;
+
+	if (keylen > reader->keyBufferLen) {
+		free(reader->key);
+		reader->keyBufferLen = keylen * 2;
+		reader->key = (unsigned char *) malloc(reader->keyBufferLen);
+		if (reader->key == NULL) {
+			reader->keyBufferLen = 0;
+			return -1;
+		}
+	}
+	if (keylen > 0 && fread(reader->key, 1, keylen, reader->fp) != keylen)
+		return -1;
+
+	reader->time += delta;
+
+	record->operation = c & ~TRACE_SUCCESS_BIT;
+	record->aggregate = 0;
+	record->amount = 0;
+	if (record->operation == AA_TRACE_ACCUMULATE) {
+		if ((aggregate = getc(reader->fp)) == EOF
+				|| readVarint(reader->fp, &amount) < 0)
+			return -1;
+		record->aggregate = aggregate;
+		record->amount = (int64_t) ((amount >> 1) ^ (~(amount & 1) + 1));
+	}
+	record->succeeded = (c & TRACE_SUCCESS_BIT) ? 1 : 0;
+	record->timestamp = reader->time;
+	record->key = reader->key;
+	record->keylen = (size_t) keylen;
+
+	return 1;
+}
+
+void
+aaTraceClose(AATraceReader *reader)
+{
+	fclose(reader->fp);
+	free(reader->key);
+	free(reader);
+}
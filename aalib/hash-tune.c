@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * Workload auto-tuning.
+ *
+ * Given a sample of the keys that are going to be loaded, try every
+ * combination of hash, probing strategy and secondary hash at a few
+ * candidate load factors and pick the one with the lowest probe cost.
+ *
+ * Building full sized trial tables would be too expensive, so each
+ * trial uses a table scaled down to hold just the sample at the same
+ * load factor.  To keep the shape of the real hash distribution, the
+ * home slot of each key is computed against the full table size and
+ * then mapped proportionally into the trial table -- so a hash that
+ * can only reach a small part of a large table (such as hashing by
+ * length) crowds the trial table in the same way.
+ */
+
+static char *sHashNames[] = { "sum", "len", "pri", "mix", NULL };
+static char *sProbeNames[] = { "lin", "qua", "dou", NULL };
+
+/** candidate load factors, fullest first */
+static double sLoadFactors[] = { 0.85, 0.7, 0.5, 0 };
+
+/**
+ * A larger table is only chosen if it at least reduces the cost
+ * by this factor compared with a smaller one
+ */
+#define	AA_TUNE_TOLERANCE	1.25
+
+/** the cost charged for a key which cannot be placed at all */
+#define	AA_TUNE_FAILURE_COST(trialSize)	((double) (trialSize))
+
+
+/**
+ * Run one trial, returning the mean number of probes per key
+ * over inserting the sample and then looking it up again
+ */
+static double
+runTrial(char *hash, char *probe, char *secondary,
+		int fullSize, AAKeyType *keys, size_t *keylens, int nKeys,
+		double loadFactor)
+{
+	AssociativeArray *trial;
+	HashIndex home, index;
+	double totalCost = 0;
+	int i, cost, trialSize;
+
+	trialSize = getLargerPrime((int) (nKeys / loadFactor) + 1);
+	if (trialSize > fullSize)
+		trialSize = fullSize;
+
+	trial = aaCreateAssociativeArray(trialSize, probe, hash, secondary);
+	if (trial == NULL)
+		return -1;
+
+	for (i = 0; i < nKeys; i++) {
+		home = (*(trial->hashAlgorithmPrimary))(keys[i], keylens[i], fullSize);
+		home = (HashIndex) (((double) home * trialSize) / fullSize);
+
+		cost = 0;
+		index = (*(trial->hashProbe))(trial, keys[i], keylens[i], home, 1, &cost);
+		if (index == (HashIndex) -1 || trial->table[index].validity == HASH_USED) {
+			/** duplicates in the sample are not the strategy's fault */
+			if (index == (HashIndex) -1)
+				totalCost += AA_TUNE_FAILURE_COST(trialSize);
+			continue;
+		}
+		totalCost += cost;
+
+		/** the trial borrows the sample keys rather than copying them */
+		trial->table[index].key = keys[i];
+		trial->table[index].keylen = keylens[i];
+		trial->table[index].validity = HASH_USED;
+		trial->nEntries++;
+
+		cost = 0;
+		(void) (*(trial->hashProbe))(trial, keys[i], keylens[i], home, 0, &cost);
+		totalCost += cost;
+	}
+
+	/** give the keys back before the table is cleaned up */
+	for (i = 0; i < trial->size; i++) {
+		trial->table[i].key = NULL;
+		trial->table[i].validity = HASH_EMPTY;
+	}
+	aaDeleteAssociativeArray(trial);
+
+	return totalCost / (2.0 * nKeys);
+}
+
+/**
+ * Create an associative array tuned for the given sample of keys
+ *
+ *  @param  expectedEntries  how many keys the table will hold
+ *  @param  keys, keylens    a sample of the keys to be stored
+ *  @param  nKeys            the number of keys in the sample
+ *  @param  options          creation options for the final array,
+ *				or NULL for the defaults
+ *  @param  report           if not NULL, the cost of each candidate
+ *				is printed here
+ *  @return the new array, or NULL if none could be created
+ */
+AssociativeArray *
+aaCreateTuned(size_t expectedEntries,
+		AAKeyType *keys, size_t *keylens, int nKeys,
+		const AAOptions *options, FILE *report)
+{
+	AAOptions defaults;
+	char *bestHash = "sum", *bestProbe = "lin", *bestSecondary = "len";
+	double bestCost = -1, cost, comboBest;
+	int bestSize = 0, comboSize, fullSize;
+	int h, p, h2, lf;
+
+	if (options == NULL) {
+		aaInitOptions(&defaults);
+		options = &defaults;
+	}
+
+	if (expectedEntries < 1)
+		expectedEntries = 1;
+
+	if (nKeys < 1) {
+		return aaCreateConfiguredArray(
+				(size_t) (expectedEntries / sLoadFactors[1]) + 1,
+				bestProbe, bestHash, bestSecondary, options);
+	}
+
+	if (report != NULL) {
+		fprintf(report, "Tuning on %d sample keys for %lu expected entries:\n",
+				nKeys, (unsigned long) expectedEntries);
+	}
+
+	for (h = 0; sHashNames[h] != NULL; h++) {
+		for (p = 0; sProbeNames[p] != NULL; p++) {
+			for (h2 = 0; sHashNames[h2] != NULL; h2++) {
+
+				/** the secondary hash only matters for double hashing */
+				if (strcmp(sProbeNames[p], "dou") != 0 && h2 > 0)
+					break;
+
+				/**
+				 * walk from the smallest table to the largest, only
+				 * moving up when it is worth the extra memory
+				 */
+				comboBest = -1;
+				comboSize = 0;
+				for (lf = 0; sLoadFactors[lf] > 0; lf++) {
+					fullSize = getLargerPrime(
+							(int) (expectedEntries / sLoadFactors[lf]) + 1);
+					if (fullSize < 1)
+						continue;
+
+					cost = runTrial(sHashNames[h], sProbeNames[p], sHashNames[h2],
+							fullSize, keys, keylens, nKeys, sLoadFactors[lf]);
+					if (cost < 0)
+						continue;
+
+					if (report != NULL) {
+						fprintf(report, "  %s/%s/%s size %9d : %10.3f probes\n",
+								sHashNames[h], sProbeNames[p], sHashNames[h2],
+								fullSize, cost);
+					}
+
+					if (comboBest < 0 || cost * AA_TUNE_TOLERANCE < comboBest) {
+						comboBest = cost;
+						comboSize = fullSize;
+					}
+				}
+
+				if (comboBest >= 0 && (bestCost < 0 || comboBest < bestCost)) {
+					bestCost = comboBest;
+					bestSize = comboSize;
+					bestHash = sHashNames[h];
+					bestProbe = sProbeNames[p];
+					bestSecondary = sHashNames[h2];
+				}
+			}
+		}
+	}
+
+	if (bestSize < 1) {
+		fprintf(stderr, "Cannot tune a table for %lu entries\n",
+				(unsigned long) expectedEntries);
+		return NULL;
+	}
+
+	if (report != NULL) {
+		fprintf(report, "Chose '%s' hash, '%s' secondary hash and '%s' probing"
+				" with size %d (%.3f probes)\n",
+				bestHash, bestSecondary, bestProbe, bestSize, bestCost);
+	}
+
+	return aaCreateConfiguredArray(bestSize, bestProbe, bestHash, bestSecondary, options);
+}
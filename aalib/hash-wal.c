@@ -0,0 +1,534 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hashtools.h"
+
+/**
+ * Write-ahead logging of updates, with group commit.
+ *
+ * The file starts with the 8 byte magic string "AAWALOG1", followed by
+ * one record per update:
+ *
+ *   4 bytes  length of the body, little-endian
+ *   4 bytes  check of the body (the low half of its aaMixHash64())
+ *   body:
+ *     1 byte   AA_LOG_INSERT or AA_LOG_DELETE
+ *     varint   key length
+ *     bytes    the key itself
+ *     varint   value length (inserts only)
+ *     bytes    the value (inserts only)
+ *
+ * Records are built up in memory, and a group of them goes to the file
+ * with a single write(2) and a single fdatasync(2), which is what makes
+ * an update durable.  That costs much the same for one record as for a
+ * thousand, so the throughput of durable updates is set by how many
+ * each group holds rather than by the disk's sync latency.
+ *
+ * A crash can leave the last group only partly written.  Its records
+ * were never reported durable, so replay stops at the first record
+ * that is short or fails its check, and cuts the file there so that
+ * the next records logged follow on from the last good one.
+ */
+
+#define	LOG_MAGIC			"AAWALOG1"
+#define	LOG_MAGIC_LEN		8
+#define	LOG_HEADER_LEN		8
+#define	LOG_BUFFER_LIMIT	(1024 * 1024)
+#define	LOG_MAX_RECORD		(1024 * 1024 * 1024)
+#define	MAX_VARINT_BYTES	10
+
+#define	AA_LOG_INSERT		1
+#define	AA_LOG_DELETE		2
+
+struct AAWriteLog {
+	int fd;
+	char *filename;
+	AALogOptions options;
+	unsigned char *buffer;
+	size_t bufferLen;
+	size_t bufferAllocated;
+	int nWaiting;
+	unsigned long long firstWaiting;
+	unsigned long nRecords;
+	unsigned long nCommits;
+	int failed;
+};
+
+
+static unsigned long long
+microTime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static size_t
+putVarint(unsigned char *out, size_t value)
+{
+	size_t n = 0;
+
+	while (value >= 0x80) {
+		out[n++] = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	out[n++] = (unsigned char) value;
+	return n;
+}
+
+/** read a varint from within the given bytes, returning its length or 0 */
+static size_t
+getVarint(const unsigned char *in, size_t available, size_t *value)
+{
+	size_t n = 0;
+	int shift = 0;
+
+	*value = 0;
+	do {
+		if (n >= available || shift > 63)
+			return 0;
+		*value |= (size_t) (in[n] & 0x7f) << shift;
+		shift += 7;
+	} while (in[n++] & 0x80);
+	return n;
+}
+
+static void
+putWord(unsigned char *out, uint32_t word)
+{
+	out[0] = (unsigned char) word;
+	out[1] = (unsigned char) (word >> 8);
+	out[2] = (unsigned char) (word >> 16);
+	out[3] = (unsigned char) (word >> 24);
+}
+
+static uint32_t
+getWord(const unsigned char *in)
+{
+	return (uint32_t) in[0] | ((uint32_t) in[1] << 8)
+			| ((uint32_t) in[2] << 16) | ((uint32_t) in[3] << 24);
+}
+
+static uint32_t
+checkBody(const unsigned char *body, size_t length)
+{
+	return (uint32_t) aaMixHash64((AAKeyType) body, length);
+}
+
+void
+aaInitLogOptions(AALogOptions *options)
+{
+	options->groupCommitOps = AA_DEFAULT_GROUP_COMMIT_OPS;
+	options->groupCommitMicros = AA_DEFAULT_GROUP_COMMIT_MICROS;
+	options->valueBytes = NULL;
+	options->makeValue = NULL;
+	options->freeValue = NULL;
+	options->userdata = NULL;
+}
+
+/** write out and sync the waiting group of records */
+static int
+commitGroup(AAWriteLog *wal)
+{
+	size_t written = 0;
+	ssize_t n;
+
+	if (wal->failed)
+		return -1;
+	if (wal->nWaiting == 0)
+		return 0;
+
+	while (written < wal->bufferLen) {
+		n = write(wal->fd, wal->buffer + written, wal->bufferLen - written);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		written += n;
+	}
+	if (written < wal->bufferLen || fdatasync(wal->fd) < 0) {
+		fprintf(stderr, "Cannot write log '%s' : %s\n", wal->filename, strerror(errno));
+		wal->failed = 1;
+		return -1;
+	}
+
+	wal->bufferLen = 0;
+	wal->nWaiting = 0;
+	wal->nCommits++;
+	return 1;
+}
+
+/**
+ * Start logging the updates to the array onto the end of the named
+ * file, creating it if need be
+ *
+ *  @return 1 on success, -1 if the file cannot be used (or the
+ *			values cannot be logged)
+ */
+int
+aaStartLog(AssociativeArray *aarray, const char *filename, const AALogOptions *options)
+{
+	char magic[LOG_MAGIC_LEN];
+	AAWriteLog *wal;
+	struct stat info;
+	ssize_t n;
+
+	aaStopLog(aarray);
+
+	if (aarray->layout == AA_LAYOUT_SHARED
+			|| (aarray->valueWidth == 0 && options->valueBytes == NULL)) {
+		fprintf(stderr, "Cannot log updates to this table without a way to save its values\n");
+		return -1;
+	}
+
+	wal = (AAWriteLog *) calloc(1, sizeof(AAWriteLog));
+	if (wal == NULL)
+		return -1;
+	wal->options = *options;
+	if (wal->options.groupCommitOps < 1)
+		wal->options.groupCommitOps = 1;
+	wal->filename = strdup(filename);
+	wal->fd = open(filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (wal->filename == NULL || wal->fd < 0 || fstat(wal->fd, &info) < 0) {
+		fprintf(stderr, "Cannot open log '%s' : %s\n", filename, strerror(errno));
+		if (wal->fd >= 0)
+			close(wal->fd);
+		free(wal->filename);
+		free(wal);
+		return -1;
+	}
+
+	/** a new log gets its magic string, and an old one must have it */
+	if (info.st_size == 0) {
+		n = write(wal->fd, LOG_MAGIC, LOG_MAGIC_LEN);
+		if (n != LOG_MAGIC_LEN || fdatasync(wal->fd) < 0)
+			info.st_size = -1;
+	} else if (pread(wal->fd, magic, LOG_MAGIC_LEN, 0) != LOG_MAGIC_LEN
+			|| memcmp(magic, LOG_MAGIC, LOG_MAGIC_LEN) != 0) {
+		info.st_size = -1;
+	}
+	if (info.st_size < 0) {
+		fprintf(stderr, "Cannot use '%s' as a log\n", filename);
+		close(wal->fd);
+		free(wal->filename);
+		free(wal);
+		return -1;
+	}
+
+	aarray->wal = wal;
+	return 1;
+}
+
+/**
+ * Make every update logged so far durable
+ *
+ *  @return 1 if a group was committed, 0 if there was nothing to
+ *			commit (or no log), or -1 if the log cannot be written
+ */
+int
+aaSyncLog(AssociativeArray *aarray)
+{
+	if (aarray->wal == NULL)
+		return 0;
+	return commitGroup(aarray->wal);
+}
+
+/**
+ * Empty the log, as everything in it is now in a snapshot of the
+ * table; records still waiting for their group are dropped with it
+ *
+ *  @return 1 on success, or -1 if the log cannot be cut
+ */
+int
+aaTruncateLog(AssociativeArray *aarray)
+{
+	AAWriteLog *wal = aarray->wal;
+
+	if (wal == NULL)
+		return -1;
+
+	wal->bufferLen = 0;
+	wal->nWaiting = 0;
+	if (ftruncate(wal->fd, LOG_MAGIC_LEN) < 0 || fdatasync(wal->fd) < 0) {
+		fprintf(stderr, "Cannot truncate log '%s' : %s\n", wal->filename, strerror(errno));
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * Commit anything waiting, and stop logging
+ *
+ *  @return the number of records logged, or 0 if no log was active
+ */
+unsigned long
+aaStopLog(AssociativeArray *aarray)
+{
+	AAWriteLog *wal = aarray->wal;
+	unsigned long nRecords;
+
+	if (wal == NULL)
+		return 0;
+
+	commitGroup(wal);
+	nRecords = wal->nRecords;
+	close(wal->fd);
+	free(wal->buffer);
+	free(wal->filename);
+	free(wal);
+	aarray->wal = NULL;
+
+	return nRecords;
+}
+
+/** add a record for an update that has been made, committing the group if it is due */
+static void
+logRecord(AssociativeArray *aarray, int operation, AAKeyType key, size_t keylen,
+		const void *value, size_t valueLen)
+{
+	AAWriteLog *wal = aarray->wal;
+	size_t needed, bodyLen, size;
+	unsigned char *record, *grown;
+	unsigned long long now;
+
+	if (wal->failed)
+		return;
+
+	needed = LOG_HEADER_LEN + 1 + 2 * MAX_VARINT_BYTES + keylen + valueLen;
+	if (wal->bufferLen + needed > wal->bufferAllocated) {
+		size = (wal->bufferAllocated > 0) ? wal->bufferAllocated * 2 : 64 * 1024;
+		while (size < wal->bufferLen + needed)
+			size *= 2;
+		grown = (unsigned char *) realloc(wal->buffer, size);
+		if (grown == NULL) {
+			fprintf(stderr, "Cannot allocate log buffer for '%s'\n", wal->filename);
+			wal->failed = 1;
+			return;
+		}
+		wal->buffer = grown;
+		wal->bufferAllocated = size;
+	}
+
+	record = wal->buffer + wal->bufferLen;
+	bodyLen = LOG_HEADER_LEN;
+	record[bodyLen++] = (unsigned char) operation;
+	bodyLen += putVarint(record + bodyLen, keylen);
+	memcpy(record + bodyLen, key, keylen);
+	bodyLen += keylen;
+	if (operation == AA_LOG_INSERT) {
+		bodyLen += putVarint(record + bodyLen, valueLen);
+		if (valueLen > 0)
+			memcpy(record + bodyLen, value, valueLen);
+		bodyLen += valueLen;
+	}
+	bodyLen -= LOG_HEADER_LEN;
+	putWord(record, (uint32_t) bodyLen);
+	putWord(record + 4, checkBody(record + LOG_HEADER_LEN, bodyLen));
+
+	wal->bufferLen += LOG_HEADER_LEN + bodyLen;
+	wal->nRecords++;
+
+	now = microTime();
+	if (wal->nWaiting++ == 0)
+		wal->firstWaiting = now;
+
+	if (wal->nWaiting >= wal->options.groupCommitOps
+			|| wal->bufferLen >= LOG_BUFFER_LIMIT
+			|| (long) (now - wal->firstWaiting) >= wal->options.groupCommitMicros)
+		commitGroup(wal);
+}
+
+/** log an insert (or the new value of an accumulator), if a log is active */
+void
+aaLogInsert(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value)
+{
+	static const unsigned char zeros[64];
+	AAWriteLog *wal = aarray->wal;
+	const void *bytes = value;
+	size_t nBytes;
+
+	if (wal == NULL)
+		return;
+
+	if (aarray->valueWidth > 0) {
+		nBytes = aarray->valueWidth;
+		if (value == NULL) {
+			/** a NULL value is stored as zeros, which need not be logged */
+			bytes = zeros;
+			nBytes = 0;
+		}
+	} else {
+		nBytes = (*wal->options.valueBytes)(value, &bytes, wal->options.userdata);
+	}
+	logRecord(aarray, AA_LOG_INSERT, key, keylen, bytes, nBytes);
+}
+
+void
+aaLogDelete(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	if (aarray->wal == NULL)
+		return;
+	logRecord(aarray, AA_LOG_DELETE, key, keylen, NULL, 0);
+}
+
+/** take a key out of the array for a replayed record, freeing its value */
+static void
+replaceKey(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		const AALogOptions *options)
+{
+	void *old = aaDelete(aarray, key, keylen);
+
+	if (old != NULL && aarray->valueWidth == 0 && options->freeValue != NULL)
+		(*options->freeValue)(old, options->userdata);
+}
+
+/** apply one record that has passed its check */
+static int
+applyRecord(AssociativeArray *aarray, const unsigned char *body, size_t bodyLen,
+		const AALogOptions *options, unsigned char *valuebuffer)
+{
+	size_t n = 1, keylen, valueLen, used;
+	const unsigned char *key, *value;
+	void *stored;
+
+	used = getVarint(body + n, bodyLen - n, &keylen);
+	if (used == 0 || keylen > bodyLen - n - used)
+		return -1;
+	n += used;
+	key = body + n;
+	n += keylen;
+
+	replaceKey(aarray, (AAKeyType) key, keylen, options);
+	if (body[0] == AA_LOG_DELETE)
+		return 1;
+	if (body[0] != AA_LOG_INSERT)
+		return -1;
+
+	used = getVarint(body + n, bodyLen - n, &valueLen);
+	if (used == 0 || valueLen > bodyLen - n - used)
+		return -1;
+	value = body + n + used;
+
+	if (aarray->valueWidth > 0) {
+		memset(valuebuffer, 0, aarray->valueWidth);
+		memcpy(valuebuffer, value, (valueLen < aarray->valueWidth) ? valueLen : aarray->valueWidth);
+		stored = valuebuffer;
+	} else {
+		stored = (*options->makeValue)(value, valueLen, options->userdata);
+		if (stored == NULL)
+			return -1;
+	}
+
+	if (aaInsert(aarray, (AAKeyType) key, keylen, stored) < 0) {
+		if (aarray->valueWidth == 0 && options->freeValue != NULL)
+			(*options->freeValue)(stored, options->userdata);
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * Apply the updates in the named log to the array, which should hold
+ * the snapshot the log was started from.  A torn or corrupt tail is
+ * cut off the file.  The array must not be logging itself.
+ *
+ *  @return the number of records applied, 0 if there is no log, or
+ *			-1 if the log cannot be read or a record cannot be applied
+ */
+long
+aaReplayLog(AssociativeArray *aarray, const char *filename, const AALogOptions *options)
+{
+	unsigned char header[LOG_HEADER_LEN], *body = NULL, *valuebuffer = NULL, *grown;
+	char magic[LOG_MAGIC_LEN];
+	size_t bodyLen, bodyAllocated = 0;
+	long nApplied = 0;
+	off_t good;
+	struct stat info;
+	FILE *fp;
+
+	if (aarray->wal != NULL
+			|| (aarray->valueWidth == 0 && options->makeValue == NULL))
+		return -1;
+
+	fp = fopen(filename, "r+b");
+	if (fp == NULL)
+		return (errno == ENOENT) ? 0 : -1;
+	if (fstat(fileno(fp), &info) < 0 || info.st_size == 0) {
+		fclose(fp);
+		return (info.st_size == 0) ? 0 : -1;
+	}
+	if (fread(magic, 1, LOG_MAGIC_LEN, fp) != LOG_MAGIC_LEN
+			|| memcmp(magic, LOG_MAGIC, LOG_MAGIC_LEN) != 0) {
+		fprintf(stderr, "'%s' is not a log\n", filename);
+		fclose(fp);
+		return -1;
+	}
+	if (aarray->valueWidth > 0) {
+		valuebuffer = (unsigned char *) malloc(aarray->valueWidth);
+		if (valuebuffer == NULL) {
+			fclose(fp);
+			return -1;
+		}
+	}
+
+	good = LOG_MAGIC_LEN;
+	while (fread(header, 1, LOG_HEADER_LEN, fp) == LOG_HEADER_LEN) {
+		bodyLen = getWord(header);
+		if (bodyLen < 1 || bodyLen > LOG_MAX_RECORD)
+			break;
+		if (bodyLen > bodyAllocated) {
+			grown = (unsigned char *) realloc(body, bodyLen);
+			if (grown == NULL) {
+				nApplied = -1;
+				break;
+			}
+			body = grown;
+			bodyAllocated = bodyLen;
+		}
+		if (fread(body, 1, bodyLen, fp) != bodyLen
+				|| checkBody(body, bodyLen) != getWord(header + 4))
+			break;
+
+		if (applyRecord(aarray, body, bodyLen, options, valuebuffer) < 0) {
+			fprintf(stderr, "Cannot apply record %ld of log '%s'\n", nApplied + 1, filename);
+			nApplied = -1;
+			break;
+		}
+		nApplied++;
+		good += LOG_HEADER_LEN + bodyLen;
+	}
+
+	/** whatever follows the last good record was never committed */
+	if (nApplied >= 0 && good < info.st_size) {
+		fprintf(stderr, "Log '%s': cutting off %ld bytes of incomplete records\n",
+				filename, (long) (info.st_size - good));
+		if (ftruncate(fileno(fp), good) < 0 || fdatasync(fileno(fp)) < 0)
+			nApplied = -1;
+	}
+
+	fclose(fp);
+	free(body);
+	free(valuebuffer);
+	return nApplied;
+}
+
+/** print how the log has been grouped */
+void
+aaPrintLogSummary(FILE *fp, AssociativeArray *aarray)
+{
+	AAWriteLog *wal = aarray->wal;
+
+	if (wal == NULL)
+		return;
+
+	fprintf(fp, "Log '%s': %lu updates in %lu group commits%s\n",
+			wal->filename, wal->nRecords, wal->nCommits,
+			wal->failed ? " (writing has failed)" : "");
+}
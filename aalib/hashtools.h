@@ -2,6 +2,9 @@
 #define	__HASHING_TOOLS_HEADER__
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <aarray.h>
 
@@ -14,6 +17,50 @@ typedef struct AssociativeArray AssociativeArray;
 typedef HashIndex (*HashAlgorithm)(AAKeyType key, size_t keyLength, HashIndex tableSize);
 typedef HashIndex (*HashProbe)(struct AssociativeArray *table, AAKeyType key, size_t keyLength, int startIndex, int, int *cost);
 
+/** hardware counter state, only allocated when counters are enabled */
+#define	AA_PERF_NCOUNTERS	5
+#define	AA_PERF_NOPS		3
+
+#define	AA_PERF_INSERT		0
+#define	AA_PERF_SEARCH		1
+#define	AA_PERF_DELETE		2
+
+typedef struct AAPerfCounters {
+	int leaderFd;
+	int fds[AA_PERF_NCOUNTERS];
+	int available[AA_PERF_NCOUNTERS];
+	int groupSlot[AA_PERF_NCOUNTERS];
+	int nOpen;
+	int startValid;
+	unsigned long long start[AA_PERF_NCOUNTERS];
+	unsigned long long totals[AA_PERF_NOPS][AA_PERF_NCOUNTERS];
+	unsigned long nOps[AA_PERF_NOPS];
+} AAPerfCounters;
+
+/** the state of a trace being recorded, private to hash-trace.c */
+typedef struct AATraceWriter AATraceWriter;
+
+/** the write-ahead log being appended to, private to hash-wal.c */
+typedef struct AAWriteLog AAWriteLog;
+
+/** the lookup filter, private to hash-filter.c */
+typedef struct AAFilter AAFilter;
+
+/** the perfect hash index of a frozen array, private to hash-freeze.c */
+typedef struct AAFrozen AAFrozen;
+
+/** the file and page cache of a disk table, private to hash-disk.c */
+typedef struct AADiskTable AADiskTable;
+
+/** the mapping of an attached shared table, private to hash-shared.c */
+typedef struct AASharedTable AASharedTable;
+
+/** the reference bits and limits of a cache, private to hash-cache.c */
+typedef struct AACache AACache;
+
+/** the blocks and dictionary of compressed keys, private to hash-keys.c */
+typedef struct AAKeyStore AAKeyStore;
+
 typedef struct KeyDataPair {
 	AAKeyType key;
 	size_t keylen;
@@ -21,8 +68,73 @@ typedef struct KeyDataPair {
 	int validity;
 } KeyDataPair;
 
+/**
+ * The compact layout keeps the entries densely in insertion order,
+ * and the slots hold only the index of their entry, or one of these
+ */
+#define	AA_INDEX_EMPTY		(-1)
+#define	AA_INDEX_DELETED	(-2)
+
+/**
+ * The packed layout squeezes a slot into 16 bytes: one word holding
+ * the key pointer, with the validity in its low 2 bits (keys are at
+ * least 4 byte aligned) and a 16 bit tag from the key's hash in its
+ * top 16 bits (which user space pointers leave clear), followed by
+ * the value pointer (or the value itself, when inline).  The key's
+ * length is kept as a 32 bit header just in front of its bytes, so
+ * it shares a cache line with them.  An all-zero slot is empty.
+ */
+typedef struct PackedSlot {
+	uintptr_t keyWord;
+	void *value;
+} PackedSlot;
+
+#define	AA_PACKED_VALIDITY_MASK	((uintptr_t) 0x3)
+#define	AA_PACKED_TAG_SHIFT		48
+#define	AA_PACKED_POINTER_MASK	((((uintptr_t) 1 << AA_PACKED_TAG_SHIFT) - 1) \
+										& ~AA_PACKED_VALIDITY_MASK)
+#define	AA_PACKED_KEY_HEADER	sizeof(uint32_t)
+
+/** the key bytes a packed slot refers to, or NULL */
+static inline AAKeyType
+aaPackedKey(uintptr_t keyWord)
+{
+	return (AAKeyType) (keyWord & AA_PACKED_POINTER_MASK);
+}
+
+/** the length stored in front of a packed key */
+static inline size_t
+aaPackedKeyLength(AAKeyType key)
+{
+	uint32_t keylen;
+
+	memcpy(&keylen, key - AA_PACKED_KEY_HEADER, sizeof(uint32_t));
+	return keylen;
+}
+
+/** release a packed key along with its header */
+static inline void
+aaPackedFreeKey(AAKeyType key)
+{
+	if (key != NULL)
+		free(key - AA_PACKED_KEY_HEADER);
+}
+
+/**
+ * Records (slots in the slots layout, entries in the compact one)
+ * are entryStride bytes apart: just a KeyDataPair normally, or with
+ * room after it for the value when values are stored inline
+ */
 struct AssociativeArray {
+	int layout;
+	size_t valueWidth;
+	size_t entryStride;
 	KeyDataPair *table;
+	PackedSlot *packed;
+	int32_t *indices;
+	KeyDataPair *entries;
+	int nEntriesUsed;
+	int nEntriesAllocated;
 	int size;
 	int nEntries;
 	HashProbe hashProbe;
@@ -31,9 +143,29 @@ struct AssociativeArray {
 	char *hashNamePrimary;
 	HashAlgorithm hashAlgorithmSecondary;
 	char *hashNameSecondary;
-	int searchCost;
-	int insertCost;
-	int deleteCost;
+	int nTombstones;
+	AAOpStats insertStats;
+	AAOpStats searchStats;
+	AAOpStats deleteStats;
+	unsigned long lookupHits;
+	unsigned long lookupMisses;
+	AAPerfCounters *perf;
+	AATraceWriter *trace;
+	AAWriteLog *wal;
+	AAOptions options;
+	AssociativeArray *retiring;
+	int migrateCursor;
+	int nResizes;
+	AAFilter *filter;
+	int nFilterRebuilds;
+	unsigned long lookupsFiltered;
+	int slotPages;
+	int slotNumaApplied;
+	AAFrozen *frozen;
+	AADiskTable *disk;
+	AASharedTable *shared;
+	AACache *cache;
+	AAKeyStore *keys;
 };
 
 
@@ -50,10 +182,332 @@ HashIndex  doubleHashProbe(AssociativeArray *table, AAKeyType key, size_t keyLen
 /** prototypes added by Lukas*/
 HashIndex hashByPrime(AAKeyType key, size_t keyLength, HashIndex tableSize);
 /** END OF prototypes added by Lukas*/
+uint64_t aaMixHash64(AAKeyType key, size_t keyLength);
+HashIndex hashByMix(AAKeyType key, size_t keyLength, HashIndex size);
 
 int getLargerPrime(int value);
 
+void aaRecordProbes(AAOpStats *opstats, int cost);
+void aaPrintOpStats(FILE *fp, const char *label, const AAOpStats *opstats);
+
+void aaPerfBegin(AssociativeArray *table);
+void aaPerfEnd(AssociativeArray *table, int operation);
+void aaPrintPerfCounters(FILE *fp, AssociativeArray *table);
+
+void aaTraceRecord(AssociativeArray *table, int operation,
+		AAKeyType key, size_t keylen, int succeeded);
+void aaTraceAccumulate(AssociativeArray *table, AAKeyType key, size_t keylen,
+		int aggregate, int64_t amount, int succeeded);
+
+void aaLogInsert(AssociativeArray *table, AAKeyType key, size_t keylen, void *value);
+void aaLogDelete(AssociativeArray *table, AAKeyType key, size_t keylen);
+void aaPrintLogSummary(FILE *fp, AssociativeArray *table);
+
+/** inserts and lookups for callers holding the aaMixHash64() of the key, in hash-table.c */
+int aaInsertHashed(AssociativeArray *table, AAKeyType key, size_t keylen,
+		void *value, uint64_t hash);
+void *aaLookupHashed(AssociativeArray *table, AAKeyType key, size_t keylen, uint64_t hash);
+void aaPrefetchHashed(AssociativeArray *table, uint64_t hash);
+
 int doKeysMatch(AAKeyType key1, size_t key1len, AAKeyType key2, size_t key2len);
 int printableKey(char *buffer, int bufferlen, AAKeyType key, size_t keylen);
 
+int aaStoreEntry(AssociativeArray *table, HashIndex slot,
+		AAKeyType ownedKey, size_t keylen, void *value);
+void aaRemoveEntry(AssociativeArray *table, HashIndex slot);
+void aaReleaseStorage(AssociativeArray *table);
+
+/** growth and incremental rehashing, in hash-resize.c */
+int aaGrowIfNeeded(AssociativeArray *table);
+void aaMigrateStep(AssociativeArray *table);
+
+/** the lookup filter, in hash-filter.c */
+AAFilter *aaFilterCreate(int nKeys, int bitsPerKey);
+void aaFilterDestroy(AAFilter *filter);
+void aaFilterAdd(AAFilter *filter, uint64_t hash);
+int aaFilterMayContain(const AAFilter *filter, uint64_t hash);
+void aaFilterRemoved(AssociativeArray *table);
+void aaPrintFilterSummary(FILE *fp, AssociativeArray *table);
+
+/** frozen, read-only arrays, in hash-freeze.c */
+HashIndex aaFrozenFind(AssociativeArray *table, AAKeyType key, size_t keylen, int *cost);
+const uint32_t *aaFrozenPilots(AssociativeArray *table, uint32_t *nBuckets, uint64_t *seed);
+void aaFrozenDestroy(AAFrozen *frozen);
+void aaPrintFrozenSummary(FILE *fp, AssociativeArray *table);
+
+/** slot array memory, in hash-memory.c */
+void *aaSlotMemoryAlloc(AssociativeArray *table, size_t bytes);
+void aaSlotMemoryFree(AssociativeArray *table, void *memory, size_t bytes);
+void aaPrintSlotMemorySummary(FILE *fp, AssociativeArray *table);
+
+/** disk tables, in hash-disk.c */
+int aaDiskOpen(AssociativeArray *table);
+void aaDiskClose(AssociativeArray *table);
+int aaDiskInsert(AssociativeArray *table, AAKeyType key, size_t keylen, void *value, int *cost);
+void *aaDiskLookup(AssociativeArray *table, AAKeyType key, size_t keylen, int *cost);
+void *aaDiskDelete(AssociativeArray *table, AAKeyType key, size_t keylen, int *cost);
+int aaDiskIterate(AssociativeArray *table,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata);
+void aaPrintDiskContents(FILE *fp, AssociativeArray *table, char *tag);
+void aaPrintDiskSummary(FILE *fp, AssociativeArray *table);
+
+/** the bytes of a slot's value, as exported to C or shared memory, in hash-emit.c */
+size_t aaSlotValueBytes(AssociativeArray *table, KeyDataPair *entry, const void **bytes,
+		size_t (*valueBytes)(void *value, const void **bytes, void *userdata),
+		void *userdata);
+
+/** tables attached from shared memory, in hash-shared.c */
+int aaSharedAttach(AssociativeArray *table);
+void aaSharedDetach(AssociativeArray *table);
+void *aaSharedLookup(AssociativeArray *table, AAKeyType key, size_t keylen, int *cost);
+int aaSharedIterate(AssociativeArray *table,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata);
+void aaPrintSharedContents(FILE *fp, AssociativeArray *table, char *tag);
+void aaPrintSharedSummary(FILE *fp, AssociativeArray *table);
+
+/** bounded caches, in hash-cache.c */
+#define	AA_CACHE_PURGE_LOAD	0.9
+
+int aaCacheCreate(AssociativeArray *table);
+void aaCacheDestroy(AACache *cache);
+void aaCacheReferenced(AssociativeArray *table, HashIndex slot);
+void aaCacheStored(AssociativeArray *table, HashIndex slot, size_t keylen);
+void aaCacheRemoved(AssociativeArray *table, HashIndex slot);
+int aaCacheEvict(AssociativeArray *table);
+int aaCacheMakeRoom(AssociativeArray *table, size_t keylen);
+void aaCacheRehashBegin(AssociativeArray *table);
+void aaCacheMoved(AssociativeArray *table, HashIndex oldSlot, HashIndex newSlot);
+void aaPrintCacheSummary(FILE *fp, AssociativeArray *table);
+
+/** compressed key storage, in hash-keys.c */
+AAKeyStore *aaKeyStoreCreate(const AAOptions *options);
+AAKeyStore *aaKeyStoreShare(AAKeyStore *store);
+void aaKeyStoreDestroy(AAKeyStore *store);
+AAKeyType aaKeyStoreAdd(AAKeyStore *store, AAKeyType key, size_t keylen);
+void aaKeyStoreRemoved(AAKeyStore *store, AAKeyType coded, size_t keylen);
+int aaKeyStoreMatches(AAKeyStore *store, AAKeyType coded, size_t codedlen,
+		AAKeyType key, size_t keylen);
+AAKeyType aaKeyStoreDecode(AAKeyStore *store, AAKeyType coded, size_t keylen);
+void aaPrintKeyStoreSummary(FILE *fp, AssociativeArray *table);
+
+/** packed layout support, in hash-packed.c */
+size_t aaPackedStride(size_t valueWidth);
+int aaPackedCreate(AssociativeArray *table);
+void aaPackedDestroy(AssociativeArray *table);
+AAKeyType aaPackedCopyKey(AAKeyType key, size_t keylen);
+int aaPackedPlace(AssociativeArray *table, HashIndex slot,
+		AAKeyType ownedKey, size_t keylen, void *value);
+
+/** compact layout support, in hash-compact.c */
+int aaCompactCreate(AssociativeArray *table);
+void aaCompactDestroy(AssociativeArray *table);
+int aaCompactPlace(AssociativeArray *table, HashIndex slot,
+		AAKeyType ownedKey, size_t keylen, void *value);
+void aaCompactRemove(AssociativeArray *table, HashIndex slot);
+
+
+/**
+ * Slot accessors.
+ *
+ * The probing code and the table operations look at slots only
+ * through these, so that they work the same way whichever storage
+ * layout the array uses.
+ */
+
+/** the i'th record of an array of KeyDataPairs entryStride apart */
+static inline KeyDataPair *
+aaRecordAt(AssociativeArray *table, KeyDataPair *records, size_t i)
+{
+	return (KeyDataPair *) ((char *) records + i * table->entryStride);
+}
+
+/** the i'th slot of the packed layout */
+static inline PackedSlot *
+aaPackedAt(AssociativeArray *table, size_t i)
+{
+	return (PackedSlot *) ((char *) table->packed + i * table->entryStride);
+}
+
+/** the value of a record: its own pointer, or the bytes stored inline after it */
+static inline void *
+aaEntryValue(AssociativeArray *table, KeyDataPair *entry)
+{
+	if (table->valueWidth > 0)
+		return (char *) entry + sizeof(KeyDataPair);
+	return entry->value;
+}
+
+/** the same for a packed slot, whose inline value replaces the pointer */
+static inline void *
+aaPackedValue(AssociativeArray *table, PackedSlot *slot)
+{
+	if (table->valueWidth > 0)
+		return &slot->value;
+	return slot->value;
+}
+
+/** copy a value into inline storage, zero filling if there is none */
+static inline void
+aaCopyInValue(AssociativeArray *table, void *storage, const void *value)
+{
+	if (value != NULL)
+		memcpy(storage, value, table->valueWidth);
+	else
+		memset(storage, 0, table->valueWidth);
+}
+
+/** the state of a slot: HASH_EMPTY, HASH_USED or HASH_DELETED */
+static inline int
+aaSlotValidity(AssociativeArray *table, HashIndex slot)
+{
+	int32_t index;
+
+	if (table->layout == AA_LAYOUT_COMPACT) {
+		index = table->indices[slot];
+		if (index >= 0)						return HASH_USED;
+		if (index == AA_INDEX_EMPTY)		return HASH_EMPTY;
+		return HASH_DELETED;
+	}
+	if (table->layout == AA_LAYOUT_PACKED)
+		return (int) (aaPackedAt(table, slot)->keyWord & AA_PACKED_VALIDITY_MASK);
+	return aaRecordAt(table, table->table, slot)->validity;
+}
+
+/**
+ * the KeyDataPair record held for a slot, or NULL if the layout keeps
+ * none there (an empty slot, a compact tombstone, or any packed slot)
+ */
+static inline KeyDataPair *
+aaSlotEntry(AssociativeArray *table, HashIndex slot)
+{
+	int32_t index;
+
+	if (table->layout == AA_LAYOUT_COMPACT) {
+		index = table->indices[slot];
+		return (index >= 0) ? aaRecordAt(table, table->entries, index) : NULL;
+	}
+	if (table->layout == AA_LAYOUT_PACKED)
+		return NULL;
+	return aaRecordAt(table, table->table, slot);
+}
+
+/**
+ * Fill in the key, length and value held in a slot, whatever the
+ * layout.  The value is the pointer aaLookup() would return.  A key
+ * from a compressed key store is decoded, and is only good until the
+ * next key is.
+ *
+ *  @return 1 if the slot holds a key (live, or left in a tombstone),
+ *			or 0 if there is none to report
+ */
+static inline int
+aaSlotRead(AssociativeArray *table, HashIndex slot, KeyDataPair *out)
+{
+	KeyDataPair *entry;
+	PackedSlot *packed;
+
+	if (table->layout == AA_LAYOUT_PACKED) {
+		packed = aaPackedAt(table, slot);
+		out->key = aaPackedKey(packed->keyWord);
+		if (out->key == NULL)
+			return 0;
+		out->keylen = aaPackedKeyLength(out->key);
+		out->value = aaPackedValue(table, packed);
+		out->validity = (int) (packed->keyWord & AA_PACKED_VALIDITY_MASK);
+		return 1;
+	}
+
+	entry = aaSlotEntry(table, slot);
+	if (entry == NULL || entry->key == NULL)
+		return 0;
+	out->key = entry->key;
+	if (table->keys != NULL)
+		out->key = aaKeyStoreDecode(table->keys, entry->key, entry->keylen);
+	out->keylen = entry->keylen;
+	out->value = aaEntryValue(table, entry);
+	out->validity = entry->validity;
+	return 1;
+}
+
+/**
+ * Just the value held in a used slot, which (unlike aaSlotRead())
+ * leaves the key alone, so that concurrent lookups do not share the
+ * key store's decoding buffer
+ */
+static inline void *
+aaSlotValue(AssociativeArray *table, HashIndex slot)
+{
+	KeyDataPair *entry;
+
+	if (table->layout == AA_LAYOUT_PACKED)
+		return aaPackedValue(table, aaPackedAt(table, slot));
+	entry = aaSlotEntry(table, slot);
+	return (entry != NULL) ? aaEntryValue(table, entry) : NULL;
+}
+
+/**
+ * The tag for a key that the packed layout keeps in its slots.  The
+ * probes work this out once per search; other layouts have no tags.
+ */
+static inline uint16_t
+aaKeyTag(AssociativeArray *table, AAKeyType key, size_t keylen)
+{
+	if (table->layout != AA_LAYOUT_PACKED)
+		return 0;
+	return (uint16_t) (aaMixHash64(key, keylen) >> 48);
+}
+
+/** does the slot hold a live entry with the given key (and tag)? */
+static inline int
+aaSlotHoldsKey(AssociativeArray *table, HashIndex slot,
+		AAKeyType key, size_t keylen, uint16_t tag)
+{
+	KeyDataPair *entry;
+	uintptr_t keyWord;
+	AAKeyType stored;
+
+	if (table->layout == AA_LAYOUT_PACKED) {
+		keyWord = aaPackedAt(table, slot)->keyWord;
+
+		/** most mismatches are caught here, without following the pointer */
+		if ((keyWord & AA_PACKED_VALIDITY_MASK) != HASH_USED
+				|| (uint16_t) (keyWord >> AA_PACKED_TAG_SHIFT) != tag)
+			return 0;
+		stored = aaPackedKey(keyWord);
+		return doKeysMatch(stored, aaPackedKeyLength(stored), key, keylen) == 1;
+	}
+
+	if (aaSlotValidity(table, slot) != HASH_USED)
+		return 0;
+	entry = aaSlotEntry(table, slot);
+	if (entry->key == NULL)
+		return 0;
+	if (table->keys != NULL)
+		return aaKeyStoreMatches(table->keys, entry->key, entry->keylen, key, keylen);
+	return doKeysMatch(entry->key, entry->keylen, key, keylen) == 1;
+}
+
+/** free the key left behind in a tombstone that is about to be reused */
+static inline void
+aaSlotReleaseKey(AssociativeArray *table, HashIndex slot)
+{
+	KeyDataPair *entry;
+	PackedSlot *packed;
+
+	if (table->layout == AA_LAYOUT_SLOTS) {
+		entry = aaRecordAt(table, table->table, slot);
+		if (table->keys != NULL && entry->key != NULL)
+			aaKeyStoreRemoved(table->keys, entry->key, entry->keylen);
+		else
+			free(entry->key);
+		entry->key = NULL;
+	} else if (table->layout == AA_LAYOUT_PACKED) {
+		packed = aaPackedAt(table, slot);
+		aaPackedFreeKey(aaPackedKey(packed->keyWord));
+		packed->keyWord = HASH_DELETED;
+	}
+}
+
 #endif
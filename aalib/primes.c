@@ -109,10 +109,29 @@ static int sPrimes[] = {
 	};
 
 
+/**
+ * Check a value for primality by trial division.  Only used for
+ * values beyond the end of the table above, so this is only
+ * paid for when creating large tables.
+ */
+static int isPrime(int value)
+{
+	int divisor;
+
+	if (value < 2) return 0;
+	if (value % 2 == 0) return value == 2;
+	for (divisor = 3; divisor <= value / divisor; divisor += 2) {
+		if (value % divisor == 0)
+			return 0;
+	}
+	return 1;
+}
+
 /**
  * Locates the next largest prime.
  *  params  value  the value to start at
- *  returns the prime larger than the given value, if known
+ *  returns the prime larger than the given value, or -1
+ *			if there is none that fits in an int
  */
 int getLargerPrime(int value)
 {
@@ -120,8 +139,13 @@ int getLargerPrime(int value)
 	while (sPrimes[i] > 0 && sPrimes[i] < value)
 		i++;
 
-	/** if we walked off the table, return -1 */
-	if (sPrimes[i] < 0) return (-1);
+	/** if we walked off the table, search for one the slow way */
+	if (sPrimes[i] < 0) {
+		while (value > 0 && ! isPrime(value)) {
+			value++;
+		}
+		return (value > 0) ? value : (-1);
+	}
 
 	return sPrimes[i];
 }
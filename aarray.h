@@ -2,6 +2,7 @@
 #define	__ASSOCIATIVE_ARRAY_TOOLS_HEADER__
 
 #include <stdio.h>
+#include <stdint.h>
 
 typedef unsigned char *AAKeyType;
 typedef size_t AAIndexType;
@@ -23,8 +24,243 @@ AssociativeArray *aaCreateAssociativeArray(
 			char *primaryHashAlgorithm,
 			char *secondaryHashAlgorithm
 		);
+
+/**
+ * Storage layouts:
+ *   AA_LAYOUT_SLOTS   - each slot holds its key and value directly
+ *   AA_LAYOUT_COMPACT - entries are kept densely in insertion order
+ *                       and slots hold a 4 byte index into them, so
+ *                       iteration is over live entries only, in the
+ *                       order they were inserted
+ *   AA_LAYOUT_PACKED  - each slot is squeezed into 16 bytes (keys
+ *                       must be shorter than 4GB), and a short hash
+ *                       tag in the slot saves following the key
+ *                       pointer for most mismatches
+ *   AA_LAYOUT_DISK    - entries live in fixed size pages of the file
+ *                       diskPath, found through an extendible hash
+ *                       directory with one page read per lookup, so
+ *                       the table can be far larger than memory
+ *   AA_LAYOUT_SHARED  - a read-only view of the table published as
+ *                       sharedName by aaPublishShared(), mapped from
+ *                       POSIX shared memory rather than loaded
+ */
+#define	AA_LAYOUT_SLOTS		0
+#define	AA_LAYOUT_COMPACT	1
+#define	AA_LAYOUT_PACKED	2
+#define	AA_LAYOUT_DISK		3
+#define	AA_LAYOUT_SHARED	4
+
+/**
+ * Growth: by default a table keeps the size it was created with.  If
+ * growAtLoad is set, an insert that would take the used slots (live
+ * entries and tombstones) past that fraction of the table moves the
+ * entries into a new table, twice the size if the live entries alone
+ * justify it, otherwise the same size without the tombstones.
+ *
+ * The move is incremental: the old table is kept alongside the new
+ * one and each later operation migrates the next rehashStep slots of
+ * it, so no single operation pays for the whole rehash.  A rehashStep
+ * of 0 moves everything at once instead.
+ */
+#define	AA_DEFAULT_REHASH_STEP	64
+
+/**
+ * Lookup filter: if filterBitsPerKey is set, a blocked Bloom filter
+ * of that many bits per slot is kept alongside the table, so that
+ * most lookups for absent keys are answered without probing.  Around
+ * 10 bits per key gives a false positive rate of about 1%.
+ */
+#define	AA_DEFAULT_FILTER_BITS	10
+
+/**
+ * Inline values: by default the array stores the value pointers it
+ * is given, and the values belong to the caller.  If valueWidth is
+ * set, aaInsert() instead copies that many bytes from the value
+ * pointer (zeros if it is NULL) into the table next to the key, and
+ * aaLookup(), aaDelete() and aaIterateAction() give back pointers to
+ * that copy.  These point into the table, so are only good until the
+ * next operation on it, and must not be freed.
+ */
+
+/**
+ * Slot memory: by default the slot array comes from malloc(3).  For
+ * large tables it can instead be mapped directly, which the kernel
+ * zeroes lazily page by page as it is first touched:
+ *   AA_PAGES_MALLOC   - malloc(3), in ordinary pages
+ *   AA_PAGES_MMAP     - an anonymous mapping of ordinary pages
+ *   AA_PAGES_HUGE     - huge pages, reserved ones (MAP_HUGETLB) if
+ *                       there are any, otherwise a mapping aligned
+ *                       for and advised to use transparent huge pages,
+ *                       so random probes need far fewer TLB entries
+ *
+ * NUMA placement: numaPolicy spreads the slot array's pages evenly
+ * over all of the nodes (AA_NUMA_INTERLEAVE), or keeps them all on
+ * numaNode (AA_NUMA_BIND), rather than wherever the thread that
+ * first touches them happens to be running.  Either one implies a
+ * mapped slot array.  Placement is a hint: if the kernel refuses it
+ * the table is still created, and aaPrintSummary() says so.
+ */
+#define	AA_PAGES_MALLOC		0
+#define	AA_PAGES_MMAP		1
+#define	AA_PAGES_HUGE		2
+
+#define	AA_NUMA_DEFAULT		0
+#define	AA_NUMA_INTERLEAVE	1
+#define	AA_NUMA_BIND		2
+
+/**
+ * Disk tables: the disk layout keeps its entries in diskPageSize byte
+ * pages of the file at diskPath, which is reopened if it already
+ * holds a table (with the same valueWidth).  Values must be inline
+ * (valueWidth set), and keys shorter than 64K and small enough to fit
+ * in a page.  Up to diskCachePages pages are kept in memory; pointers
+ * given back point into that cache, so are only good until the next
+ * operation.  The file is brought up to date when the array is
+ * deleted.  A disk table grows by splitting one page at a time, so
+ * growAtLoad and the lookup filter do not apply to it.
+ */
+#define	AA_DEFAULT_DISK_PAGE	4096
+#define	AA_DEFAULT_DISK_CACHE	256
+
+/**
+ * Caches: if cacheEntries or cacheBytes is set the array is a bounded
+ * cache.  An insert that would take it past cacheEntries live entries
+ * (half the slots if only a byte budget is given), or past cacheBytes
+ * of keys and records (values the caller owns are not counted), makes
+ * room by evicting entries chosen by the CLOCK, or second chance,
+ * policy rather than failing: a key found by aaLookup() is kept over
+ * one that has not been looked up since the clock hand last passed
+ * it.  Each evicted entry is passed to the evicted callback, if there
+ * is one, along with evictUserdata, so that its value can be freed;
+ * the key belongs to the array and is freed after the call returns.
+ *
+ * A cache keeps the size it is created with, made at least twice
+ * cacheEntries, so growAtLoad does not apply to it.  Only the slots,
+ * compact and packed layouts can be caches, and a cache cannot be
+ * frozen.  aaLookupConcurrent() does not count as a use of a key.
+ */
+
+/**
+ * Key storage: by default each key is copied into its own malloc(3)
+ * block.  With AA_KEYS_COMPRESSED the keys are instead packed into
+ * large shared blocks, each front coded against whichever of the
+ * nDictionaryKeys keys in keyDictionary (a sample of the keys, with
+ * their lengths in keyDictionaryLengths, copied when the array is
+ * created) shares the longest prefix with it.  Keys are compared in
+ * their coded form; those handed out by aaIterateAction() and the
+ * other walks are decoded into a buffer that is only good until the
+ * next one is.  The space of deleted keys is not reused until the
+ * array is deleted.  Only the slots and compact layouts can compress
+ * their keys.
+ */
+#define	AA_KEYS_MALLOC		0
+#define	AA_KEYS_COMPRESSED	1
+
+/** creation options not covered by the arguments above */
+typedef struct AAOptions {
+	int layout;
+	double growAtLoad;
+	int rehashStep;
+	int filterBitsPerKey;
+	size_t valueWidth;
+	int pages;
+	int numaPolicy;
+	int numaNode;
+	const char *diskPath;
+	int diskPageSize;
+	int diskCachePages;
+	const char *sharedName;
+	int cacheEntries;
+	size_t cacheBytes;
+	int (*evicted)(AAKeyType key, size_t keylen, void *value, void *userdata);
+	void *evictUserdata;
+	int keyStore;
+	AAKeyType *keyDictionary;
+	size_t *keyDictionaryLengths;
+	int nDictionaryKeys;
+} AAOptions;
+
+void aaInitOptions(AAOptions *options);
+AssociativeArray *aaCreateConfiguredArray(
+			size_t size,
+			char *probingStrategy,
+			char *primaryHashAlgorithm,
+			char *secondaryHashAlgorithm,
+			const AAOptions *options
+		);
+
+/**
+ * create an array whose strategies and size are chosen by trial
+ * inserts of a sample of the keys; the choices made are printed
+ * to the report file if it is not NULL.  The options may be NULL
+ * for the defaults.
+ */
+AssociativeArray *aaCreateTuned(size_t expectedEntries,
+		AAKeyType *sampleKeys, size_t *sampleKeyLengths, int nSamples,
+		const AAOptions *options, FILE *report);
 void aaDeleteAssociativeArray(AssociativeArray *array);
 
+/**
+ * Rebuild a loaded array as a minimal perfect hash: one slot per key,
+ * and exactly one probe per lookup.  The array is read-only from then
+ * on (aaInsert() fails and aaDelete() finds nothing), but aaLookup()
+ * and the other queries work as before.  Returns 1 on success, or -1
+ * if the array could not be frozen, in which case it is unchanged.
+ */
+int aaFreeze(AssociativeArray *array);
+
+/**
+ * Static tables: a frozen array written out as C source by
+ * aaEmitStaticTable() (the aagen tool does this for a data file), to
+ * be compiled into a program.  It is all constant data, so it lives
+ * in read-only memory, costs nothing at start-up, and is shared by
+ * every process using it.  The values are byte strings, given by the
+ * valueBytes callback when emitting (or the inline values, if the
+ * array has them), and aaStaticLookup() returns a pointer to the
+ * bytes of the value for a key, or NULL if the key is not present.
+ */
+typedef struct AAStaticTable {
+	uint64_t seed;
+	uint32_t nBuckets;
+	uint32_t nSlots;
+	uint32_t nKeys;
+	const uint32_t *pilots;
+	const uint32_t *keyOffsets;
+	const unsigned char *keyBytes;
+	const uint32_t *valueOffsets;
+	const unsigned char *valueBytes;
+} AAStaticTable;
+
+const void *aaStaticLookup(const AAStaticTable *table,
+		AAKeyType key, size_t keylength);
+int aaEmitStaticTable(FILE *source, FILE *header,
+		AssociativeArray *array, const char *name, const char *headerName,
+		size_t (*valueBytes)(void *value, const void **bytes, void *userdata),
+		void *userdata);
+
+/**
+ * Shared tables: aaPublishShared() copies a frozen array, laid out as
+ * a static table (with offsets rather than pointers), into a POSIX
+ * shared memory segment under the given name, and any number of
+ * processes can then create arrays with the AA_LAYOUT_SHARED layout
+ * and that sharedName to look keys up in it in place.  Such an array
+ * is read-only, like a frozen one, and its values are the published
+ * byte strings, which must not be changed or freed.
+ *
+ * Publishing again under the same name replaces the table without
+ * disturbing readers: they keep the table they have mapped until
+ * they call aaRefreshShared(), which moves them on to the newest one
+ * (returning 1, or 0 if they already had it).  Values looked up
+ * before a refresh must not be used after it.  aaUnlinkShared()
+ * removes the name once no more readers need to attach.
+ */
+int aaPublishShared(AssociativeArray *array, const char *name,
+		size_t (*valueBytes)(void *value, const void **bytes, void *userdata),
+		void *userdata);
+int aaRefreshShared(AssociativeArray *array);
+int aaUnlinkShared(const char *name);
+
+
 int aaIterateAction(
 		AssociativeArray *array,
 		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
@@ -37,8 +273,278 @@ int aaInsert(AssociativeArray *array,
 void *aaLookup(AssociativeArray *array, AAKeyType key, size_t keylength);
 void *aaDelete(AssociativeArray *array, AAKeyType key, size_t keylength);
 
+/**
+ * Insert a batch of keys, as aaInsert() on each in turn, but fetching
+ * the home slots of the keys a few ahead into the cache while each one
+ * is placed, so that a large table's cache misses overlap.  Returns the
+ * number inserted: if it is less than nKeys, keys[result] could not be.
+ */
+int aaInsertBatch(AssociativeArray *array, int nKeys,
+		AAKeyType *keys, size_t *keylengths, void **values);
+
+/**
+ * Aggregation: aaAccumulate() folds an amount into a 64 bit
+ * accumulator kept inline for each key, adding the key first (with
+ * the amount, or a count of 1) if it is not there yet, all with one
+ * probe of the table.  The array must have been created with a
+ * valueWidth of sizeof(int64_t), and aaLookup() and aaIterateAction()
+ * give back pointers to the accumulators.  Returns 1 if the key was
+ * added, 0 if it was already there, or -1 if it could not be added,
+ * or the array cannot be updated in place (a disk, shared or frozen
+ * one).
+ *
+ *   AA_AGGREGATE_COUNT - the number of times the key was seen
+ *   AA_AGGREGATE_SUM   - the sum of the amounts
+ *   AA_AGGREGATE_MIN   - the smallest amount
+ *   AA_AGGREGATE_MAX   - the largest amount
+ */
+#define	AA_AGGREGATE_COUNT	0
+#define	AA_AGGREGATE_SUM	1
+#define	AA_AGGREGATE_MIN	2
+#define	AA_AGGREGATE_MAX	3
+
+int aaAccumulate(AssociativeArray *array,
+		AAKeyType key, size_t keylength,
+		int operation, int64_t amount);
+
 /** print out the data, prefixing each line with the lineLeader */
 void aaPrintContents(FILE *fp, AssociativeArray *array, char *lineLeader);
 void aaPrintSummary(FILE *fp, AssociativeArray *array);
 
+
+/**
+ * Probe-length statistics gathered for one kind of operation.
+ *
+ * The histogram is bucketed by powers of two: bucket b counts the
+ * operations whose probe length was in [2^b, 2^(b+1)), with bucket 0
+ * also holding any zero-length probes.
+ */
+#define	AA_HISTOGRAM_BUCKETS	32
+
+typedef struct AAOpStats {
+	unsigned long count;
+	unsigned long totalProbes;
+	unsigned long maxProbes;
+	unsigned long histogram[AA_HISTOGRAM_BUCKETS];
+} AAOpStats;
+
+/** a snapshot of the state and the running costs of an array */
+typedef struct AAStats {
+	size_t size;
+	size_t nEntries;
+	size_t nTombstones;
+	double loadFactor;
+	AAOpStats insertion;
+	AAOpStats search;
+	AAOpStats deletion;
+	unsigned long lookupHits;
+	unsigned long lookupMisses;
+} AAStats;
+
+/** statistics gathering and reporting */
+int aaGetStats(AssociativeArray *array, AAStats *stats);
+double aaStatsMeanProbes(const AAOpStats *opstats);
+unsigned long aaStatsPercentile(const AAOpStats *opstats, double percentile);
+void aaPrintStats(FILE *fp, AssociativeArray *array);
+
+/**
+ * Lookups that may be made from several threads at once, provided no
+ * thread changes the array meanwhile.  These take no part in resizing
+ * and are neither traced nor sampled by the hardware counters; their
+ * probe lengths and hits go into the caller's own AASearchStats, which
+ * can be added to the array's statistics afterwards.
+ */
+typedef struct AASearchStats {
+	AAOpStats search;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long filtered;
+} AASearchStats;
+
+void *aaLookupConcurrent(AssociativeArray *array,
+		AAKeyType key, size_t keylength, AASearchStats *stats);
+void aaMergeSearchStats(AssociativeArray *array, const AASearchStats *stats);
+
+/**
+ * optional hardware counter sampling around each operation; returns
+ * -1 if counters are not available on this system
+ */
+int aaEnablePerfCounters(AssociativeArray *array);
+void aaDisablePerfCounters(AssociativeArray *array);
+
+/**
+ * Operation traces: while a trace is being recorded every insert,
+ * lookup, delete and accumulate is written to a compact binary file,
+ * which can be read back with the reader calls below
+ */
+#define	AA_TRACE_INSERT		1
+#define	AA_TRACE_LOOKUP		2
+#define	AA_TRACE_DELETE		3
+#define	AA_TRACE_ACCUMULATE	4
+
+typedef struct AATraceRecord {
+	int operation;
+	int succeeded;
+	unsigned long long timestamp;	/* nanoseconds from start of trace */
+	AAKeyType key;
+	size_t keylen;
+	int aggregate;					/* accumulates only: AA_AGGREGATE_SUM etc. */
+	int64_t amount;					/* accumulates only */
+} AATraceRecord;
+
+typedef struct AATraceReader AATraceReader;
+
+int aaStartTrace(AssociativeArray *array, const char *filename);
+unsigned long aaStopTrace(AssociativeArray *array);
+
+AATraceReader *aaTraceOpen(const char *filename);
+int aaTraceNext(AATraceReader *reader, AATraceRecord *record);
+void aaTraceClose(AATraceReader *reader);
+
+/**
+ * summarize clustering and occupancy of the table without dumping it,
+ * and compare the clustering its keys would have under every hash and
+ * probe (aaPrintClusterAnalysis() covers only the table's own hash and
+ * probe, and only the new generation while it is being grown)
+ */
+void aaPrintClusterAnalysis(FILE *fp, AssociativeArray *array,
+		int nRegions, int nLargest);
+void aaPrintConfigurationComparison(FILE *fp, AssociativeArray *array);
+
+/**
+ * Hash joins: aaHashJoin() matches the rows of two inputs on their
+ * keys, building a table on the smaller one and probing it with the
+ * other.  Both inputs are radix partitioned on the hash of their keys
+ * first, so that each partition's table stays in cache, and the
+ * partitions are joined on nThreads threads.
+ *
+ *   AA_JOIN_INNER - every pair of rows with equal keys
+ *   AA_JOIN_LEFT  - as inner, plus each left row with no match, with
+ *                   a NULL right value
+ *   AA_JOIN_ANTI  - only the left rows with no match
+ *
+ * Each result is passed to the emit callback, which is never called
+ * from two threads at once; rows come out in no particular order.
+ * If emit returns a negative number the join stops.  aaHashJoin()
+ * returns the number of rows emitted, or -1 on failure.
+ */
+#define	AA_JOIN_INNER		0
+#define	AA_JOIN_LEFT		1
+#define	AA_JOIN_ANTI		2
+
+/** one input to a join: its rows, as parallel arrays */
+typedef struct AAJoinInput {
+	size_t nRows;
+	AAKeyType *keys;
+	size_t *keylens;
+	void **values;
+} AAJoinInput;
+
+long aaHashJoin(const AAJoinInput *left, const AAJoinInput *right,
+		int joinType, int nThreads,
+		int (*emit)(AAKeyType key, size_t keylen,
+				void *leftValue, void *rightValue, void *userdata),
+		void *userdata);
+
+/**
+ * Clusters: a table can be spread over several worker processes, each
+ * serving its share of the keys over a Unix domain socket (as a3 -S
+ * does, at <socketBase>.0, <socketBase>.1 and so on).  The key space
+ * is cut into AA_CLUSTER_PARTITIONS partitions by the top bits of the
+ * key's hash, and each worker owns a set of them.  Which worker owns
+ * which partition depends only on the number of workers, so any
+ * router opened on the same workers sends each key to the same place.
+ *
+ * aaClusterInsert(), aaClusterLookup() and aaClusterDelete() route a
+ * single operation to the worker that owns the key; the batch versions
+ * send each worker its share of the keys at once, pipelined, and wait
+ * for all of the replies, which makes them far quicker per key.
+ * Values travel as strings, and keys and values may not contain tabs
+ * or line breaks.  An insert replaces any value the key already had.
+ * The values handed back belong to the router, and are only good
+ * until its next call.  The single operations return NULL (or -1) both
+ * for a missing key and for a worker that cannot be reached; the
+ * batch ones return -1 for the latter, and otherwise the number of
+ * keys stored, found or deleted.
+ *
+ * aaClusterAddWorker() takes on the next worker, which must already
+ * be serving at <socketBase>.<nWorkers>, and moves to it about a share
+ * of the partitions from the workers with the most, copying their keys
+ * across before they are dropped from the old workers.  Only the keys
+ * in the moved partitions change hands.  It returns the number of keys
+ * moved, or -1 if the move failed, in which case the router carries
+ * on with the old workers (and the new one should be discarded).
+ */
+#define	AA_CLUSTER_PARTITION_BITS	10
+#define	AA_CLUSTER_PARTITIONS		(1 << AA_CLUSTER_PARTITION_BITS)
+
+typedef struct AACluster AACluster;
+
+AACluster *aaClusterOpen(const char *socketBase, int nWorkers);
+void aaClusterClose(AACluster *cluster);
+int aaClusterPartition(AAKeyType key, size_t keylength);
+int aaClusterWorkerOf(AACluster *cluster, int partition);
+
+int aaClusterInsert(AACluster *cluster,
+		AAKeyType key, size_t keylength, const char *value);
+const char *aaClusterLookup(AACluster *cluster,
+		AAKeyType key, size_t keylength);
+const char *aaClusterDelete(AACluster *cluster,
+		AAKeyType key, size_t keylength);
+
+int aaClusterInsertBatch(AACluster *cluster, int nKeys,
+		AAKeyType *keys, size_t *keylengths, const char **values);
+int aaClusterLookupBatch(AACluster *cluster, int nKeys,
+		AAKeyType *keys, size_t *keylengths, const char **values);
+int aaClusterDeleteBatch(AACluster *cluster, int nKeys,
+		AAKeyType *keys, size_t *keylengths, const char **values);
+
+int aaClusterAddWorker(AACluster *cluster);
+
+/**
+ * Write-ahead logs: once aaStartLog() is called, every insert, delete
+ * and accumulate that changes the array is appended to the named file,
+ * so that the updates made since the table was last saved survive a
+ * crash.  Records are committed in groups, each with one write and one
+ * fdatasync: a group goes out once it holds groupCommitOps records, or
+ * once its first record has waited groupCommitMicros microseconds (as
+ * seen by the next update), or when aaSyncLog() is called.  An update
+ * is only durable once its group is committed, so a caller that must
+ * acknowledge updates should call aaSyncLog() before it does so.
+ *
+ * Inline values are logged as they are; for pointer values valueBytes
+ * gives the bytes to log (as for aaPublishShared()), and makeValue
+ * builds a value back from them on replay.  freeValue, if set, is used
+ * on values that replay replaces or deletes.
+ *
+ * aaReplayLog() applies a log to an array holding the snapshot the log
+ * was started from, before logging starts again.  It stops at the first
+ * incomplete or corrupt record, which can only belong to a group that
+ * was never committed, and cuts it and anything after it off the file.
+ * It returns the number of records applied, 0 if there is no log, or
+ * -1 on failure.  Once a fresh snapshot has been written, aaTruncateLog()
+ * empties the log.  aaStopLog() commits any waiting records, closes the
+ * file and returns the number of records logged.
+ */
+#define	AA_DEFAULT_GROUP_COMMIT_OPS		1024
+#define	AA_DEFAULT_GROUP_COMMIT_MICROS	10000
+
+typedef struct AALogOptions {
+	int groupCommitOps;
+	long groupCommitMicros;
+	size_t (*valueBytes)(void *value, const void **bytes, void *userdata);
+	void *(*makeValue)(const void *bytes, size_t nBytes, void *userdata);
+	void (*freeValue)(void *value, void *userdata);
+	void *userdata;
+} AALogOptions;
+
+void aaInitLogOptions(AALogOptions *options);
+int aaStartLog(AssociativeArray *array, const char *filename,
+		const AALogOptions *options);
+long aaReplayLog(AssociativeArray *array, const char *filename,
+		const AALogOptions *options);
+int aaSyncLog(AssociativeArray *array);
+int aaTruncateLog(AssociativeArray *array);
+unsigned long aaStopLog(AssociativeArray *array);
+
 #endif
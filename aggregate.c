@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <string.h> /* for strlen(), strerror() */
+#include <stdlib.h> /* for strtoll() */
+#include <stdint.h>
+#include <errno.h>
+
+#include "aarray.h"
+#include "data-reader.h"
+#include "aggregate.h"
+
+/**
+ * Aggregating data files by key, through aaAccumulate().
+ *
+ * The lines of the files are folded into the array as they are read,
+ * so only one accumulator per distinct key is ever held, however
+ * large the files.  For a count the values are ignored; otherwise
+ * they must be integers.  Once every file has been read the keys and
+ * their results are written out, tab separated like the data files
+ * themselves, in no particular order.
+ */
+
+#define	LINE_MAX	1024
+
+/** write out one key and its result */
+static int
+writeAggregate(AAKeyType key, size_t keylen, void *value, void *userdata)
+{
+	FILE *ofp = (FILE *) userdata;
+	int64_t result;
+
+	memcpy(&result, value, sizeof(int64_t));
+	fwrite(key, 1, keylen, ofp);
+	fprintf(ofp, "\t%lld\n", (long long) result);
+	return 0;
+}
+
+/** fold every line of one file into the array */
+static long
+aggregateDataFile(AssociativeArray *assocArray, char *filename, int operation)
+{
+	char linebuffer[LINE_MAX];
+	char *strkey = NULL, *value = NULL, *end;
+	long long amount = 0;
+	long nRecords = 0;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: Failed to open input file '%s' : %s\n",
+				filename, strerror(errno));
+		return -1;
+	}
+
+	while (readDataLine(fp, linebuffer, LINE_MAX, &strkey, &value) > 0) {
+		if (operation != AA_AGGREGATE_COUNT) {
+			errno = 0;
+			amount = strtoll(value, &end, 10);
+			if (end == value || *end != '\0' || errno != 0) {
+				fprintf(stderr, "Error: value '%s' for key '%s' is not an integer\n",
+						value, strkey);
+				fclose(fp);
+				return -1;
+			}
+		}
+
+		if (aaAccumulate(assocArray, (AAKeyType) strkey, strlen(strkey),
+					operation, (int64_t) amount) < 0) {
+			fprintf(stderr, "Failed to add key '%s' to assocArray\n", strkey);
+			fclose(fp);
+			return -1;
+		}
+		nRecords++;
+	}
+
+	fclose(fp);
+	return nRecords;
+}
+
+/**
+ * Aggregate all of the files into the array, which must store its
+ * values inline as int64_t, then write out the results
+ *
+ *  @return the number of records aggregated, or -1 on failure
+ */
+long
+aggregateDataFiles(AssociativeArray *assocArray,
+		char **filenames, int nFiles, int operation, FILE *ofp)
+{
+	long nRecords = 0, n;
+	int i;
+
+	for (i = 0; i < nFiles; i++) {
+		n = aggregateDataFile(assocArray, filenames[i], operation);
+		if (n < 0) {
+			fprintf(stderr, "Error: failed aggregating file '%s'\n", filenames[i]);
+			return -1;
+		}
+		nRecords += n;
+	}
+
+	aaIterateAction(assocArray, writeAggregate, ofp);
+	return nRecords;
+}
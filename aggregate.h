@@ -0,0 +1,9 @@
+#ifndef	__AGGREGATE_HEADER__
+#define	__AGGREGATE_HEADER__
+
+#include "aarray.h"
+
+long aggregateDataFiles(AssociativeArray *assocArray,
+		char **filenames, int nFiles, int operation, FILE *ofp);
+
+#endif
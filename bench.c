@@ -0,0 +1,633 @@
+#include <stdio.h>
+#include <string.h> /* for strlen(), strcmp() */
+#include <stdlib.h> /* for malloc(), strtod() */
+#include <unistd.h> /* for getopt() */
+#include <stdint.h>
+#include <time.h>   /* for clock_gettime() */
+#include <math.h>
+#include <errno.h>
+
+#include "aarray.h"
+
+/**
+ * Benchmark harness for the associative array library.
+ *
+ * Generates synthetic keys (either strings or integers), inserts them
+ * into a table for every combination of hash and probing strategy
+ * at each of a set of load factors, then times hit lookups, miss
+ * lookups and deletions.  Lookups may be uniform across the keys
+ * present or follow a Zipf distribution, so that a few keys are
+ * very popular.  Results are written as CSV or JSON.
+ */
+
+#define	MAX_KEYLEN		32
+#define	MAX_LIST		16
+#define	OPTIONLEN		14
+#define	CHECK_INTERVAL	1024
+
+#define	DEFAULT_SIZES	"1000,10000"
+#define	DEFAULT_LOADS	"0.25,0.5,0.75,0.9"
+#define	DEFAULT_BUDGET	10.0
+
+typedef enum { KEY_STRING, KEY_INT } KeyKind;
+typedef enum { DIST_UNIFORM, DIST_ZIPF } Distribution;
+typedef enum { FORMAT_CSV, FORMAT_JSON } Format;
+
+static char *sHashNames[] = { "sum", "len", "pri", "mix", NULL };
+static char *sProbeNames[] = { "lin", "qua", "dou", NULL };
+
+/** the value stored for every key; only its address matters */
+static int sDummyValue;
+
+
+/**
+ * Random number generation -- splitmix64, which is fast, has a
+ * tiny state and makes a good bijective mixing function as well
+ */
+static uint64_t
+mix64(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static uint64_t
+nextRandom(uint64_t *state)
+{
+	*state += 0x9e3779b97f4a7c15ULL;
+	return mix64(*state);
+}
+
+/** a random double in [0, 1) */
+static double
+nextUniform(uint64_t *state)
+{
+	return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/** murmur3's 32-bit finalizer, which is a bijection on 32 bit values */
+static uint32_t
+mix32(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+
+/**
+ * Zipf sampling by rejection-inversion (Hormann and Derflinger),
+ * which needs no tables and so works for any number of keys
+ */
+typedef struct ZipfSampler {
+	double exponent;
+	double nElements;
+	double hIntegralX1;
+	double hIntegralN;
+	double s;
+} ZipfSampler;
+
+static double
+zipfHelper1(double x)
+{
+	if (fabs(x) > 1e-8)
+		return log1p(x) / x;
+	return 1 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+}
+
+static double
+zipfHelper2(double x)
+{
+	if (fabs(x) > 1e-8)
+		return expm1(x) / x;
+	return 1 + x * 0.5 * (1 + x * (1.0 / 3.0) * (1 + 0.25 * x));
+}
+
+static double
+zipfH(ZipfSampler *z, double x)
+{
+	return exp(-z->exponent * log(x));
+}
+
+static double
+zipfHIntegral(ZipfSampler *z, double x)
+{
+	double logX = log(x);
+	return zipfHelper2((1 - z->exponent) * logX) * logX;
+}
+
+static double
+zipfHIntegralInverse(ZipfSampler *z, double x)
+{
+	double t = x * (1 - z->exponent);
+	if (t < -1) t = -1;
+	return exp(zipfHelper1(t) * x);
+}
+
+static void
+zipfInit(ZipfSampler *z, size_t nElements, double exponent)
+{
+	z->exponent = exponent;
+	z->nElements = (double) nElements;
+	z->hIntegralX1 = zipfHIntegral(z, 1.5) - 1;
+	z->hIntegralN = zipfHIntegral(z, z->nElements + 0.5);
+	z->s = 2 - zipfHIntegralInverse(z, zipfHIntegral(z, 2.5) - zipfH(z, 2));
+}
+
+/** returns a rank in [0, nElements), with 0 the most popular */
+static size_t
+zipfSample(ZipfSampler *z, uint64_t *state)
+{
+	double u, x, k;
+
+	for (;;) {
+		u = z->hIntegralN + nextUniform(state) * (z->hIntegralX1 - z->hIntegralN);
+		x = zipfHIntegralInverse(z, u);
+		k = floor(x + 0.5);
+		if (k < 1)
+			k = 1;
+		else if (k > z->nElements)
+			k = z->nElements;
+		if (k - x <= z->s || u >= zipfHIntegral(z, k + 0.5) - zipfH(z, k))
+			return (size_t) k - 1;
+	}
+}
+
+
+/**
+ * Build the key with the given index into the buffer, returning its
+ * length.  Distinct indices always produce distinct keys, so indices
+ * [0, n) can be inserted and [n, 2n) used to generate misses.
+ */
+static size_t
+makeKey(unsigned char *buffer, KeyKind kind, size_t index, uint64_t seed)
+{
+	static const char hexDigits[] = "0123456789abcdef";
+	uint64_t mixed;
+	uint32_t intkey;
+	size_t len, extra, i;
+
+	if (kind == KEY_INT) {
+		intkey = mix32((uint32_t) index ^ (uint32_t) seed);
+		memcpy(buffer, &intkey, sizeof(uint32_t));
+		return sizeof(uint32_t);
+	}
+
+	/**
+	 * 16 hex digits of a bijective mix of the index keep the keys
+	 * unique, followed by a variable length tail so that key
+	 * lengths vary between 16 and 24 characters
+	 */
+	mixed = mix64((uint64_t) index ^ seed);
+	for (i = 0; i < 16; i++) {
+		buffer[i] = hexDigits[(mixed >> (4 * i)) & 0xf];
+	}
+	len = 16;
+	extra = (size_t) (mix64(mixed) % 9);
+	for (i = 0; i < extra; i++) {
+		buffer[len++] = 'a' + (char) ((mixed >> (3 * i)) % 26);
+	}
+	return len;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** the results of running one configuration */
+typedef struct BenchResult {
+	char *hash, *secondary, *probe;
+	KeyKind kind;
+	Distribution distribution;
+	size_t requestedSize, tableSize;
+	double loadFactor;
+	size_t nKeys, nInserted;
+	int failedInserts;
+	double insertRate, hitRate, missRate, deleteRate;
+	double insertProbes, hitProbes, missProbes, deleteProbes;
+	int complete;
+} BenchResult;
+
+/** the settings shared by all of the runs */
+typedef struct BenchConfig {
+	double budget;
+	double zipfExponent;
+	uint64_t seed;
+} BenchConfig;
+
+/** mean probes for the operations done since the snapshot was taken */
+static double
+probesSince(const AAOpStats *after, const AAOpStats *before)
+{
+	unsigned long count = after->count - before->count;
+
+	if (count == 0) return 0.0;
+	return (double) (after->totalProbes - before->totalProbes) / count;
+}
+
+/**
+ * Run one configuration, filling in the result
+ *
+ *  @return 1 on success, -1 if the table could not be created
+ */
+static int
+runOne(BenchConfig *config, BenchResult *result)
+{
+	unsigned char key[MAX_KEYLEN];
+	AssociativeArray *assocArray;
+	AAStats before, after;
+	ZipfSampler zipf;
+	uint64_t rng = config->seed;
+	size_t i, n, index, keylen, nOps;
+	double start, elapsed;
+
+	assocArray = aaCreateAssociativeArray(result->requestedSize,
+			result->probe, result->hash, result->secondary);
+	if (assocArray == NULL)
+		return -1;
+
+	aaGetStats(assocArray, &before);
+	result->tableSize = before.size;
+	result->nKeys = n = (size_t) (result->loadFactor * before.size);
+	result->complete = 1;
+	result->failedInserts = 0;
+
+	/** insertion */
+	start = now();
+	for (i = 0; i < n; i++) {
+		keylen = makeKey(key, result->kind, i, config->seed);
+		if (aaInsert(assocArray, key, keylen, &sDummyValue) < 0)
+			result->failedInserts++;
+		if (i % CHECK_INTERVAL == 0 && now() - start > config->budget) {
+			result->complete = 0;
+			i++;
+			break;
+		}
+	}
+	elapsed = now() - start;
+	result->nInserted = n = i;
+	result->insertRate = (elapsed > 0) ? n / elapsed : 0;
+	aaGetStats(assocArray, &after);
+	result->insertProbes = probesSince(&after.insertion, &before.insertion);
+
+	if (n > 0 && result->distribution == DIST_ZIPF)
+		zipfInit(&zipf, n, config->zipfExponent);
+
+	/** lookups of keys that are present */
+	before = after;
+	start = now();
+	for (nOps = 0; nOps < n; nOps++) {
+		if (result->distribution == DIST_ZIPF)
+			index = zipfSample(&zipf, &rng);
+		else
+			index = (size_t) (nextRandom(&rng) % n);
+		keylen = makeKey(key, result->kind, index, config->seed);
+		(void) aaLookup(assocArray, key, keylen);
+		if (nOps % CHECK_INTERVAL == 0 && now() - start > config->budget) {
+			result->complete = 0;
+			nOps++;
+			break;
+		}
+	}
+	elapsed = now() - start;
+	result->hitRate = (elapsed > 0) ? nOps / elapsed : 0;
+	aaGetStats(assocArray, &after);
+	result->hitProbes = probesSince(&after.search, &before.search);
+
+	/** lookups of keys that were never inserted */
+	before = after;
+	start = now();
+	for (nOps = 0; nOps < n; nOps++) {
+		keylen = makeKey(key, result->kind, n + nOps, config->seed);
+		(void) aaLookup(assocArray, key, keylen);
+		if (nOps % CHECK_INTERVAL == 0 && now() - start > config->budget) {
+			result->complete = 0;
+			nOps++;
+			break;
+		}
+	}
+	elapsed = now() - start;
+	result->missRate = (elapsed > 0) ? nOps / elapsed : 0;
+	aaGetStats(assocArray, &after);
+	result->missProbes = probesSince(&after.search, &before.search);
+
+	/** deletion of everything that was inserted */
+	before = after;
+	start = now();
+	for (nOps = 0; nOps < n; nOps++) {
+		keylen = makeKey(key, result->kind, nOps, config->seed);
+		(void) aaDelete(assocArray, key, keylen);
+		if (nOps % CHECK_INTERVAL == 0 && now() - start > config->budget) {
+			result->complete = 0;
+			nOps++;
+			break;
+		}
+	}
+	elapsed = now() - start;
+	result->deleteRate = (elapsed > 0) ? nOps / elapsed : 0;
+	aaGetStats(assocArray, &after);
+	result->deleteProbes = probesSince(&after.deletion, &before.deletion);
+
+	aaDeleteAssociativeArray(assocArray);
+	return 1;
+}
+
+static void
+printHeader(FILE *fp, Format format)
+{
+	if (format == FORMAT_CSV) {
+		fprintf(fp, "hash,secondary,probe,keys,distribution,"
+				"requested_size,table_size,load_factor,entries,failed_inserts,"
+				"inserts_per_sec,hit_lookups_per_sec,miss_lookups_per_sec,deletes_per_sec,"
+				"insert_probes,hit_probes,miss_probes,delete_probes,complete\n");
+	} else {
+		fprintf(fp, "[\n");
+	}
+}
+
+static void
+printResult(FILE *fp, Format format, BenchResult *r, int first)
+{
+	const char *kind = (r->kind == KEY_INT) ? "int" : "string";
+	const char *dist = (r->distribution == DIST_ZIPF) ? "zipf" : "uniform";
+
+	if (format == FORMAT_CSV) {
+		fprintf(fp, "%s,%s,%s,%s,%s,%lu,%lu,%.2f,%lu,%d,"
+				"%.0f,%.0f,%.0f,%.0f,%.3f,%.3f,%.3f,%.3f,%d\n",
+				r->hash, r->secondary, r->probe, kind, dist,
+				(unsigned long) r->requestedSize, (unsigned long) r->tableSize,
+				r->loadFactor, (unsigned long) r->nInserted, r->failedInserts,
+				r->insertRate, r->hitRate, r->missRate, r->deleteRate,
+				r->insertProbes, r->hitProbes, r->missProbes, r->deleteProbes,
+				r->complete);
+	} else {
+		fprintf(fp, "%s  {\"hash\": \"%s\", \"secondary\": \"%s\", \"probe\": \"%s\", "
+				"\"keys\": \"%s\", \"distribution\": \"%s\", "
+				"\"requested_size\": %lu, \"table_size\": %lu, "
+				"\"load_factor\": %.2f, \"entries\": %lu, \"failed_inserts\": %d, "
+				"\"inserts_per_sec\": %.0f, \"hit_lookups_per_sec\": %.0f, "
+				"\"miss_lookups_per_sec\": %.0f, \"deletes_per_sec\": %.0f, "
+				"\"insert_probes\": %.3f, \"hit_probes\": %.3f, "
+				"\"miss_probes\": %.3f, \"delete_probes\": %.3f, "
+				"\"complete\": %s}",
+				first ? "" : ",\n",
+				r->hash, r->secondary, r->probe, kind, dist,
+				(unsigned long) r->requestedSize, (unsigned long) r->tableSize,
+				r->loadFactor, (unsigned long) r->nInserted, r->failedInserts,
+				r->insertRate, r->hitRate, r->missRate, r->deleteRate,
+				r->insertProbes, r->hitProbes, r->missProbes, r->deleteProbes,
+				r->complete ? "true" : "false");
+	}
+	fflush(fp);
+}
+
+static void
+printFooter(FILE *fp, Format format)
+{
+	if (format == FORMAT_JSON)
+		fprintf(fp, "\n]\n");
+}
+
+/**
+ * Parse a comma separated list of numbers, returning how many
+ * were found or -1 on error
+ */
+static int
+parseList(char *text, double *values, int maxValues)
+{
+	char *end;
+	int n = 0;
+
+	while (*text != '\0') {
+		if (n >= maxValues)
+			return -1;
+		errno = 0;
+		values[n] = strtod(text, &end);
+		if (end == text || errno != 0)
+			return -1;
+		n++;
+		text = end;
+		if (*text == ',')
+			text++;
+		else if (*text != '\0')
+			return -1;
+	}
+	return n;
+}
+
+/** print out the help */
+void usage(char *progname)
+{
+	fprintf(stderr, "%s [<OPTIONS>]\n", progname);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Benchmarks every hash and probing strategy combination on\n");
+	fprintf(stderr, "synthetic keys across a sweep of table sizes and load factors.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options: \n");
+	fprintf(stderr, "%-*s: Print this help.\n", OPTIONLEN, "-h");
+	fprintf(stderr, "%-*s: Comma separated table sizes, default %s.\n",
+			OPTIONLEN, "-n <SIZES>", DEFAULT_SIZES);
+	fprintf(stderr, "%-*s: Comma separated load factors, default %s.\n",
+			OPTIONLEN, "-l <LOADS>", DEFAULT_LOADS);
+	fprintf(stderr, "%-*s: Key type: \"string\", \"int\" or \"both\" (default).\n",
+			OPTIONLEN, "-k <KEYS>");
+	fprintf(stderr, "%-*s: Lookup distribution: \"uniform\", \"zipf\" or \"both\" (default).\n",
+			OPTIONLEN, "-d <DIST>");
+	fprintf(stderr, "%-*s: Zipf exponent, default 1.0.\n", OPTIONLEN, "-z <EXP>");
+	fprintf(stderr, "%-*s: Only benchmark the given hash: \"sum\", \"len\", \"pri\" or \"mix\".\n",
+			OPTIONLEN, "-H <ALG>");
+	fprintf(stderr, "%-*s: Only benchmark the given probing strategy: \"lin\", \"qua\" or \"dou\".\n",
+			OPTIONLEN, "-P <ALG>");
+	fprintf(stderr, "%-*s: Output format: \"csv\" (default) or \"json\".\n",
+			OPTIONLEN, "-f <FORMAT>");
+	fprintf(stderr, "%-*s: Output file to write to, default stdout.\n",
+			OPTIONLEN, "-o <FILE>");
+	fprintf(stderr, "%-*s: Seed for the key generator, default 1.\n", OPTIONLEN, "-S <SEED>");
+	fprintf(stderr, "%-*s: Time budget in seconds for each phase of a run, default %.0f.\n",
+			OPTIONLEN, "-T <SECONDS>", DEFAULT_BUDGET);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Runs that exceed the time budget are reported with complete=0\n");
+	fprintf(stderr, "and rates computed over the operations that finished.\n");
+	fprintf(stderr, "\n");
+	exit (1);
+}
+
+/** is the name given one of those in the list (by its first three letters)? */
+static int
+isListed(const char *name, char **names)
+{
+	int i;
+
+	for (i = 0; names[i] != NULL; i++) {
+		if (strncmp(name, names[i], 3) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Program mainline -- runs the sweep described by the options
+ */
+int
+main(int argc, char **argv)
+{
+	char *programname = argv[0];
+	FILE *ofp = stdout;
+	Format format = FORMAT_CSV;
+	BenchConfig config;
+	BenchResult result;
+	double sizes[MAX_LIST], loads[MAX_LIST];
+	int nSizes, nLoads;
+	char *sizeList = DEFAULT_SIZES, *loadList = DEFAULT_LOADS;
+	char *onlyHash = NULL, *onlyProbe = NULL;
+	int useString = 1, useInt = 1, useUniform = 1, useZipf = 1;
+	int h, h2, p, si, li, k, d, first = 1;
+	unsigned long long seed = 1;
+	int c;
+
+	config.budget = DEFAULT_BUDGET;
+	config.zipfExponent = 1.0;
+
+	while ((c = getopt(argc, argv, "hn:l:k:d:z:H:P:f:o:S:T:")) != -1) {
+		if (c == 'n') {
+			sizeList = optarg;
+		} else if (c == 'l') {
+			loadList = optarg;
+		} else if (c == 'k') {
+			if (strcmp(optarg, "string") != 0 && strcmp(optarg, "int") != 0
+					&& strcmp(optarg, "both") != 0) {
+				fprintf(stderr, "Error: unknown key type '%s'\n", optarg);
+				usage(programname);
+			}
+			useString = (strcmp(optarg, "int") != 0);
+			useInt = (strcmp(optarg, "string") != 0);
+		} else if (c == 'd') {
+			if (strcmp(optarg, "uniform") != 0 && strcmp(optarg, "zipf") != 0
+					&& strcmp(optarg, "both") != 0) {
+				fprintf(stderr, "Error: unknown lookup distribution '%s'\n", optarg);
+				usage(programname);
+			}
+			useUniform = (strcmp(optarg, "zipf") != 0);
+			useZipf = (strcmp(optarg, "uniform") != 0);
+		} else if (c == 'z') {
+			if (sscanf(optarg, "%lf", &config.zipfExponent) != 1
+					|| config.zipfExponent <= 0) {
+				fprintf(stderr, "Error: bad Zipf exponent '%s'\n", optarg);
+				usage(programname);
+			}
+		} else if (c == 'H') {
+			onlyHash = optarg;
+		} else if (c == 'P') {
+			onlyProbe = optarg;
+		} else if (c == 'f') {
+			if (strcmp(optarg, "json") == 0) {
+				format = FORMAT_JSON;
+			} else if (strcmp(optarg, "csv") == 0) {
+				format = FORMAT_CSV;
+			} else {
+				fprintf(stderr, "Error: unknown output format '%s'\n", optarg);
+				usage(programname);
+			}
+		} else if (c == 'o') {
+			ofp = fopen(optarg, "w");
+			if (ofp == NULL) {
+				fprintf(stderr,
+						"Error: cannot open requested output file '%s' : %s\n",
+						optarg, strerror(errno));
+				usage(programname);
+			}
+		} else if (c == 'S') {
+			if (sscanf(optarg, "%llu", &seed) != 1) {
+				fprintf(stderr, "Error: bad seed '%s'\n", optarg);
+				usage(programname);
+			}
+		} else if (c == 'T') {
+			if (sscanf(optarg, "%lf", &config.budget) != 1) {
+				fprintf(stderr, "Error: bad time budget '%s'\n", optarg);
+				usage(programname);
+			}
+		} else {
+			usage(programname);
+		}
+	}
+	config.seed = (uint64_t) seed;
+
+	if (onlyHash != NULL && ! isListed(onlyHash, sHashNames)) {
+		fprintf(stderr, "Error: no such hash '%s'\n", onlyHash);
+		usage(programname);
+	}
+	if (onlyProbe != NULL && ! isListed(onlyProbe, sProbeNames)) {
+		fprintf(stderr, "Error: no such probing strategy '%s'\n", onlyProbe);
+		usage(programname);
+	}
+
+	nSizes = parseList(sizeList, sizes, MAX_LIST);
+	nLoads = parseList(loadList, loads, MAX_LIST);
+	if (nSizes <= 0 || nLoads <= 0) {
+		fprintf(stderr, "Error: cannot parse size or load factor list\n");
+		usage(programname);
+	}
+
+	printHeader(ofp, format);
+
+	for (h = 0; sHashNames[h] != NULL; h++) {
+		if (onlyHash != NULL && strncmp(onlyHash, sHashNames[h], 3) != 0)
+			continue;
+		for (p = 0; sProbeNames[p] != NULL; p++) {
+			if (onlyProbe != NULL && strncmp(onlyProbe, sProbeNames[p], 3) != 0)
+				continue;
+
+			/** the secondary hash only matters for double hashing */
+			for (h2 = 0; sHashNames[h2] != NULL; h2++) {
+				if (strcmp(sProbeNames[p], "dou") != 0 && h2 > 0)
+					break;
+
+				for (si = 0; si < nSizes; si++) {
+					for (li = 0; li < nLoads; li++) {
+						for (k = 0; k < 2; k++) {
+							if ((k == KEY_STRING && ! useString)
+									|| (k == KEY_INT && ! useInt))
+								continue;
+							for (d = 0; d < 2; d++) {
+								if ((d == DIST_UNIFORM && ! useUniform)
+										|| (d == DIST_ZIPF && ! useZipf))
+									continue;
+
+								memset(&result, 0, sizeof(result));
+								result.hash = sHashNames[h];
+								result.secondary = sHashNames[h2];
+								result.probe = sProbeNames[p];
+								result.kind = (KeyKind) k;
+								result.distribution = (Distribution) d;
+								result.requestedSize = (size_t) sizes[si];
+								result.loadFactor = loads[li];
+
+								if (runOne(&config, &result) < 0) {
+									fprintf(stderr, "Error: cannot create table of size %lu\n",
+											(unsigned long) result.requestedSize);
+									continue;
+								}
+								printResult(ofp, format, &result, first);
+								first = 0;
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	printFooter(ofp, format);
+	if (ofp != stdout)
+		fclose(ofp);
+
+	return 0;
+}
@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <string.h> /* for strlen(), strerror() */
+#include <stdlib.h> /* for malloc(), free() */
+#include <errno.h>
+#include <signal.h>
+#include <time.h>   /* for nanosleep() */
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "aarray.h"
+#include "data-reader.h"
+#include "server.h"
+#include "cluster.h"
+
+/**
+ * Cluster mode for the driver: rather than loading one table, start
+ * worker processes, each serving an empty table (made just as the
+ * single table would be) at <socketBase>.<n>, and send them the data
+ * files, deletions and queries through the router in aalib, a batch
+ * of lines at a time.  Workers added after loading take their share
+ * of the keys from the others before the deletions and queries, which
+ * print exactly what they would for a single table.  The workers are
+ * stopped (with SIGTERM, as a server is) once we are done.
+ *
+ * Keys travel as text, so are never stored as integers here.
+ */
+
+#define	LINE_MAX			1024
+#define	CLUSTER_BATCH		1024
+#define	STARTUP_TRIES		400
+#define	STARTUP_WAIT_NS		(25 * 1000 * 1000)
+
+/** the lines being sent as one batch, with the keys and values in them */
+typedef struct ClusterBatch {
+	int nKeys;
+	AAKeyType keys[CLUSTER_BATCH];
+	size_t keylens[CLUSTER_BATCH];
+	const char *values[CLUSTER_BATCH];
+	char lines[CLUSTER_BATCH][LINE_MAX];
+} ClusterBatch;
+
+
+static int
+freeValue(AAKeyType key, size_t keylen, void *value, void *userdata)
+{
+	if (value != NULL)	free(value);
+	return 0;
+}
+
+/** the socket a worker serves on */
+static int
+workerPath(char *path, size_t pathlen, const char *socketBase, int index)
+{
+	if (snprintf(path, pathlen, "%s.%d", socketBase, index) >= (int) pathlen) {
+		fprintf(stderr, "Error: cluster socket name '%s.%d' is too long\n",
+				socketBase, index);
+		return -1;
+	}
+	return 1;
+}
+
+/** wait until the worker is taking connections, or has given up */
+static int
+waitForWorker(const char *path, pid_t pid)
+{
+	struct timespec pause = { 0, STARTUP_WAIT_NS };
+	struct sockaddr_un address;
+	int tries, fd, status;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	for (tries = 0; tries < STARTUP_TRIES; tries++) {
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		status = connect(fd, (struct sockaddr *) &address, sizeof(address));
+		close(fd);
+		if (status == 0)
+			return 1;
+		if (waitpid(pid, &status, WNOHANG) == pid)
+			return -1;
+		nanosleep(&pause, NULL);
+	}
+	return -1;
+}
+
+/**
+ * Fork a worker to serve a table of its own as the given worker
+ *
+ *  @return its pid once it is serving, or -1
+ */
+static pid_t
+startWorker(ClusterConfig *config, int index)
+{
+	char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	AssociativeArray *assocArray;
+	size_t valueWidth = config->options->valueWidth;
+	pid_t pid;
+
+	if (workerPath(path, sizeof(path), config->socketBase, index) < 0)
+		return -1;
+
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "Error: cannot start cluster worker %d : %s\n",
+				index, strerror(errno));
+		return -1;
+	}
+
+	if (pid == 0) {
+		/** a worker reports on stderr, leaving stdout to the results */
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		assocArray = aaCreateConfiguredArray(config->arraySize, config->probe,
+				config->hashPrimary, config->hashSecondary, config->options);
+		if (assocArray == NULL
+				|| serveAssociativeArray(assocArray, path, 0, valueWidth) < 0)
+			_exit(1);
+		if (valueWidth == 0)
+			aaIterateAction(assocArray, freeValue, NULL);
+		aaDeleteAssociativeArray(assocArray);
+		fflush(stdout);
+		_exit(0);
+	}
+
+	if (waitForWorker(path, pid) < 0) {
+		fprintf(stderr, "Error: cluster worker %d did not start serving on '%s'\n",
+				index, path);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	return pid;
+}
+
+static void
+stopWorkers(pid_t *pids, int nWorkers)
+{
+	int i;
+
+	for (i = 0; i < nWorkers; i++)
+		kill(pids[i], SIGTERM);
+	for (i = 0; i < nWorkers; i++)
+		waitpid(pids[i], NULL, 0);
+}
+
+/** insert the batch of lines read so far */
+static int
+flushInserts(AACluster *cluster, ClusterBatch *batch)
+{
+	int nStored;
+
+	if (batch->nKeys == 0)
+		return 1;
+	nStored = aaClusterInsertBatch(cluster, batch->nKeys,
+			batch->keys, batch->keylens, batch->values);
+	if (nStored != batch->nKeys) {
+		if (nStored >= 0) {
+			fprintf(stderr, "Error: %d of %d keys could not be stored in the cluster\n",
+					batch->nKeys - nStored, batch->nKeys);
+		}
+		return -1;
+	}
+	batch->nKeys = 0;
+	return 1;
+}
+
+static int
+loadCluster(AACluster *cluster, char *filename, ClusterBatch *batch)
+{
+	char *strkey = NULL, *value = NULL;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: Failed to open input file '%s' : %s",
+				filename, strerror(errno));
+		return -1;
+	}
+
+	batch->nKeys = 0;
+	while (readDataLine(fp, batch->lines[batch->nKeys], LINE_MAX, &strkey, &value) > 0) {
+		batch->keys[batch->nKeys] = (AAKeyType) strkey;
+		batch->keylens[batch->nKeys] = strlen(strkey);
+		batch->values[batch->nKeys] = value;
+		batch->nKeys++;
+		if (batch->nKeys == CLUSTER_BATCH && flushInserts(cluster, batch) < 0) {
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return flushInserts(cluster, batch);
+}
+
+/** look up or delete the batch of keys read so far, printing what each gave */
+static int
+flushKeys(AACluster *cluster, ClusterBatch *batch, int deleting)
+{
+	const char *label = deleting ? "DELETE" : "LOOKUP";
+	int i, status;
+
+	if (batch->nKeys == 0)
+		return 1;
+	if (deleting) {
+		status = aaClusterDeleteBatch(cluster, batch->nKeys,
+				batch->keys, batch->keylens, batch->values);
+	} else {
+		status = aaClusterLookupBatch(cluster, batch->nKeys,
+				batch->keys, batch->keylens, batch->values);
+	}
+	if (status < 0)
+		return -1;
+
+	for (i = 0; i < batch->nKeys; i++) {
+		if (batch->values[i] == NULL) {
+			printf("%s: key '%s' produced no value\n", label, (char *) batch->keys[i]);
+		} else {
+			printf("%s: key '%s' produced value '%s'\n", label,
+					(char *) batch->keys[i], batch->values[i]);
+		}
+	}
+	batch->nKeys = 0;
+	return 1;
+}
+
+static int
+processKeys(AACluster *cluster, char *filename, ClusterBatch *batch, int deleting)
+{
+	char *strkey = NULL;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: Failed to open query input file '%s' : %s",
+				filename, strerror(errno));
+		return -1;
+	}
+
+	batch->nKeys = 0;
+	while (readPlainLine(fp, batch->lines[batch->nKeys], LINE_MAX, &strkey)) {
+		batch->keys[batch->nKeys] = (AAKeyType) strkey;
+		batch->keylens[batch->nKeys] = strlen(strkey);
+		batch->nKeys++;
+		if (batch->nKeys == CLUSTER_BATCH && flushKeys(cluster, batch, deleting) < 0) {
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return flushKeys(cluster, batch, deleting);
+}
+
+/**
+ * Run the whole cluster: start the workers, load the files, add any
+ * more workers, then do the deletions and queries
+ *
+ *  @return 1 on success, or -1 on failure
+ */
+int
+runCluster(ClusterConfig *config, int nWorkers, int nAddedWorkers,
+		char **filenames, int nFiles, char *deletefile, char *queryfile)
+{
+	AACluster *cluster = NULL;
+	ClusterBatch *batch;
+	pid_t *pids;
+	int nStarted = 0, status = -1, nMoved, i;
+
+	batch = (ClusterBatch *) malloc(sizeof(ClusterBatch));
+	pids = (pid_t *) malloc((nWorkers + nAddedWorkers) * sizeof(pid_t));
+	if (batch == NULL || pids == NULL) {
+		fprintf(stderr, "Error: cannot allocate cluster buffers\n");
+		free(batch);
+		free(pids);
+		return -1;
+	}
+
+	for (nStarted = 0; nStarted < nWorkers; nStarted++) {
+		if ((pids[nStarted] = startWorker(config, nStarted)) < 0)
+			goto done;
+	}
+	cluster = aaClusterOpen(config->socketBase, nWorkers);
+	if (cluster == NULL)
+		goto done;
+
+	for (i = 0; i < nFiles; i++) {
+		if (loadCluster(cluster, filenames[i], batch) < 0) {
+			fprintf(stderr, "Error: failed loading from file '%s'\n", filenames[i]);
+			goto done;
+		}
+	}
+	printf("Associative array loaded\n");
+
+	/** each new worker takes its share of the keys loaded so far */
+	for (i = 0; i < nAddedWorkers; i++) {
+		if ((pids[nStarted] = startWorker(config, nStarted)) < 0)
+			goto done;
+		nStarted++;
+		nMoved = aaClusterAddWorker(cluster);
+		if (nMoved < 0) {
+			fprintf(stderr, "Error: cannot rebalance onto cluster worker %d\n", nStarted - 1);
+			goto done;
+		}
+		fprintf(stderr, "Added cluster worker %d, moving %d keys to it\n",
+				nStarted - 1, nMoved);
+	}
+
+	if (deletefile != NULL && processKeys(cluster, deletefile, batch, 1) < 0)
+		goto done;
+	if (queryfile != NULL && processKeys(cluster, queryfile, batch, 0) < 0)
+		goto done;
+	status = 1;
+
+done:
+	aaClusterClose(cluster);
+	fflush(stdout);
+	stopWorkers(pids, nStarted);
+	free(pids);
+	free(batch);
+	return status;
+}
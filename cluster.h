@@ -0,0 +1,19 @@
+#ifndef	__CLUSTER_HEADER__
+#define	__CLUSTER_HEADER__
+
+#include "aarray.h"
+
+/** how to make the table that each worker serves */
+typedef struct ClusterConfig {
+	const char *socketBase;
+	int arraySize;
+	char *probe;
+	char *hashPrimary;
+	char *hashSecondary;
+	AAOptions *options;
+} ClusterConfig;
+
+int runCluster(ClusterConfig *config, int nWorkers, int nAddedWorkers,
+		char **filenames, int nFiles, char *deletefile, char *queryfile);
+
+#endif
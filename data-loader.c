@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <string.h> /* for strlen(), strdup(), strerror() */
+#include <stdlib.h> /* for malloc(), free() */
+#include <ctype.h>  /* for isdigit() */
+#include <errno.h>
+
+#include "aarray.h"
+#include "data-reader.h"
+#include "data-loader.h"
+
+/**
+ * Loading the key/value pairs of a data file into an array, shared
+ * by the driver and the table generator.
+ */
+
+#define	LINE_MAX	128
+
+/**
+ * The value to insert for a line: a copy on the heap that the array
+ * will point to, or (when the array stores values inline) the string
+ * cut down to fit in the given buffer of valueWidth bytes
+ */
+static void *
+makeValue(char *value, char *buffer, size_t valueWidth)
+{
+	if (valueWidth == 0)
+		return strdup(value);
+
+	/** always leave room for the terminating NUL */
+	strncpy(buffer, value, valueWidth - 1);
+	buffer[valueWidth - 1] = '\0';
+	return buffer;
+}
+
+/**
+ * Load the assocArray of attribute value entries
+ *
+ *  @return the number of entries loaded, or -1 on failure
+ */
+int
+loadAssociativeArray(AssociativeArray *assocArray, char *filename, int useIntKey,
+		size_t valueWidth)
+{
+	char linebuffer[LINE_MAX];
+	char *valuebuffer = NULL;
+	char *strkey = NULL, *value = NULL;
+	void *stored;
+	int nEntries = 0, status = 1;
+	int intkey;
+	FILE *fp = NULL;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: Failed to open input file '%s' : %s\n",
+				filename, strerror(errno));
+		return -1;
+	}
+
+	if (valueWidth > 0) {
+		valuebuffer = (char *) malloc(valueWidth);
+		if (valuebuffer == NULL) {
+			fprintf(stderr, "Error: cannot allocate value buffer\n");
+			fclose(fp);
+			return -1;
+		}
+	}
+
+	while (status > 0 && readDataLine(fp, linebuffer, LINE_MAX, &strkey, &value) > 0) {
+		stored = makeValue(value, valuebuffer, valueWidth);
+		if (useIntKey && isdigit(strkey[0])) {
+			if (sscanf(strkey, "%d", &intkey) != 1) {
+				fprintf(stderr, "Error: Failed extracting integer from '%s'\n", strkey);
+				status = -1;
+			} else if (aaInsert(assocArray,
+						(AAKeyType) &intkey, sizeof(int), stored) < 0) {
+				fprintf(stderr, "Failed to add key '%d' to assocArray\n", intkey);
+				status = -1;
+			}
+		} else {
+
+			if (aaInsert(assocArray,
+						(AAKeyType) strkey, strlen(strkey), stored) < 0) {
+				fprintf(stderr, "Failed to add key '%s' to assocArray\n", strkey);
+				status = -1;
+			}
+		}
+
+		if (status < 0) {
+			if (valueWidth == 0)	free(stored);
+		} else {
+			nEntries++;
+		}
+	}
+
+	if (valuebuffer != NULL)	free(valuebuffer);
+	fclose(fp);
+	return (status < 0) ? -1 : nEntries;
+}
@@ -0,0 +1,9 @@
+#ifndef	__DATA_LOADER_HEADER__
+#define	__DATA_LOADER_HEADER__
+
+#include "aarray.h"
+
+int loadAssociativeArray(AssociativeArray *assocArray,
+		char *filename, int useIntKey, size_t valueWidth);
+
+#endif
@@ -26,13 +26,29 @@ readDataLine(
 			char **value
 		)
 {
-	char *delimiterPosition = NULL;
-
 	/** read the file until empty */
 	if (fgets(line, maxlinelen, dataFP) == NULL) {
 		return 0;
 	}
 
+	return parseDataLine(line, key, value);
+}
+
+
+/**
+ * Split a line already in memory into its attribute and value, in
+ * place.  This is the parsing half of readDataLine(), for readers
+ * that do their own I/O.
+ */
+int
+parseDataLine(
+			char *line,
+			char **key,
+			char **value
+		)
+{
+	char *delimiterPosition = NULL;
+
 	/** find the delimiter */
 	delimiterPosition = strchr(line, DELIMITER_CHAR);
 	if (delimiterPosition == NULL) {
@@ -5,6 +5,7 @@
 int readDataLine(FILE *dataFP,
 		char *linebuffer, int maxlinelen,
 		char **key, char **value);
+int parseDataLine(char *line, char **key, char **value);
 int readPlainLine(FILE *dataFP,
 		char *linebuffer, int maxlinelen,
 		char **value);
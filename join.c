@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <string.h> /* for strlen(), strdup(), strerror() */
+#include <stdlib.h> /* for malloc(), free() */
+#include <errno.h>
+
+#include "aarray.h"
+#include "data-reader.h"
+#include "join.h"
+
+/**
+ * Joining two data files on their keys, through aaHashJoin().
+ *
+ * Both files are read into memory whole, as the join partitions each
+ * side before it looks anything up, and the joined rows are written
+ * out as they come, tab separated like the data files themselves:
+ * the key, the left value and (except for anti joins) the right
+ * value, which is empty for a left row that nothing matched.
+ */
+
+#define	LINE_MAX			1024
+#define	INITIAL_ROWS		1024
+
+/** the rows read from one file */
+typedef struct JoinFile {
+	AAJoinInput input;
+	size_t nAllocated;
+} JoinFile;
+
+typedef struct JoinOutput {
+	FILE *ofp;
+	int joinType;
+} JoinOutput;
+
+
+static void
+freeJoinFile(JoinFile *file)
+{
+	size_t i;
+
+	for (i = 0; i < file->input.nRows; i++) {
+		free(file->input.keys[i]);
+		free(file->input.values[i]);
+	}
+	free(file->input.keys);
+	free(file->input.keylens);
+	free(file->input.values);
+	memset(file, 0, sizeof(JoinFile));
+}
+
+/** make room for another row */
+static int
+growJoinFile(JoinFile *file)
+{
+	size_t nAllocated = (file->nAllocated == 0) ? INITIAL_ROWS : file->nAllocated * 2;
+	AAKeyType *keys;
+	size_t *keylens;
+	void **values;
+
+	keys = (AAKeyType *) realloc(file->input.keys, nAllocated * sizeof(AAKeyType));
+	if (keys == NULL)
+		return -1;
+	file->input.keys = keys;
+	keylens = (size_t *) realloc(file->input.keylens, nAllocated * sizeof(size_t));
+	if (keylens == NULL)
+		return -1;
+	file->input.keylens = keylens;
+	values = (void **) realloc(file->input.values, nAllocated * sizeof(void *));
+	if (values == NULL)
+		return -1;
+	file->input.values = values;
+
+	file->nAllocated = nAllocated;
+	return 1;
+}
+
+/** read every key/value line of a file */
+static int
+readJoinFile(char *filename, JoinFile *file)
+{
+	char linebuffer[LINE_MAX];
+	char *strkey = NULL, *value = NULL;
+	size_t n;
+	int status;
+	FILE *fp;
+
+	memset(file, 0, sizeof(JoinFile));
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: Failed to open join input file '%s' : %s\n",
+				filename, strerror(errno));
+		return -1;
+	}
+
+	while ((status = readDataLine(fp, linebuffer, LINE_MAX, &strkey, &value)) > 0) {
+		n = file->input.nRows;
+		if (n == file->nAllocated && growJoinFile(file) < 0) {
+			status = -1;
+			break;
+		}
+		file->input.keys[n] = (AAKeyType) strdup(strkey);
+		file->input.keylens[n] = strlen(strkey);
+		file->input.values[n] = strdup(value);
+		file->input.nRows++;
+		if (file->input.keys[n] == NULL || file->input.values[n] == NULL) {
+			status = -1;
+			break;
+		}
+	}
+	fclose(fp);
+
+	if (status < 0) {
+		fprintf(stderr, "Error: failed reading join input file '%s'\n", filename);
+		freeJoinFile(file);
+		return -1;
+	}
+	return 1;
+}
+
+/** write out one joined row */
+static int
+writeJoinedRow(AAKeyType key, size_t keylen,
+		void *leftValue, void *rightValue, void *userdata)
+{
+	JoinOutput *output = (JoinOutput *) userdata;
+
+	fwrite(key, 1, keylen, output->ofp);
+	if (output->joinType == AA_JOIN_ANTI) {
+		fprintf(output->ofp, "\t%s\n", (char *) leftValue);
+	} else {
+		fprintf(output->ofp, "\t%s\t%s\n", (char *) leftValue,
+				(rightValue != NULL) ? (char *) rightValue : "");
+	}
+	return ferror(output->ofp) ? -1 : 1;
+}
+
+/**
+ * Join the two files, writing the joined rows to the output
+ *
+ *  @return the number of rows written, or -1 on failure
+ */
+int
+joinDataFiles(char *leftFile, char *rightFile, int joinType,
+		int nThreads, FILE *ofp)
+{
+	JoinFile left, right;
+	JoinOutput output;
+	long nRows;
+
+	if (readJoinFile(leftFile, &left) < 0)
+		return -1;
+	if (readJoinFile(rightFile, &right) < 0) {
+		freeJoinFile(&left);
+		return -1;
+	}
+
+	output.ofp = ofp;
+	output.joinType = joinType;
+	nRows = aaHashJoin(&left.input, &right.input, joinType, nThreads,
+			writeJoinedRow, &output);
+	if (nRows < 0)
+		fprintf(stderr, "Error: failed joining '%s' with '%s'\n", leftFile, rightFile);
+
+	freeJoinFile(&left);
+	freeJoinFile(&right);
+	return (int) nRows;
+}
@@ -0,0 +1,9 @@
+#ifndef	__JOIN_HEADER__
+#define	__JOIN_HEADER__
+
+#include "aarray.h"
+
+int joinDataFiles(char *leftFile, char *rightFile, int joinType,
+		int nThreads, FILE *ofp);
+
+#endif
@@ -4,56 +4,78 @@
 #include <unistd.h> /* for getopt() */
 #include <ctype.h>  /* for isdigit() */
 #include <errno.h>
+#include <fcntl.h>  /* for open() */
+#include <libgen.h> /* for dirname() */
 
 #include "aarray.h"
 #include "data-reader.h"
+#include "data-loader.h"
+#include "parallel-query.h"
+#include "server.h"
+#include "join.h"
+#include "aggregate.h"
+#include "pipelined-load.h"
+#include "cluster.h"
 
 #define	LINE_MAX	128
 
 /**
- * Load the assocArray of attribute value entries
+ * Collect a sample of the keys in the given files for tuning, using
+ * reservoir sampling so that every key is equally likely to be kept.
+ * The sampled keys are copied onto the heap.
+ *
+ * Returns the total number of entries in the files, or -1 on error
  */
-static int
-loadAssociativeArray(AssociativeArray *assocArray, char *filename, int useIntKey)
+static long
+sampleKeys(char **filenames, int nFiles, int useIntKey,
+		AAKeyType *keys, size_t *keylens, int maxSamples, int *nSamples)
 {
 	char linebuffer[LINE_MAX];
 	char *strkey = NULL, *value = NULL;
-	int nEntries = 0;
-	int intkey;
-	FILE *fp = NULL;
-
-	fp = fopen(filename, "r");
-	if (fp == NULL) {
-		fprintf(stderr, "Error: Failed to open input file '%s' : %s",
-				filename, strerror(errno));
-		return -1;
-	}
+	long nEntries = 0, slot;
+	int intkey, i;
+	AAKeyType key;
+	size_t keylen;
+	FILE *fp;
+
+	*nSamples = 0;
+	srand(1);
+
+	for (i = 0; i < nFiles; i++) {
+		fp = fopen(filenames[i], "r");
+		if (fp == NULL) {
+			fprintf(stderr, "Error: Failed to open input file '%s' : %s",
+					filenames[i], strerror(errno));
+			return -1;
+		}
 
-	while (readDataLine(fp, linebuffer, LINE_MAX, &strkey, &value) > 0) {
-		if (useIntKey && isdigit(strkey[0])) {
-			if (sscanf(strkey, "%d", &intkey) != 1) {
-				fprintf(stderr, "Error: Failed extracting integer from '%s'\n", strkey);
-				return -1;
-			}
-			if (aaInsert(assocArray,
-						(AAKeyType) &intkey, sizeof(int),
-						strdup(value)) < 0) {
-				fprintf(stderr, "Failed to add key '%d' to assocArray\n", intkey);
-				return -1;
+		while (readDataLine(fp, linebuffer, LINE_MAX, &strkey, &value) > 0) {
+			if (useIntKey && isdigit(strkey[0])
+					&& sscanf(strkey, "%d", &intkey) == 1) {
+				key = (AAKeyType) &intkey;
+				keylen = sizeof(int);
+			} else {
+				key = (AAKeyType) strkey;
+				keylen = strlen(strkey);
 			}
-		} else {
 
-			if (aaInsert(assocArray,
-						(AAKeyType) strkey, strlen(strkey),
-						strdup(value)) < 0) {
-				fprintf(stderr, "Failed to add key '%s' to assocArray\n", strkey);
-				return -1;
+			/** fill the reservoir, then replace entries at random */
+			slot = (nEntries < maxSamples) ? nEntries : (long) (rand() % (nEntries + 1));
+			if (slot < maxSamples) {
+				if (slot < *nSamples) {
+					free(keys[slot]);
+				} else {
+					(*nSamples)++;
+				}
+				keys[slot] = (AAKeyType) malloc(keylen);
+				memcpy(keys[slot], key, keylen);
+				keylens[slot] = keylen;
 			}
+			nEntries++;
 		}
-		nEntries++;
+		fclose(fp);
 	}
 
-	fclose(fp);
 	return nEntries;
 }
 
@@ -106,10 +128,11 @@ queryAssociativeArray(AssociativeArray *assocArray, char *filename, int useIntKe
 /**
  * Delete the selected values from the array.  Note that we free the values
  * as otherwise they are memory leaks as we are managing the memory for
- * these values outside of the library
+ * these values outside of the library (unless they are stored inline)
  */
 static int
-deleteFromAssociativeArray(AssociativeArray *assocArray, char *filename, int useIntKey)
+deleteFromAssociativeArray(AssociativeArray *assocArray, char *filename, int useIntKey,
+		size_t valueWidth)
 {
 	char linebuffer[LINE_MAX];
 	char *strkey = NULL, *value = NULL;
@@ -135,7 +158,7 @@ deleteFromAssociativeArray(AssociativeArray *assocArray, char *filename, int use
 				printf("DELETE: key (%d) produced no value\n", intkey);
 			} else {
 				printf("DELETE: key (%d) produced value '%s'\n", intkey, value);
-				free(value);
+				if (valueWidth == 0)	free(value);
 			}
 
 		} else {
@@ -144,7 +167,7 @@ deleteFromAssociativeArray(AssociativeArray *assocArray, char *filename, int use
 				printf("DELETE: key '%s' produced no value\n", strkey);
 			} else {
 				printf("DELETE: key '%s' produced value '%s'\n", strkey, value);
-				free(value);
+				if (valueWidth == 0)	free(value);
 			}
 		}
 	}
@@ -161,8 +184,122 @@ deleteValue(AAKeyType key, size_t keylen, void *value, void *userdata)
 	return 0;
 }
 
+/** the bytes of a value to publish: its string, including the NUL */
+static size_t
+stringValueBytes(void *value, const void **bytes, void *userdata)
+{
+	*bytes = value;
+	return strlen((const char *) value) + 1;
+}
+
+/** a value replayed from the log: its string, copied onto the heap */
+static void *
+copyStringValue(const void *bytes, size_t nBytes, void *userdata)
+{
+	char *value = (char *) malloc(nBytes + 1);
+
+	if (value != NULL) {
+		memcpy(value, bytes, nBytes);
+		value[nBytes] = '\0';
+	}
+	return value;
+}
+
+static void
+freeStringValue(void *value, void *userdata)
+{
+	free(value);
+}
+
+/** where a snapshot is being written, and how wide its values are */
+typedef struct Snapshot {
+	FILE *fp;
+	size_t valueWidth;
+} Snapshot;
+
+static int
+writeSnapshotEntry(AAKeyType key, size_t keylen, void *value, void *userdata)
+{
+	Snapshot *snapshot = (Snapshot *) userdata;
+	size_t valueLen = 0;
+
+	if (value != NULL) {
+		valueLen = (snapshot->valueWidth > 0)
+				? strnlen((const char *) value, snapshot->valueWidth)
+				: strlen((const char *) value);
+	}
+	if (fprintf(snapshot->fp, "%.*s\t%.*s\n", (int) keylen, (const char *) key,
+			(int) valueLen, (const char *) value) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/** sync the directory holding the named file, making a rename into it durable */
+static int
+syncDirectoryOf(const char *filename)
+{
+	char path[FILENAME_MAX];
+	int fd, result;
+
+	snprintf(path, sizeof(path), "%s", filename);
+	fd = open(dirname(path), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		return -1;
+	}
+	result = fsync(fd);
+	close(fd);
+	return result;
+}
+
+/**
+ * Write the contents of the table out as a data file that can be
+ * loaded again.  It is written beside the file named and synced
+ * before being renamed over it, so that a crash leaves either the old
+ * snapshot or the new one, and never part of one.  The directory is
+ * synced after the rename, so that once we return the new snapshot
+ * has replaced the old one for good and the log can be emptied.
+ */
+static int
+writeSnapshot(AssociativeArray *assocArray, const char *filename, size_t valueWidth)
+{
+	char tmpname[FILENAME_MAX];
+	Snapshot snapshot;
+	int result;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	snapshot.fp = fopen(tmpname, "w");
+	if (snapshot.fp == NULL) {
+		fprintf(stderr, "Error: cannot create snapshot '%s' : %s\n",
+				tmpname, strerror(errno));
+		return -1;
+	}
+	snapshot.valueWidth = valueWidth;
+
+	result = aaIterateAction(assocArray, writeSnapshotEntry, &snapshot);
+	if (fflush(snapshot.fp) != 0 || fsync(fileno(snapshot.fp)) < 0) {
+		result = -1;
+	}
+	if (fclose(snapshot.fp) != 0 || result < 0 || rename(tmpname, filename) < 0) {
+		fprintf(stderr, "Error: cannot write snapshot '%s' : %s\n",
+				filename, strerror(errno));
+		unlink(tmpname);
+		return -1;
+	}
+	if (syncDirectoryOf(filename) < 0) {
+		fprintf(stderr, "Error: cannot sync the directory of snapshot '%s' : %s\n",
+				filename, strerror(errno));
+		return -1;
+	}
+	return 1;
+}
+
 #define	DEFAULT_ARRAY_SIZE	100
 #define OPTIONLEN	10
+#define	ANALYSIS_REGIONS	10
+#define	ANALYSIS_LARGEST	5
+#define	TUNING_SAMPLES		2000
+#define	AGGREGATE_LOAD		0.75
 
 /** print out the help */
 void usage(char *progname)
@@ -180,19 +317,101 @@ void usage(char *progname)
 	fprintf(stderr, "%-*s: Output file to write to, default stdout.\n",
 			OPTIONLEN, "-o <FILE>");
 	fprintf(stderr, "%-*s: Print out the table after processing.\n", OPTIONLEN, "-p");
+	fprintf(stderr, "%-*s: Use the compact, insertion-ordered table layout.\n", OPTIONLEN, "-c");
+	fprintf(stderr, "%-*s: Use the packed layout, with 16 byte tagged slots.\n", OPTIONLEN, "-K");
+	fprintf(stderr, "%-*s: Keep the table in pages of <FILE>, reopening it if it exists\n",
+			OPTIONLEN, "-D <FILE>");
+	fprintf(stderr, "%-*s: (needs -V); an existing table needs no data files.\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Pack the keys into blocks, front coded against a sample of them.\n",
+			OPTIONLEN, "-k");
+	fprintf(stderr, "%-*s: Freeze the table into a perfect hash before any queries.\n", OPTIONLEN, "-Z");
+	fprintf(stderr, "%-*s: Freeze the table and publish it in shared memory as <NAME>,\n",
+			OPTIONLEN, "-U <NAME>");
+	fprintf(stderr, "%-*s: where it stays after we exit.\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Query the table published as <NAME> rather than loading one\n",
+			OPTIONLEN, "-W <NAME>");
+	fprintf(stderr, "%-*s: (no data files are given).\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Map the slot array rather than malloc it, in \"huge\" pages\n",
+			OPTIONLEN, "-M <PAGES>");
+	fprintf(stderr, "%-*s: or ordinary ones (\"mmap\").\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Place the slot array on the given NUMA node, or spread it\n",
+			OPTIONLEN, "-N <NODE>");
+	fprintf(stderr, "%-*s: over all of them with \"interleave\".\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Store values inline in the table, cut to <WIDTH> bytes.\n",
+			OPTIONLEN, "-V <WIDTH>");
+	fprintf(stderr, "%-*s: Keep a Bloom filter in front of the table to answer misses quickly.\n",
+			OPTIONLEN, "-F");
+	fprintf(stderr, "%-*s: Keep at most <N> entries, evicting the least recently\n",
+			OPTIONLEN, "-E <N>");
+	fprintf(stderr, "%-*s: used (by the CLOCK policy) to make room for new ones.\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: As -E, but limit the bytes of keys and records instead.\n",
+			OPTIONLEN, "-B <BYTES>");
+	fprintf(stderr, "%-*s: Grow the table once the slots in use pass this load factor.\n",
+			OPTIONLEN, "-g <LOAD>");
+	fprintf(stderr, "%-*s: Slots of the old table migrated per operation while growing,\n",
+			OPTIONLEN, "-R <STEP>");
+	fprintf(stderr, "%-*s: default %d, or 0 to rehash everything at once.\n",
+			OPTIONLEN, "", AA_DEFAULT_REHASH_STEP);
+	fprintf(stderr, "%-*s: Print out probe length statistics after processing.\n", OPTIONLEN, "-s");
+	fprintf(stderr, "%-*s: Sample hardware performance counters around each operation.\n", OPTIONLEN, "-C");
+	fprintf(stderr, "%-*s: Record a trace of every operation into <FILE>\n",
+			OPTIONLEN, "-t <FILE>");
+	fprintf(stderr, "%-*s: Replay the updates logged in <LOG> once the data files are loaded,\n",
+			OPTIONLEN, "-l <LOG>");
+	fprintf(stderr, "%-*s: then log every update after them there too.\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Commit the log in groups of up to <OPS> updates, default %d.\n",
+			OPTIONLEN, "-w <OPS>", AA_DEFAULT_GROUP_COMMIT_OPS);
+	fprintf(stderr, "%-*s: Write the table to <FILE> as a data file at the end, and empty\n",
+			OPTIONLEN, "-x <FILE>");
+	fprintf(stderr, "%-*s: the log (-l), as <FILE> now holds its updates.\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Print out a cluster and occupancy analysis after processing,\n", OPTIONLEN, "-A");
+	fprintf(stderr, "%-*s: and compare the clustering of the keys under each hash and probe.\n",
+			OPTIONLEN, "");
 	fprintf(stderr, "%-*s: Hash using the given algorithm.  Choices are \"sum\", \"length\",\n",
 			OPTIONLEN, "-H <ALG>");
-	fprintf(stderr, "%-*s: or \"prime\".\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: \"prime\" or \"mix\", or \"auto\" to choose the hash, probing and size\n",
+			OPTIONLEN, "");
+	fprintf(stderr, "%-*s: by trial inserts of a sample of the data (-P, -2 and -n are ignored).\n",
+			OPTIONLEN, "");
 	fprintf(stderr, "%-*s: Probe using the given algorithm.  Choices are \"linear\", \"quadratic\",\n",
 			OPTIONLEN, "-P <ALG>");
 	fprintf(stderr, "%-*s: or \"doublehash\".\n", OPTIONLEN, "");
 	fprintf(stderr, "%-*s: Perform queries on all of the keys listed in <FILE> (one per line)\n",
 			OPTIONLEN, "-q <FILE>");
+	fprintf(stderr, "%-*s: Run the queries on <N> threads (not used with -t or -C).\n",
+			OPTIONLEN, "-j <N>");
+	fprintf(stderr, "%-*s: Load the data files through a pipeline of a reader thread,\n",
+			OPTIONLEN, "-L <N>");
+	fprintf(stderr, "%-*s: <N> parser threads and the inserts, rather than line by line.\n",
+			OPTIONLEN, "");
 	fprintf(stderr, "%-*s: Delete all of the keys listed in <FILE> (one per line)\n",
 			OPTIONLEN, "-d <FILE>");
+	fprintf(stderr, "%-*s: Rather than loading a table, join the first data file with the\n",
+			OPTIONLEN, "-J <TYPE>");
+	fprintf(stderr, "%-*s: second on their keys, on -j threads, and write out the joined\n",
+			OPTIONLEN, "");
+	fprintf(stderr, "%-*s: rows.  <TYPE> is \"inner\", \"left\" or \"anti\".\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Rather than loading a table, fold the values of each key in the\n",
+			OPTIONLEN, "-G <OP>");
+	fprintf(stderr, "%-*s: data files into one result and write out the keys and results.\n",
+			OPTIONLEN, "");
+	fprintf(stderr, "%-*s: <OP> is \"count\", \"sum\", \"min\" or \"max\"; the table grows as\n",
+			OPTIONLEN, "");
+	fprintf(stderr, "%-*s: needed unless -g says otherwise (-i, -V, -E and -B do not apply).\n",
+			OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Then serve GET, PUT and DEL requests on the Unix socket\n",
+			OPTIONLEN, "-S <SOCKET>");
+	fprintf(stderr, "%-*s: <SOCKET> until interrupted.\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Spread the table over <N> worker processes, serving on\n",
+			OPTIONLEN, "-X <N>");
+	fprintf(stderr, "%-*s: <SOCKET>.0 onwards (named by -S), and load and query it there.\n",
+			OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Add <N> more workers to the cluster once it is loaded.\n",
+			OPTIONLEN, "-Y <N>");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "The order of the operations controlled by -d, -q and -p are: deletion first,\n");
-	fprintf(stderr, "followed by any queries, and then finally printing (if indicated)\n");
+	fprintf(stderr, "followed by freezing (-Z) and publishing (-U), any queries, serving (-S),\n");
+	fprintf(stderr, "writing a snapshot (-x) and then finally printing (if indicated)\n");
 	fprintf(stderr, "\n");
 	exit (1);
 }
@@ -209,21 +428,85 @@ main(int argc, char **argv)
 	int arraySize = DEFAULT_ARRAY_SIZE;
 	int useIntKey = 0;
 	int printContents = 0;
-	char *queryfile = NULL, *deletefile = NULL;
+	int printStats = 0;
+	int printAnalysis = 0;
+	int usePerfCounters = 0;
+	int nQueryThreads = 1;
+	int nLoadParsers = 0;
+	int nClusterWorkers = 0, nAddedWorkers = 0;
+	int freeze = 0;
+	char *queryfile = NULL, *deletefile = NULL, *tracefile = NULL;
+	char *publishName = NULL, *socketPath = NULL;
+	char *logfile = NULL, *snapshotfile = NULL;
+	int joinType = -1;
+	int aggregateOp = -1;
+	long nRecords;
+	AAKeyType tuningKeys[TUNING_SAMPLES];
+	size_t tuningKeylens[TUNING_SAMPLES];
+	int nTuningKeys;
+	long nExpected;
 	int i, c;
 
 	AssociativeArray *assocArray;
+	AAOptions options;
+	AALogOptions logOptions;
+	AAStats stats;
+	ClusterConfig cluster;
 	char *hash1 = "sum", *hash2 = "len", *probe = "lin";
 
 	/* save program name before calling getopt() */
 	programname = argv[0];
+	aaInitOptions(&options);
+	aaInitLogOptions(&logOptions);
 
 	/** use getopt(3) to parse command line */
-	while ((c = getopt(argc, argv, "hpin:o:P:H:2:q:d:")) != -1) {
+	while ((c = getopt(argc, argv, "hpsACcKkZin:o:P:H:2:q:d:t:g:R:j:FV:M:N:D:U:W:S:J:E:B:G:L:X:Y:l:w:x:")) != -1) {
 		if (c == 'i') {
 			useIntKey = 1;
 		} else if (c == 'p') {
 			printContents = 1;
+		} else if (c == 's') {
+			printStats = 1;
+		} else if (c == 'A') {
+			printAnalysis = 1;
+		} else if (c == 'C') {
+			usePerfCounters = 1;
+		} else if (c == 'c') {
+			options.layout = AA_LAYOUT_COMPACT;
+		} else if (c == 'K') {
+			options.layout = AA_LAYOUT_PACKED;
+		} else if (c == 'k') {
+			options.keyStore = AA_KEYS_COMPRESSED;
+		} else if (c == 'D') {
+			options.layout = AA_LAYOUT_DISK;
+			options.diskPath = optarg;
+		} else if (c == 'Z') {
+			freeze = 1;
+		} else if (c == 'U') {
+			freeze = 1;
+			publishName = optarg;
+		} else if (c == 'W') {
+			options.layout = AA_LAYOUT_SHARED;
+			options.sharedName = optarg;
+		} else if (c == 'M') {
+			if (strncmp(optarg, "huge", 4) == 0) {
+				options.pages = AA_PAGES_HUGE;
+			} else if (strncmp(optarg, "mmap", 4) == 0) {
+				options.pages = AA_PAGES_MMAP;
+			} else {
+				fprintf(stderr, "Error: unknown kind of pages '%s'\n", optarg);
+				usage(programname);
+			}
+		} else if (c == 'N') {
+			if (strncmp(optarg, "int", 3) == 0) {
+				options.numaPolicy = AA_NUMA_INTERLEAVE;
+			} else if (sscanf(optarg, "%d", &options.numaNode) == 1
+					&& options.numaNode >= 0) {
+				options.numaPolicy = AA_NUMA_BIND;
+			} else {
+				fprintf(stderr, "Error: cannot parse NUMA node from '%s'\n", optarg);
+				usage(programname);
+			}
 		} else if (c == 'n') {
 			if (sscanf(optarg, "%d", &arraySize) != 1) {
 				fprintf(stderr,
@@ -232,6 +515,54 @@ main(int argc, char **argv)
 				usage(programname);
 			}
 
+		} else if (c == 'V') {
+			if (sscanf(optarg, "%zu", &options.valueWidth) != 1
+					|| options.valueWidth < 1) {
+				fprintf(stderr,
+						"Error: cannot parse value width from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
+		} else if (c == 'F') {
+			options.filterBitsPerKey = AA_DEFAULT_FILTER_BITS;
+
+		} else if (c == 'E') {
+			if (sscanf(optarg, "%d", &options.cacheEntries) != 1
+					|| options.cacheEntries < 1) {
+				fprintf(stderr,
+						"Error: cannot parse cache capacity from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
+		} else if (c == 'B') {
+			if (sscanf(optarg, "%zu", &options.cacheBytes) != 1
+					|| options.cacheBytes < 1) {
+				fprintf(stderr,
+						"Error: cannot parse cache byte budget from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
+		} else if (c == 'g') {
+			if (sscanf(optarg, "%lf", &options.growAtLoad) != 1
+					|| options.growAtLoad <= 0 || options.growAtLoad > 1) {
+				fprintf(stderr,
+						"Error: cannot parse load factor to grow at from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
+		} else if (c == 'R') {
+			if (sscanf(optarg, "%d", &options.rehashStep) != 1
+					|| options.rehashStep < 0) {
+				fprintf(stderr,
+						"Error: cannot parse rehash step from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
 		} else if (c == 'H') {
 			hash1 = optarg;
 
@@ -244,9 +575,88 @@ main(int argc, char **argv)
 		} else if (c == 'q') {
 			queryfile = optarg;
 
+		} else if (c == 'j') {
+			if (sscanf(optarg, "%d", &nQueryThreads) != 1 || nQueryThreads < 1) {
+				fprintf(stderr,
+						"Error: cannot parse number of query threads from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
+		} else if (c == 'L') {
+			if (sscanf(optarg, "%d", &nLoadParsers) != 1 || nLoadParsers < 1) {
+				fprintf(stderr,
+						"Error: cannot parse number of parser threads from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
+		} else if (c == 'X') {
+			if (sscanf(optarg, "%d", &nClusterWorkers) != 1 || nClusterWorkers < 1) {
+				fprintf(stderr,
+						"Error: cannot parse number of cluster workers from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
+		} else if (c == 'Y') {
+			if (sscanf(optarg, "%d", &nAddedWorkers) != 1 || nAddedWorkers < 1) {
+				fprintf(stderr,
+						"Error: cannot parse number of cluster workers to add from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
 		} else if (c == 'd') {
 			deletefile = optarg;
 
+		} else if (c == 'S') {
+			socketPath = optarg;
+
+		} else if (c == 'J') {
+			if (strncmp(optarg, "inner", 5) == 0) {
+				joinType = AA_JOIN_INNER;
+			} else if (strncmp(optarg, "left", 4) == 0) {
+				joinType = AA_JOIN_LEFT;
+			} else if (strncmp(optarg, "anti", 4) == 0) {
+				joinType = AA_JOIN_ANTI;
+			} else {
+				fprintf(stderr, "Error: unknown kind of join '%s'\n", optarg);
+				usage(programname);
+			}
+
+		} else if (c == 'G') {
+			if (strncmp(optarg, "count", 5) == 0) {
+				aggregateOp = AA_AGGREGATE_COUNT;
+			} else if (strncmp(optarg, "sum", 3) == 0) {
+				aggregateOp = AA_AGGREGATE_SUM;
+			} else if (strncmp(optarg, "min", 3) == 0) {
+				aggregateOp = AA_AGGREGATE_MIN;
+			} else if (strncmp(optarg, "max", 3) == 0) {
+				aggregateOp = AA_AGGREGATE_MAX;
+			} else {
+				fprintf(stderr, "Error: unknown kind of aggregate '%s'\n", optarg);
+				usage(programname);
+			}
+
+		} else if (c == 't') {
+			tracefile = optarg;
+
+		} else if (c == 'l') {
+			logfile = optarg;
+
+		} else if (c == 'w') {
+			if (sscanf(optarg, "%d", &logOptions.groupCommitOps) != 1
+					|| logOptions.groupCommitOps < 1) {
+				fprintf(stderr,
+						"Error: cannot parse group commit size from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
+		} else if (c == 'x') {
+			snapshotfile = optarg;
+
 		} else if (c == 'o') {
 			ofp = fopen(optarg, "w");
 			if (ofp == NULL) {
@@ -265,47 +675,258 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc < 1) {
+	/** a join works from the files themselves, not a loaded table */
+	if (joinType >= 0) {
+		if (argc != 2) {
+			fprintf(stderr, "Error: a join (-J) needs exactly two data files\n");
+			usage(programname);
+		}
+		c = joinDataFiles(argv[0], argv[1], joinType, nQueryThreads, ofp);
+		if (c < 0) {
+			return -1;
+		}
+		fprintf(stderr, "Joined %d rows\n", c);
+		return 0;
+	}
+
+	if (options.layout == AA_LAYOUT_SHARED) {
+		if (argc > 0) {
+			fprintf(stderr, "Error: a shared table (-W) cannot be loaded with more data\n");
+			usage(programname);
+		}
+	} else if (argc < 1 && (options.layout != AA_LAYOUT_DISK
+			|| access(options.diskPath, F_OK) != 0)) {
+		/** a disk table that already exists has its data, and can be used as it is */
 		fprintf(stderr, "Error: No data files listed to load!\n");
 		usage(programname);
 	}
 
+	/** aggregates are kept inline, and must all be kept */
+	if (aggregateOp >= 0) {
+		if (options.layout == AA_LAYOUT_DISK || options.layout == AA_LAYOUT_SHARED
+				|| options.cacheEntries > 0 || options.cacheBytes > 0) {
+			fprintf(stderr, "Error: aggregation (-G) needs an in-memory table that keeps every key\n");
+			usage(programname);
+		}
+		useIntKey = 0;
+		options.valueWidth = sizeof(int64_t);
+		if (options.growAtLoad <= 0) {
+			options.growAtLoad = AGGREGATE_LOAD;
+		}
+	}
+
+	/** a cluster's workers serve ordinary tables, and are sent keys as text */
+	if (nClusterWorkers > 0 || nAddedWorkers > 0) {
+		if (nClusterWorkers < 1 || socketPath == NULL) {
+			fprintf(stderr, "Error: a cluster (-X) needs a socket name (-S) for its workers\n");
+			usage(programname);
+		}
+		if (options.layout == AA_LAYOUT_DISK || options.layout == AA_LAYOUT_SHARED
+				|| aggregateOp >= 0 || freeze || nLoadParsers > 0
+				|| strcmp(hash1, "auto") == 0) {
+			fprintf(stderr, "Error: a cluster (-X) cannot be combined with -D, -W, -G, -Z, -U, -L or -H auto\n");
+			usage(programname);
+		}
+		useIntKey = 0;
+	}
+
+	/** only a table of our own, loaded from data files, is logged or saved */
+	if ((logfile != NULL || snapshotfile != NULL)
+			&& (options.layout == AA_LAYOUT_SHARED || aggregateOp >= 0
+				|| nClusterWorkers > 0)) {
+		fprintf(stderr, "Error: a log (-l) or snapshot (-x) cannot be combined with -W, -G or -X\n");
+		usage(programname);
+	}
+	if (snapshotfile != NULL && useIntKey) {
+		fprintf(stderr, "Error: a snapshot (-x) writes keys as strings, so cannot be used with -i\n");
+		usage(programname);
+	}
+
+	/** the values of evicted entries are ours to free */
+	if ((options.cacheEntries > 0 || options.cacheBytes > 0) && options.valueWidth == 0) {
+		options.evicted = deleteValue;
+	}
+
+	if (options.keyStore == AA_KEYS_COMPRESSED && options.layout != AA_LAYOUT_SLOTS
+			&& options.layout != AA_LAYOUT_COMPACT) {
+		fprintf(stderr, "Error: compressed keys (-k) need the default or compact (-c) layout\n");
+		usage(programname);
+	}
+
+	if (options.layout == AA_LAYOUT_DISK && options.valueWidth == 0) {
+		fprintf(stderr, "Error: a disk table (-D) stores its values inline, so needs -V\n");
+		usage(programname);
+	}
+
+	/** the sample of keys that tunes the table also makes the key dictionary */
+	nTuningKeys = 0;
+	if (strcmp(hash1, "auto") == 0 || options.keyStore == AA_KEYS_COMPRESSED) {
+		nExpected = sampleKeys(argv, argc, useIntKey,
+				tuningKeys, tuningKeylens, TUNING_SAMPLES, &nTuningKeys);
+		if (nExpected < 0) {
+			return -1;
+		}
+	}
+	if (options.keyStore == AA_KEYS_COMPRESSED) {
+		options.keyDictionary = tuningKeys;
+		options.keyDictionaryLengths = tuningKeylens;
+		options.nDictionaryKeys = nTuningKeys;
+	}
+
+	/** a cluster builds its tables in the workers instead */
+	if (nClusterWorkers > 0) {
+		cluster.socketBase = socketPath;
+		cluster.arraySize = arraySize;
+		cluster.probe = probe;
+		cluster.hashPrimary = hash1;
+		cluster.hashSecondary = hash2;
+		cluster.options = &options;
+		c = runCluster(&cluster, nClusterWorkers, nAddedWorkers,
+				argv, argc, deletefile, queryfile);
+		for (i = 0; i < nTuningKeys; i++) {
+			free(tuningKeys[i]);
+		}
+		return (c < 0) ? -1 : 0;
+	}
+
 	/** allocate the array and fail out if we cannot */
-	assocArray = aaCreateAssociativeArray(arraySize, probe, hash1, hash2);
+	if (strcmp(hash1, "auto") == 0) {
+		assocArray = aaCreateTuned(nExpected,
+				tuningKeys, tuningKeylens, nTuningKeys, &options, stderr);
+	} else {
+		assocArray = aaCreateConfiguredArray(arraySize, probe, hash1, hash2, &options);
+	}
+	for (i = 0; i < nTuningKeys; i++) {
+		free(tuningKeys[i]);
+	}
 	if (assocArray == NULL) {
 		fprintf(stderr, "Error: cannot allocate associative array - exitting\n");
 		return -1;
 	}
 
+	/** counters are only a diagnostic, so carry on without them */
+	if (usePerfCounters && aaEnablePerfCounters(assocArray) < 0) {
+		fprintf(stderr, "Warning: hardware performance counters are not available\n");
+	}
+
+	if (tracefile != NULL && aaStartTrace(assocArray, tracefile) < 0) {
+		fprintf(stderr, "Error: cannot open trace file '%s' : %s\n",
+				tracefile, strerror(errno));
+		return -1;
+	}
+
+
+	/** an aggregation streams the files through the table instead of loading them */
+	if (aggregateOp >= 0) {
+		nRecords = aggregateDataFiles(assocArray, argv, argc, aggregateOp, ofp);
+		if (nRecords < 0) {
+			return -1;
+		}
+		aaGetStats(assocArray, &stats);
+		fprintf(stderr, "Aggregated %ld records into %lu keys\n",
+				nRecords, (unsigned long) stats.nEntries);
+		if (printStats) {
+			aaPrintStats(stderr, assocArray);
+		}
+		aaDeleteAssociativeArray(assocArray);
+		return 0;
+	}
 
 	/** getopt leaves us only "file" arguments left in argv */
 	for (i = 0; i < argc; i++) {
-		if (loadAssociativeArray(assocArray, argv[i], useIntKey) < 0) {
+		if (nLoadParsers > 0) {
+			c = loadAssociativeArrayPipelined(assocArray, argv[i], useIntKey,
+					options.valueWidth, nLoadParsers);
+		} else {
+			c = loadAssociativeArray(assocArray, argv[i], useIntKey, options.valueWidth);
+		}
+		if (c < 0) {
 			fprintf(stderr, "Error: failed loading from file '%s'\n", argv[i]);
 			return -1;
 		}
 	}
 	printf("Associative array loaded\n");
 
+	/** bring the table up to date from the log, then carry on logging */
+	if (logfile != NULL) {
+		if (options.valueWidth == 0) {
+			logOptions.valueBytes = stringValueBytes;
+			logOptions.makeValue = copyStringValue;
+			logOptions.freeValue = freeStringValue;
+		}
+		nRecords = aaReplayLog(assocArray, logfile, &logOptions);
+		if (nRecords < 0 || aaStartLog(assocArray, logfile, &logOptions) < 0) {
+			fprintf(stderr, "Error: cannot use log '%s'\n", logfile);
+			return -1;
+		}
+		fprintf(stderr, "Replayed %ld updates from log '%s'\n", nRecords, logfile);
+	}
+
 
 	/** delete anything that we were asked to */
 	if (deletefile != NULL) {
-		deleteFromAssociativeArray(assocArray, deletefile, useIntKey);
+		deleteFromAssociativeArray(assocArray, deletefile, useIntKey, options.valueWidth);
+	}
+
+	/** the table is only queried from here on, so it can be frozen */
+	if (freeze && aaFreeze(assocArray) < 0) {
+		fprintf(stderr, "Warning: cannot freeze the table - querying it as it is\n");
+	}
+
+	/** only a frozen table can be published */
+	if (publishName != NULL && aaPublishShared(assocArray, publishName,
+			(options.valueWidth == 0) ? stringValueBytes : NULL, NULL) < 0) {
+		fprintf(stderr, "Error: cannot publish the table as '%s'\n", publishName);
+		return -1;
 	}
 
 	/** perform any queries we were asked to */
 	if (queryfile != NULL) {
-		queryAssociativeArray(assocArray, queryfile, useIntKey);
+		/**
+		 * traces and counters follow a single thread, so need the serial
+		 * version, as does the page cache of a disk table
+		 */
+		if (nQueryThreads > 1 && tracefile == NULL && ! usePerfCounters
+				&& options.layout != AA_LAYOUT_DISK) {
+			queryAssociativeArrayParallel(assocArray, queryfile, useIntKey, nQueryThreads);
+		} else {
+			queryAssociativeArray(assocArray, queryfile, useIntKey);
+		}
+	}
+
+	/** serve the table until we are interrupted */
+	if (socketPath != NULL
+			&& serveAssociativeArray(assocArray, socketPath, useIntKey, options.valueWidth) < 0) {
+		return -1;
+	}
+
+	/** once the snapshot is safely written, the log has nothing it needs */
+	if (snapshotfile != NULL) {
+		if (writeSnapshot(assocArray, snapshotfile, options.valueWidth) < 0) {
+			return -1;
+		}
+		if (logfile != NULL && aaTruncateLog(assocArray) < 0) {
+			return -1;
+		}
 	}
 
 	/* print out what we loaded */
 	aaPrintSummary(ofp, assocArray);
+	if (printStats) {
+		aaPrintStats(ofp, assocArray);
+	}
+	if (printAnalysis) {
+		aaPrintClusterAnalysis(ofp, assocArray, ANALYSIS_REGIONS, ANALYSIS_LARGEST);
+		aaPrintConfigurationComparison(ofp, assocArray);
+	}
 	if (printContents) {
 		aaPrintContents(ofp, assocArray, "  ");
 	}
 
-	/* clean up before exit */
-	aaIterateAction(assocArray, deleteValue, NULL);
+	/* clean up before exit (the values of a shared table are not ours) */
+	if (options.valueWidth == 0 && options.layout != AA_LAYOUT_SHARED) {
+		aaIterateAction(assocArray, deleteValue, NULL);
+	}
 	aaDeleteAssociativeArray(assocArray);
 
 	/* exit with success if we get here */
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <string.h> /* for strlen(), strerror() */
+#include <stdlib.h> /* for malloc(), free() */
+#include <stdarg.h> /* for va_list */
+#include <ctype.h>  /* for isdigit() */
+#include <errno.h>
+#include <pthread.h>
+
+#include "aarray.h"
+#include "data-reader.h"
+#include "parallel-query.h"
+
+/**
+ * Multi-threaded version of the query pass in mainline.c.
+ *
+ * The query file is read in rounds: the main thread reads one chunk
+ * of lines for each worker, the workers look their chunks up in the
+ * (unchanging) array and format the results into their own buffers,
+ * and then the buffers are written out in file order with a single
+ * fwrite(3) each.  The output is identical to the serial version.
+ */
+
+#define	LINE_MAX			128
+#define	CHUNK_LINES			16384
+#define	OUTPUT_INITIAL_SIZE	(CHUNK_LINES * 48)
+
+/** one worker's share of a round */
+typedef struct QueryChunk {
+	AssociativeArray *assocArray;
+	int useIntKey;
+	char (*lines)[LINE_MAX];
+	char **keys;
+	int nLines;
+	char *output;
+	size_t outputLen;
+	size_t outputAllocated;
+	int failedLine;
+	const char *failure;
+	AASearchStats stats;
+} QueryChunk;
+
+
+/** printf onto the end of the chunk's output buffer */
+static int
+appendOutput(QueryChunk *chunk, const char *format, ...)
+{
+	va_list args;
+	char *newOutput;
+	int len;
+
+	for (;;) {
+		va_start(args, format);
+		len = vsnprintf(chunk->output + chunk->outputLen,
+				chunk->outputAllocated - chunk->outputLen, format, args);
+		va_end(args);
+		if (len < 0)
+			return -1;
+		if ((size_t) len < chunk->outputAllocated - chunk->outputLen)
+			break;
+
+		newOutput = (char *) realloc(chunk->output,
+				chunk->outputAllocated * 2 + len);
+		if (newOutput == NULL)
+			return -1;
+		chunk->output = newOutput;
+		chunk->outputAllocated = chunk->outputAllocated * 2 + len;
+	}
+
+	chunk->outputLen += len;
+	return 1;
+}
+
+/** worker thread: look up every key in the chunk */
+static void *
+queryChunk(void *arg)
+{
+	QueryChunk *chunk = (QueryChunk *) arg;
+	char *strkey, *value;
+	int intkey, i, status;
+
+	chunk->outputLen = 0;
+	chunk->failedLine = -1;
+	memset(&chunk->stats, 0, sizeof(AASearchStats));
+
+	for (i = 0; i < chunk->nLines; i++) {
+		strkey = chunk->keys[i];
+		if (chunk->useIntKey && isdigit(strkey[0])) {
+			if (sscanf(strkey, "%d", &intkey) != 1) {
+				chunk->failedLine = i;
+				chunk->failure = "Failed extracting integer from";
+				break;
+			}
+
+			value = aaLookupConcurrent(chunk->assocArray,
+					(AAKeyType) &intkey, sizeof(int), &chunk->stats);
+			if (value == NULL) {
+				status = appendOutput(chunk, "LOOKUP: key (%d) produced no value\n", intkey);
+			} else {
+				status = appendOutput(chunk, "LOOKUP: key (%d) produced value '%s'\n", intkey, value);
+			}
+
+		} else {
+			value = aaLookupConcurrent(chunk->assocArray,
+					(AAKeyType) strkey, strlen(strkey), &chunk->stats);
+			if (value == NULL) {
+				status = appendOutput(chunk, "LOOKUP: key '%s' produced no value\n", strkey);
+			} else {
+				status = appendOutput(chunk, "LOOKUP: key '%s' produced value '%s'\n", strkey, value);
+			}
+		}
+
+		if (status < 0) {
+			chunk->failedLine = i;
+			chunk->failure = "Out of memory formatting the result for";
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/** read up to a chunk's worth of lines, returning how many were read */
+static int
+readChunk(FILE *fp, QueryChunk *chunk)
+{
+	chunk->nLines = 0;
+	while (chunk->nLines < CHUNK_LINES
+			&& readPlainLine(fp, chunk->lines[chunk->nLines], LINE_MAX,
+					&chunk->keys[chunk->nLines])) {
+		chunk->nLines++;
+	}
+	return chunk->nLines;
+}
+
+static void
+freeChunks(QueryChunk *chunks, int nChunks)
+{
+	int i;
+
+	for (i = 0; i < nChunks; i++) {
+		free(chunks[i].lines);
+		free(chunks[i].keys);
+		free(chunks[i].output);
+	}
+	free(chunks);
+}
+
+/**
+ * Query the array with all the values in the given file, using
+ * the given number of threads
+ */
+int
+queryAssociativeArrayParallel(AssociativeArray *assocArray, char *filename,
+		int useIntKey, int nThreads)
+{
+	QueryChunk *chunks;
+	pthread_t *threads;
+	FILE *fp = NULL;
+	int nRead, i, status = 1, done = 0;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: Failed to open query input file '%s' : %s",
+				filename, strerror(errno));
+		return -1;
+	}
+
+	chunks = (QueryChunk *) calloc(nThreads, sizeof(QueryChunk));
+	threads = (pthread_t *) malloc(nThreads * sizeof(pthread_t));
+	if (chunks == NULL || threads == NULL) {
+		fprintf(stderr, "Error: cannot allocate query threads\n");
+		free(chunks);
+		free(threads);
+		fclose(fp);
+		return -1;
+	}
+
+	for (i = 0; i < nThreads; i++) {
+		chunks[i].assocArray = assocArray;
+		chunks[i].useIntKey = useIntKey;
+		chunks[i].lines = malloc(CHUNK_LINES * sizeof(*chunks[i].lines));
+		chunks[i].keys = (char **) malloc(CHUNK_LINES * sizeof(char *));
+		chunks[i].output = (char *) malloc(OUTPUT_INITIAL_SIZE);
+		chunks[i].outputAllocated = OUTPUT_INITIAL_SIZE;
+		if (chunks[i].lines == NULL || chunks[i].keys == NULL
+				|| chunks[i].output == NULL) {
+			fprintf(stderr, "Error: cannot allocate query buffers\n");
+			freeChunks(chunks, nThreads);
+			free(threads);
+			fclose(fp);
+			return -1;
+		}
+	}
+
+	while ( ! done && status > 0) {
+		/** read a chunk for each worker, and set them going */
+		for (nRead = 0; nRead < nThreads; nRead++) {
+			if (readChunk(fp, &chunks[nRead]) == 0)
+				break;
+			if (pthread_create(&threads[nRead], NULL, queryChunk, &chunks[nRead]) != 0) {
+				/** no thread to be had, so do this one ourselves */
+				queryChunk(&chunks[nRead]);
+				threads[nRead] = pthread_self();
+			}
+		}
+		if (nRead < nThreads)
+			done = 1;
+
+		/** then write the results out in their original order */
+		for (i = 0; i < nRead; i++) {
+			if ( ! pthread_equal(threads[i], pthread_self()))
+				pthread_join(threads[i], NULL);
+		}
+		for (i = 0; i < nRead; i++) {
+			aaMergeSearchStats(assocArray, &chunks[i].stats);
+			if (status < 0)
+				continue;
+
+			fwrite(chunks[i].output, 1, chunks[i].outputLen, stdout);
+			if (chunks[i].failedLine >= 0) {
+				fprintf(stderr, "Error: %s '%s'\n", chunks[i].failure,
+						chunks[i].keys[chunks[i].failedLine]);
+				status = -1;
+			}
+		}
+	}
+
+	freeChunks(chunks, nThreads);
+	free(threads);
+	fclose(fp);
+	return status;
+}
@@ -0,0 +1,9 @@
+#ifndef	__PARALLEL_QUERY_HEADER__
+#define	__PARALLEL_QUERY_HEADER__
+
+#include "aarray.h"
+
+int queryAssociativeArrayParallel(AssociativeArray *assocArray,
+		char *filename, int useIntKey, int nThreads);
+
+#endif
@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <string.h> /* for strchr(), strlen(), strerror() */
+#include <stdlib.h> /* for malloc(), free() */
+#include <ctype.h>  /* for isdigit() */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>  /* for sched_yield() */
+
+#include "aarray.h"
+#include "data-reader.h"
+#include "pipelined-load.h"
+
+/**
+ * Pipelined version of the load pass in mainline.c.
+ *
+ * The load is split into three stages running at once, so that the
+ * reading, the parsing and the probing of the table overlap:
+ *
+ *   - a reader thread fills large buffers from the file, each ending
+ *     on a line boundary, and deals them out to the parsers in turn
+ *   - each parser thread splits its buffers into lines in place, with
+ *     the same parsing as readDataLine(), and makes them into batches
+ *     of key and value pointers, copying the values as the serial
+ *     loader would (a strdup(3) each, or cut down to the inline width)
+ *   - the calling thread takes the batches from the parsers in the
+ *     same turn and inserts them with aaInsertBatch()
+ *
+ * Each pair of neighbouring threads shares a single producer, single
+ * consumer ring, so the stages hand work on without locks.  Taking
+ * the batches in the order the buffers were dealt keeps the inserts
+ * in file order, so the result (and any error) is the same as for
+ * the serial loader.  A NULL in a ring marks the end of the file.
+ */
+
+#define	READ_BUFFER_SIZE	(1024 * 1024)
+#define	QUEUE_DEPTH			4
+#define	CACHE_LINE			64
+
+/** a single producer, single consumer ring of pointers */
+typedef struct LoadQueue {
+	void *items[QUEUE_DEPTH];
+	unsigned long head;			/** next to take, written by the consumer */
+	char pad[CACHE_LINE];
+	unsigned long tail;			/** next to fill, written by the producer */
+} LoadQueue;
+
+/** one buffer's lines, parsed and ready to insert */
+typedef struct LoadBatch {
+	char *data;					/** the buffer, which the keys point into */
+	int nRecords;
+	AAKeyType *keys;
+	size_t *keylens;
+	void **values;
+	int *intKeys;
+	char *inlineValues;			/** valueWidth bytes per record, if inline */
+	int badLine;				/** a line after these could not be parsed */
+} LoadBatch;
+
+typedef struct LoadPipeline LoadPipeline;
+
+typedef struct LoadParser {
+	LoadPipeline *pipeline;
+	pthread_t thread;
+	LoadQueue buffers;
+	LoadQueue batches;
+	int ended;					/** its end marker has reached the inserter */
+} LoadParser;
+
+struct LoadPipeline {
+	FILE *fp;
+	int useIntKey;
+	size_t valueWidth;
+	int nParsers;
+	LoadParser *parsers;
+	int stopped;				/** set by the inserter to wind the others up */
+	int readFailed;
+};
+
+/** passed on in place of a batch that there was no memory for */
+static LoadBatch outOfMemory;
+
+
+static void
+queuePush(LoadQueue *queue, void *item)
+{
+	unsigned long tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+	while (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == QUEUE_DEPTH)
+		sched_yield();
+	queue->items[tail % QUEUE_DEPTH] = item;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *
+queuePop(LoadQueue *queue)
+{
+	unsigned long head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	void *item;
+
+	while (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == head)
+		sched_yield();
+	item = queue->items[head % QUEUE_DEPTH];
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	return item;
+}
+
+/**
+ * free a batch, along with the values (from the given one on) that
+ * never made it into the array
+ */
+static void
+freeBatch(LoadBatch *batch, int fromRecord, size_t valueWidth)
+{
+	int i;
+
+	if (valueWidth == 0) {
+		for (i = fromRecord; i < batch->nRecords; i++)
+			free(batch->values[i]);
+	}
+	free(batch->data);
+	free(batch->keys);
+	free(batch->keylens);
+	free(batch->values);
+	free(batch->intKeys);
+	free(batch->inlineValues);
+	free(batch);
+}
+
+/**
+ * reader thread: deal out buffers of whole lines, carrying any
+ * partial line at the end of one over into the next
+ */
+static void *
+readStage(void *arg)
+{
+	LoadPipeline *pipeline = (LoadPipeline *) arg;
+	char *buffer, *lastNewline, *carry = NULL;
+	size_t carryLen = 0, len, allocated, n;
+	int turn = 0;
+
+	while ( ! __atomic_load_n(&pipeline->stopped, __ATOMIC_RELAXED)) {
+		allocated = READ_BUFFER_SIZE + carryLen;
+		buffer = (char *) malloc(allocated + 1);
+		if (buffer == NULL) {
+			pipeline->readFailed = 1;
+			break;
+		}
+		if (carryLen > 0)
+			memcpy(buffer, carry, carryLen);
+		len = carryLen;
+		free(carry);
+		carry = NULL;
+		carryLen = 0;
+
+		n = fread(buffer + len, 1, allocated - len, pipeline->fp);
+		len += n;
+		if (n == 0) {
+			if (ferror(pipeline->fp))
+				pipeline->readFailed = 1;
+
+			/** the end of the file ends the last line */
+			if (len > 0 && ! pipeline->readFailed) {
+				buffer[len] = '\0';
+				queuePush(&pipeline->parsers[turn].buffers, buffer);
+				turn = (turn + 1) % pipeline->nParsers;
+			} else {
+				free(buffer);
+			}
+			break;
+		}
+
+		/** hold back the partial line at the end for the next buffer */
+		buffer[len] = '\0';
+		lastNewline = NULL;
+		for (n = len; n > 0; n--) {
+			if (buffer[n - 1] == '\n') {
+				lastNewline = &buffer[n - 1];
+				break;
+			}
+		}
+		if (lastNewline == NULL) {
+			/** a line longer than the whole buffer: read on */
+			carry = buffer;
+			carryLen = len;
+			continue;
+		}
+		carryLen = len - (lastNewline + 1 - buffer);
+		if (carryLen > 0) {
+			carry = (char *) malloc(carryLen);
+			if (carry == NULL) {
+				free(buffer);
+				pipeline->readFailed = 1;
+				break;
+			}
+			memcpy(carry, lastNewline + 1, carryLen);
+		}
+		lastNewline[1] = '\0';
+
+		queuePush(&pipeline->parsers[turn].buffers, buffer);
+		turn = (turn + 1) % pipeline->nParsers;
+	}
+	free(carry);
+
+	/** every parser gets the end marker, in turn after its last buffer */
+	for (n = 0; n < (size_t) pipeline->nParsers; n++) {
+		queuePush(&pipeline->parsers[turn].buffers, NULL);
+		turn = (turn + 1) % pipeline->nParsers;
+	}
+	return NULL;
+}
+
+/** parse the lines of one buffer into a batch */
+static LoadBatch *
+parseBuffer(LoadPipeline *pipeline, char *buffer)
+{
+	LoadBatch *batch;
+	char *line, *end, *strkey, *value;
+	int nLines = 1, n;
+
+	for (line = buffer; (line = strchr(line, '\n')) != NULL; line++)
+		nLines++;
+
+	batch = (LoadBatch *) calloc(1, sizeof(LoadBatch));
+	if (batch == NULL)
+		return NULL;
+	batch->data = buffer;
+	batch->keys = (AAKeyType *) malloc(nLines * sizeof(AAKeyType));
+	batch->keylens = (size_t *) malloc(nLines * sizeof(size_t));
+	batch->values = (void **) malloc(nLines * sizeof(void *));
+	batch->intKeys = (int *) malloc(nLines * sizeof(int));
+	if (pipeline->valueWidth > 0)
+		batch->inlineValues = (char *) calloc(nLines, pipeline->valueWidth);
+	if (batch->keys == NULL || batch->keylens == NULL || batch->values == NULL
+			|| batch->intKeys == NULL
+			|| (pipeline->valueWidth > 0 && batch->inlineValues == NULL)) {
+		batch->data = NULL;
+		freeBatch(batch, 0, pipeline->valueWidth);
+		return NULL;
+	}
+
+	for (line = buffer; *line != '\0'; line = end) {
+		end = strchr(line, '\n');
+		if (end != NULL) {
+			*end++ = '\0';
+		} else {
+			end = line + strlen(line);
+		}
+
+		if (parseDataLine(line, &strkey, &value) < 0) {
+			batch->badLine = 1;
+			break;
+		}
+
+		n = batch->nRecords;
+		if (pipeline->useIntKey && isdigit(strkey[0])
+				&& sscanf(strkey, "%d", &batch->intKeys[n]) == 1) {
+			batch->keys[n] = (AAKeyType) &batch->intKeys[n];
+			batch->keylens[n] = sizeof(int);
+		} else {
+			batch->keys[n] = (AAKeyType) strkey;
+			batch->keylens[n] = strlen(strkey);
+		}
+
+		/** the same copy of the value makeValue() makes */
+		if (pipeline->valueWidth == 0) {
+			batch->values[n] = strdup(value);
+			if (batch->values[n] == NULL) {
+				batch->badLine = 1;
+				break;
+			}
+		} else {
+			batch->values[n] = batch->inlineValues + (size_t) n * pipeline->valueWidth;
+			strncpy(batch->values[n], value, pipeline->valueWidth - 1);
+		}
+		batch->nRecords++;
+	}
+
+	return batch;
+}
+
+/** parser thread: turn each buffer dealt to us into a batch */
+static void *
+parseStage(void *arg)
+{
+	LoadParser *parser = (LoadParser *) arg;
+	LoadPipeline *pipeline = parser->pipeline;
+	LoadBatch *batch;
+	char *buffer;
+
+	while ((buffer = (char *) queuePop(&parser->buffers)) != NULL) {
+		/** once the load has stopped, only drain the ring */
+		if (__atomic_load_n(&pipeline->stopped, __ATOMIC_RELAXED)) {
+			free(buffer);
+			continue;
+		}
+		batch = parseBuffer(pipeline, buffer);
+		if (batch == NULL) {
+			free(buffer);
+			batch = &outOfMemory;
+		}
+		queuePush(&parser->batches, batch);
+	}
+
+	queuePush(&parser->batches, NULL);
+	return NULL;
+}
+
+/** report a key that could not be inserted, as the serial loader does */
+static void
+reportFailedKey(LoadBatch *batch, int record)
+{
+	if (batch->keys[record] == (AAKeyType) &batch->intKeys[record]) {
+		fprintf(stderr, "Failed to add key '%d' to assocArray\n", batch->intKeys[record]);
+	} else {
+		fprintf(stderr, "Failed to add key '%.*s' to assocArray\n",
+				(int) batch->keylens[record], (char *) batch->keys[record]);
+	}
+}
+
+/**
+ * Load the array from the file with a pipeline of nParsers parsing
+ * threads between the reader and the inserts
+ *
+ *  @return the number of entries loaded, or -1 on failure
+ */
+int
+loadAssociativeArrayPipelined(AssociativeArray *assocArray, char *filename,
+		int useIntKey, size_t valueWidth, int nParsers)
+{
+	LoadPipeline pipeline;
+	pthread_t reader;
+	LoadBatch *batch;
+	int nEntries = 0, nEnded = 0, failed = 0, turn = 0, nInserted, i;
+
+	memset(&pipeline, 0, sizeof(LoadPipeline));
+	pipeline.fp = fopen(filename, "r");
+	if (pipeline.fp == NULL) {
+		fprintf(stderr, "Error: Failed to open input file '%s' : %s",
+				filename, strerror(errno));
+		return -1;
+	}
+	pipeline.useIntKey = useIntKey;
+	pipeline.valueWidth = valueWidth;
+	pipeline.nParsers = nParsers;
+	pipeline.parsers = (LoadParser *) calloc(nParsers, sizeof(LoadParser));
+	if (pipeline.parsers == NULL) {
+		fclose(pipeline.fp);
+		return -1;
+	}
+
+	/** make do with as many parsers as we can start */
+	for (i = 0; i < nParsers; i++) {
+		pipeline.parsers[i].pipeline = &pipeline;
+		if (pthread_create(&pipeline.parsers[i].thread, NULL,
+				parseStage, &pipeline.parsers[i]) != 0)
+			break;
+	}
+	nParsers = pipeline.nParsers = i;
+	if (nParsers == 0 || pthread_create(&reader, NULL, readStage, &pipeline) != 0) {
+		fprintf(stderr, "Error: cannot start the threads to load '%s'\n", filename);
+		for (i = 0; i < nParsers; i++) {
+			queuePush(&pipeline.parsers[i].buffers, NULL);
+			while (queuePop(&pipeline.parsers[i].batches) != NULL)
+				;
+			pthread_join(pipeline.parsers[i].thread, NULL);
+		}
+		free(pipeline.parsers);
+		fclose(pipeline.fp);
+		return -1;
+	}
+
+	/**
+	 * take every parser's batches in turn until all have ended (once
+	 * the load stops they may end unevenly, so skip those that have)
+	 */
+	while (nEnded < nParsers) {
+		if (pipeline.parsers[turn].ended) {
+			turn = (turn + 1) % nParsers;
+			continue;
+		}
+		batch = (LoadBatch *) queuePop(&pipeline.parsers[turn].batches);
+		if (batch == NULL) {
+			pipeline.parsers[turn].ended = 1;
+			nEnded++;
+		}
+		turn = (turn + 1) % nParsers;
+		if (batch == NULL) {
+			continue;
+		}
+
+		if (batch == &outOfMemory) {
+			if ( ! failed)
+				fprintf(stderr, "Error: cannot allocate a batch of parsed lines\n");
+			failed = 1;
+			__atomic_store_n(&pipeline.stopped, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (failed) {
+			freeBatch(batch, 0, valueWidth);
+			continue;
+		}
+
+		nInserted = aaInsertBatch(assocArray, batch->nRecords,
+				batch->keys, batch->keylens, batch->values);
+		nEntries += nInserted;
+		if (nInserted < batch->nRecords) {
+			reportFailedKey(batch, nInserted);
+			failed = 1;
+		} else if (batch->badLine) {
+			/** the serial loader stops quietly at a line it cannot parse */
+			failed = 2;
+		}
+		freeBatch(batch, nInserted, valueWidth);
+
+		if (failed)
+			__atomic_store_n(&pipeline.stopped, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_join(reader, NULL);
+	for (i = 0; i < nParsers; i++)
+		pthread_join(pipeline.parsers[i].thread, NULL);
+	free(pipeline.parsers);
+	fclose(pipeline.fp);
+
+	if (pipeline.readFailed && failed == 0) {
+		fprintf(stderr, "Error: failed reading input file '%s'\n", filename);
+		return -1;
+	}
+	return (failed == 1) ? -1 : nEntries;
+}
@@ -0,0 +1,9 @@
+#ifndef	__PIPELINED_LOAD_HEADER__
+#define	__PIPELINED_LOAD_HEADER__
+
+#include "aarray.h"
+
+int loadAssociativeArrayPipelined(AssociativeArray *assocArray,
+		char *filename, int useIntKey, size_t valueWidth, int nParsers);
+
+#endif
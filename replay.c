@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <string.h> /* for strerror() */
+#include <stdlib.h> /* for malloc(), qsort() */
+#include <unistd.h> /* for getopt() */
+#include <time.h>   /* for clock_gettime() */
+#include <errno.h>
+
+#include "aarray.h"
+
+/**
+ * Replay a recorded operation trace (see aaStartTrace()) against a
+ * table built with whichever configuration is given on the command
+ * line, and report the throughput and latency distribution of each
+ * kind of operation.
+ *
+ * The trace records whether each operation succeeded, so the replay
+ * also reports how many operations behaved differently this time,
+ * which should be zero for any correct configuration large enough
+ * to hold the data.
+ */
+
+#define	DEFAULT_ARRAY_SIZE	100
+#define	OPTIONLEN			10
+#define	NOPS				4
+#define	DICTIONARY_SAMPLES	2000
+
+static const char *sOperationNames[NOPS] = { "Insertion", "Search", "Deletion", "Accumulate" };
+
+/**
+ * the value stored for every key; only its address matters, but an
+ * inline table copies valueWidth bytes of it
+ */
+static void *sDummyValue;
+
+/** a growable list of latencies, in nanoseconds */
+typedef struct LatencyList {
+	unsigned int *values;
+	size_t count;
+	size_t allocated;
+	unsigned long divergent;
+} LatencyList;
+
+static int
+addLatency(LatencyList *list, unsigned int latency)
+{
+	unsigned int *newValues;
+
+	if (list->count == list->allocated) {
+		list->allocated = (list->allocated == 0) ? 4096 : list->allocated * 2;
+		newValues = (unsigned int *) realloc(list->values,
+				list->allocated * sizeof(unsigned int));
+		if (newValues == NULL)
+			return -1;
+		list->values = newValues;
+	}
+	list->values[list->count++] = latency;
+	return 1;
+}
+
+static int
+compareLatency(const void *a, const void *b)
+{
+	unsigned int la = *(const unsigned int *) a, lb = *(const unsigned int *) b;
+	return (la > lb) - (la < lb);
+}
+
+/** the given percentile of a sorted list */
+static unsigned int
+percentile(LatencyList *list, double pct)
+{
+	size_t index;
+
+	if (list->count == 0)
+		return 0;
+	index = (size_t) ((pct / 100.0) * (list->count - 1) + 0.5);
+	return list->values[index];
+}
+
+static unsigned long long
+nanoTime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Collect a sample of the keys inserted by the trace, to front code
+ * compressed keys against, using reservoir sampling as a3 does over
+ * its data files.  The sampled keys are copied onto the heap.
+ *
+ * Returns the number of keys sampled, or -1 on error
+ */
+static int
+sampleTraceKeys(const char *filename, AAKeyType *keys, size_t *keylens, int maxSamples)
+{
+	AATraceReader *reader;
+	AATraceRecord record;
+	long nInserts = 0, slot;
+	int nSamples = 0, status;
+
+	reader = aaTraceOpen(filename);
+	if (reader == NULL)
+		return -1;
+
+	srand(1);
+	while ((status = aaTraceNext(reader, &record)) > 0) {
+		if (record.operation != AA_TRACE_INSERT)
+			continue;
+
+		/** fill the reservoir, then replace entries at random */
+		slot = (nInserts < maxSamples) ? nInserts : (long) (rand() % (nInserts + 1));
+		if (slot < maxSamples) {
+			if (slot < nSamples) {
+				free(keys[slot]);
+			} else {
+				nSamples++;
+			}
+			keys[slot] = (AAKeyType) malloc(record.keylen + 1);
+			memcpy(keys[slot], record.key, record.keylen);
+			keylens[slot] = record.keylen;
+		}
+		nInserts++;
+	}
+	aaTraceClose(reader);
+
+	return (status < 0) ? -1 : nSamples;
+}
+
+/** print out the help */
+void usage(char *progname)
+{
+	fprintf(stderr, "%s [<OPTIONS>] <tracefile>\n", progname);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Replays a trace of operations recorded with 'a3 -t' against a\n");
+	fprintf(stderr, "fresh associative array and reports throughput and latencies.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options: \n");
+	fprintf(stderr, "%-*s: Print this help.\n", OPTIONLEN, "-h");
+	fprintf(stderr, "%-*s: Size of table used internally, default %d.\n",
+			OPTIONLEN, "-n <SIZE>", DEFAULT_ARRAY_SIZE);
+	fprintf(stderr, "%-*s: Output file to write to, default stdout.\n",
+			OPTIONLEN, "-o <FILE>");
+	fprintf(stderr, "%-*s: Hash using the given algorithm.  Choices are \"sum\", \"length\",\n",
+			OPTIONLEN, "-H <ALG>");
+	fprintf(stderr, "%-*s: \"prime\" or \"mix\".\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Secondary hash for double hashing, same choices as -H.\n",
+			OPTIONLEN, "-2 <ALG>");
+	fprintf(stderr, "%-*s: Probe using the given algorithm.  Choices are \"linear\", \"quadratic\",\n",
+			OPTIONLEN, "-P <ALG>");
+	fprintf(stderr, "%-*s: or \"doublehash\".\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Print out the table summary after the replay.\n", OPTIONLEN, "-s");
+	fprintf(stderr, "%-*s: Use the compact, insertion-ordered table layout.\n", OPTIONLEN, "-c");
+	fprintf(stderr, "%-*s: Use the packed layout, with 16 byte tagged slots.\n", OPTIONLEN, "-K");
+	fprintf(stderr, "%-*s: Map the slot array rather than malloc it, in \"huge\" pages\n",
+			OPTIONLEN, "-M <PAGES>");
+	fprintf(stderr, "%-*s: or ordinary ones (\"mmap\").\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Place the slot array on the given NUMA node, or spread it\n",
+			OPTIONLEN, "-N <NODE>");
+	fprintf(stderr, "%-*s: over all of them with \"interleave\".\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Keep the table in pages of <FILE>, which must not exist yet\n",
+			OPTIONLEN, "-D <FILE>");
+	fprintf(stderr, "%-*s: (needs -V).\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Pack the keys into blocks, front coded against a sample of them.\n",
+			OPTIONLEN, "-k");
+	fprintf(stderr, "%-*s: Store values inline in the table, <WIDTH> bytes each (%d\n",
+			OPTIONLEN, "-V <WIDTH>", (int) sizeof(int64_t));
+	fprintf(stderr, "%-*s: for a trace of accumulates).\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Keep a Bloom filter in front of the table to answer misses quickly.\n",
+			OPTIONLEN, "-F");
+	fprintf(stderr, "%-*s: Keep at most <N> entries, evicting the least recently\n",
+			OPTIONLEN, "-E <N>");
+	fprintf(stderr, "%-*s: used (by the CLOCK policy) to make room for new ones.\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: As -E, but limit the bytes of keys and records instead.\n",
+			OPTIONLEN, "-B <BYTES>");
+	fprintf(stderr, "%-*s: Grow the table once the slots in use pass this load factor.\n",
+			OPTIONLEN, "-g <LOAD>");
+	fprintf(stderr, "%-*s: Slots of the old table migrated per operation while growing,\n",
+			OPTIONLEN, "-R <STEP>");
+	fprintf(stderr, "%-*s: default %d, or 0 to rehash everything at once.\n",
+			OPTIONLEN, "", AA_DEFAULT_REHASH_STEP);
+	fprintf(stderr, "\n");
+	exit (1);
+}
+
+/**
+ * Program mainline -- replays the trace named on the command line
+ */
+int
+main(int argc, char **argv)
+{
+	char *programname = argv[0];
+	FILE *ofp = stdout;
+	int arraySize = DEFAULT_ARRAY_SIZE;
+	char *hash1 = "sum", *hash2 = "len", *probe = "lin";
+	int printSummary = 0;
+	AssociativeArray *assocArray;
+	AAOptions options;
+	AATraceReader *reader;
+	AATraceRecord record;
+	AAKeyType dictionaryKeys[DICTIONARY_SAMPLES];
+	size_t dictionaryKeylens[DICTIONARY_SAMPLES];
+	int nDictionaryKeys = 0;
+	LatencyList latencies[NOPS];
+	unsigned long long start, end, replayStart, replayTime, totalOps = 0;
+	int op, status, succeeded, i, c;
+
+	aaInitOptions(&options);
+
+	while ((c = getopt(argc, argv, "hscKkn:o:P:H:2:g:R:FM:N:D:V:E:B:")) != -1) {
+		if (c == 'n') {
+			if (sscanf(optarg, "%d", &arraySize) != 1) {
+				fprintf(stderr,
+						"Error: cannot parse assocArray size requested from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+		} else if (c == 'H') {
+			hash1 = optarg;
+		} else if (c == '2') {
+			hash2 = optarg;
+		} else if (c == 'P') {
+			probe = optarg;
+		} else if (c == 's') {
+			printSummary = 1;
+		} else if (c == 'c') {
+			options.layout = AA_LAYOUT_COMPACT;
+		} else if (c == 'K') {
+			options.layout = AA_LAYOUT_PACKED;
+		} else if (c == 'k') {
+			options.keyStore = AA_KEYS_COMPRESSED;
+		} else if (c == 'D') {
+			options.layout = AA_LAYOUT_DISK;
+			options.diskPath = optarg;
+		} else if (c == 'V') {
+			if (sscanf(optarg, "%zu", &options.valueWidth) != 1
+					|| options.valueWidth < 1) {
+				fprintf(stderr, "Error: cannot parse value width from '%s'\n", optarg);
+				usage(programname);
+			}
+		} else if (c == 'E') {
+			if (sscanf(optarg, "%d", &options.cacheEntries) != 1
+					|| options.cacheEntries < 1) {
+				fprintf(stderr, "Error: cannot parse cache capacity from '%s'\n", optarg);
+				usage(programname);
+			}
+		} else if (c == 'B') {
+			if (sscanf(optarg, "%zu", &options.cacheBytes) != 1
+					|| options.cacheBytes < 1) {
+				fprintf(stderr, "Error: cannot parse cache byte budget from '%s'\n", optarg);
+				usage(programname);
+			}
+		} else if (c == 'M') {
+			if (strncmp(optarg, "huge", 4) == 0) {
+				options.pages = AA_PAGES_HUGE;
+			} else if (strncmp(optarg, "mmap", 4) == 0) {
+				options.pages = AA_PAGES_MMAP;
+			} else {
+				fprintf(stderr, "Error: unknown kind of pages '%s'\n", optarg);
+				usage(programname);
+			}
+		} else if (c == 'N') {
+			if (strncmp(optarg, "int", 3) == 0) {
+				options.numaPolicy = AA_NUMA_INTERLEAVE;
+			} else if (sscanf(optarg, "%d", &options.numaNode) == 1
+					&& options.numaNode >= 0) {
+				options.numaPolicy = AA_NUMA_BIND;
+			} else {
+				fprintf(stderr, "Error: cannot parse NUMA node from '%s'\n", optarg);
+				usage(programname);
+			}
+		} else if (c == 'F') {
+			options.filterBitsPerKey = AA_DEFAULT_FILTER_BITS;
+		} else if (c == 'g') {
+			if (sscanf(optarg, "%lf", &options.growAtLoad) != 1
+					|| options.growAtLoad <= 0 || options.growAtLoad > 1) {
+				fprintf(stderr, "Error: cannot parse load factor to grow at from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+		} else if (c == 'R') {
+			if (sscanf(optarg, "%d", &options.rehashStep) != 1
+					|| options.rehashStep < 0) {
+				fprintf(stderr, "Error: cannot parse rehash step from '%s'\n", optarg);
+				usage(programname);
+			}
+		} else if (c == 'o') {
+			ofp = fopen(optarg, "w");
+			if (ofp == NULL) {
+				fprintf(stderr,
+						"Error: cannot open requested output file '%s' : %s\n",
+						optarg, strerror(errno));
+				usage(programname);
+			}
+		} else {
+			usage(programname);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		fprintf(stderr, "Error: exactly one trace file must be given\n");
+		usage(programname);
+	}
+
+	if (options.keyStore == AA_KEYS_COMPRESSED && options.layout != AA_LAYOUT_SLOTS
+			&& options.layout != AA_LAYOUT_COMPACT) {
+		fprintf(stderr, "Error: compressed keys (-k) need the default or compact (-c) layout\n");
+		usage(programname);
+	}
+
+	/** the replay is into a fresh table, so must not pick up an old one */
+	if (options.layout == AA_LAYOUT_DISK) {
+		if (options.valueWidth == 0) {
+			fprintf(stderr, "Error: a disk table (-D) stores its values inline, so needs -V\n");
+			usage(programname);
+		}
+		if (access(options.diskPath, F_OK) == 0) {
+			fprintf(stderr, "Error: disk table '%s' already exists\n", options.diskPath);
+			return -1;
+		}
+	}
+
+	sDummyValue = calloc(1, (options.valueWidth > sizeof(int)) ? options.valueWidth : sizeof(int));
+	if (sDummyValue == NULL) {
+		fprintf(stderr, "Error: cannot allocate the value to insert\n");
+		return -1;
+	}
+
+	/** the keys are compressed against a sample of those the trace inserts */
+	if (options.keyStore == AA_KEYS_COMPRESSED) {
+		nDictionaryKeys = sampleTraceKeys(argv[0],
+				dictionaryKeys, dictionaryKeylens, DICTIONARY_SAMPLES);
+		if (nDictionaryKeys < 0) {
+			fprintf(stderr, "Error: cannot read trace file '%s'\n", argv[0]);
+			return -1;
+		}
+		options.keyDictionary = dictionaryKeys;
+		options.keyDictionaryLengths = dictionaryKeylens;
+		options.nDictionaryKeys = nDictionaryKeys;
+	}
+
+	reader = aaTraceOpen(argv[0]);
+	if (reader == NULL) {
+		fprintf(stderr, "Error: cannot read trace file '%s'\n", argv[0]);
+		return -1;
+	}
+
+	assocArray = aaCreateConfiguredArray(arraySize, probe, hash1, hash2, &options);
+	for (i = 0; i < nDictionaryKeys; i++) {
+		free(dictionaryKeys[i]);
+	}
+	if (assocArray == NULL) {
+		fprintf(stderr, "Error: cannot allocate associative array - exitting\n");
+		return -1;
+	}
+
+	memset(latencies, 0, sizeof(latencies));
+
+	replayStart = nanoTime();
+	while ((status = aaTraceNext(reader, &record)) > 0) {
+		op = record.operation - AA_TRACE_INSERT;
+		if (op < 0 || op >= NOPS) {
+			fprintf(stderr, "Error: unknown operation %d in trace\n", record.operation);
+			status = -1;
+			break;
+		}
+
+		/** accumulators are kept inline, so every accumulate would fail without them */
+		if (record.operation == AA_TRACE_ACCUMULATE && options.valueWidth != sizeof(int64_t)) {
+			fprintf(stderr, "Error: a trace of accumulates (a3 -G) needs -V %d\n",
+					(int) sizeof(int64_t));
+			return -1;
+		}
+
+		start = nanoTime();
+		if (record.operation == AA_TRACE_INSERT) {
+			succeeded = aaInsert(assocArray, record.key, record.keylen, sDummyValue) >= 0;
+		} else if (record.operation == AA_TRACE_LOOKUP) {
+			succeeded = aaLookup(assocArray, record.key, record.keylen) != NULL;
+		} else if (record.operation == AA_TRACE_ACCUMULATE) {
+			succeeded = aaAccumulate(assocArray, record.key, record.keylen,
+					record.aggregate, record.amount) >= 0;
+		} else {
+			succeeded = aaDelete(assocArray, record.key, record.keylen) != NULL;
+		}
+		end = nanoTime();
+
+		if (addLatency(&latencies[op], (unsigned int) (end - start)) < 0) {
+			fprintf(stderr, "Error: out of memory recording latencies\n");
+			return -1;
+		}
+		if (succeeded != record.succeeded)
+			latencies[op].divergent++;
+		totalOps++;
+	}
+	replayTime = nanoTime() - replayStart;
+	aaTraceClose(reader);
+
+	if (status < 0) {
+		fprintf(stderr, "Error: trace file '%s' is corrupt\n", argv[0]);
+	}
+
+	fprintf(ofp, "Replayed %llu operations in %.3f ms (%.0f ops/sec)\n",
+			totalOps, replayTime / 1e6,
+			(replayTime > 0) ? totalOps / (replayTime / 1e9) : 0.0);
+	fprintf(ofp, "Strategies used: '%s' hash, '%s' secondary hash and '%s' probing\n",
+			hash1, hash2, probe);
+	fprintf(ofp, "Latencies in nanoseconds:\n");
+	fprintf(ofp, "  %-10s   %10s %8s %8s %8s %8s %8s %10s\n",
+			"", "ops", "p50", "p90", "p99", "p99.9", "max", "divergent");
+	for (op = 0; op < NOPS; op++) {
+		qsort(latencies[op].values, latencies[op].count,
+				sizeof(unsigned int), compareLatency);
+		fprintf(ofp, "  %-10s : %10lu %8u %8u %8u %8u %8u %10lu\n",
+				sOperationNames[op], (unsigned long) latencies[op].count,
+				percentile(&latencies[op], 50.0),
+				percentile(&latencies[op], 90.0),
+				percentile(&latencies[op], 99.0),
+				percentile(&latencies[op], 99.9),
+				percentile(&latencies[op], 100.0),
+				latencies[op].divergent);
+		free(latencies[op].values);
+	}
+
+	if (printSummary) {
+		aaPrintSummary(ofp, assocArray);
+	}
+
+	/** values are all the same dummy, so there is only that to free */
+	aaDeleteAssociativeArray(assocArray);
+	free(sDummyValue);
+
+	return (status < 0) ? -1 : 0;
+}
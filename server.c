@@ -0,0 +1,651 @@
+#include <stdio.h>
+#include <string.h> /* for strlen(), strerror() */
+#include <stdlib.h> /* for malloc(), free() */
+#include <stdarg.h> /* for va_list */
+#include <ctype.h>  /* for isdigit(), isxdigit() */
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "aarray.h"
+#include "server.h"
+
+/**
+ * Server mode for the driver: the loaded array is kept resident and
+ * served over a Unix domain socket, so that short-lived jobs can share
+ * one warm table rather than each loading the data files again.
+ *
+ * The protocol is a line per request, with tab separated fields as in
+ * the data files, and a line per reply, in the order of the requests:
+ *
+ *     GET <key>            VALUE <value>, or NONE
+ *     PUT <key> <value>    OK, replacing any value the key had, or
+ *                          ERROR if it cannot be stored
+ *     DEL <key>            OK, or NONE if the key was not there
+ *     POP <key>            as DEL, but VALUE <value> rather than OK
+ *
+ * and, for moving keys between the workers of a cluster (see
+ * aaClusterAddWorker()), with the partitions of the key space named
+ * by a bitmap of AA_CLUSTER_PARTITIONS / 4 hex digits, the lowest
+ * bit of the first digit being partition 0:
+ *
+ *     SCAN <bitmap>        ENTRY <key> <value> for each key in those
+ *                          partitions, then END <count>
+ *     DROP <bitmap>        OK <count>, once those keys are deleted
+ *
+ * Clients may pipeline as many requests as they like without waiting
+ * for the replies.  Everything one read brings in is answered as a
+ * batch, straight through the table operations, with the replies
+ * gathered into one buffer and sent with as few writes as possible.
+ * One thread serves every client, through epoll(7); a client whose
+ * replies are piling up unread is not read from until they drain.
+ * If the array is being logged, the updates of a batch are committed
+ * to the log before any of its replies go out, so an OK is durable.
+ *
+ * The server runs until it is sent SIGINT or SIGTERM.
+ */
+
+#define	REQUEST_MAX			4096
+#define	INPUT_BUFFER_SIZE	(64 * 1024)
+#define	OUTPUT_INITIAL_SIZE	(16 * 1024)
+#define	OUTPUT_HIGH_WATER	(1024 * 1024)
+#define	MAX_EVENTS			64
+#define	FIELD_CHAR			'\t'
+
+/** one client */
+typedef struct Connection {
+	int fd;
+	char *input;
+	size_t inputLen;
+	char *output;
+	size_t outputLen;
+	size_t outputSent;
+	size_t outputAllocated;
+	int events;
+	int closing;
+	struct Connection *prev;
+	struct Connection *next;
+} Connection;
+
+typedef struct Server {
+	AssociativeArray *assocArray;
+	int useIntKey;
+	size_t valueWidth;
+	char *valuebuffer;
+	char *oldvaluebuffer;
+	int listenFd;
+	int epollFd;
+	Connection *connections;
+	unsigned long nConnections;
+	unsigned long nRequests;
+	unsigned long nBatches;
+} Server;
+
+static volatile sig_atomic_t sStopRequested = 0;
+
+
+static void
+requestStop(int signo)
+{
+	sStopRequested = 1;
+}
+
+/** printf onto the end of the connection's output buffer */
+static int
+appendOutput(Connection *conn, const char *format, ...)
+{
+	va_list args;
+	char *newOutput;
+	int len;
+
+	for (;;) {
+		va_start(args, format);
+		len = vsnprintf(conn->output + conn->outputLen,
+				conn->outputAllocated - conn->outputLen, format, args);
+		va_end(args);
+		if (len < 0)
+			return -1;
+		if ((size_t) len < conn->outputAllocated - conn->outputLen)
+			break;
+
+		newOutput = (char *) realloc(conn->output,
+				conn->outputAllocated * 2 + len);
+		if (newOutput == NULL)
+			return -1;
+		conn->output = newOutput;
+		conn->outputAllocated = conn->outputAllocated * 2 + len;
+	}
+
+	conn->outputLen += len;
+	return 1;
+}
+
+/**
+ * The value to store for a PUT: a copy on the heap, or the string cut
+ * down to fit the server's buffer if the array stores values inline
+ */
+static void *
+makeValue(Server *server, char *value)
+{
+	if (server->valueWidth == 0)
+		return strdup(value);
+
+	strncpy(server->valuebuffer, value, server->valueWidth - 1);
+	server->valuebuffer[server->valueWidth - 1] = '\0';
+	return server->valuebuffer;
+}
+
+/** the entries of some partitions, being listed or collected to drop */
+typedef struct PartitionScan {
+	Connection *conn;
+	unsigned char partitions[AA_CLUSTER_PARTITIONS];
+	AAKeyType *keys;
+	size_t *keylens;
+	long nKeys;
+	long nAllocated;
+} PartitionScan;
+
+/** read a SCAN or DROP bitmap into a flag for each partition */
+static int
+parsePartitions(const char *bitmap, unsigned char *partitions)
+{
+	int i, bit, digit;
+
+	if (strlen(bitmap) != AA_CLUSTER_PARTITIONS / 4)
+		return -1;
+	for (i = 0; i < AA_CLUSTER_PARTITIONS / 4; i++) {
+		if ( ! isxdigit(bitmap[i]))
+			return -1;
+		digit = isdigit(bitmap[i]) ? bitmap[i] - '0' : tolower(bitmap[i]) - 'a' + 10;
+		for (bit = 0; bit < 4; bit++)
+			partitions[i * 4 + bit] = (digit >> bit) & 1;
+	}
+	return 1;
+}
+
+/** list an entry, if it is in one of the partitions asked for */
+static int
+scanEntry(AAKeyType key, size_t keylen, void *value, void *userdata)
+{
+	PartitionScan *scan = (PartitionScan *) userdata;
+
+	if ( ! scan->partitions[aaClusterPartition(key, keylen)])
+		return 0;
+	scan->nKeys++;
+	return appendOutput(scan->conn, "ENTRY\t%.*s\t%s\n", (int) keylen, (char *) key,
+			(char *) value);
+}
+
+/** keep a copy of the key of an entry to drop, as it cannot go mid-walk */
+static int
+collectEntry(AAKeyType key, size_t keylen, void *value, void *userdata)
+{
+	PartitionScan *scan = (PartitionScan *) userdata;
+	AAKeyType *keys;
+	size_t *keylens;
+	long nAllocated;
+
+	if ( ! scan->partitions[aaClusterPartition(key, keylen)])
+		return 0;
+
+	if (scan->nKeys == scan->nAllocated) {
+		nAllocated = (scan->nAllocated == 0) ? 1024 : scan->nAllocated * 2;
+		keys = (AAKeyType *) realloc(scan->keys, nAllocated * sizeof(AAKeyType));
+		if (keys != NULL)
+			scan->keys = keys;
+		keylens = (size_t *) realloc(scan->keylens, nAllocated * sizeof(size_t));
+		if (keylens != NULL)
+			scan->keylens = keylens;
+		if (keys == NULL || keylens == NULL)
+			return -1;
+		scan->nAllocated = nAllocated;
+	}
+
+	scan->keys[scan->nKeys] = (AAKeyType) malloc(keylen > 0 ? keylen : 1);
+	if (scan->keys[scan->nKeys] == NULL)
+		return -1;
+	memcpy(scan->keys[scan->nKeys], key, keylen);
+	scan->keylens[scan->nKeys++] = keylen;
+	return 0;
+}
+
+/** answer a SCAN or a DROP */
+static int
+handlePartitionRequest(Server *server, Connection *conn, int drop, const char *bitmap)
+{
+	PartitionScan scan;
+	void *value;
+	long i;
+	int status;
+
+	memset(&scan, 0, sizeof(PartitionScan));
+	scan.conn = conn;
+	if (parsePartitions(bitmap, scan.partitions) < 0)
+		return appendOutput(conn, "ERROR\tbad partition bitmap\n");
+
+	if ( ! drop) {
+		if (aaIterateAction(server->assocArray, scanEntry, &scan) < 0)
+			return -1;
+		return appendOutput(conn, "END\t%ld\n", scan.nKeys);
+	}
+
+	status = aaIterateAction(server->assocArray, collectEntry, &scan);
+	for (i = 0; i < scan.nKeys; i++) {
+		if (status >= 0) {
+			value = aaDelete(server->assocArray, scan.keys[i], scan.keylens[i]);
+			if (value != NULL && server->valueWidth == 0)	free(value);
+		}
+		free(scan.keys[i]);
+	}
+	free(scan.keys);
+	free(scan.keylens);
+	if (status < 0)
+		return appendOutput(conn, "ERROR\tcannot collect keys to drop\n");
+	return appendOutput(conn, "OK\t%ld\n", scan.nKeys);
+}
+
+/** answer a single request line */
+static int
+handleRequest(Server *server, Connection *conn, char *line)
+{
+	AssociativeArray *assocArray = server->assocArray;
+	char *command = line, *strkey, *value = NULL, *result, *stored;
+	AAKeyType key;
+	size_t keylen;
+	int intkey, status;
+
+	strkey = strchr(line, FIELD_CHAR);
+	if (strkey == NULL)
+		return appendOutput(conn, "ERROR\tmissing key\n");
+	*strkey++ = '\0';
+	value = strchr(strkey, FIELD_CHAR);
+	if (value != NULL)
+		*value++ = '\0';
+
+	/** partitions of the key space are named by a bitmap, not a key */
+	if ((strcmp(command, "SCAN") == 0 || strcmp(command, "DROP") == 0) && value == NULL)
+		return handlePartitionRequest(server, conn, command[0] == 'D', strkey);
+
+	/** keys are converted just as they are when the files are loaded */
+	key = (AAKeyType) strkey;
+	keylen = strlen(strkey);
+	if (server->useIntKey && isdigit(strkey[0])) {
+		if (sscanf(strkey, "%d", &intkey) != 1)
+			return appendOutput(conn, "ERROR\tbad integer key\n");
+		key = (AAKeyType) &intkey;
+		keylen = sizeof(int);
+	}
+
+	if (strcmp(command, "GET") == 0 && value == NULL) {
+		result = aaLookup(assocArray, key, keylen);
+		if (result == NULL)
+			return appendOutput(conn, "NONE\n");
+		return appendOutput(conn, "VALUE\t%s\n", result);
+
+	} else if (strcmp(command, "DEL") == 0 && value == NULL) {
+		result = aaDelete(assocArray, key, keylen);
+		if (result == NULL)
+			return appendOutput(conn, "NONE\n");
+		if (server->valueWidth == 0)	free(result);
+		return appendOutput(conn, "OK\n");
+
+	} else if (strcmp(command, "POP") == 0 && value == NULL) {
+		result = aaDelete(assocArray, key, keylen);
+		if (result == NULL)
+			return appendOutput(conn, "NONE\n");
+		status = appendOutput(conn, "VALUE\t%s\n", result);
+		if (server->valueWidth == 0)	free(result);
+		return status;
+
+	} else if (strcmp(command, "PUT") == 0 && value != NULL) {
+		/** the old value is kept until the new one is in, and put back if it cannot be */
+		stored = makeValue(server, value);
+		if (stored == NULL)
+			return appendOutput(conn, "ERROR\tcannot store key\n");
+
+		result = aaDelete(assocArray, key, keylen);
+		if (result != NULL && server->valueWidth > 0) {
+			memcpy(server->oldvaluebuffer, result, server->valueWidth);
+			result = server->oldvaluebuffer;
+		}
+
+		if (aaInsert(assocArray, key, keylen, stored) < 0) {
+			if (server->valueWidth == 0)	free(stored);
+			if (result != NULL && aaInsert(assocArray, key, keylen, result) < 0
+					&& server->valueWidth == 0)
+				free(result);
+			return appendOutput(conn, "ERROR\tcannot store key\n");
+		}
+		if (result != NULL && server->valueWidth == 0)	free(result);
+		return appendOutput(conn, "OK\n");
+	}
+
+	return appendOutput(conn, "ERROR\tunknown request\n");
+}
+
+/**
+ * Answer every complete request in the input buffer, as one batch,
+ * leaving any partial request at the start of the buffer
+ */
+static int
+processInput(Server *server, Connection *conn)
+{
+	char *line = conn->input, *end, *newline;
+	int nRequests = 0;
+
+	end = conn->input + conn->inputLen;
+	while (line < end && (newline = memchr(line, '\n', end - line)) != NULL) {
+		*newline = '\0';
+		if (newline > line && newline[-1] == '\r')
+			newline[-1] = '\0';
+		if (newline - line > REQUEST_MAX) {
+			appendOutput(conn, "ERROR\trequest too long\n");
+			conn->closing = 1;
+			return -1;
+		}
+		if (handleRequest(server, conn, line) < 0) {
+			conn->closing = 1;
+			return -1;
+		}
+		nRequests++;
+		line = newline + 1;
+	}
+
+	conn->inputLen = end - line;
+	memmove(conn->input, line, conn->inputLen);
+
+	/** a full buffer with no end of line in it can never be answered */
+	if (conn->inputLen == INPUT_BUFFER_SIZE) {
+		appendOutput(conn, "ERROR\trequest too long\n");
+		conn->closing = 1;
+		return -1;
+	}
+
+	if (nRequests > 0) {
+		server->nRequests += nRequests;
+		server->nBatches++;
+	}
+	return nRequests;
+}
+
+static void
+closeConnection(Server *server, Connection *conn)
+{
+	epoll_ctl(server->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+
+	if (conn->prev != NULL) {
+		conn->prev->next = conn->next;
+	} else {
+		server->connections = conn->next;
+	}
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+
+	free(conn->input);
+	free(conn->output);
+	free(conn);
+}
+
+/** send as much of the pending output as the socket will take */
+static int
+flushOutput(Connection *conn)
+{
+	ssize_t nSent;
+
+	while (conn->outputSent < conn->outputLen) {
+		nSent = send(conn->fd, conn->output + conn->outputSent,
+				conn->outputLen - conn->outputSent, MSG_NOSIGNAL);
+		if (nSent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		conn->outputSent += nSent;
+	}
+	conn->outputLen = conn->outputSent = 0;
+	return 1;
+}
+
+/**
+ * Read from a client while there is room and its replies are being
+ * taken, then send what we can and decide what to wait for next
+ */
+static void
+serviceConnection(Server *server, Connection *conn, int readable)
+{
+	struct epoll_event event;
+	ssize_t nRead;
+	int events;
+
+	while (readable && ! conn->closing
+			&& conn->outputLen - conn->outputSent < OUTPUT_HIGH_WATER) {
+		nRead = read(conn->fd, conn->input + conn->inputLen,
+				INPUT_BUFFER_SIZE - conn->inputLen);
+		if (nRead < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				conn->closing = 1;
+			break;
+		}
+		if (nRead == 0) {
+			/** the client is done, but still gets its replies */
+			conn->closing = 1;
+			break;
+		}
+		conn->inputLen += nRead;
+		if (processInput(server, conn) < 0)
+			break;
+	}
+
+	/** a log that cannot be committed leaves nothing to acknowledge */
+	if (aaSyncLog(server->assocArray) < 0
+			|| flushOutput(conn) < 0 || (conn->closing && conn->outputLen == 0)) {
+		closeConnection(server, conn);
+		return;
+	}
+
+	events = 0;
+	if ( ! conn->closing && conn->outputLen - conn->outputSent < OUTPUT_HIGH_WATER)
+		events |= EPOLLIN;
+	if (conn->outputLen > 0)
+		events |= EPOLLOUT;
+	if (events != conn->events) {
+		memset(&event, 0, sizeof(event));
+		event.events = events;
+		event.data.ptr = conn;
+		epoll_ctl(server->epollFd, EPOLL_CTL_MOD, conn->fd, &event);
+		conn->events = events;
+	}
+}
+
+/** take on every client waiting to connect */
+static void
+acceptConnections(Server *server)
+{
+	struct epoll_event event;
+	Connection *conn;
+	int fd;
+
+	while ((fd = accept(server->listenFd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		conn = (Connection *) calloc(1, sizeof(Connection));
+		if (conn != NULL) {
+			conn->input = (char *) malloc(INPUT_BUFFER_SIZE);
+			conn->output = (char *) malloc(OUTPUT_INITIAL_SIZE);
+			conn->outputAllocated = OUTPUT_INITIAL_SIZE;
+		}
+		if (conn == NULL || conn->input == NULL || conn->output == NULL) {
+			fprintf(stderr, "Error: cannot allocate buffers for a client\n");
+			if (conn != NULL) {
+				free(conn->input);
+				free(conn->output);
+				free(conn);
+			}
+			close(fd);
+			continue;
+		}
+
+		conn->fd = fd;
+		conn->events = EPOLLIN;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = conn;
+		if (epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			free(conn->input);
+			free(conn->output);
+			free(conn);
+			close(fd);
+			continue;
+		}
+
+		conn->next = server->connections;
+		if (conn->next != NULL)
+			conn->next->prev = conn;
+		server->connections = conn;
+		server->nConnections++;
+	}
+}
+
+/** bind a listening socket, replacing a stale socket file */
+static int
+openListener(const char *socketPath)
+{
+	struct sockaddr_un address;
+	struct stat info;
+	int fd;
+
+	if (strlen(socketPath) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Error: socket path '%s' is too long\n", socketPath);
+		return -1;
+	}
+	if (lstat(socketPath, &info) == 0) {
+		if ( ! S_ISSOCK(info.st_mode)) {
+			fprintf(stderr, "Error: '%s' exists and is not a socket\n", socketPath);
+			return -1;
+		}
+		unlink(socketPath);
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketPath);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0
+			|| listen(fd, SOMAXCONN) < 0) {
+		fprintf(stderr, "Error: cannot listen on '%s' : %s\n",
+				socketPath, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Serve the array on the given socket until told to stop
+ *
+ *  @return 1 after a clean shutdown, or -1 if the server could not
+ *				be started
+ */
+int
+serveAssociativeArray(AssociativeArray *assocArray, const char *socketPath,
+		int useIntKey, size_t valueWidth)
+{
+	struct epoll_event event, events[MAX_EVENTS];
+	struct sigaction action, oldInt, oldTerm;
+	Server server;
+	int nEvents, i;
+
+	memset(&server, 0, sizeof(Server));
+	server.assocArray = assocArray;
+	server.useIntKey = useIntKey;
+	server.valueWidth = valueWidth;
+	if (valueWidth > 0) {
+		server.valuebuffer = (char *) malloc(valueWidth);
+		server.oldvaluebuffer = (char *) malloc(valueWidth);
+		if (server.valuebuffer == NULL || server.oldvaluebuffer == NULL) {
+			free(server.valuebuffer);
+			free(server.oldvaluebuffer);
+			fprintf(stderr, "Error: cannot allocate value buffer\n");
+			return -1;
+		}
+	}
+
+	server.listenFd = openListener(socketPath);
+	server.epollFd = epoll_create1(EPOLL_CLOEXEC);
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (server.listenFd < 0 || server.epollFd < 0
+			|| epoll_ctl(server.epollFd, EPOLL_CTL_ADD, server.listenFd, &event) < 0) {
+		if (server.listenFd >= 0) {
+			close(server.listenFd);
+			unlink(socketPath);
+		}
+		if (server.epollFd >= 0)
+			close(server.epollFd);
+		free(server.valuebuffer);
+		free(server.oldvaluebuffer);
+		return -1;
+	}
+
+	/** no SA_RESTART, so that the signal wakes us out of epoll_wait() */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = requestStop;
+	sigemptyset(&action.sa_mask);
+	sStopRequested = 0;
+	sigaction(SIGINT, &action, &oldInt);
+	sigaction(SIGTERM, &action, &oldTerm);
+
+	printf("Serving on '%s'\n", socketPath);
+	fflush(stdout);
+
+	while ( ! sStopRequested) {
+		nEvents = epoll_wait(server.epollFd, events, MAX_EVENTS, -1);
+		if (nEvents < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error: epoll_wait failed : %s\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < nEvents; i++) {
+			if (events[i].data.ptr == NULL) {
+				acceptConnections(&server);
+			} else if (events[i].events & (EPOLLERR | EPOLLHUP)
+					&& ! (events[i].events & EPOLLIN)) {
+				closeConnection(&server, (Connection *) events[i].data.ptr);
+			} else {
+				serviceConnection(&server, (Connection *) events[i].data.ptr,
+						events[i].events & EPOLLIN);
+			}
+		}
+	}
+
+	sigaction(SIGINT, &oldInt, NULL);
+	sigaction(SIGTERM, &oldTerm, NULL);
+
+	while (server.connections != NULL)
+		closeConnection(&server, server.connections);
+	close(server.epollFd);
+	close(server.listenFd);
+	unlink(socketPath);
+	free(server.valuebuffer);
+	free(server.oldvaluebuffer);
+
+	printf("Server stopped: %lu connections, %lu requests in %lu batches\n",
+			server.nConnections, server.nRequests, server.nBatches);
+	return 1;
+}
@@ -0,0 +1,9 @@
+#ifndef	__SERVER_HEADER__
+#define	__SERVER_HEADER__
+
+#include "aarray.h"
+
+int serveAssociativeArray(AssociativeArray *assocArray,
+		const char *socketPath, int useIntKey, size_t valueWidth);
+
+#endif